@@ -0,0 +1,198 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the write barrier on segment 0 with mprotect. Arming
+ * protects every page at once; after that each page changes protection on
+ * its own, as stores dirty it and Barrier_clean protects it again, so
+ * arming costs one system call and a page two more for every time it is
+ * stored into after it was cleaned. After FAULT_LIMIT faults a page stays
+ * writable: a guest that keeps its variables on the same page as the loop
+ * using them would otherwise pay a fault and an mprotect every time
+ * around.
+ */
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "barrier.h"
+#define WORD_SIZE uint32_t
+#define FAULT_LIMIT 8
+#define T Barrier_T
+
+/* Struct that holds the size of a page, the first byte the barrier
+ * protects and how many pages from there, the dirty bitmap and how many
+ * words it has room for, how many times each page has faulted since it was
+ * armed (up to FAULT_LIMIT), and the counts Barrier_report prints.
+ */
+struct T {
+        size_t page_bytes;
+        char *base;
+        unsigned num_pages;
+        uint64_t *dirty;
+        unsigned dirty_capacity;
+        uint8_t *faulted;
+        uint64_t armed;
+        uint64_t faults;
+        uint64_t cleaned;
+        uint64_t given_up;
+};
+
+/* Sets the protection of the count pages from page to prot, exiting if it
+ * cannot.
+ */
+static void protect(T barrier, unsigned page, unsigned count, int prot);
+
+
+/* Creates a barrier that protects nothing yet, for pages of the size the
+ * system has.
+ */
+T Barrier_new()
+{
+        T barrier = calloc(1, sizeof(struct Barrier_T));
+        assert(barrier != NULL);
+        barrier->page_bytes = sysconf(_SC_PAGESIZE);
+        assert(barrier->page_bytes % sizeof(WORD_SIZE) == 0);
+        return barrier;
+}
+
+/* Makes whatever the barrier protects writable and frees the barrier. */
+void Barrier_free(T *barrier)
+{
+        Barrier_disarm(*barrier);
+        free((*barrier)->dirty);
+        free((*barrier)->faulted);
+        free(*barrier);
+        *barrier = NULL;
+}
+
+/* Returns how many words a page holds. */
+unsigned Barrier_page_words(T barrier)
+{
+        return barrier->page_bytes / sizeof(WORD_SIZE);
+}
+
+/* Protects the pages holding the length words at words, after making the
+ * dirty bitmap and fault counts big enough for them and clearing them. The
+ * pages must not be protected already; disarm first.
+ */
+void Barrier_arm(T barrier, WORD_SIZE *words, WORD_SIZE length)
+{
+        size_t bytes = (size_t)length * sizeof(WORD_SIZE);
+        unsigned num_pages = (bytes + barrier->page_bytes - 1) /
+                             barrier->page_bytes;
+        unsigned needed = (num_pages + 63) / 64;
+
+        assert(barrier->base == NULL);
+        assert((uintptr_t)words % barrier->page_bytes == 0);
+        if (needed > barrier->dirty_capacity) {
+                free(barrier->dirty);
+                free(barrier->faulted);
+                barrier->dirty = malloc(needed * sizeof(uint64_t));
+                barrier->faulted = malloc(needed * 64);
+                assert(barrier->dirty != NULL && barrier->faulted != NULL);
+                barrier->dirty_capacity = needed;
+        }
+        memset(barrier->dirty, 0, needed * sizeof(uint64_t));
+        memset(barrier->faulted, 0, needed * 64);
+
+        barrier->base = (char *)words;
+        barrier->num_pages = num_pages;
+        if (num_pages > 0) {
+                protect(barrier, 0, num_pages, PROT_READ);
+        }
+        barrier->armed += num_pages;
+}
+
+/* Makes every page the barrier protects writable again and forgets them. */
+void Barrier_disarm(T barrier)
+{
+        if (barrier->base != NULL && barrier->num_pages > 0) {
+                protect(barrier, 0, barrier->num_pages,
+                        PROT_READ | PROT_WRITE);
+        }
+        barrier->base = NULL;
+        barrier->num_pages = 0;
+}
+
+/* Marks the page addr is in dirty and makes it writable, if the barrier
+ * protects it. Only compares, stores and one mprotect, so it is safe in a
+ * signal handler; if the mprotect fails the page is left alone and false
+ * returned, so the fault is not retried forever.
+ */
+bool Barrier_fault(T barrier, const void *addr, unsigned *page)
+{
+        const char *byte = addr;
+        unsigned index;
+
+        if (barrier->base == NULL || byte < barrier->base ||
+            byte >= barrier->base +
+                    (size_t)barrier->num_pages * barrier->page_bytes) {
+                return false;
+        }
+        index = (byte - barrier->base) / barrier->page_bytes;
+        if (mprotect(barrier->base + (size_t)index * barrier->page_bytes,
+                     barrier->page_bytes, PROT_READ | PROT_WRITE) != 0) {
+                return false;
+        }
+        barrier->dirty[index / 64] |= (uint64_t)1 << (index % 64);
+        barrier->faulted[index]++;
+        barrier->faults++;
+        *page = index;
+        return true;
+}
+
+/* Protects dirty page again and marks it clean, unless it has faulted
+ * FAULT_LIMIT times. A page given up on is never protected again, so it
+ * cannot fault again either, and its count stays at the limit.
+ */
+bool Barrier_clean(T barrier, unsigned page)
+{
+        assert(page < barrier->num_pages);
+        assert(barrier->dirty[page / 64] & ((uint64_t)1 << (page % 64)));
+        if (barrier->faulted[page] >= FAULT_LIMIT) {
+                /* the caller stops asking once it is refused */
+                barrier->given_up++;
+                return false;
+        }
+        protect(barrier, page, 1, PROT_READ);
+        barrier->dirty[page / 64] &= ~((uint64_t)1 << (page % 64));
+        barrier->cleaned++;
+        return true;
+}
+
+/* Returns the dirty bitmap and the number of pages armed. */
+const uint64_t *Barrier_dirty(T barrier, unsigned *num_pages)
+{
+        *num_pages = barrier->num_pages;
+        return barrier->dirty;
+}
+
+/* Prints the pages armed, stores that faulted, pages cleaned and pages
+ * given up on.
+ */
+void Barrier_report(T barrier, FILE *out)
+{
+        fprintf(out, "barrier: %" PRIu64 " pages armed, %" PRIu64
+                " faults, %" PRIu64 " pages cleaned, %" PRIu64 " given up "
+                "on\n", barrier->armed, barrier->faults, barrier->cleaned,
+                barrier->given_up);
+}
+
+/* Sets the protection of the count pages from page to prot. A failure
+ * means the process is out of mappings or segment 0 is on pages that
+ * cannot be protected one at a time, and the barrier cannot work either
+ * way.
+ */
+static void protect(T barrier, unsigned page, unsigned count, int prot)
+{
+        if (mprotect(barrier->base + (size_t)page * barrier->page_bytes,
+                     (size_t)count * barrier->page_bytes, prot) != 0) {
+                fprintf(stderr, "Error: cannot protect segment 0\n");
+                exit(EXIT_FAILURE);
+        }
+}
@@ -0,0 +1,74 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the write barrier on segment 0, used by builds with
+ * -DWRITE_BARRIER. The words of segment 0 are mapped read-only, so the
+ * first store into each page faults instead of every store having to
+ * check whether it is into segment 0. The um's fault handler passes the
+ * address to Barrier_fault, which marks the page dirty and makes it
+ * writable again; whatever was derived from the page (predecoded
+ * instructions, or code from any later tier) is stale from then on until
+ * it is rebuilt and the page is protected again with Barrier_clean. A
+ * page that keeps being stored into, because the guest keeps data next to
+ * its code, is given up on instead: it stays writable and dirty until the
+ * barrier is armed again, and whatever runs from it must read its words
+ * afresh. The dirty pages are kept in a bitmap, one bit per page, for any
+ * tier to read.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#ifndef BARRIER_H_INCLUDED
+#define BARRIER_H_INCLUDED
+#define WORD_SIZE uint32_t
+#define T Barrier_T
+typedef struct T *T;
+
+/* Creates a barrier that protects nothing yet. */
+T Barrier_new();
+
+/* Disarms the barrier and frees it. */
+void Barrier_free(T *barrier);
+
+/* Returns how many words a page holds. */
+unsigned Barrier_page_words(T barrier);
+
+/* Maps the pages holding the length words at words, which must start a
+ * page and be the only thing on their pages, read-only, with every page
+ * clean. Exits if they cannot be protected.
+ */
+void Barrier_arm(T barrier, WORD_SIZE *words, WORD_SIZE length);
+
+/* Makes every page the barrier protects writable again and forgets them,
+ * before their words are released or replaced.
+ */
+void Barrier_disarm(T barrier);
+
+/* If addr is in a page the barrier protects, marks the page dirty, makes
+ * it writable, sets page to its index and returns true; otherwise returns
+ * false. Async-signal-safe.
+ */
+bool Barrier_fault(T barrier, const void *addr, unsigned *page);
+
+/* Protects dirty page again and marks it clean, so that what is derived
+ * from its words can be rebuilt, and returns true, unless the page has
+ * faulted too often to be worth protecting; then it is left writable and
+ * dirty for good and false is returned, and the caller should not ask
+ * again until the next Barrier_arm.
+ */
+bool Barrier_clean(T barrier, unsigned page);
+
+/* Returns the dirty bitmap, bit page % 64 of word page / 64 for each page,
+ * and sets num_pages to the number of pages armed. Valid until the next
+ * Barrier_arm.
+ */
+const uint64_t *Barrier_dirty(T barrier, unsigned *num_pages);
+
+/* Prints how many pages have been armed, how many stores faulted, how
+ * many pages were cleaned and how many were given up on to out.
+ */
+void Barrier_report(T barrier, FILE *out);
+
+#undef T
+#endif
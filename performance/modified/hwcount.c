@@ -0,0 +1,445 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the hardware counters with perf_event_open. The
+ * counters are one group, so the kernel puts them on the processor
+ * together and one read of the first (the leader) returns them all, along
+ * with how long the group was enabled and how long it was really counting;
+ * if the processor had to share its counters with someone else the counts
+ * are scaled up by the ratio, as perf stat does. Only user space is
+ * counted, which is all an unprivileged process may count, and all of the
+ * interpreter but its system calls.
+ *
+ * Sampling sets the leader to raise SIGIO every time it counts its sample
+ * period. The handler reads the group, which is a system call and so safe
+ * in a handler, and charges the difference from the last read to the
+ * current class. A sample covers everything since the last one, so a class
+ * is charged for whatever ran just before it, as perf record charges a
+ * sample to the instruction it landed on; over thousands of samples the
+ * shares come out right.
+ */
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <assert.h>
+#include "hwcount.h"
+#define NUM_EVENTS 6
+#define NONE (-1)
+#define T Hwcount_T
+
+enum { CYCLES = 0, INSTRUCTIONS, BRANCHES, BRANCH_MISSES, LLC_MISSES,
+       TASK_CLOCK };
+
+/* A counter: its name in the report, what perf_event_open calls it and how
+ * many events between samples when it leads the group.
+ */
+typedef struct Event {
+        const char *name;
+        uint32_t type;
+        uint64_t config;
+        uint64_t period;
+} Event;
+
+static const Event events[NUM_EVENTS] = {
+        { "cycles",        PERF_TYPE_HARDWARE,
+          PERF_COUNT_HW_CPU_CYCLES,          1000000 },
+        { "instructions",  PERF_TYPE_HARDWARE,
+          PERF_COUNT_HW_INSTRUCTIONS,        1000000 },
+        { "branches",      PERF_TYPE_HARDWARE,
+          PERF_COUNT_HW_BRANCH_INSTRUCTIONS, 200000 },
+        { "branch-misses", PERF_TYPE_HARDWARE,
+          PERF_COUNT_HW_BRANCH_MISSES,       10000 },
+        { "LLC-misses",    PERF_TYPE_HARDWARE,
+          PERF_COUNT_HW_CACHE_MISSES,        10000 },
+        { "task-clock-ns", PERF_TYPE_SOFTWARE,
+          PERF_COUNT_SW_TASK_CLOCK,          1000000 },
+};
+
+static const char *const phase_names[HWCOUNT_PHASES] = {
+        "load", "execute", "teardown"
+};
+
+/* Struct that holds the descriptor of each counter (-1 if it could not be
+ * opened) and the counter at each place of a group read, the leader, the
+ * error that kept the first counter out, whether any count was scaled up,
+ * the phase being counted and the counts when it started, the counts of
+ * each phase, and for sampling whether a sample counts now, the class
+ * running, the classes with their names, counts and samples, and the
+ * counts at the last sample.
+ */
+struct T {
+        int fds[NUM_EVENTS];
+        int order[NUM_EVENTS];
+        unsigned num_open;
+        int leader;
+        int error;
+        volatile bool scaled;
+        Hwcount_phase phase;
+        uint64_t start[NUM_EVENTS];
+        uint64_t phases[HWCOUNT_PHASES][NUM_EVENTS];
+        volatile sig_atomic_t sampling;
+        volatile const unsigned char *current;
+        unsigned num_classes;
+        const char *const *names;
+        uint64_t (*classes)[NUM_EVENTS];
+        uint64_t *samples;
+        uint64_t last[NUM_EVENTS];
+};
+
+/* The counters the SIGIO handler samples, if any. */
+static T sampled = NULL;
+
+/* Reads every counter of the group into values, indexed by event, scaled
+ * up if the group did not count the whole time it was enabled. Counters
+ * not open read 0. Async-signal-safe.
+ */
+static void read_group(T hw, uint64_t *values);
+
+/* Charges what the counters counted since the last sample to the class
+ * running, if the execute phase is being sampled.
+ */
+static void sample(int sig, siginfo_t *info, void *context);
+
+/* Sets value to counts[num] / counts[den] and returns true, if both were
+ * counted and counts[den] is not 0.
+ */
+static bool ratio(T hw, const uint64_t *counts, int num, int den,
+                  double *value);
+
+
+/* Opens the counters for the calling thread as a group led by the first
+ * one that opens, and starts them.
+ */
+T Hwcount_new()
+{
+        T hw = calloc(1, sizeof(struct Hwcount_T));
+
+        assert(hw != NULL);
+        hw->leader = NONE;
+        for (int e = 0; e < NUM_EVENTS; e++) {
+                struct perf_event_attr attr;
+                int fd;
+
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = events[e].type;
+                attr.config = events[e].config;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                if (hw->leader == NONE) {
+                        attr.disabled = 1;
+                        attr.read_format = PERF_FORMAT_GROUP |
+                                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+                        attr.sample_period = events[e].period;
+                        attr.wakeup_events = 1;
+                }
+                fd = syscall(SYS_perf_event_open, &attr, 0, -1,
+                             hw->leader == NONE ? -1 : hw->fds[hw->leader],
+                             0);
+                hw->fds[e] = fd;
+                if (fd < 0) {
+                        if (hw->error == 0) {
+                                hw->error = errno;
+                        }
+                        continue;
+                }
+                hw->order[hw->num_open++] = e;
+                if (hw->leader == NONE) {
+                        hw->leader = e;
+                }
+        }
+        if (hw->leader != NONE) {
+                ioctl(hw->fds[hw->leader], PERF_EVENT_IOC_RESET,
+                      PERF_IOC_FLAG_GROUP);
+                ioctl(hw->fds[hw->leader], PERF_EVENT_IOC_ENABLE,
+                      PERF_IOC_FLAG_GROUP);
+        }
+        return hw;
+}
+
+/* Stops sampling, closes the counters and frees them. */
+void Hwcount_free(T *hw)
+{
+        if (sampled == *hw) {
+                sampled = NULL;
+        }
+        for (int e = 0; e < NUM_EVENTS; e++) {
+                if ((*hw)->fds[e] >= 0) {
+                        close((*hw)->fds[e]);
+                }
+        }
+        free((*hw)->classes);
+        free((*hw)->samples);
+        free(*hw);
+        *hw = NULL;
+}
+
+/* Reads the counters as phase starts. The execute phase also starts the
+ * samples from here, so none is charged for what came before it.
+ */
+void Hwcount_start(T hw, Hwcount_phase phase)
+{
+        if (hw == NULL) {
+                return;
+        }
+        read_group(hw, hw->start);
+        hw->phase = phase;
+        if (phase == HWCOUNT_EXECUTE && hw->classes != NULL) {
+                memcpy(hw->last, hw->start, sizeof(hw->last));
+                hw->sampling = 1;
+        }
+}
+
+/* Stops sampling and adds what was counted since Hwcount_start to its
+ * phase. A scaled count can come out a little lower than the one before
+ * it, which counts as nothing.
+ */
+void Hwcount_stop(T hw)
+{
+        uint64_t now[NUM_EVENTS];
+
+        if (hw == NULL) {
+                return;
+        }
+        hw->sampling = 0;
+        read_group(hw, now);
+        for (int e = 0; e < NUM_EVENTS; e++) {
+                if (now[e] > hw->start[e]) {
+                        hw->phases[hw->phase][e] += now[e] - hw->start[e];
+                }
+        }
+}
+
+/* Has the leader raise SIGIO for this process at every sample period and
+ * sets up the classes the handler charges. If the signal cannot be set up
+ * the report just has no classes.
+ */
+void Hwcount_sample(T hw, volatile const unsigned char *current,
+                    unsigned num_classes, const char *const *names)
+{
+        struct sigaction action;
+        int fd;
+
+        assert(num_classes > 0);
+        if (hw->leader == NONE || sampled != NULL) {
+                return;
+        }
+        hw->classes = calloc(num_classes, sizeof(*hw->classes));
+        hw->samples = calloc(num_classes, sizeof(uint64_t));
+        assert(hw->classes != NULL && hw->samples != NULL);
+        hw->current = current;
+        hw->num_classes = num_classes;
+        hw->names = names;
+
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = sample;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGIO, &action, NULL);
+        sampled = hw;
+
+        fd = hw->fds[hw->leader];
+        if (fcntl(fd, F_SETOWN, getpid()) != 0 ||
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) != 0) {
+                sampled = NULL;
+                free(hw->classes);
+                free(hw->samples);
+                hw->classes = NULL;
+                hw->samples = NULL;
+        }
+}
+
+/* Prints a column per phase for each counter that was counted, then the
+ * ratios the counters give, the counters that were not counted and the
+ * classes, if sampled.
+ */
+void Hwcount_report(T hw, FILE *out)
+{
+        double value;
+
+        if (hw->leader == NONE) {
+                fprintf(out, "Hardware counters: none available (%s)\n",
+                        strerror(hw->error));
+                return;
+        }
+        fprintf(out, "Hardware counters, user space only:\n%-16s", "");
+        for (int p = 0; p < HWCOUNT_PHASES; p++) {
+                fprintf(out, " %15s", phase_names[p]);
+        }
+        fprintf(out, "\n");
+        for (unsigned i = 0; i < hw->num_open; i++) {
+                int e = hw->order[i];
+
+                fprintf(out, "  %-14s", events[e].name);
+                for (int p = 0; p < HWCOUNT_PHASES; p++) {
+                        fprintf(out, " %15" PRIu64, hw->phases[p][e]);
+                }
+                fprintf(out, "\n");
+        }
+        if (hw->fds[CYCLES] >= 0 && hw->fds[INSTRUCTIONS] >= 0) {
+                fprintf(out, "  %-14s", "IPC");
+                for (int p = 0; p < HWCOUNT_PHASES; p++) {
+                        if (ratio(hw, hw->phases[p], INSTRUCTIONS, CYCLES,
+                                  &value)) {
+                                fprintf(out, " %15.2f", value);
+                        } else {
+                                fprintf(out, " %15s", "-");
+                        }
+                }
+                fprintf(out, "\n");
+        }
+        if (hw->fds[BRANCHES] >= 0 && hw->fds[BRANCH_MISSES] >= 0) {
+                fprintf(out, "  %-14s", "branch-miss %");
+                for (int p = 0; p < HWCOUNT_PHASES; p++) {
+                        if (ratio(hw, hw->phases[p], BRANCH_MISSES,
+                                  BRANCHES, &value)) {
+                                fprintf(out, " %15.2f", 100 * value);
+                        } else {
+                                fprintf(out, " %15s", "-");
+                        }
+                }
+                fprintf(out, "\n");
+        }
+        if (hw->num_open < NUM_EVENTS) {
+                const char *separator = "";
+
+                fprintf(out, "  not counted: ");
+                for (int e = 0; e < NUM_EVENTS; e++) {
+                        if (hw->fds[e] < 0) {
+                                fprintf(out, "%s%s", separator,
+                                        events[e].name);
+                                separator = ", ";
+                        }
+                }
+                fprintf(out, " (%s)\n", strerror(hw->error));
+        }
+        if (hw->scaled) {
+                fprintf(out, "  counts scaled up: the processor was "
+                        "shared with other counters\n");
+        }
+
+        if (hw->classes == NULL) {
+                return;
+        }
+        uint64_t samples = 0, total = 0;
+
+        for (unsigned c = 0; c < hw->num_classes; c++) {
+                samples += hw->samples[c];
+                total += hw->classes[c][hw->leader];
+        }
+        fprintf(out, "\nBy opcode class, %" PRIu64 " samples of %" PRIu64
+                " %s while executing:\n", samples,
+                events[hw->leader].period, events[hw->leader].name);
+        fprintf(out, "  %-10s %9s %8s %8s %14s %14s\n", "class",
+                "samples", "share", "IPC", "branch-miss %", "LLC-misses");
+        for (unsigned c = 0; c < hw->num_classes; c++) {
+                const uint64_t *counts = hw->classes[c];
+
+                if (hw->samples[c] == 0) {
+                        continue;
+                }
+                fprintf(out, "  %-10s %9" PRIu64 " %7.1f%%", hw->names[c],
+                        hw->samples[c], total == 0 ? 0.0 :
+                        100.0 * counts[hw->leader] / total);
+                if (ratio(hw, counts, INSTRUCTIONS, CYCLES, &value)) {
+                        fprintf(out, " %8.2f", value);
+                } else {
+                        fprintf(out, " %8s", "-");
+                }
+                if (ratio(hw, counts, BRANCH_MISSES, BRANCHES, &value)) {
+                        fprintf(out, " %14.2f", 100 * value);
+                } else {
+                        fprintf(out, " %14s", "-");
+                }
+                if (hw->fds[LLC_MISSES] >= 0) {
+                        fprintf(out, " %14" PRIu64 "\n", counts[LLC_MISSES]);
+                } else {
+                        fprintf(out, " %14s\n", "-");
+                }
+        }
+}
+
+/* Reads every counter of the group into values, indexed by event. The
+ * read gives the number of counters, the time the group was enabled and
+ * running, and the counts in the order the counters were opened.
+ */
+static void read_group(T hw, uint64_t *values)
+{
+        uint64_t buffer[3 + NUM_EVENTS];
+        ssize_t got;
+
+        memset(values, 0, NUM_EVENTS * sizeof(uint64_t));
+        if (hw->leader == NONE) {
+                return;
+        }
+        got = read(hw->fds[hw->leader], buffer, sizeof(buffer));
+        if (got < (ssize_t)(3 * sizeof(uint64_t)) || buffer[2] == 0) {
+                return;
+        }
+        for (unsigned i = 0; i < buffer[0] && i < hw->num_open; i++) {
+                uint64_t count = buffer[3 + i];
+
+                if (buffer[2] < buffer[1]) {
+                        count = (double)count * buffer[1] / buffer[2];
+                        hw->scaled = true;
+                }
+                values[hw->order[i]] = count;
+        }
+}
+
+/* Charges what the counters counted since the last sample to the class
+ * running. A read can fail with errno set, which the code the signal
+ * interrupted must not see.
+ */
+static void sample(int sig, siginfo_t *info, void *context)
+{
+        T hw = sampled;
+        int saved = errno;
+        uint64_t now[NUM_EVENTS];
+        unsigned class;
+
+        (void) sig;
+        (void) info;
+        (void) context;
+        if (hw == NULL || !hw->sampling) {
+                return;
+        }
+        read_group(hw, now);
+        class = *hw->current;
+        if (class < hw->num_classes) {
+                for (int e = 0; e < NUM_EVENTS; e++) {
+                        if (now[e] > hw->last[e]) {
+                                hw->classes[class][e] += now[e] -
+                                                         hw->last[e];
+                        }
+                }
+                hw->samples[class]++;
+        }
+        memcpy(hw->last, now, sizeof(now));
+        errno = saved;
+}
+
+/* Sets value to counts[num] / counts[den] and returns true, if both were
+ * counted and counts[den] is not 0.
+ */
+static bool ratio(T hw, const uint64_t *counts, int num, int den,
+                  double *value)
+{
+        if (hw->fds[num] < 0 || hw->fds[den] < 0 || counts[den] == 0) {
+                return false;
+        }
+        *value = (double)counts[num] / counts[den];
+        return true;
+}
@@ -0,0 +1,68 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the hardware counters of ./um --hwcounters. A group of
+ * perf_event_open counters (cycles, instructions, branches, branch misses
+ * and last level cache misses, with task clock as one the kernel always
+ * has) counts the um's own thread in user space, and the counts are split
+ * by the phase they fell in: loading the program, running it and freeing
+ * the um. Counters the processor or kernel does not offer are left out,
+ * so a virtual machine without a PMU still gets the task clock.
+ *
+ * With a profiling build the counts can also be sampled: every so many
+ * events of the group's first counter a signal reads the group and
+ * charges what it counted since the last sample to the opcode class the
+ * profiler says is running.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#ifndef HWCOUNT_H_INCLUDED
+#define HWCOUNT_H_INCLUDED
+#define T Hwcount_T
+typedef struct T *T;
+
+/* The phases counts are split into. */
+typedef enum Hwcount_phase {
+        HWCOUNT_LOAD = 0,
+        HWCOUNT_EXECUTE,
+        HWCOUNT_TEARDOWN,
+        HWCOUNT_PHASES
+} Hwcount_phase;
+
+/* Opens and starts the counters for the calling thread. Counters that
+ * cannot be opened are left out; if none can, the report says so and
+ * nothing is counted.
+ */
+T Hwcount_new();
+
+/* Closes the counters, stopping any sampling, and frees them. */
+void Hwcount_free(T *hw);
+
+/* Starts charging what is counted to phase. Does nothing if hw is NULL,
+ * so callers need not check whether counting is on.
+ */
+void Hwcount_start(T hw, Hwcount_phase phase);
+
+/* Charges what was counted since Hwcount_start to its phase. Does nothing
+ * if hw is NULL.
+ */
+void Hwcount_stop(T hw);
+
+/* Samples the counts of the execute phase into num_classes classes named
+ * names, charging each sample to the class in *current when it is taken.
+ * The names must outlive hw. Installs a SIGIO handler; one hw per process
+ * can sample.
+ */
+void Hwcount_sample(T hw, volatile const unsigned char *current,
+                    unsigned num_classes, const char *const *names);
+
+/* Prints the counts of each phase, with instructions per cycle and the
+ * share of branches missed where both were counted, and per class if
+ * sampled, to out.
+ */
+void Hwcount_report(T hw, FILE *out);
+
+#undef T
+#endif
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include "segment.h"
 #include "instructions.h"
+#include "io.h"
 #define REG_SIZE uint32_t
 #define WORD_SIZE uint32_t
 
@@ -105,11 +106,11 @@ void unmap_segment(Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c)
 }
 
 /* The value in reg_c is displayed on the I/O device if it is in the range of 
- * 0-255.
+ * 0-255. The device is the buffered one on standard output.
  */
 void output(Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c)
 {
-        fprintf(stdout, "%c", (char)(*reg_c));
+        Io_put(Io_stdio(), *reg_c);
         (void) reg_b;
         (void) seg_memory;
 }
@@ -120,11 +121,7 @@ void output(Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c)
  */
 void input(Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c)
 {
-        *reg_c = fgetc(stdin); 
-        
-        if (*reg_c ==  (unsigned)EOF) {
-                *reg_c = ~0;
-        }
+        *reg_c = Io_get(Io_stdio());
         (void) reg_b;
         (void) seg_memory;
 }
@@ -63,7 +63,7 @@ void map_segment(Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c);
 void unmap_segment(Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c);
 
 /* The value in reg_c is displayed on the I/O device if it is in the range of
- * 0-255.
+ * 0-255. Both output and input use the device from Io_stdio.
  */
 void output(Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c);
 
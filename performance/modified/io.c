@@ -0,0 +1,379 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the I/O device of the UM. Each device owns one output
+ * and one input buffer of BUF_SIZE bytes; the backend is only called to
+ * empty or refill them.
+ */
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "io.h"
+#define REG_SIZE uint32_t
+#define BUF_SIZE 65536
+#define T Io_T
+
+/* Struct that holds the backend, the bytes waiting to be written, the
+ * bytes read but not yet handed to the guest, whether writing has failed
+ * and whether the end of input counts as blocked.
+ */
+struct T {
+        Io_backend backend;
+        unsigned char out[BUF_SIZE];
+        size_t out_len;
+        unsigned char in[BUF_SIZE];
+        size_t in_pos;
+        size_t in_len;
+        bool at_eof;
+        bool failed;
+        bool pause_at_eof;
+};
+
+/* State of the fd and file backends. */
+typedef struct Fd_state {
+        int in_fd;
+        int out_fd;
+        bool owned;
+} Fd_state;
+
+/* State of the memory backend. */
+typedef struct Mem_state {
+        const unsigned char *input;
+        size_t in_length;
+        size_t in_pos;
+        unsigned char *output;
+        size_t out_length;
+        size_t out_capacity;
+} Mem_state;
+
+/* The device on standard input and output, once created. */
+static T stdio_device;
+
+static long fd_read(void *state, unsigned char *buf, size_t len);
+static long fd_write(void *state, const unsigned char *buf, size_t len);
+static void fd_close(void *state);
+static long mem_read(void *state, unsigned char *buf, size_t len);
+static long mem_write(void *state, const unsigned char *buf, size_t len);
+static void mem_close(void *state);
+
+/* Creates a device on a new Fd_state for the two descriptors. */
+static T fd_device(int in_fd, int out_fd, bool owned);
+
+/* Refills the input buffer from the backend if it is empty and the input
+ * has not ended. Returns false if the backend has no input yet.
+ */
+static bool fill(T io);
+
+/* Flushes the standard device; registered with atexit. A process whose
+ * standard output could not be written exits with a failure.
+ */
+static void flush_stdio();
+
+
+/* Creates a device on top of backend. */
+T Io_new(Io_backend backend)
+{
+        T io = malloc(sizeof(struct Io_T));
+        assert(io != NULL);
+        io->backend = backend;
+        io->out_len = 0;
+        io->in_pos = 0;
+        io->in_len = 0;
+        io->at_eof = false;
+        io->failed = false;
+        io->pause_at_eof = false;
+        return io;
+}
+
+/* Creates a device reading from in_fd and writing to out_fd. */
+T Io_fd(int in_fd, int out_fd)
+{
+        return fd_device(in_fd, out_fd, false);
+}
+
+/* Creates a device whose input is the length bytes at input and whose
+ * output is kept in memory.
+ */
+T Io_memory(const unsigned char *input, size_t length)
+{
+        Mem_state *mem = calloc(1, sizeof(Mem_state));
+        assert(mem != NULL);
+        mem->input = input;
+        mem->in_length = length;
+
+        Io_backend backend = { mem_read, mem_write, mem_close, mem };
+        return Io_new(backend);
+}
+
+/* Creates a device on the files at in_path and out_path. */
+T Io_file(const char *in_path, const char *out_path)
+{
+        int in_fd = -1;
+        int out_fd = -1;
+
+        if (in_path != NULL && (in_fd = open(in_path, O_RDONLY)) < 0) {
+                return NULL;
+        }
+        if (out_path != NULL && (out_fd = open(out_path, 
+                                               O_WRONLY | O_CREAT | O_TRUNC,
+                                               0666)) < 0) {
+                if (in_fd >= 0) {
+                        close(in_fd);
+                }
+                return NULL;
+        }
+        return fd_device(in_fd, out_fd, true);
+}
+
+/* Returns the device on standard input and output. */
+T Io_stdio()
+{
+        if (stdio_device == NULL) {
+                stdio_device = Io_fd(STDIN_FILENO, STDOUT_FILENO);
+                atexit(flush_stdio);
+        }
+        return stdio_device;
+}
+
+/* Flushes the device and frees it along with its backend. */
+void Io_free(T *io)
+{
+        Io_flush(*io);
+        if ((*io)->backend.close != NULL) {
+                (*io)->backend.close((*io)->backend.state);
+        }
+        if (*io == stdio_device) {
+                stdio_device = NULL;
+        }
+        free(*io);
+        *io = NULL;
+}
+
+/* Writes the low 8 bits of c, writing the buffer out first if it is full. */
+void Io_put(T io, REG_SIZE c)
+{
+        if (io->out_len == BUF_SIZE) {
+                Io_flush(io);
+        }
+        io->out[io->out_len++] = (unsigned char)c;
+}
+
+/* Flushes any output and returns the next byte of input. The backend must
+ * not be blocked (see Io_ready).
+ */
+REG_SIZE Io_get(T io)
+{
+        bool ready;
+
+        Io_flush(io);
+        ready = fill(io);
+        assert(ready);
+        (void) ready;
+        if (io->in_pos == io->in_len) {
+                return ~(REG_SIZE)0;
+        }
+        return io->in[io->in_pos++];
+}
+
+/* Flushes any output and returns whether Io_get can answer right away. */
+bool Io_ready(T io)
+{
+        Io_flush(io);
+        return fill(io);
+}
+
+/* Writes out everything buffered so far. Once a write fails the device
+ * remembers it and throws away everything written after it.
+ */
+void Io_flush(T io)
+{
+        if (io->out_len == 0) {
+                return;
+        }
+        if (!io->failed && io->backend.write != NULL &&
+            io->backend.write(io->backend.state, io->out, io->out_len) < 0) {
+                io->failed = true;
+        }
+        io->out_len = 0;
+}
+
+/* Returns whether writing to the device has failed. */
+bool Io_error(T io)
+{
+        return io->failed;
+}
+
+/* Chooses whether the end of input is reported as blocked. */
+void Io_pause_at_eof(T io, bool pause)
+{
+        io->pause_at_eof = pause;
+}
+
+/* Returns the output kept by a device from Io_memory. */
+const unsigned char *Io_output(T io, size_t *length)
+{
+        assert(io->backend.write == mem_write);
+        Io_flush(io);
+
+        Mem_state *mem = io->backend.state;
+        *length = mem->out_length;
+        return mem->output;
+}
+
+/* Refills the input buffer from the backend if it is empty and the input
+ * has not ended. Returns false if the backend has no input yet; an error
+ * reading counts as the end of input.
+ */
+static bool fill(T io)
+{
+        long got = 0;
+
+        if (io->in_pos < io->in_len || io->at_eof) {
+                return true;
+        }
+        if (io->backend.read != NULL) {
+                got = io->backend.read(io->backend.state, io->in, BUF_SIZE);
+        }
+        if (got == IO_BLOCKED || (got == 0 && io->pause_at_eof)) {
+                return false;
+        }
+        if (got <= 0) {
+                io->at_eof = true;
+                return true;
+        }
+        io->in_pos = 0;
+        io->in_len = got;
+        return true;
+}
+
+/* Reads up to len bytes from the input descriptor, retrying on signals. A
+ * non-blocking descriptor with nothing to read is blocked.
+ */
+static long fd_read(void *state, unsigned char *buf, size_t len)
+{
+        Fd_state *fds = state;
+        ssize_t got;
+
+        if (fds->in_fd < 0) {
+                return 0;
+        }
+        do {
+                got = read(fds->in_fd, buf, len);
+        } while (got < 0 && errno == EINTR);
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return IO_BLOCKED;
+        }
+        return got;
+}
+
+/* Writes all len bytes to the output descriptor. */
+static long fd_write(void *state, const unsigned char *buf, size_t len)
+{
+        Fd_state *fds = state;
+        size_t done = 0;
+
+        if (fds->out_fd < 0) {
+                return 0;
+        }
+        while (done < len) {
+                ssize_t wrote = write(fds->out_fd, buf + done, len - done);
+                if (wrote < 0 && errno != EINTR) {
+                        return -1;
+                }
+                if (wrote > 0) {
+                        done += wrote;
+                }
+        }
+        return done;
+}
+
+/* Closes the descriptors if the device opened them. */
+static void fd_close(void *state)
+{
+        Fd_state *fds = state;
+
+        if (fds->owned) {
+                if (fds->in_fd >= 0) {
+                        close(fds->in_fd);
+                }
+                if (fds->out_fd >= 0) {
+                        close(fds->out_fd);
+                }
+        }
+        free(fds);
+}
+
+/* Copies up to len bytes of the remaining input. */
+static long mem_read(void *state, unsigned char *buf, size_t len)
+{
+        Mem_state *mem = state;
+        size_t left = mem->in_length - mem->in_pos;
+
+        if (len > left) {
+                len = left;
+        }
+        memcpy(buf, mem->input + mem->in_pos, len);
+        mem->in_pos += len;
+        return len;
+}
+
+/* Appends len bytes to the kept output, doubling its capacity as needed. */
+static long mem_write(void *state, const unsigned char *buf, size_t len)
+{
+        Mem_state *mem = state;
+
+        if (mem->out_length + len > mem->out_capacity) {
+                size_t capacity = mem->out_capacity * 2 + len;
+                unsigned char *output = realloc(mem->output, capacity);
+                if (output == NULL) {
+                        return -1;
+                }
+                mem->output = output;
+                mem->out_capacity = capacity;
+        }
+        memcpy(mem->output + mem->out_length, buf, len);
+        mem->out_length += len;
+        return len;
+}
+
+/* Frees the kept output. */
+static void mem_close(void *state)
+{
+        Mem_state *mem = state;
+
+        free(mem->output);
+        free(mem);
+}
+
+/* Creates a device on a new Fd_state for the two descriptors. */
+static T fd_device(int in_fd, int out_fd, bool owned)
+{
+        Fd_state *fds = malloc(sizeof(Fd_state));
+        assert(fds != NULL);
+        fds->in_fd = in_fd;
+        fds->out_fd = out_fd;
+        fds->owned = owned;
+
+        Io_backend backend = { fd_read, fd_write, fd_close, fds };
+        return Io_new(backend);
+}
+
+/* Flushes the standard device. */
+static void flush_stdio()
+{
+        if (stdio_device != NULL) {
+                Io_flush(stdio_device);
+                if (stdio_device->failed) {
+                        fprintf(stderr, "Output error.\n");
+                        _exit(EXIT_FAILURE);
+                }
+        }
+}
@@ -0,0 +1,102 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the I/O device of the UM. Output goes into a private buffer
+ * that is written out when it fills, when the guest asks for input and
+ * when the device is flushed or freed; input is read in bulk. Where the
+ * bytes come from and go to is up to a backend: file descriptors, memory
+ * or files.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#ifndef IO_H_INCLUDED
+#define IO_H_INCLUDED
+#define REG_SIZE uint32_t
+#define T Io_T
+typedef struct T *T;
+
+/* What a backend's read returns when no input has arrived yet but more
+ * may come.
+ */
+#define IO_BLOCKED (-2)
+
+/* A backend: read fills buf with up to len bytes and returns how many, 0 at
+ * the end of input, -1 on an error or IO_BLOCKED if it would have to wait;
+ * write takes all len bytes and returns -1 on an error; close releases
+ * state. Any of them may be NULL, meaning no input, output that is thrown
+ * away or nothing to release.
+ */
+typedef struct Io_backend {
+        long (*read)(void *state, unsigned char *buf, size_t len);
+        long (*write)(void *state, const unsigned char *buf, size_t len);
+        void (*close)(void *state);
+        void *state;
+} Io_backend;
+
+/* Creates a device on top of backend. */
+T Io_new(Io_backend backend);
+
+/* Creates a device reading from in_fd and writing to out_fd. Either may be
+ * -1 for no input or output that is thrown away. The descriptors are left
+ * open when the device is freed.
+ */
+T Io_fd(int in_fd, int out_fd);
+
+/* Creates a device whose input is the length bytes at input and whose
+ * output is kept in memory for Io_output. input must outlive the device.
+ */
+T Io_memory(const unsigned char *input, size_t length);
+
+/* Creates a device reading from the file at in_path and writing to the file
+ * at out_path, either of which may be NULL. Returns NULL if a file cannot
+ * be opened.
+ */
+T Io_file(const char *in_path, const char *out_path);
+
+/* Returns the device on standard input and output, which is flushed when
+ * the process exits. The process then exits with a failure if any of its
+ * output could not be written.
+ */
+T Io_stdio();
+
+/* Flushes the device and frees it along with its backend. */
+void Io_free(T *io);
+
+/* Writes the low 8 bits of c. */
+void Io_put(T io, REG_SIZE c);
+
+/* Flushes any output and returns the next byte of input, or a word of all
+ * 1s at the end of input. If the backend can block, Io_ready must have
+ * returned true first.
+ */
+REG_SIZE Io_get(T io);
+
+/* Flushes any output and returns whether Io_get can return without
+ * waiting: there is input, or the input has ended. Only false for backends
+ * that can return IO_BLOCKED (non-blocking descriptors included).
+ */
+bool Io_ready(T io);
+
+/* Writes out everything buffered so far. If the backend fails to write,
+ * the output is thrown away from then on and Io_error reports it.
+ */
+void Io_flush(T io);
+
+/* Returns whether writing to the device has failed. */
+bool Io_error(T io);
+
+/* Chooses whether the end of input is reported as blocked (Io_ready returns
+ * false) rather than read, so a guest can be stopped just before it sees
+ * the end of its input.
+ */
+void Io_pause_at_eof(T io, bool pause);
+
+/* Returns the output kept by a device from Io_memory after flushing it, and
+ * stores its size in length.
+ */
+const unsigned char *Io_output(T io, size_t *length);
+
+#undef T
+#endif
@@ -0,0 +1,874 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the x86-64 JIT tier of the UM.
+ *
+ * A block starts at any word of segment 0 that is jumped to and runs until
+ * a halt, a load program or an invalid instruction. The 8 UM registers are
+ * pinned to machine registers for as long as native code runs: registers
+ * 0-5 to the six callee-saved ones, so that they survive calls untouched,
+ * and 6-7 to r10d and r11d, which are spilled to the stack around calls.
+ * Loads and stores find segment 0, and the last segment each of them used,
+ * inline through pointers kept on the first page of the code cache, which
+ * native code reaches relative to its own address, and call into
+ * segment.c only when those miss. Map, unmap and I/O are calls into
+ * segment.c and io.c.
+ *
+ * Every exit from native code goes through one trampoline that saves the
+ * registers and returns to Jit_run, which compiles the next block, patches
+ * the jump that asked for it so the two blocks are chained from then on,
+ * and enters native code again. A store into a word of segment 0 that has
+ * been compiled throws all of the code away; a guest that does this too
+ * often is handed back to the interpreter.
+ */
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "segment.h"
+#include "jit.h"
+#include "io.h"
+#define REG_SIZE uint32_t
+#define WORD_SIZE uint32_t
+#define T Jit_T
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+
+#define OPCODE_LSB 28
+#define A_LSB 6
+#define B_LSB 3
+#define C_LSB 0
+#define LOAD_VAL_LSB 25
+#define VAL_LENGTH 25
+
+#define CODE_SIZE (32 << 20)    /* bytes of executable memory */
+#define LOOKUP_BYTES 4096       /* of them kept for the Lookup */
+#define BLOCK_MAX 256           /* instructions per block */
+#define INST_BYTES_MAX 192      /* native bytes per instruction with its stub */
+#define FLUSH_MAX 1024          /* code flushes before giving up on the JIT */
+#define NO_SEGMENT UINT32_MAX
+
+/* x86-64 register numbers */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R10 10
+#define R11 11
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+/* Machine register that holds each UM register */
+static const int um_regs[8] = { RBX, RBP, R12, R13, R14, R15, R10, R11 };
+#define UM_REG(i) (um_regs[i])
+
+/* Reasons native code returns to Jit_run */
+enum { EXIT_HALT, EXIT_FALLBACK, EXIT_CHAIN, EXIT_DISPATCH, EXIT_LOADP,
+       EXIT_STORE0 };
+
+/* Opcodes of the UM */
+enum { CMOV, LOAD, STORE, ADD, MUL, DIV, NAND, HALT, MAP, UNMAP, OUT, IN,
+       LOADP, LOADV };
+
+/* The segments native code finds inline: the words of segment 0, the same
+ * once they have been made writable (NULL until then), and the last
+ * segment loaded from and the last one stored into, with their words. A
+ * store that misses may copy shared words and move the segment cached for
+ * loads, so the miss refills both; unmapping a cached segment or moving
+ * segment 0 empties them.
+ */
+typedef struct Lookup {
+        WORD_SIZE *code;
+        WORD_SIZE *code_store;
+        WORD_SIZE *load_words;
+        WORD_SIZE *store_words;
+        REG_SIZE load_id;
+        REG_SIZE store_id;
+} Lookup;
+
+/* Struct that holds the state handed over by the exit trampoline (the
+ * first four fields), the code cache, the segments native code finds
+ * inline and the per-word tables for segment 0.
+ */
+struct T {
+        REG_SIZE regs[8];
+        WORD_SIZE pc;
+        WORD_SIZE reason;
+        uint8_t *patch;
+
+        Segment_T memory;
+        Io_T io;
+        uint8_t *code;
+        uint8_t *code_start;
+        uint8_t *free_code;
+        uint8_t *exit;
+        void (*enter)(T jit, void *block);
+        Lookup *lookup;
+
+        void **entries;
+        uint8_t *translated;
+        WORD_SIZE length;
+        unsigned generation;
+        unsigned flushes;
+};
+
+static void tables_load(T jit);
+static void flush(T jit);
+static void *block_for(T jit, WORD_SIZE pc);
+static void compile(T jit, WORD_SIZE pc);
+static void emit_trampolines(T jit);
+static void patch_rel32(uint8_t *site, uint8_t *target);
+static WORD_SIZE *jit_load(T jit, REG_SIZE id);
+static int jit_store(T jit, REG_SIZE id, REG_SIZE offset, REG_SIZE word);
+static void jit_unmap(T jit, REG_SIZE id);
+
+/* Creates a JIT that compiles the program held in segment 0 of memory and
+ * does I/O on io. Returns NULL if executable memory is not available on
+ * this machine.
+ */
+T Jit_new(Segment_T memory, Io_T io)
+{
+        void *code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) {
+                return NULL;
+        }
+
+        T jit = calloc(1, sizeof(struct Jit_T));
+        assert(jit != NULL);
+        jit->memory = memory;
+        jit->io = io;
+        jit->code = code;
+        jit->lookup = code;
+        mprotect(code, LOOKUP_BYTES, PROT_READ | PROT_WRITE);
+        jit->free_code = jit->code + LOOKUP_BYTES;
+        emit_trampolines(jit);
+        jit->code_start = jit->free_code;
+        tables_load(jit);
+        return jit;
+}
+
+/* Frees the JIT and all of the code it has generated. */
+void Jit_free(T *jit)
+{
+        munmap((*jit)->code, CODE_SIZE);
+        free((*jit)->entries);
+        free((*jit)->translated);
+        free(*jit);
+        *jit = NULL;
+}
+
+/* Runs segment 0 natively from the word offset *pc until the guest halts or
+ * the rest of the run has to be interpreted.
+ */
+bool Jit_run(T jit, REG_SIZE *registers, WORD_SIZE *pc)
+{
+        WORD_SIZE next = *pc;
+        uint8_t *patch = NULL;
+        unsigned generation = 0;
+        bool halted = false;
+
+        memcpy(jit->regs, registers, sizeof(jit->regs));
+
+        while (true) {
+                uint8_t *block = block_for(jit, next);
+                if (block == NULL) {
+                        break;
+                }
+
+                /* chain the jump that asked for this block straight to it */
+                if (patch != NULL && generation == jit->generation) {
+                        patch_rel32(patch, block);
+                }
+                patch = NULL;
+
+                jit->enter(jit, block);
+                next = jit->pc;
+
+                if (jit->reason == EXIT_HALT) {
+                        halted = true;
+                        break;
+                }
+                else if (jit->reason == EXIT_FALLBACK) {
+                        break;
+                }
+                else if (jit->reason == EXIT_CHAIN) {
+                        patch = jit->patch;
+                        generation = jit->generation;
+                }
+                else if (jit->reason == EXIT_LOADP) {
+                        WORD_SIZE word = Segment_ptr(jit->memory, 0)[next];
+                        REG_SIZE b = jit->regs[(word >> B_LSB) & 0x7];
+                        next = jit->regs[(word >> C_LSB) & 0x7];
+                        if (b != 0) {
+                                Segment_move(jit->memory, b, 0);
+                                tables_load(jit);
+                        }
+                }
+                else if (jit->reason == EXIT_STORE0) {
+                        flush(jit);
+                        if (++jit->flushes > FLUSH_MAX) {
+                                break;
+                        }
+                }
+        }
+
+        memcpy(registers, jit->regs, sizeof(jit->regs));
+        *pc = next;
+        return halted;
+}
+
+/* Sizes the per-word tables for the program now in segment 0, points the
+ * Lookup at it with nothing cached and throws away all code compiled for
+ * the old one.
+ */
+static void tables_load(T jit)
+{
+        jit->lookup->code = Segment_ptr(jit->memory, 0);
+        jit->lookup->code_store = NULL;
+        jit->lookup->load_id = NO_SEGMENT;
+        jit->lookup->store_id = NO_SEGMENT;
+        free(jit->entries);
+        free(jit->translated);
+        jit->length = Segment_length(jit->memory, 0);
+        jit->entries = calloc(jit->length + 1, sizeof(void *));
+        jit->translated = calloc(jit->length + 1, 1);
+        assert(jit->entries != NULL && jit->translated != NULL);
+        flush(jit);
+}
+
+/* Throws away every compiled block. */
+static void flush(T jit)
+{
+        jit->free_code = jit->code_start;
+        memset(jit->entries, 0, (jit->length + 1) * sizeof(void *));
+        memset(jit->translated, 0, jit->length + 1);
+        jit->generation++;
+}
+
+/* Returns the native code for the block starting at pc, compiling it first
+ * if need be, or NULL if pc is outside of segment 0.
+ */
+static void *block_for(T jit, WORD_SIZE pc)
+{
+        if (pc >= jit->length) {
+                return NULL;
+        }
+        if (jit->entries[pc] == NULL) {
+                if (jit->free_code + BLOCK_MAX * INST_BYTES_MAX >
+                    jit->code + CODE_SIZE) {
+                        flush(jit);
+                }
+                compile(jit, pc);
+        }
+        return jit->entries[pc];
+}
+
+/*****************************************************************
+ *                      x86-64 code emission
+ *****************************************************************/
+
+static void emit(T jit, uint8_t byte)
+{
+        *(jit->free_code++) = byte;
+}
+
+static void emit32(T jit, uint32_t value)
+{
+        memcpy(jit->free_code, &value, sizeof(value));
+        jit->free_code += sizeof(value);
+}
+
+static void emit64(T jit, uint64_t value)
+{
+        memcpy(jit->free_code, &value, sizeof(value));
+        jit->free_code += sizeof(value);
+}
+
+/* REX prefix for an instruction with the given ModRM reg and rm fields,
+ * left out when nothing in it is set.
+ */
+static void emit_rex(T jit, int wide, int reg, int rm)
+{
+        uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (rex != 0x40) {
+                emit(jit, rex);
+        }
+}
+
+/* 32-bit register to register instruction: opcode reg, rm */
+static void emit_rr(T jit, uint8_t opcode, int reg, int rm)
+{
+        emit_rex(jit, 0, reg, rm);
+        emit(jit, opcode);
+        emit(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* 32-bit register to register instruction with a 0F opcode: dst <- src */
+static void emit_0f(T jit, uint8_t opcode, int dst, int src)
+{
+        emit_rex(jit, 0, dst, src);
+        emit(jit, 0x0F);
+        emit(jit, opcode);
+        emit(jit, 0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+static void emit_mov(T jit, int dst, int src)
+{
+        emit_rr(jit, 0x89, src, dst);
+}
+
+static void emit_mov_imm(T jit, int dst, uint32_t value)
+{
+        emit_rex(jit, 0, 0, dst);
+        emit(jit, 0xB8 + (dst & 7));
+        emit32(jit, value);
+}
+
+static void emit_mov_imm64(T jit, int dst, uint64_t value)
+{
+        emit_rex(jit, 1, 0, dst);
+        emit(jit, 0xB8 + (dst & 7));
+        emit64(jit, value);
+}
+
+/* 32-bit instruction between reg and [base + offset]; 0x89 stores reg and
+ * 0x8B loads it. wide makes it 64-bit.
+ */
+static void emit_mem(T jit, int wide, uint8_t opcode, int reg, int base, 
+                     size_t offset)
+{
+        emit_rex(jit, wide, reg, base);
+        emit(jit, opcode);
+        emit(jit, 0x40 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP) {
+                emit(jit, 0x24);
+        }
+        emit(jit, (uint8_t)offset);
+}
+
+/* Instruction between reg and the field at slot, addressed relative to
+ * the end of the instruction.
+ */
+static void emit_rip(T jit, int wide, uint8_t opcode, int reg, 
+                     const void *slot)
+{
+        emit_rex(jit, wide, reg, 0);
+        emit(jit, opcode);
+        emit(jit, 0x05 | ((reg & 7) << 3));
+        emit32(jit, (uint32_t)(int32_t)((const uint8_t *)slot - 
+                                        (jit->free_code + 4)));
+}
+
+/* 32-bit instruction between reg and [base + index << scale]. base must
+ * not be rbp or r13.
+ */
+static void emit_sib(T jit, uint8_t opcode, int reg, int base, int index,
+                     int scale)
+{
+        uint8_t rex = 0x40 | ((reg >> 3) << 2) | ((index >> 3) << 1) | 
+                      (base >> 3);
+        if (rex != 0x40) {
+                emit(jit, rex);
+        }
+        emit(jit, opcode);
+        emit(jit, 0x04 | ((reg & 7) << 3));
+        emit(jit, (scale << 6) | ((index & 7) << 3) | (base & 7));
+}
+
+static void emit_call(T jit, uintptr_t function)
+{
+        emit_mov_imm64(jit, RAX, function);
+        emit(jit, 0xFF);
+        emit(jit, 0xD0);
+}
+
+/* Writes the target of the rel32 at site */
+static void patch_rel32(uint8_t *site, uint8_t *target)
+{
+        int32_t rel = (int32_t)(target - (site + 4));
+        memcpy(site, &rel, sizeof(rel));
+}
+
+/* Writes the target of the rel8 at site */
+static void patch_rel8(uint8_t *site, uint8_t *target)
+{
+        site[0] = (uint8_t)(int8_t)(target - (site + 1));
+}
+
+static void emit_jmp(T jit, uint8_t *target)
+{
+        emit(jit, 0xE9);
+        jit->free_code += 4;
+        patch_rel32(jit->free_code - 4, target);
+}
+
+/* Leaves native code, telling Jit_run why (ecx) and where to carry on
+ * (eax).
+ */
+static void emit_exit(T jit, WORD_SIZE pc, WORD_SIZE reason)
+{
+        emit_mov_imm(jit, RAX, pc);
+        emit_mov_imm(jit, RCX, reason);
+        emit_jmp(jit, jit->exit);
+}
+
+/* Spills or reloads the UM registers held in caller-saved r10d and r11d,
+ * using the padding that keeps the stack aligned for calls.
+ */
+static void emit_spill(T jit)
+{
+        emit_mem(jit, 0, 0x89, UM_REG(6), RSP, 0);
+        emit_mem(jit, 0, 0x89, UM_REG(7), RSP, sizeof(REG_SIZE));
+}
+
+static void emit_reload(T jit)
+{
+        emit_mem(jit, 0, 0x8B, UM_REG(6), RSP, 0);
+        emit_mem(jit, 0, 0x8B, UM_REG(7), RSP, sizeof(REG_SIZE));
+}
+
+/* Jumps to the block at target: directly if it has been compiled already,
+ * otherwise through a stub that asks Jit_run to compile it and patch this
+ * jump to point at it.
+ */
+static void emit_goto(T jit, WORD_SIZE target)
+{
+        if (target < jit->length && jit->entries[target] != NULL) {
+                emit_jmp(jit, jit->entries[target]);
+                return;
+        }
+
+        uint8_t *site = jit->free_code + 1;
+        emit_jmp(jit, jit->free_code + 5);
+        emit_mov_imm64(jit, RDX, (uintptr_t)site);
+        emit_exit(jit, target, EXIT_CHAIN);
+}
+
+/* Jumps to the block at the word offset held in register c, looked up in
+ * the entry table inline; blocks not compiled yet go through Jit_run.
+ */
+static void emit_goto_dynamic(T jit, int c)
+{
+        uint8_t *miss1, *miss2;
+
+        emit_mov(jit, RAX, c);
+        emit(jit, 0x3D);                                /* cmp eax, len */
+        emit32(jit, jit->length);
+        emit(jit, 0x73);                                /* jae miss */
+        miss1 = jit->free_code++;
+        emit_mov_imm64(jit, RDX, (uintptr_t)jit->entries);
+        emit(jit, 0x48);                                /* mov rdx, */
+        emit(jit, 0x8B);                                /* [rdx+rax*8] */
+        emit(jit, 0x14);
+        emit(jit, 0xC2);
+        emit(jit, 0x48);                                /* test rdx, rdx */
+        emit(jit, 0x85);
+        emit(jit, 0xD2);
+        emit(jit, 0x74);                                /* jz miss */
+        miss2 = jit->free_code++;
+        emit(jit, 0xFF);                                /* jmp rdx */
+        emit(jit, 0xE2);
+
+        patch_rel8(miss1, jit->free_code);
+        patch_rel8(miss2, jit->free_code);
+        emit_mov_imm(jit, RCX, EXIT_DISPATCH);
+        emit_jmp(jit, jit->exit);
+}
+
+/* Loads register a from word c of segment b, which known says holds value.
+ * Segment 0 and the last segment loaded from are found inline, any other
+ * through jit_load.
+ */
+static void emit_load(T jit, int a, int b, int c, bool known, REG_SIZE value)
+{
+        Lookup *lookup = jit->lookup;
+        uint8_t *zero = NULL, *miss = NULL, *load, *done;
+
+        if (!known || value == 0) {
+                emit_rip(jit, 1, 0x8B, RAX, &lookup->code);
+        }
+        if (!known) {
+                emit_rr(jit, 0x85, UM_REG(b), UM_REG(b));
+                emit(jit, 0x74);                        /* jz load */
+                zero = jit->free_code++;
+        }
+        if (!known || value != 0) {
+                emit_rip(jit, 0, 0x3B, UM_REG(b), &lookup->load_id);
+                emit(jit, 0x75);                        /* jne miss */
+                miss = jit->free_code++;
+                emit_rip(jit, 1, 0x8B, RAX, &lookup->load_words);
+        }
+        load = jit->free_code;
+        if (zero != NULL) {
+                patch_rel8(zero, load);
+        }
+        emit_sib(jit, 0x8B, UM_REG(a), RAX, UM_REG(c), 2);
+        if (miss == NULL) {
+                return;
+        }
+
+        emit(jit, 0xEB);                                /* jmp done */
+        done = jit->free_code++;
+        patch_rel8(miss, jit->free_code);
+        emit_spill(jit);
+        emit_mov_imm64(jit, RDI, (uintptr_t)jit);
+        emit_mov(jit, RSI, UM_REG(b));
+        emit_call(jit, (uintptr_t)jit_load);
+        emit_reload(jit);
+        emit(jit, 0xEB);                                /* jmp load */
+        jit->free_code++;
+        patch_rel8(jit->free_code - 1, load);
+        patch_rel8(done, jit->free_code);
+}
+
+/* Stores register c into word b of segment a, which known says holds
+ * value, for the instruction at pc. Segment 0 is stored into inline once
+ * it is writable, unless the word has been compiled, and so is the last
+ * segment stored into; anything else goes through jit_store, and native
+ * code leaves after it if compiled code was stored over.
+ */
+static void emit_store(T jit, WORD_SIZE pc, int a, int b, int c, bool known,
+                       REG_SIZE value)
+{
+        Lookup *lookup = jit->lookup;
+        uint8_t *other = NULL, *store = NULL, *slow[4], *done, *skip;
+        int num_slow = 0;
+
+        if (!known) {
+                emit_rr(jit, 0x85, UM_REG(a), UM_REG(a));
+                emit(jit, 0x75);                        /* jnz other */
+                other = jit->free_code++;
+        }
+        if (!known || value == 0) {
+                emit_rip(jit, 1, 0x8B, RAX, &lookup->code_store);
+                emit(jit, 0x48);                        /* test rax, rax */
+                emit(jit, 0x85);
+                emit(jit, 0xC0);
+                emit(jit, 0x74);                        /* jz slow */
+                slow[num_slow++] = jit->free_code++;
+                emit_rex(jit, 0, 0, UM_REG(b));         /* cmp b, len */
+                emit(jit, 0x81);
+                emit(jit, 0xF8 | (UM_REG(b) & 7));
+                emit32(jit, jit->length);
+                emit(jit, 0x73);                        /* jae slow */
+                slow[num_slow++] = jit->free_code++;
+                emit_mov_imm64(jit, RDX, (uintptr_t)jit->translated);
+                emit_sib(jit, 0x80, 7, RDX, UM_REG(b), 0); /* cmp [rdx+b], */
+                emit(jit, 0);                           /* 0 */
+                emit(jit, 0x75);                        /* jne slow */
+                slow[num_slow++] = jit->free_code++;
+        }
+        if (!known) {
+                emit(jit, 0xEB);                        /* jmp store */
+                store = jit->free_code++;
+                patch_rel8(other, jit->free_code);
+        }
+        if (!known || value != 0) {
+                emit_rip(jit, 0, 0x3B, UM_REG(a), &lookup->store_id);
+                emit(jit, 0x75);                        /* jne slow */
+                slow[num_slow++] = jit->free_code++;
+                emit_rip(jit, 1, 0x8B, RAX, &lookup->store_words);
+        }
+        if (store != NULL) {
+                patch_rel8(store, jit->free_code);
+        }
+        emit_sib(jit, 0x89, UM_REG(c), RAX, UM_REG(b), 2);
+        emit(jit, 0xEB);                                /* jmp done */
+        done = jit->free_code++;
+
+        for (int i = 0; i < num_slow; i++) {
+                patch_rel8(slow[i], jit->free_code);
+        }
+        emit_spill(jit);
+        emit_mov_imm64(jit, RDI, (uintptr_t)jit);
+        emit_mov(jit, RSI, UM_REG(a));
+        emit_mov(jit, RDX, UM_REG(b));
+        emit_mov(jit, RCX, UM_REG(c));
+        emit_call(jit, (uintptr_t)jit_store);
+        emit_reload(jit);
+        emit_rr(jit, 0x85, RAX, RAX);
+        emit(jit, 0x74);                                /* jz skip */
+        skip = jit->free_code++;
+        emit_exit(jit, pc + 1, EXIT_STORE0);
+        patch_rel8(skip, jit->free_code);
+        patch_rel8(done, jit->free_code);
+}
+
+/* Emits the code to enter and leave native code at the start of the cache,
+ * where flushes leave it alone. Entering takes the Jit_T in rdi and the
+ * block in rsi; leaving stores the registers, eax, ecx and rdx back into
+ * the Jit_T.
+ */
+static void emit_trampolines(T jit)
+{
+        static const uint8_t prologue[] = {
+                0x53, 0x55, 0x41, 0x54, 0x41, 0x55,     /* push rbx, rbp, */
+                0x41, 0x56, 0x41, 0x57,                 /* r12-r15 */
+                0x48, 0x83, 0xEC, 0x08                  /* sub rsp, 8 */
+        };
+        static const uint8_t epilogue[] = {
+                0x48, 0x83, 0xC4, 0x08,                 /* add rsp, 8 */
+                0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D,     /* pop r15-r12, */
+                0x41, 0x5C, 0x5D, 0x5B,                 /* rbp, rbx */
+                0xC3                                    /* ret */
+        };
+
+        jit->enter = (void (*)(T, void *))(uintptr_t)jit->free_code;
+        for (size_t i = 0; i < sizeof(prologue); i++) {
+                emit(jit, prologue[i]);
+        }
+        for (int i = 0; i < 8; i++) {
+                emit_mem(jit, 0, 0x8B, UM_REG(i), RDI, i * sizeof(REG_SIZE));
+        }
+        emit(jit, 0xFF);                                /* jmp rsi */
+        emit(jit, 0xE6);
+
+        jit->exit = jit->free_code;
+        emit_mov_imm64(jit, RDI, (uintptr_t)jit);
+        for (int i = 0; i < 8; i++) {
+                emit_mem(jit, 0, 0x89, UM_REG(i), RDI, i * sizeof(REG_SIZE));
+        }
+        emit_mem(jit, 0, 0x89, RAX, RDI, offsetof(struct Jit_T, pc));
+        emit_mem(jit, 0, 0x89, RCX, RDI, offsetof(struct Jit_T, reason));
+        emit_mem(jit, 1, 0x89, RDX, RDI, offsetof(struct Jit_T, patch));
+        for (size_t i = 0; i < sizeof(epilogue); i++) {
+                emit(jit, epilogue[i]);
+        }
+}
+
+/* Compiles the block starting at pc. Registers set by load value earlier in
+ * the block are tracked so that the usual load value, load program pair
+ * becomes a direct jump.
+ */
+static void compile(T jit, WORD_SIZE pc)
+{
+        const WORD_SIZE *words = Segment_ptr(jit->memory, 0);
+        uintptr_t memory = (uintptr_t)jit->memory;
+        bool known[8] = { false };
+        REG_SIZE value[8] = { 0 };
+        WORD_SIZE count;
+
+        jit->entries[pc] = jit->free_code;
+
+        for (count = 0; ; count++, pc++) {
+                if (pc >= jit->length) {
+                        emit_exit(jit, pc, EXIT_FALLBACK);
+                        return;
+                }
+                if (count == BLOCK_MAX) {
+                        emit_goto(jit, pc);
+                        return;
+                }
+
+                WORD_SIZE word = words[pc];
+                unsigned opcode = word >> OPCODE_LSB;
+                int a = (word >> A_LSB) & 0x7;
+                int b = (word >> B_LSB) & 0x7;
+                int c = (word >> C_LSB) & 0x7;
+                uint8_t *skip;
+
+                jit->translated[pc] = 1;
+
+                switch (opcode) {
+                case CMOV:
+                        emit_rr(jit, 0x85, UM_REG(c), UM_REG(c));
+                        emit_0f(jit, 0x45, UM_REG(a), UM_REG(b));
+                        known[a] = false;
+                        break;
+                case LOAD:
+                        emit_load(jit, a, b, c, known[b], value[b]);
+                        known[a] = false;
+                        break;
+                case STORE:
+                        emit_store(jit, pc, a, b, c, known[a], value[a]);
+                        break;
+                case ADD:
+                        emit_mov(jit, RAX, UM_REG(b));
+                        emit_rr(jit, 0x01, UM_REG(c), RAX);
+                        emit_mov(jit, UM_REG(a), RAX);
+                        known[a] = false;
+                        break;
+                case MUL:
+                        emit_mov(jit, RAX, UM_REG(b));
+                        emit_0f(jit, 0xAF, RAX, UM_REG(c));
+                        emit_mov(jit, UM_REG(a), RAX);
+                        known[a] = false;
+                        break;
+                case DIV:
+                        emit_mov(jit, RAX, UM_REG(b));
+                        emit_rr(jit, 0x31, RDX, RDX);
+                        emit_rr(jit, 0xF7, 6, UM_REG(c));
+                        emit_mov(jit, UM_REG(a), RAX);
+                        known[a] = false;
+                        break;
+                case NAND:
+                        emit_mov(jit, RAX, UM_REG(b));
+                        emit_rr(jit, 0x21, UM_REG(c), RAX);
+                        emit_rr(jit, 0xF7, 2, RAX);
+                        emit_mov(jit, UM_REG(a), RAX);
+                        known[a] = false;
+                        break;
+                case HALT:
+                        emit_exit(jit, pc, EXIT_HALT);
+                        return;
+                case MAP:
+                        emit_spill(jit);
+                        emit_mov_imm64(jit, RDI, memory);
+                        emit_mov(jit, RSI, UM_REG(c));
+                        emit_call(jit, (uintptr_t)Segment_map);
+                        emit_reload(jit);
+                        emit_mov(jit, UM_REG(b), RAX);
+                        known[b] = false;
+                        break;
+                case UNMAP:
+                        emit_spill(jit);
+                        emit_mov_imm64(jit, RDI, (uintptr_t)jit);
+                        emit_mov(jit, RSI, UM_REG(c));
+                        emit_call(jit, (uintptr_t)jit_unmap);
+                        emit_reload(jit);
+                        break;
+                case OUT:
+                        emit_spill(jit);
+                        emit_mov_imm64(jit, RDI, (uintptr_t)jit->io);
+                        emit_mov(jit, RSI, UM_REG(c));
+                        emit_call(jit, (uintptr_t)Io_put);
+                        emit_reload(jit);
+                        break;
+                case IN:
+                        /* the interpreter blocks if no input is ready */
+                        emit_spill(jit);
+                        emit_mov_imm64(jit, RDI, (uintptr_t)jit->io);
+                        emit_call(jit, (uintptr_t)Io_ready);
+                        emit_reload(jit);
+                        emit_rr(jit, 0x84, RAX, RAX);   /* test al, al */
+                        emit(jit, 0x75);                /* jnz ready */
+                        skip = jit->free_code++;
+                        emit_exit(jit, pc, EXIT_FALLBACK);
+                        patch_rel8(skip, jit->free_code);
+                        emit_spill(jit);
+                        emit_mov_imm64(jit, RDI, (uintptr_t)jit->io);
+                        emit_call(jit, (uintptr_t)Io_get);
+                        emit_reload(jit);
+                        emit_mov(jit, UM_REG(c), RAX);
+                        known[c] = false;
+                        break;
+                case LOADP:
+                        if (known[b] && value[b] != 0) {
+                                emit_exit(jit, pc, EXIT_LOADP);
+                                return;
+                        }
+                        if (!known[b]) {
+                                emit_rr(jit, 0x85, UM_REG(b), UM_REG(b));
+                                emit(jit, 0x74);        /* jz skip */
+                                skip = jit->free_code++;
+                                emit_exit(jit, pc, EXIT_LOADP);
+                                patch_rel8(skip, jit->free_code);
+                        }
+                        if (known[c]) {
+                                emit_goto(jit, value[c]);
+                        }
+                        else {
+                                emit_goto_dynamic(jit, UM_REG(c));
+                        }
+                        return;
+                case LOADV:
+                        a = (word >> LOAD_VAL_LSB) & 0x7;
+                        value[a] = word & ((1u << VAL_LENGTH) - 1);
+                        known[a] = true;
+                        emit_mov_imm(jit, UM_REG(a), value[a]);
+                        break;
+                default:
+                        emit_exit(jit, pc, EXIT_FALLBACK);
+                        return;
+                }
+        }
+}
+
+/*****************************************************************
+ *                  Helpers called from native code
+ *****************************************************************/
+
+/* Returns the words of segment id, which is not 0, after caching them for
+ * loads.
+ */
+static WORD_SIZE *jit_load(T jit, REG_SIZE id)
+{
+        jit->lookup->load_id = id;
+        jit->lookup->load_words = Segment_ptr(jit->memory, id);
+        return jit->lookup->load_words;
+}
+
+/* Stores word at offset in segment id, copying its words first if they are
+ * shared, and caches them for stores. Copying may have moved the segment
+ * cached for loads, so that is refilled. Returns whether the word stored
+ * over was compiled code in segment 0, in which case native code leaves so
+ * the code can be flushed.
+ */
+static int jit_store(T jit, REG_SIZE id, REG_SIZE offset, REG_SIZE word)
+{
+        Lookup *lookup = jit->lookup;
+        WORD_SIZE *words = Segment_writable(jit->memory, id);
+
+        words[offset] = word;
+        if (lookup->load_id != NO_SEGMENT) {
+                lookup->load_words = Segment_ptr(jit->memory, 
+                                                 lookup->load_id);
+        }
+        if (id != 0) {
+                lookup->store_id = id;
+                lookup->store_words = words;
+                return 0;
+        }
+        lookup->code_store = words;
+        return offset < jit->length && jit->translated[offset];
+}
+
+/* Unmaps segment id, emptying the caches that hold it first. */
+static void jit_unmap(T jit, REG_SIZE id)
+{
+        if (id == jit->lookup->load_id) {
+                jit->lookup->load_id = NO_SEGMENT;
+        }
+        if (id == jit->lookup->store_id) {
+                jit->lookup->store_id = NO_SEGMENT;
+        }
+        Segment_unmap(jit->memory, id);
+}
+
+#else
+
+/* Without x86-64 there is no JIT and the um always interprets. */
+T Jit_new(Segment_T memory, Io_T io)
+{
+        (void) memory;
+        (void) io;
+        return NULL;
+}
+
+void Jit_free(T *jit)
+{
+        *jit = NULL;
+}
+
+bool Jit_run(T jit, REG_SIZE *registers, WORD_SIZE *pc)
+{
+        (void) jit;
+        (void) registers;
+        (void) pc;
+        return false;
+}
+
+#endif
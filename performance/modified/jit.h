@@ -0,0 +1,38 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the x86-64 JIT tier of the UM. Basic blocks of segment 0
+ * are compiled to native code on first use and chained together; anything
+ * the JIT does not handle is handed back to the interpreter.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include "segment.h"
+#include "io.h"
+#ifndef JIT_H_INCLUDED
+#define JIT_H_INCLUDED
+#define REG_SIZE uint32_t
+#define WORD_SIZE uint32_t
+#define T Jit_T
+typedef struct T *T;
+
+/* Creates a JIT that compiles the program held in segment 0 of memory and
+ * does I/O on io. Returns NULL if executable memory is not available on
+ * this machine.
+ */
+T Jit_new(Segment_T memory, Io_T io);
+
+/* Frees the JIT and all of the code it has generated. */
+void Jit_free(T *jit);
+
+/* Runs segment 0 natively from the word offset *pc with the 8 registers in
+ * registers. Returns true once the guest halts. Returns false if the rest of
+ * the run should be interpreted instead (an invalid instruction, running off
+ * the end of segment 0, or a guest that keeps rewriting its own code); *pc
+ * and registers then hold the state to resume from.
+ */
+bool Jit_run(T jit, REG_SIZE *registers, WORD_SIZE *pc);
+
+#undef T
+#endif
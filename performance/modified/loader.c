@@ -0,0 +1,157 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the um binary loader. The size of the file is checked
+ * on the descriptor that gets mapped, so it is the size of what is read.
+ * On x86-64 the words are swapped 8 at a time with an AVX2 byte shuffle, or
+ * 4 at a time with SSSE3, whichever the processor has; anything else, and
+ * the tail of the file, goes through bswap one word at a time.
+ */
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "segment.h"
+#include "loader.h"
+#define WORD_SIZE uint32_t
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* Swaps n words 8 at a time and returns how many it swapped. */
+__attribute__((target("avx2")))
+static size_t swap_avx2(WORD_SIZE *dst, const unsigned char *src, size_t n);
+
+/* Swaps n words 4 at a time and returns how many it swapped. */
+__attribute__((target("ssse3")))
+static size_t swap_ssse3(WORD_SIZE *dst, const unsigned char *src, size_t n);
+#endif
+
+/* Exits with the error the um gives for a program it cannot load. */
+static void bad_file();
+
+
+/* Maps segment 0 of memory to hold the um binary at path and returns how
+ * many words it has.
+ */
+WORD_SIZE Loader_load(Segment_T memory, const char *path)
+{
+        WORD_SIZE num_words;
+
+        if (!Loader_read(memory, path, &num_words)) {
+                bad_file();
+        }
+        return num_words;
+}
+
+/* Maps segment 0 of memory to hold the um binary at path and stores how
+ * many words it has in length. The file is mapped before segment 0 is, so
+ * memory is untouched if anything fails.
+ */
+bool Loader_read(Segment_T memory, const char *path, WORD_SIZE *length)
+{
+        const unsigned char *bytes = NULL;
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+        ID_SIZE id;
+
+        if (fd < 0) {
+                return false;
+        }
+        if (fstat(fd, &st) != 0 || st.st_size % 4 != 0 ||
+            st.st_size / 4 > UINT32_MAX) {
+                close(fd);
+                return false;
+        }
+        if (st.st_size > 0) {
+                bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (bytes == MAP_FAILED) {
+                return false;
+        }
+
+        *length = st.st_size / 4;
+        id = Segment_map(memory, *length);
+        assert(id == 0);
+        (void) id;
+        if (bytes != NULL) {
+                Loader_swap(Segment_ptr(memory, 0), bytes, *length);
+                munmap((void *)bytes, st.st_size);
+        }
+        return true;
+}
+
+/* Stores the n big-endian words starting at src into dst in host order. */
+void Loader_swap(WORD_SIZE *dst, const unsigned char *src, size_t n)
+{
+        size_t i = 0;
+
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) {
+                i = swap_avx2(dst, src, n);
+        } else if (__builtin_cpu_supports("ssse3")) {
+                i = swap_ssse3(dst, src, n);
+        }
+#endif
+        for (; i < n; i++) {
+                WORD_SIZE word;
+                memcpy(&word, src + 4 * i, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                word = __builtin_bswap32(word);
+#endif
+                dst[i] = word;
+        }
+}
+
+#if defined(__x86_64__)
+/* Swaps n words 8 at a time and returns how many it swapped. */
+__attribute__((target("avx2")))
+static size_t swap_avx2(WORD_SIZE *dst, const unsigned char *src, size_t n)
+{
+        const __m256i order = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                               11, 10, 9, 8, 15, 14, 13, 12,
+                                               3, 2, 1, 0, 7, 6, 5, 4,
+                                               11, 10, 9, 8, 15, 14, 13, 12);
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                __m256i words = _mm256_loadu_si256((const __m256i *)
+                                                   (src + 4 * i));
+                _mm256_storeu_si256((__m256i *)(dst + i),
+                                    _mm256_shuffle_epi8(words, order));
+        }
+        return i;
+}
+
+/* Swaps n words 4 at a time and returns how many it swapped. */
+__attribute__((target("ssse3")))
+static size_t swap_ssse3(WORD_SIZE *dst, const unsigned char *src, size_t n)
+{
+        const __m128i order = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                            11, 10, 9, 8, 15, 14, 13, 12);
+        size_t i;
+
+        for (i = 0; i + 4 <= n; i += 4) {
+                __m128i words = _mm_loadu_si128((const __m128i *)
+                                                (src + 4 * i));
+                _mm_storeu_si128((__m128i *)(dst + i),
+                                 _mm_shuffle_epi8(words, order));
+        }
+        return i;
+}
+#endif
+
+/* Exits with the error the um gives for a program it cannot load. */
+static void bad_file()
+{
+        fprintf(stderr, "Incompatible File Size.\n");
+        exit(EXIT_FAILURE);
+}
@@ -0,0 +1,32 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for loading um binaries. The file is mapped rather than read,
+ * and its big-endian words are swapped into segment 0 in bulk.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "segment.h"
+#ifndef LOADER_H_INCLUDED
+#define LOADER_H_INCLUDED
+#define WORD_SIZE uint32_t
+
+/* Maps segment 0 of memory to hold the um binary at path and returns how
+ * many words it has. Exits with an error if the file cannot be read or is
+ * not a whole number of words.
+ */
+WORD_SIZE Loader_load(Segment_T memory, const char *path);
+
+/* Like Loader_load, but returns false instead of exiting if the file cannot
+ * be read or is not a whole number of words, leaving memory as it was.
+ */
+bool Loader_read(Segment_T memory, const char *path, WORD_SIZE *length);
+
+/* Stores the n big-endian words starting at src into dst in host order.
+ * src does not have to be aligned.
+ */
+void Loader_swap(WORD_SIZE *dst, const unsigned char *src, size_t n);
+
+#endif
@@ -0,0 +1,375 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Command line front end of the UM: runs one program on standard input and
+ * output with the library in um.c, and turns how it stopped into the um's
+ * messages and exit status.
+ *
+ * --checkpoint FILE runs the program until it has read all of standard
+ * input and wants more, then saves it to FILE instead of reading the end of
+ * input. --restore FILE (in place of the program) carries on from such a
+ * snapshot, so a program's warmup can be run once and skipped after.
+ *
+ * --fuse LIST chooses the superinstructions the interpreter fuses, as
+ * names like loadv+load separated by commas, or default, all or none.
+ *
+ * --huge-pages SIZE puts segments of at least SIZE bytes (with an optional
+ * k or m suffix, or off for none) on transparent huge pages, 2m by
+ * default. --hugetlb takes them from the hugetlbfs pool first.
+ *
+ * --hwcounters counts the um's cycles, instructions, branch misses and
+ * cache misses with perf_event_open while it loads, runs and frees the
+ * program, and prints them to stderr at the end.
+ *
+ * --profile PREFIX writes the report of a -DPROFILE build to PREFIX.prof
+ * and PREFIX.folded; the UM_PROFILE environment variable gives a default.
+ * Without either no profile is written.
+ *
+ * --fork-server loads (or restores) and predecodes the program once and
+ * then reads requests from standard input, one per line:
+ *
+ *     input output
+ *
+ * For each it forks a child that runs the program with input and output as
+ * its standard input and output (- for none), sharing the parent's program
+ * pages copy-on-write, and writes a reply line to standard output with the
+ * child's exit status and the user time it took in seconds.
+ */
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "io.h"
+#include "um.h"
+#define MAX_LINE 4096
+
+/* Runs the loaded um (unless load_only), frees it and turns how it stopped
+ * into an exit status, printing the message for a failure.
+ */
+int finish(UM_T um, bool load_only);
+
+/* Runs um, waiting for more input whenever standard input is
+ * non-blocking and has none yet. The um must not pause at the end of
+ * input.
+ */
+UM_status run(UM_T um);
+
+/* Serves the requests on standard input with a child forked from um for
+ * each, until standard input ends.
+ */
+void serve(UM_T um, bool load_only);
+
+/* Opens path (or /dev/null if it is -) with flags as descriptor fd in the
+ * calling process, exiting if it cannot.
+ */
+void redirect(const char *path, int flags, int fd);
+
+/* Reads a size in bytes, with an optional k or m suffix, or off for 0,
+ * from text into bytes. Returns false if text is not one.
+ */
+bool parse_size(const char *text, size_t *bytes);
+
+
+int main(int argc, char *argv[])
+{
+        bool use_jit = false;
+        bool load_only = false;
+        bool fork_server = false;
+        const char *checkpoint = NULL;
+        const char *restore = NULL;
+        const char *fuse = "default";
+        const char *huge = "2m";
+        bool hugetlb = false;
+        bool hwcounters = false;
+        const char *profile = getenv("UM_PROFILE");
+        bool profile_option = false;
+        size_t threshold;
+        int num_args;
+        UM_status status;
+
+        while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+                if (strcmp(argv[1], "--jit") == 0) {
+                        use_jit = true;
+                } else if (strcmp(argv[1], "--load-only") == 0) {
+                        load_only = true;
+                } else if (strcmp(argv[1], "--fork-server") == 0) {
+                        fork_server = true;
+                } else if (strcmp(argv[1], "--checkpoint") == 0 &&
+                           argc > 2) {
+                        checkpoint = argv[2];
+                        argc--;
+                        argv++;
+                } else if (strcmp(argv[1], "--fuse") == 0 && argc > 2) {
+                        fuse = argv[2];
+                        argc--;
+                        argv++;
+                } else if (strcmp(argv[1], "--huge-pages") == 0 &&
+                           argc > 2) {
+                        huge = argv[2];
+                        argc--;
+                        argv++;
+                } else if (strcmp(argv[1], "--hugetlb") == 0) {
+                        hugetlb = true;
+                } else if (strcmp(argv[1], "--hwcounters") == 0) {
+                        hwcounters = true;
+                } else if (strcmp(argv[1], "--profile") == 0 &&
+                           argc > 2) {
+                        profile = argv[2];
+                        profile_option = true;
+                        argc--;
+                        argv++;
+                } else if (strcmp(argv[1], "--restore") == 0 && argc > 2) {
+                        restore = argv[2];
+                        argc--;
+                        argv++;
+                } else {
+                        fprintf(stderr, "Error: unknown option %s\n", argv[1]);
+                        exit(EXIT_FAILURE);
+                }
+                argc--;
+                argv++;
+        }
+
+        num_args = (restore == NULL) ? 2 : 1;
+        if (argc > num_args) {
+                fprintf(stderr, "Error: too many arguments\n");
+                exit(EXIT_FAILURE);
+        }
+        else if (argc < num_args) {
+                fprintf(stderr, "Error: too few arguments\n");
+                exit(EXIT_FAILURE);
+        }
+        if (checkpoint != NULL && use_jit) {
+                fprintf(stderr, "Error: --checkpoint cannot use --jit\n");
+                exit(EXIT_FAILURE);
+        }
+        if (checkpoint != NULL && fork_server) {
+                fprintf(stderr, "Error: --checkpoint cannot use "
+                        "--fork-server\n");
+                exit(EXIT_FAILURE);
+        }
+        if (hwcounters && fork_server) {
+                /* the counters count the server, not the children */
+                fprintf(stderr, "Error: --hwcounters cannot use "
+                        "--fork-server\n");
+                exit(EXIT_FAILURE);
+        }
+
+        if (!parse_size(huge, &threshold)) {
+                fprintf(stderr, "Error: bad size %s for --huge-pages\n",
+                        huge);
+                exit(EXIT_FAILURE);
+        }
+
+        Io_pause_at_eof(Io_stdio(), checkpoint != NULL);
+        UM_T um = UM_new(Io_stdio());
+        if (hwcounters) {
+                UM_hwcounters(um);
+        }
+        if (!UM_profile_to(um, profile) && profile_option) {
+                fprintf(stderr, "Error: --profile needs a -DPROFILE build\n");
+                exit(EXIT_FAILURE);
+        }
+        UM_use_jit(um, use_jit);
+        if (!UM_fuse(um, fuse)) {
+                fprintf(stderr, "Error: unknown superinstruction in %s\n",
+                        fuse);
+                exit(EXIT_FAILURE);
+        }
+        UM_huge_pages(um, threshold, hugetlb);
+        if (restore != NULL) {
+                status = UM_restore(um, restore);
+                if (status != UM_OK) {
+                        fprintf(stderr, "Error: %s is not a snapshot\n",
+                                restore);
+                        exit(EXIT_FAILURE);
+                }
+        } else {
+                status = UM_load(um, argv[1]);
+        }
+        if (status == UM_OK && fork_server) {
+                serve(um, load_only);
+                UM_free(&um);
+                return 0;
+        }
+        if (status == UM_OK && !load_only) {
+                /* with a checkpoint, blocking is where the snapshot goes */
+                status = (checkpoint != NULL) ? UM_run(um) : run(um);
+        }
+        if (status == UM_BLOCKED && checkpoint != NULL) {
+                if (!UM_save(um, checkpoint)) {
+                        fprintf(stderr, "Error: cannot write %s\n",
+                                checkpoint);
+                        exit(EXIT_FAILURE);
+                }
+                status = UM_OK;
+        }
+        UM_report_fault(um, stderr);
+        UM_free(&um);
+
+        if (checkpoint != NULL && status == UM_HALTED) {
+                fprintf(stderr, "Halted before the end of input: "
+                        "%s not written.\n", checkpoint);
+        }
+
+        if (status != UM_OK && status != UM_HALTED) {
+                fprintf(stderr, "%s\n", UM_describe(status));
+                exit(EXIT_FAILURE);
+        }
+        return 0;
+}
+
+/* Runs the loaded um (unless load_only), frees it and turns how it stopped
+ * into an exit status, printing the message for a failure as main does.
+ * The child leaves with _exit, which skips the check io.c makes at exit
+ * that the output was written, so it is made here.
+ */
+int finish(UM_T um, bool load_only)
+{
+        UM_status status = UM_OK;
+
+        if (!load_only) {
+                status = run(um);
+        }
+        UM_report_fault(um, stderr);
+        UM_free(&um);
+        if (status != UM_OK && status != UM_HALTED) {
+                fprintf(stderr, "%s\n", UM_describe(status));
+                return EXIT_FAILURE;
+        }
+        Io_flush(Io_stdio());
+        if (Io_error(Io_stdio())) {
+                fprintf(stderr, "Output error.\n");
+                return EXIT_FAILURE;
+        }
+        return 0;
+}
+
+/* Runs um, and whenever it blocks (standard input is non-blocking and
+ * empty), waits for standard input to be readable or closed and runs it
+ * again. The um does not pause at the end of input, so once poll returns
+ * the read it blocked on gets either input or the end of it.
+ */
+UM_status run(UM_T um)
+{
+        struct pollfd in = { STDIN_FILENO, POLLIN, 0 };
+        UM_status status = UM_run(um);
+
+        while (status == UM_BLOCKED) {
+                if (poll(&in, 1, -1) < 0 && errno != EINTR) {
+                        fprintf(stderr, "Error: cannot wait for input\n");
+                        exit(EXIT_FAILURE);
+                }
+                status = UM_run(um);
+        }
+        return status;
+}
+
+/* Serves the requests on standard input one at a time. Each child points
+ * its standard input and output at the files of its request and runs the
+ * um it inherited, which was loaded and predecoded before the fork, so all
+ * a run costs up front is the fork itself. The parent waits for the child
+ * and replies with its exit status (128 plus the signal if it was killed)
+ * and user time, flushing every reply so a client can wait for each.
+ */
+void serve(UM_T um, bool load_only)
+{
+        char line[MAX_LINE];
+        char input[MAX_LINE];
+        char output[MAX_LINE];
+
+        fflush(stdout);
+        while (fgets(line, sizeof(line), stdin) != NULL) {
+                struct rusage usage;
+                int status;
+                int fields = sscanf(line, "%4095s %4095s", input, output);
+
+                if (fields < 1) {
+                        continue;
+                }
+                if (fields < 2) {
+                        strcpy(output, "-");
+                }
+
+                pid_t pid = fork();
+                if (pid < 0) {
+                        fprintf(stderr, "Error: cannot fork\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (pid == 0) {
+                        redirect(input, O_RDONLY, STDIN_FILENO);
+                        redirect(output, O_WRONLY | O_CREAT | O_TRUNC,
+                                 STDOUT_FILENO);
+                        _exit(finish(um, load_only));
+                }
+
+                if (wait4(pid, &status, 0, &usage) != pid) {
+                        fprintf(stderr, "Error: cannot wait for child\n");
+                        exit(EXIT_FAILURE);
+                }
+                printf("%d %.6f\n", WIFEXITED(status) ?
+                       WEXITSTATUS(status) : 128 + WTERMSIG(status),
+                       usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6);
+                fflush(stdout);
+        }
+}
+
+/* Opens path (or /dev/null if it is -) with flags as descriptor fd in the
+ * calling process, exiting if it cannot.
+ */
+void redirect(const char *path, int flags, int fd)
+{
+        int opened;
+
+        if (strcmp(path, "-") == 0) {
+                path = "/dev/null";
+        }
+        opened = open(path, flags, 0666);
+        if (opened < 0) {
+                fprintf(stderr, "Error: cannot open %s\n", path);
+                _exit(EXIT_FAILURE);
+        }
+        if (opened != fd) {
+                dup2(opened, fd);
+                close(opened);
+        }
+}
+
+/* Reads a size in bytes from text: a number with an optional k or m
+ * suffix (binary units), or off for 0. Returns false if text is not one.
+ */
+bool parse_size(const char *text, size_t *bytes)
+{
+        char *end;
+        unsigned long long size;
+
+        if (strcmp(text, "off") == 0) {
+                *bytes = 0;
+                return true;
+        }
+        if (*text < '0' || *text > '9') {
+                return false;
+        }
+        size = strtoull(text, &end, 10);
+        if (*end == 'k' || *end == 'K') {
+                size <<= 10;
+                end++;
+        } else if (*end == 'm' || *end == 'M') {
+                size <<= 20;
+                end++;
+        }
+        if (*end != '\0') {
+                return false;
+        }
+        *bytes = size;
+        return true;
+}
@@ -0,0 +1,298 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the allocator behind segmented memory.
+ *
+ * Block sizes are rounded up to a power of two words, from 4 up to
+ * POOL_LARGE. Each size class keeps a free list threaded through the
+ * released blocks themselves and a slab it carves new blocks from; slabs
+ * are mapped anonymously in SLAB_BYTES pieces and never given back until
+ * the pool is freed. Fresh slab memory is already zero, so only recycled
+ * blocks are cleared, and only for the words the caller asked for.
+ *
+ * Blocks larger than POOL_LARGE are mapped one at a time. Those of at
+ * least the huge page threshold are rounded up to whole HUGE_BYTES pages
+ * and aligned to one, so that the kernel can back all of them with huge
+ * pages: from the hugetlbfs pool if asked and it has them, otherwise
+ * transparent ones asked for with MADV_HUGEPAGE. The default threshold is
+ * HUGE_THRESHOLD.
+ *
+ * Blocks can also live in memory the pool did not allocate, such as a
+ * mapped snapshot (Pool_adopt). Releasing one of those does nothing.
+ */
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include "pool.h"
+#define WORD_SIZE uint32_t
+#define MIN_SHIFT 2
+#define NUM_CLASSES 12
+#define POOL_LARGE (1u << (MIN_SHIFT + NUM_CLASSES - 1))
+#define SLAB_BYTES (1u << 20)
+#define HUGE_BYTES ((size_t)2 << 20)
+#define HUGE_THRESHOLD HUGE_BYTES
+#define T Pool_T
+
+/* A released block, linked into the free list of its size class. */
+typedef struct Block {
+        struct Block *next;
+} Block;
+
+/* Struct that holds the free list and the unused part of the current slab
+ * for each size class, every slab mapped so far, the adopted range of
+ * memory, if any, the statistics and how large blocks get huge pages.
+ */
+struct T {
+        Block *free_list[NUM_CLASSES];
+        char *slab_next[NUM_CLASSES];
+        char *slab_end[NUM_CLASSES];
+        void **slabs;
+        unsigned num_slabs;
+        unsigned slab_capacity;
+        char *adopted;
+        char *adopted_end;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t large;
+        Pool_huge huge;
+};
+
+/* Returns the size class for a block of words words. */
+static inline unsigned size_class(WORD_SIZE words);
+
+/* Returns a new block from the slab of size class cls, mapping a new slab
+ * if the current one is used up.
+ */
+static WORD_SIZE *carve(T pool, unsigned cls);
+
+/* Returns anonymous zeroed memory of the given number of bytes. */
+static void *map_bytes(size_t bytes);
+
+/* Returns whether a large block of bytes bytes is put on huge pages. */
+static inline bool is_huge(T pool, size_t bytes);
+
+/* Returns anonymous zeroed memory of bytes rounded up to whole huge pages,
+ * aligned to a huge page and backed by huge pages if the kernel can.
+ */
+static void *map_huge(T pool, size_t bytes);
+
+
+/* Creates an allocator with no memory set aside yet. */
+T Pool_new()
+{
+        T pool = calloc(1, sizeof(struct Pool_T));
+        assert(pool != NULL);
+        pool->huge.threshold = HUGE_THRESHOLD;
+        return pool;
+}
+
+/* Frees the allocator and all of the memory it has set aside. Large
+ * blocks still in use are the caller's to release first.
+ */
+void Pool_free(T *pool)
+{
+        unsigned i;
+
+        for (i = 0; i < (*pool)->num_slabs; i++) {
+                munmap((*pool)->slabs[i], SLAB_BYTES);
+        }
+        free((*pool)->slabs);
+        free(*pool);
+        *pool = NULL;
+}
+
+/* Returns a block of words words, all set to 0. */
+WORD_SIZE *Pool_alloc(T pool, WORD_SIZE words)
+{
+        if (words > POOL_LARGE) {
+                size_t bytes = (size_t)words * sizeof(WORD_SIZE);
+
+                pool->large++;
+                return is_huge(pool, bytes) ? map_huge(pool, bytes)
+                                            : map_bytes(bytes);
+        }
+
+        unsigned cls = size_class(words);
+        Block *block = pool->free_list[cls];
+
+        if (block != NULL) {
+                pool->free_list[cls] = block->next;
+                pool->hits++;
+                memset(block, 0, words * sizeof(WORD_SIZE));
+                return (WORD_SIZE *)block;
+        }
+
+        pool->misses++;
+        return carve(pool, cls);
+}
+
+/* Gives back a block of words words returned by Pool_alloc, or from the
+ * adopted range, where it is left alone.
+ */
+void Pool_release(T pool, WORD_SIZE *block, WORD_SIZE words)
+{
+        if ((char *)block >= pool->adopted && 
+            (char *)block < pool->adopted_end) {
+                return;
+        }
+        if (words > POOL_LARGE) {
+                size_t bytes = (size_t)words * sizeof(WORD_SIZE);
+
+                if (is_huge(pool, bytes)) {
+                        bytes = (bytes + HUGE_BYTES - 1) & ~(HUGE_BYTES - 1);
+                }
+                munmap(block, bytes);
+                return;
+        }
+
+        unsigned cls = size_class(words);
+        Block *freed = (Block *)block;
+
+        freed->next = pool->free_list[cls];
+        pool->free_list[cls] = freed;
+}
+
+/* Returns the fewest words a block of at least words words must be
+ * allocated with to be mapped on its own: more than POOL_LARGE.
+ */
+WORD_SIZE Pool_exclusive_words(WORD_SIZE words)
+{
+        return (words > POOL_LARGE) ? words : POOL_LARGE + 1;
+}
+
+/* Returns whether the block of words words was mapped on its own, which
+ * maps whole pages, rather than carved from a slab or adopted.
+ */
+bool Pool_exclusive(T pool, const WORD_SIZE *block, WORD_SIZE words)
+{
+        return words > POOL_LARGE &&
+               ((const char *)block < pool->adopted ||
+                (const char *)block >= pool->adopted_end);
+}
+
+/* Lets blocks in the bytes at base be released to the pool. */
+void Pool_adopt(T pool, void *base, size_t bytes)
+{
+        assert(pool->adopted == NULL);
+        pool->adopted = base;
+        pool->adopted_end = (char *)base + bytes;
+}
+
+/* Puts blocks of at least threshold bytes allocated from now on on huge
+ * pages. Blocks already mapped must have been mapped the same way, since
+ * releasing one works out from its size how it was mapped.
+ */
+void Pool_huge_pages(T pool, size_t threshold, bool hugetlb)
+{
+        pool->huge.threshold = threshold;
+        pool->huge.hugetlb = hugetlb;
+}
+
+/* Returns how blocks are put on huge pages and how many have been. */
+Pool_huge Pool_huge_stats(T pool)
+{
+        return pool->huge;
+}
+
+/* Prints the allocation statistics of the pool. */
+void Pool_report(T pool, FILE *out)
+{
+        uint64_t small = pool->hits + pool->misses;
+
+        fprintf(out, "pool: %" PRIu64 " hits, %" PRIu64 " misses "
+                "(%.1f%% hit rate), %" PRIu64 " large (%" PRIu64 " on huge "
+                "pages), %u slabs\n",
+                pool->hits, pool->misses,
+                small ? 100.0 * pool->hits / small : 0.0, pool->large,
+                pool->huge.advised + pool->huge.pooled, pool->num_slabs);
+}
+
+/* Returns the size class for a block of words words: the power of two it
+ * rounds up to, counted from 2^MIN_SHIFT.
+ */
+static inline unsigned size_class(WORD_SIZE words)
+{
+        if (words <= (1u << MIN_SHIFT)) {
+                return 0;
+        }
+        return 32 - __builtin_clz(words - 1) - MIN_SHIFT;
+}
+
+/* Returns a new block from the slab of size class cls. */
+static WORD_SIZE *carve(T pool, unsigned cls)
+{
+        size_t bytes = (sizeof(WORD_SIZE) << MIN_SHIFT) << cls;
+
+        if (pool->slab_next[cls] == NULL ||
+            (size_t)(pool->slab_end[cls] - pool->slab_next[cls]) < bytes) {
+                if (pool->num_slabs == pool->slab_capacity) {
+                        pool->slab_capacity = pool->slab_capacity * 2 + 16;
+                        pool->slabs = realloc(pool->slabs, 
+                                              pool->slab_capacity * 
+                                              sizeof(void *));
+                        assert(pool->slabs != NULL);
+                }
+                char *slab = map_bytes(SLAB_BYTES);
+                pool->slabs[pool->num_slabs++] = slab;
+                pool->slab_next[cls] = slab;
+                pool->slab_end[cls] = slab + SLAB_BYTES;
+        }
+
+        WORD_SIZE *block = (WORD_SIZE *)pool->slab_next[cls];
+        pool->slab_next[cls] += bytes;
+        return block;
+}
+
+/* Returns anonymous zeroed memory of the given number of bytes. */
+static void *map_bytes(size_t bytes)
+{
+        void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(mem != MAP_FAILED);
+        return mem;
+}
+
+/* Returns whether a large block of bytes bytes is put on huge pages. */
+static inline bool is_huge(T pool, size_t bytes)
+{
+        return pool->huge.threshold != 0 && bytes >= pool->huge.threshold;
+}
+
+/* Returns anonymous zeroed memory of bytes rounded up to whole huge pages
+ * and aligned to one. It comes from the hugetlbfs pool if the pool is
+ * asked to use it and it has enough free pages; otherwise a huge page
+ * more is mapped, the ends are trimmed off and the rest is advised to be
+ * backed by transparent huge pages.
+ */
+static void *map_huge(T pool, size_t bytes)
+{
+        size_t length = (bytes + HUGE_BYTES - 1) & ~(HUGE_BYTES - 1);
+        char *mem, *aligned;
+
+        if (pool->huge.hugetlb) {
+                mem = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (mem != MAP_FAILED) {
+                        pool->huge.pooled++;
+                        pool->huge.pooled_bytes += length;
+                        return mem;
+                }
+        }
+
+        mem = map_bytes(length + HUGE_BYTES);
+        aligned = (char *)(((uintptr_t)mem + HUGE_BYTES - 1) &
+                           ~(uintptr_t)(HUGE_BYTES - 1));
+        if (aligned > mem) {
+                munmap(mem, aligned - mem);
+        }
+        munmap(aligned + length, mem + HUGE_BYTES - aligned);
+        madvise(aligned, length, MADV_HUGEPAGE);
+        pool->huge.advised++;
+        pool->huge.advised_bytes += length;
+        return aligned;
+}
@@ -0,0 +1,83 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the allocator behind segmented memory. Small blocks come
+ * from per-size-class free lists backed by slabs; large blocks are mapped
+ * from the kernel one at a time, on huge pages if they are big enough.
+ * Every block is handed out zeroed.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#ifndef POOL_H_INCLUDED
+#define POOL_H_INCLUDED
+#define WORD_SIZE uint32_t
+#define T Pool_T
+typedef struct T *T;
+
+/* How blocks are put on huge pages, and how many have been: blocks of at
+ * least threshold bytes (none if 0) get transparent huge pages, asked for
+ * with MADV_HUGEPAGE, or pages from the hugetlbfs pool first if hugetlb is
+ * set and it has enough free.
+ */
+typedef struct Pool_huge {
+        size_t threshold;
+        bool hugetlb;
+        uint64_t advised;
+        uint64_t advised_bytes;
+        uint64_t pooled;
+        uint64_t pooled_bytes;
+} Pool_huge;
+
+/* Creates an allocator with no memory set aside yet. */
+T Pool_new();
+
+/* Frees the allocator and all of the memory it has set aside, including
+ * blocks that were never released.
+ */
+void Pool_free(T *pool);
+
+/* Returns a block of words words, all set to 0. */
+WORD_SIZE *Pool_alloc(T pool, WORD_SIZE words);
+
+/* Gives back a block of words words returned by Pool_alloc, or lying in
+ * the range given to Pool_adopt.
+ */
+void Pool_release(T pool, WORD_SIZE *block, WORD_SIZE words);
+
+/* Returns the fewest words a block of at least words words must be
+ * allocated with to lie on pages that no other block shares.
+ */
+WORD_SIZE Pool_exclusive_words(WORD_SIZE words);
+
+/* Returns whether the block of words words lies on pages that no other
+ * block shares: whether it was mapped on its own, rather than carved from
+ * a slab or lying in the adopted range.
+ */
+bool Pool_exclusive(T pool, const WORD_SIZE *block, WORD_SIZE words);
+
+/* Lets blocks that lie in the bytes at base, which the pool did not
+ * allocate, be released to it; releasing them does nothing. The memory
+ * stays the caller's and must outlive the pool. A pool adopts at most one
+ * range.
+ */
+void Pool_adopt(T pool, void *base, size_t bytes);
+
+/* Puts blocks of at least threshold bytes (none if 0) allocated from now
+ * on on huge pages, from the hugetlbfs pool first if hugetlb is set. Must
+ * be called before any block that large is allocated.
+ */
+void Pool_huge_pages(T pool, size_t threshold, bool hugetlb);
+
+/* Returns how blocks are put on huge pages and how many have been. */
+Pool_huge Pool_huge_stats(T pool);
+
+/* Prints how many allocations were served from a free list (hits), needed
+ * new slab space (misses) or were too large for a size class.
+ */
+void Pool_report(T pool, FILE *out);
+
+#undef T
+#endif
@@ -0,0 +1,562 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the predecoded copy of segment 0. The instructions are
+ * kept in one array that only grows, so reloading segment 0 with a program
+ * no larger than any before it costs no allocation.
+ *
+ * Superinstructions are matched on the plain opcodes of the words at and
+ * after each word, longest first, so a word fuses the same way whether it
+ * was decoded by Predecode_load or patched by Predecode_update. Guests
+ * store into segment 0 often enough (midmark.um about once every ten
+ * instructions) that matching goes through tables indexed by opcodes,
+ * built when the fusion set is chosen.
+ *
+ * An Op is 8 bytes, its four byte fields then its immediate, so on x86-64
+ * whole programs are decoded with vector shifts and masks: the byte fields
+ * of each word are built in one 32-bit lane and the immediate in another,
+ * and the two are interleaved into Ops and stored together, 8 words at a
+ * time with AVX2 or 4 with SSE2, which every x86-64 has. Comparing the
+ * opcodes with 13 in the same registers counts the invalid ones, and the
+ * count is kept up to date as words are patched, marked and refreshed.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "predecode.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#define WORD_SIZE uint32_t
+#define OPCODE_LSB 28
+#define A_LSB 6
+#define B_LSB 3
+#define C_LSB 0
+#define LOAD_VAL_LSB 25
+#define VAL_LENGTH 25
+#define CMOV 0
+#define LOAD 1
+#define STORE 2
+#define ADD 3
+#define NAND 6
+#define LOAD_PROGRAM 12
+#define LOAD_VALUE 13
+#define INVALID 14
+#define MAX_FUSED 3
+#define T Predecode_T
+
+/* Struct that holds the decoded instructions, the capacity of the array
+ * that holds them, how many of them are program words, how many of those
+ * have an invalid opcode, the fusion set,
+ * the runs of words superinstructions must stay within (0 for no limit)
+ * and the superinstruction in the set for each pair and triple of plain
+ * opcodes (0 where there is none).
+ */
+struct T {
+        Op *ops;
+        unsigned capacity;
+        unsigned length;
+        unsigned invalid;
+        unsigned fuse;
+        unsigned window;
+        uint8_t pairs[FUSED_BASE][FUSED_BASE];
+        uint8_t triples[FUSED_BASE][FUSED_BASE][FUSED_BASE];
+};
+
+/* A superinstruction: its name and the opcodes of the words it runs. */
+typedef struct Pattern {
+        const char *name;
+        unsigned length;
+        uint8_t opcodes[MAX_FUSED];
+} Pattern;
+
+/* Every superinstruction, indexed by its opcode less FUSED_BASE. */
+static const Pattern patterns[FUSED_END - FUSED_BASE] = {
+        [FUSED_LOADV_LOAD - FUSED_BASE] =
+                { "loadv+load", 2, { LOAD_VALUE, LOAD } },
+        [FUSED_LOADV_STORE - FUSED_BASE] =
+                { "loadv+store", 2, { LOAD_VALUE, STORE } },
+        [FUSED_LOADV_LOADV - FUSED_BASE] =
+                { "loadv+loadv", 2, { LOAD_VALUE, LOAD_VALUE } },
+        [FUSED_LOADV_LOADP - FUSED_BASE] =
+                { "loadv+loadp", 2, { LOAD_VALUE, LOAD_PROGRAM } },
+        [FUSED_LOADV_CMOV - FUSED_BASE] =
+                { "loadv+cmov", 2, { LOAD_VALUE, CMOV } },
+        [FUSED_STORE_LOADV - FUSED_BASE] =
+                { "store+loadv", 2, { STORE, LOAD_VALUE } },
+        [FUSED_LOAD_LOADV - FUSED_BASE] =
+                { "load+loadv", 2, { LOAD, LOAD_VALUE } },
+        [FUSED_NAND_NAND - FUSED_BASE] =
+                { "nand+nand", 2, { NAND, NAND } },
+        [FUSED_NAND_CMOV - FUSED_BASE] =
+                { "nand+cmov", 2, { NAND, CMOV } },
+        [FUSED_LOAD_LOADP - FUSED_BASE] =
+                { "load+loadp", 2, { LOAD, LOAD_PROGRAM } },
+        [FUSED_LOADV_STORE_LOADV - FUSED_BASE] =
+                { "loadv+store+loadv", 3, { LOAD_VALUE, STORE, LOAD_VALUE } },
+        [FUSED_LOADV_LOAD_LOADV - FUSED_BASE] =
+                { "loadv+load+loadv", 3, { LOAD_VALUE, LOAD, LOAD_VALUE } },
+        [FUSED_LOAD_ADD_STORE - FUSED_BASE] =
+                { "load+add+store", 3, { LOAD, ADD, STORE } }
+};
+
+/* Returns the opcode of the word an Op with opcode was decoded from, even
+ * if it starts a superinstruction.
+ */
+static unsigned plain_opcode(unsigned opcode);
+
+/* Returns whether an Op with opcode was decoded from a word with an
+ * invalid opcode. Superinstructions, stale and uncached words were not.
+ */
+static inline unsigned is_invalid(unsigned opcode);
+
+/* Gives the word at offset the opcode of the longest superinstruction in
+ * the fusion set that starts there, or its plain opcode if none does.
+ */
+static void fuse_at(T prog, unsigned offset);
+
+/* Fuses the words from first up to end, if there is a fusion set. */
+static void fuse_range(T prog, unsigned first, unsigned end);
+
+/* Gives the instructions for the count words from first, up to the end of
+ * the program, opcode.
+ */
+static void mark(T prog, unsigned first, unsigned count, unsigned opcode);
+
+#if defined(__x86_64__)
+/* Returns the sum of the four 32-bit lanes of v. */
+static unsigned lane_sum(__m128i v);
+
+/* Decodes n words 8 at a time, adding the number with invalid opcodes to
+ * invalid, and returns how many it decoded.
+ */
+__attribute__((target("avx2")))
+static unsigned decode_avx2(Op *ops, const WORD_SIZE *words, unsigned n,
+                            unsigned *invalid);
+
+/* Decodes n words 4 at a time, adding the number with invalid opcodes to
+ * invalid, and returns how many it decoded.
+ */
+static unsigned decode_sse2(Op *ops, const WORD_SIZE *words, unsigned n,
+                            unsigned *invalid);
+#endif
+
+/* Creates an empty predecoded program. */
+T Predecode_new()
+{
+        T prog = malloc(sizeof(struct Predecode_T));
+        assert(prog != NULL);
+        prog->ops = NULL;
+        prog->capacity = 0;
+        prog->length = 0;
+        prog->invalid = 0;
+        prog->window = 0;
+        assert(sizeof(Op) == 8 && offsetof(Op, value) == 4);
+        Predecode_fuse(prog, FUSE_DEFAULT);
+        return prog;
+}
+
+/* Creates an empty predecoded program with the fusion set and window of
+ * prog.
+ */
+T Predecode_like(T prog)
+{
+        T like = Predecode_new();
+
+        Predecode_fuse(like, prog->fuse);
+        like->window = prog->window;
+        return like;
+}
+
+/* Chooses the superinstructions the next Predecode_load fuses and fills in
+ * the tables that match them.
+ */
+void Predecode_fuse(T prog, unsigned set)
+{
+        assert((set & ~FUSE_ALL) == 0);
+        prog->fuse = set;
+        memset(prog->pairs, 0, sizeof(prog->pairs));
+        memset(prog->triples, 0, sizeof(prog->triples));
+
+        for (unsigned i = 0; i < FUSED_END - FUSED_BASE; i++) {
+                const uint8_t *opcodes = patterns[i].opcodes;
+
+                if ((set & (1u << i)) == 0) {
+                        continue;
+                }
+                if (patterns[i].length == 2) {
+                        prog->pairs[opcodes[0]][opcodes[1]] = FUSED_BASE + i;
+                } else {
+                        prog->triples[opcodes[0]][opcodes[1]][opcodes[2]] =
+                                FUSED_BASE + i;
+                }
+        }
+}
+
+/* Keeps the superinstructions the next Predecode_load fuses inside aligned
+ * runs of window words (0 for no limit).
+ */
+void Predecode_window(T prog, unsigned window)
+{
+        prog->window = window;
+}
+
+/* Turns a comma-separated list of superinstruction names, or "default",
+ * "all" or "none", into a fusion set. Returns false if a name is unknown.
+ */
+bool Predecode_fusion(const char *list, unsigned *set)
+{
+        if (strcmp(list, "default") == 0) {
+                *set = FUSE_DEFAULT;
+                return true;
+        } else if (strcmp(list, "all") == 0) {
+                *set = FUSE_ALL;
+                return true;
+        } else if (strcmp(list, "none") == 0) {
+                *set = 0;
+                return true;
+        }
+
+        *set = 0;
+        while (*list != '\0') {
+                size_t length = strcspn(list, ",");
+                unsigned i;
+
+                for (i = 0; i < FUSED_END - FUSED_BASE; i++) {
+                        if (strlen(patterns[i].name) == length &&
+                            strncmp(patterns[i].name, list, length) == 0) {
+                                break;
+                        }
+                }
+                if (i == FUSED_END - FUSED_BASE) {
+                        return false;
+                }
+                *set |= 1u << i;
+                list += length;
+                if (*list == ',') {
+                        list++;
+                }
+        }
+        return true;
+}
+
+/* Frees the predecoded program and its instructions. */
+void Predecode_free(T *prog)
+{
+        free((*prog)->ops);
+        free(*prog);
+        *prog = NULL;
+}
+
+/* Decodes length words into the program, replacing whatever it held, and
+ * appends an invalid instruction after the last one.
+ */
+void Predecode_load(T prog, const WORD_SIZE *words, unsigned length)
+{
+        if (length + 1 > prog->capacity) {
+                free(prog->ops);
+                prog->capacity = length + 1;
+                prog->ops = malloc(sizeof(Op) * prog->capacity);
+                assert(prog->ops != NULL);
+        }
+
+        prog->invalid = Predecode_decode(prog->ops, words, length);
+        Predecode_word(&(prog->ops[length]), (WORD_SIZE)INVALID << OPCODE_LSB);
+        prog->length = length;
+        fuse_range(prog, 0, length);
+}
+
+/* Re-decodes the instruction at offset after the guest stores word there,
+ * then matches the superinstructions that could cover it again, unless its
+ * opcode is unchanged and so is every match.
+ */
+void Predecode_update(T prog, WORD_SIZE offset, WORD_SIZE word)
+{
+        Op *op = &(prog->ops[offset]);
+        unsigned opcode = op->opcode;
+
+        prog->invalid -= is_invalid(opcode);
+        Predecode_word(op, word);
+        prog->invalid += is_invalid(op->opcode);
+        if (prog->fuse != 0 && op->opcode == plain_opcode(opcode)) {
+                op->opcode = opcode;
+        } else if (prog->fuse != 0) {
+                WORD_SIZE first = (offset < MAX_FUSED - 1) ? 0 :
+                                  offset - (MAX_FUSED - 1);
+
+                for (WORD_SIZE i = first; i <= offset; i++) {
+                        fuse_at(prog, i);
+                }
+        }
+}
+
+/* Marks the instructions for the count words from first, up to the end of
+ * the program, STALE. The invalid instruction after the last word stays.
+ */
+void Predecode_stale(T prog, unsigned first, unsigned count)
+{
+        mark(prog, first, count, STALE);
+}
+
+/* Marks the instructions for the count words from first, up to the end of
+ * the program, UNCACHED.
+ */
+void Predecode_uncache(T prog, unsigned first, unsigned count)
+{
+        mark(prog, first, count, UNCACHED);
+}
+
+/* Decodes the count words from first, up to the end of the program, from
+ * words again and fuses them. Fusing runs only up to the end of the range,
+ * so the range must be a whole window for superinstructions to be the
+ * same as Predecode_load would make.
+ */
+void Predecode_refresh(T prog, const WORD_SIZE *words, unsigned first,
+                       unsigned count)
+{
+        unsigned end = (count > prog->length - first) ? prog->length
+                                                      : first + count;
+
+        for (unsigned i = first; i < end; i++) {
+                prog->invalid -= is_invalid(prog->ops[i].opcode);
+        }
+        prog->invalid += Predecode_decode(prog->ops + first, words + first,
+                                          end - first);
+        fuse_range(prog, first, end);
+}
+
+/* Returns the decoded instructions, valid until the next Predecode_load. */
+Op *Predecode_ops(T prog)
+{
+        return prog->ops;
+}
+
+/* Returns how many program words have an invalid opcode. */
+unsigned Predecode_invalid(T prog)
+{
+        return prog->invalid;
+}
+
+/* Decodes a single word into op. */
+void Predecode_word(Op *op, WORD_SIZE word)
+{
+        op->opcode = word >> OPCODE_LSB;
+        op->a = (word >> A_LSB) & 0x7;
+        op->b = (word >> B_LSB) & 0x7;
+        op->c = (word >> C_LSB) & 0x7;
+        op->value = 0;
+
+        if (op->opcode == LOAD_VALUE) {
+                op->a = (word >> LOAD_VAL_LSB) & 0x7;
+                op->value = word & ((1u << VAL_LENGTH) - 1);
+        }
+}
+
+/* Decodes the n words at words into ops, as many as it can with AVX2 or
+ * SSE2 and the rest one at a time, and returns how many have an invalid
+ * opcode.
+ */
+unsigned Predecode_decode(Op *ops, const WORD_SIZE *words, unsigned n)
+{
+        unsigned invalid = 0;
+        unsigned i = 0;
+
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) {
+                i = decode_avx2(ops, words, n, &invalid);
+        } else {
+                i = decode_sse2(ops, words, n, &invalid);
+        }
+#endif
+        for (; i < n; i++) {
+                Predecode_word(&ops[i], words[i]);
+                invalid += (ops[i].opcode >= INVALID);
+        }
+        return invalid;
+}
+
+/* Returns the opcode of the word an Op with opcode was decoded from: a
+ * superinstruction starts with the word of its first opcode.
+ */
+static unsigned plain_opcode(unsigned opcode)
+{
+        if (opcode < FUSED_BASE) {
+                return opcode;
+        }
+        return patterns[opcode - FUSED_BASE].opcodes[0];
+}
+
+/* Returns 1 for the two invalid opcodes and 0 for every other, so it can
+ * be added to a count.
+ */
+static inline unsigned is_invalid(unsigned opcode)
+{
+        return opcode == INVALID || opcode == INVALID + 1;
+}
+
+/* Gives the word at offset the opcode of the longest superinstruction in
+ * the fusion set whose opcodes match the words from offset on, without
+ * running past the end of the program or of the window offset is in, or
+ * its plain opcode if none does.
+ */
+static void fuse_at(T prog, unsigned offset)
+{
+        Op *ops = prog->ops + offset;
+        unsigned first = plain_opcode(ops[0].opcode);
+        unsigned second, fused = 0;
+        unsigned end = prog->length;
+
+        if (prog->window != 0 &&
+            offset - offset % prog->window + prog->window < end) {
+                end = offset - offset % prog->window + prog->window;
+        }
+        if (offset + 2 <= end) {
+                second = plain_opcode(ops[1].opcode);
+                if (offset + 3 <= end) {
+                        fused = prog->triples[first][second]
+                                             [plain_opcode(ops[2].opcode)];
+                }
+                if (fused == 0) {
+                        fused = prog->pairs[first][second];
+                }
+        }
+        ops[0].opcode = (fused == 0) ? first : fused;
+}
+
+/* Fuses the words from first up to end, in order, if the fusion set is not
+ * empty.
+ */
+static void fuse_range(T prog, unsigned first, unsigned end)
+{
+        if (prog->fuse != 0) {
+                for (unsigned i = first; i < end; i++) {
+                        fuse_at(prog, i);
+                }
+        }
+}
+
+/* Gives the instructions for the count words from first, up to the end of
+ * the program, opcode, touching nothing but their opcodes.
+ */
+static void mark(T prog, unsigned first, unsigned count, unsigned opcode)
+{
+        unsigned end = (count > prog->length - first) ? prog->length
+                                                      : first + count;
+
+        for (unsigned i = first; i < end; i++) {
+                prog->invalid -= is_invalid(prog->ops[i].opcode);
+                prog->ops[i].opcode = opcode;
+        }
+}
+
+#if defined(__x86_64__)
+/* Returns the sum of the four 32-bit lanes of v, adding the halves
+ * swapped and then the pairs in each half swapped.
+ */
+static unsigned lane_sum(__m128i v)
+{
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(v);
+}
+
+/* Decodes n words 8 at a time: each 32-bit lane builds the byte fields of
+ * its Op (the opcode, then a, b and c, with a moved for load value) and
+ * its immediate, which is kept only for load value. Interleaving the two
+ * pairs up the lanes of each 128-bit half, so the halves are swapped
+ * across before the 8 Ops are stored in order.
+ */
+__attribute__((target("avx2")))
+static unsigned decode_avx2(Op *ops, const WORD_SIZE *words, unsigned n,
+                            unsigned *invalid)
+{
+        const __m256i reg_mask = _mm256_set1_epi32(0x7);
+        const __m256i value_mask = _mm256_set1_epi32((1 << VAL_LENGTH) - 1);
+        const __m256i load_value = _mm256_set1_epi32(LOAD_VALUE);
+        __m256i count = _mm256_setzero_si256();
+        unsigned i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                __m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+                __m256i opcode = _mm256_srli_epi32(w, OPCODE_LSB);
+                __m256i is_loadv = _mm256_cmpeq_epi32(opcode, load_value);
+                __m256i a = _mm256_blendv_epi8(
+                        _mm256_and_si256(_mm256_srli_epi32(w, A_LSB),
+                                         reg_mask),
+                        _mm256_and_si256(_mm256_srli_epi32(w, LOAD_VAL_LSB),
+                                         reg_mask),
+                        is_loadv);
+                __m256i b = _mm256_and_si256(_mm256_srli_epi32(w, B_LSB),
+                                             reg_mask);
+                __m256i c = _mm256_and_si256(_mm256_srli_epi32(w, C_LSB),
+                                             reg_mask);
+                __m256i fields = _mm256_or_si256(
+                        _mm256_or_si256(opcode, _mm256_slli_epi32(a, 8)),
+                        _mm256_or_si256(_mm256_slli_epi32(b, 16),
+                                        _mm256_slli_epi32(c, 24)));
+                __m256i value = _mm256_and_si256(is_loadv, _mm256_and_si256(
+                        w, value_mask));
+                __m256i low = _mm256_unpacklo_epi32(fields, value);
+                __m256i high = _mm256_unpackhi_epi32(fields, value);
+
+                _mm256_storeu_si256((__m256i *)(ops + i),
+                                    _mm256_permute2x128_si256(low, high,
+                                                              0x20));
+                _mm256_storeu_si256((__m256i *)(ops + i + 4),
+                                    _mm256_permute2x128_si256(low, high,
+                                                              0x31));
+                count = _mm256_sub_epi32(count, _mm256_cmpgt_epi32(
+                        opcode, load_value));
+        }
+        *invalid += lane_sum(_mm_add_epi32(_mm256_castsi256_si128(count),
+                                           _mm256_extracti128_si256(count,
+                                                                    1)));
+        return i;
+}
+
+/* Decodes n words 4 at a time, as decode_avx2 does 8, without a blend:
+ * the a field of load value is selected with and and andnot.
+ */
+static unsigned decode_sse2(Op *ops, const WORD_SIZE *words, unsigned n,
+                            unsigned *invalid)
+{
+        const __m128i reg_mask = _mm_set1_epi32(0x7);
+        const __m128i value_mask = _mm_set1_epi32((1 << VAL_LENGTH) - 1);
+        const __m128i load_value = _mm_set1_epi32(LOAD_VALUE);
+        __m128i count = _mm_setzero_si128();
+        unsigned i;
+
+        for (i = 0; i + 4 <= n; i += 4) {
+                __m128i w = _mm_loadu_si128((const __m128i *)(words + i));
+                __m128i opcode = _mm_srli_epi32(w, OPCODE_LSB);
+                __m128i is_loadv = _mm_cmpeq_epi32(opcode, load_value);
+                __m128i a = _mm_or_si128(
+                        _mm_andnot_si128(is_loadv, _mm_and_si128(
+                                _mm_srli_epi32(w, A_LSB), reg_mask)),
+                        _mm_and_si128(is_loadv, _mm_and_si128(
+                                _mm_srli_epi32(w, LOAD_VAL_LSB), reg_mask)));
+                __m128i b = _mm_and_si128(_mm_srli_epi32(w, B_LSB), reg_mask);
+                __m128i c = _mm_and_si128(_mm_srli_epi32(w, C_LSB), reg_mask);
+                __m128i fields = _mm_or_si128(
+                        _mm_or_si128(opcode, _mm_slli_epi32(a, 8)),
+                        _mm_or_si128(_mm_slli_epi32(b, 16),
+                                     _mm_slli_epi32(c, 24)));
+                __m128i value = _mm_and_si128(is_loadv, _mm_and_si128(
+                        w, value_mask));
+
+                _mm_storeu_si128((__m128i *)(ops + i),
+                                 _mm_unpacklo_epi32(fields, value));
+                _mm_storeu_si128((__m128i *)(ops + i + 2),
+                                 _mm_unpackhi_epi32(fields, value));
+                count = _mm_sub_epi32(count, _mm_cmpgt_epi32(opcode,
+                                                             load_value));
+        }
+        *invalid += lane_sum(count);
+        return i;
+}
+#endif
@@ -0,0 +1,158 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the predecoded copy of segment 0. Every program word is
+ * split once into its opcode, register indices and immediate value so the
+ * um never has to pull a word apart with shifts while it runs. Whole
+ * programs are decoded 8 words at a time with AVX2, or 4 with SSE2.
+ *
+ * Runs of adjacent instructions that profiles of real guests show are
+ * common can be fused into superinstructions: the first word of the run
+ * gets one of the opcodes from FUSED_BASE up, and the threaded engine
+ * executes the whole run on one dispatch. The words after it keep their
+ * own opcodes, so a jump into the middle of a run still works.
+ *
+ * Under the write barrier of -DWRITE_BARRIER the words of a page of
+ * segment 0 that is stored into are marked STALE all at once, and decoded
+ * again from segment 0 when the engine next reaches one of them, or marked
+ * UNCACHED for good if the page keeps being stored into. Runs are
+ * fused only within a page there, so marking one page never leaves a
+ * superinstruction on another covering stale words.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#ifndef PREDECODE_H_INCLUDED
+#define PREDECODE_H_INCLUDED
+#define WORD_SIZE uint32_t
+#define T Predecode_T
+typedef struct T *T;
+
+/* The superinstructions, named after the opcodes they run in order. Each
+ * is also a bit in a fusion set, 1 << (fused - FUSED_BASE).
+ */
+typedef enum Fused {
+        FUSED_BASE = 16,
+        FUSED_LOADV_LOAD = FUSED_BASE,
+        FUSED_LOADV_STORE,
+        FUSED_LOADV_LOADV,
+        FUSED_LOADV_LOADP,
+        FUSED_LOADV_CMOV,
+        FUSED_STORE_LOADV,
+        FUSED_LOAD_LOADV,
+        FUSED_NAND_NAND,
+        FUSED_NAND_CMOV,
+        FUSED_LOAD_LOADP,
+        FUSED_LOADV_STORE_LOADV,
+        FUSED_LOADV_LOAD_LOADV,
+        FUSED_LOAD_ADD_STORE,
+        FUSED_END
+} Fused;
+
+/* The opcode of a word whose page has been stored into since it was
+ * decoded.
+ */
+#define STALE FUSED_END
+
+/* The opcode of a word on a page stored into too often to be worth
+ * decoding once; it is decoded from segment 0 every time it runs.
+ */
+#define UNCACHED (STALE + 1)
+
+/* Number of opcodes an Op can have, plain, fused, stale and uncached. */
+#define NUM_OPS (UNCACHED + 1)
+
+/* Every superinstruction. */
+#define FUSE_ALL ((1u << (FUSED_END - FUSED_BASE)) - 1)
+
+/* The fusion set new programs get. Every superinstruction here came out of
+ * the pair and triple counts of a profiling build on sandmark.umz and
+ * midmark.um, and the whole set ran faster than any subset tried.
+ */
+#define FUSE_DEFAULT FUSE_ALL
+
+/* A single decoded instruction. For load value, a holds the target register
+ * and value the 25-bit immediate; every other opcode leaves value at 0. The
+ * opcode of the first word of a superinstruction is the superinstruction's.
+ */
+typedef struct Op {
+        uint8_t opcode;
+        uint8_t a;
+        uint8_t b;
+        uint8_t c;
+        WORD_SIZE value;
+} Op;
+
+/* Creates an empty predecoded program that fuses the FUSE_DEFAULT set. */
+T Predecode_new();
+
+/* Creates an empty predecoded program that fuses and keeps to windows as
+ * prog does.
+ */
+T Predecode_like(T prog);
+
+/* Chooses the superinstructions the next Predecode_load fuses (0 for
+ * none).
+ */
+void Predecode_fuse(T prog, unsigned set);
+
+/* Keeps the superinstructions the next Predecode_load fuses inside aligned
+ * runs of window words, the pages of segment 0 (0 for no limit).
+ */
+void Predecode_window(T prog, unsigned window);
+
+/* Turns list, a comma-separated list of superinstruction names such as
+ * "loadv+load,nand+nand", or "default", "all" or "none", into a fusion set.
+ * Returns false if a name is unknown.
+ */
+bool Predecode_fusion(const char *list, unsigned *set);
+
+/* Frees the predecoded program and its instructions. */
+void Predecode_free(T *prog);
+
+/* Decodes length words into the program, replacing whatever it held. The
+ * instruction after the last word is an invalid instruction, so running off
+ * the end of segment 0 stops the um instead of reading stray memory.
+ */
+void Predecode_load(T prog, const WORD_SIZE *words, unsigned length);
+
+/* Re-decodes the instruction at offset after the guest stores word there,
+ * along with any superinstruction that covered it.
+ */
+void Predecode_update(T prog, WORD_SIZE offset, WORD_SIZE word);
+
+/* Marks the instructions for the count words from first STALE. Only
+ * writes to the instructions and their count of invalid opcodes, so a
+ * signal handler can call it.
+ */
+void Predecode_stale(T prog, unsigned first, unsigned count);
+
+/* Marks the instructions for the count words from first UNCACHED. */
+void Predecode_uncache(T prog, unsigned first, unsigned count);
+
+/* Decodes the count words from first again from the words of segment 0,
+ * fusing them only among themselves.
+ */
+void Predecode_refresh(T prog, const WORD_SIZE *words, unsigned first,
+                       unsigned count);
+
+/* Returns the decoded instructions, valid until the next Predecode_load. */
+Op *Predecode_ops(T prog);
+
+/* Returns how many words of the program decode to an invalid opcode, which
+ * in practice are data kept in segment 0. Stale and uncached words are not
+ * counted until they are decoded again.
+ */
+unsigned Predecode_invalid(T prog);
+
+/* Decodes a single word into op. */
+void Predecode_word(Op *op, WORD_SIZE word);
+
+/* Decodes the n words at words into the n Ops at ops, as Predecode_word
+ * would each, with SIMD where the processor has it. Returns how many of
+ * the words have an invalid opcode.
+ */
+unsigned Predecode_decode(Op *ops, const WORD_SIZE *words, unsigned n);
+
+#undef T
+#endif
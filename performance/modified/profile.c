@@ -0,0 +1,621 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the execution profiler of the UM.
+ *
+ * The UM has no call instruction, so calls are guessed: a load program is
+ * a call if some register holds the address of the word after it (the
+ * return address the callee will jump back to), and a return if it jumps
+ * to the return address of a call still on the guessed stack. Stacks are
+ * kept as a trie of frames, and every instruction is charged to the node
+ * of the stack it ran under.
+ *
+ * Runs of two and three instructions executed one after the other from
+ * adjacent words are counted by their opcodes too; the most common are the
+ * superinstructions worth fusing in predecode.c.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "profile.h"
+#define REG_SIZE uint32_t
+#define WORD_SIZE uint32_t
+#define NUM_OPCODES 16
+#define NUM_CLASSES 7
+#define NUM_BUCKETS 33
+#define TOP 20
+#define MAX_DEPTH 128
+#define NO_FUNCTION UINT32_MAX
+#define T Profile_T
+
+/* Counts for one program that has been in segment 0. */
+typedef struct Program {
+        WORD_SIZE length;
+        WORD_SIZE invalid;
+        uint64_t instructions;
+        uint64_t *counts;
+        uint64_t *targets;
+} Program;
+
+/* A node of the stack trie: the function entered (NO_FUNCTION for the top
+ * of a program), the node it was called from and the instructions run
+ * with exactly this stack.
+ */
+typedef struct Node {
+        uint32_t parent;
+        WORD_SIZE function;
+        uint32_t program;
+        uint64_t instructions;
+} Node;
+
+/* A frame of the guessed stack: its trie node and where it returns to. */
+typedef struct Frame {
+        uint32_t node;
+        WORD_SIZE ret;
+} Frame;
+
+/* Struct that holds every count, the trie of stacks with a hash table from
+ * (parent, function) to node, and the guessed stack itself. pairs and
+ * triples are indexed by the opcodes of a run of adjacent instructions,
+ * first opcode most significant; last holds the opcodes of the last two
+ * instructions, run how many of them were adjacent to the one after. huge
+ * is how segments went on huge pages and anon_huge how many bytes of
+ * anonymous memory were on transparent huge pages when it was recorded.
+ * current is the class of the last opcode counted, for the hardware
+ * counters to sample.
+ */
+struct T {
+        uint64_t total;
+        uint64_t opcodes[NUM_OPCODES];
+        uint64_t pairs[NUM_OPCODES * NUM_OPCODES];
+        uint64_t triples[NUM_OPCODES * NUM_OPCODES * NUM_OPCODES];
+        unsigned last[2];
+        unsigned run;
+        WORD_SIZE last_pc;
+        Program *programs;
+        unsigned num_programs;
+        uint64_t loadp;
+        uint64_t replaced;
+        uint64_t maps[NUM_BUCKETS];
+        uint64_t unmaps[NUM_BUCKETS];
+        uint64_t accesses[2][PROFILE_LOOKUPS];
+        Pool_huge huge;
+        uint64_t anon_huge;
+        volatile unsigned char current;
+
+        Node *nodes;
+        uint32_t num_nodes;
+        uint32_t node_capacity;
+        uint32_t *children;
+        uint32_t table_size;
+
+        Frame stack[MAX_DEPTH];
+        unsigned depth;
+        uint64_t charged;
+};
+
+static const char *const names[NUM_OPCODES] = {
+        "cmov", "load", "store", "add", "mul", "div", "nand", "halt",
+        "map", "unmap", "output", "input", "loadp", "loadv", "invalid",
+        "invalid"
+};
+
+/* The class of each opcode for the hardware counters, and their names. */
+static const unsigned char classes[NUM_OPCODES] = {
+        0, 2, 2, 0, 0, 0, 0, 6, 3, 3, 5, 5, 4, 1, 6, 6
+};
+
+static const char *const class_names[NUM_CLASSES] = {
+        "arith", "loadv", "memory", "segments", "jump", "io", "other"
+};
+
+/* Returns the trie node for calling function from parent, adding it if it
+ * is new.
+ */
+static uint32_t child(T prof, uint32_t parent, WORD_SIZE function);
+
+/* Charges the instructions run since the last call to the current stack. */
+static void settle(T prof);
+
+/* Returns the histogram bucket for size: 0 for 0 and k + 1 for sizes from
+ * 2^k up to 2^(k+1) - 1.
+ */
+static unsigned bucket(WORD_SIZE size);
+
+/* Prints a size histogram under title. */
+static void print_histogram(FILE *out, const char *title,
+                            const uint64_t *buckets);
+
+/* Prints the TOP largest of the n counts with their offsets, and their
+ * share of total unless total is 0.
+ */
+static void print_top(FILE *out, const uint64_t *counts, WORD_SIZE n,
+                      uint64_t total);
+
+/* Prints the TOP largest of the n counts of runs of length opcodes with
+ * their opcode names and share of total.
+ */
+static void print_runs(FILE *out, const uint64_t *counts, unsigned n,
+                       unsigned length, uint64_t total);
+
+/* Prints the frames of the stack ending at node, outermost first. */
+static void print_stack(T prof, FILE *out, uint32_t node);
+
+/* Returns how many bytes of the process's anonymous memory are on
+ * transparent huge pages, or 0 if the kernel does not say.
+ */
+static uint64_t anon_huge_bytes();
+
+
+/* Creates an empty profile. */
+T Profile_new()
+{
+        T prof = calloc(1, sizeof(struct Profile_T));
+        assert(prof != NULL);
+
+        prof->node_capacity = 1024;
+        prof->nodes = malloc(prof->node_capacity * sizeof(Node));
+        prof->table_size = 2048;
+        prof->children = calloc(prof->table_size, sizeof(uint32_t));
+        assert(prof->nodes != NULL && prof->children != NULL);
+
+        prof->nodes[0].parent = 0;
+        prof->nodes[0].function = NO_FUNCTION;
+        prof->nodes[0].program = 0;
+        prof->nodes[0].instructions = 0;
+        prof->num_nodes = 1;
+        prof->stack[0].node = 0;
+        prof->stack[0].ret = NO_FUNCTION;
+        prof->depth = 1;
+        return prof;
+}
+
+/* Frees the profile. */
+void Profile_free(T *prof)
+{
+        unsigned i;
+
+        for (i = 0; i < (*prof)->num_programs; i++) {
+                free((*prof)->programs[i].counts);
+                free((*prof)->programs[i].targets);
+        }
+        free((*prof)->programs);
+        free((*prof)->nodes);
+        free((*prof)->children);
+        free(*prof);
+        *prof = NULL;
+}
+
+/* Starts counting for a new program of length words in segment 0, invalid
+ * of them data. Its stack starts out empty, under a frame of its own.
+ */
+void Profile_load(T prof, WORD_SIZE length, WORD_SIZE invalid)
+{
+        Program *program;
+
+        settle(prof);
+        prof->programs = realloc(prof->programs, (prof->num_programs + 1) *
+                                                 sizeof(Program));
+        assert(prof->programs != NULL);
+        program = &prof->programs[prof->num_programs++];
+        program->length = length;
+        program->invalid = invalid;
+        program->instructions = 0;
+        program->counts = calloc((size_t)length + 1, sizeof(uint64_t));
+        program->targets = calloc((size_t)length + 1, sizeof(uint64_t));
+        assert(program->counts != NULL && program->targets != NULL);
+
+        prof->stack[0].node = child(prof, 0, NO_FUNCTION);
+        prof->depth = 1;
+        prof->run = 0;
+}
+
+/* Counts one execution of the instruction with the given opcode at pc. */
+void Profile_step(T prof, WORD_SIZE pc, unsigned opcode)
+{
+        Program *program = &prof->programs[prof->num_programs - 1];
+
+        prof->total++;
+        prof->opcodes[opcode]++;
+        prof->current = classes[opcode];
+        program->instructions++;
+        if (pc <= program->length) {
+                program->counts[pc]++;
+        }
+
+        if (prof->run > 0 && pc == prof->last_pc + 1) {
+                unsigned pair = prof->last[0] * NUM_OPCODES + opcode;
+                prof->pairs[pair]++;
+                if (prof->run > 1) {
+                        prof->triples[prof->last[1] * NUM_OPCODES *
+                                      NUM_OPCODES + pair]++;
+                }
+                prof->run++;
+        } else {
+                prof->run = 1;
+        }
+        prof->last[1] = prof->last[0];
+        prof->last[0] = opcode;
+        prof->last_pc = pc;
+}
+
+/* Counts a load program at pc to target and updates the guessed stack. */
+void Profile_jump(T prof, WORD_SIZE pc, WORD_SIZE target, bool replaced,
+                  const REG_SIZE *r)
+{
+        Program *program = &prof->programs[prof->num_programs - 1];
+        unsigned i;
+
+        prof->loadp++;
+        if (replaced) {
+                prof->replaced++;
+                return;
+        }
+        if (target <= program->length) {
+                program->targets[target]++;
+        }
+
+        for (i = prof->depth - 1; i > 0; i--) {
+                if (prof->stack[i].ret == target) {
+                        settle(prof);
+                        prof->depth = i;
+                        return;
+                }
+        }
+        if (prof->depth == MAX_DEPTH) {
+                return;
+        }
+        for (i = 0; i < 8; i++) {
+                if (r[i] == pc + 1) {
+                        settle(prof);
+                        prof->stack[prof->depth].node = 
+                                child(prof, prof->stack[prof->depth - 1].node,
+                                      target);
+                        prof->stack[prof->depth].ret = pc + 1;
+                        prof->depth++;
+                        return;
+                }
+        }
+}
+
+/* Counts a map of a segment of size words. */
+void Profile_map(T prof, WORD_SIZE size)
+{
+        prof->maps[bucket(size)]++;
+}
+
+/* Counts an unmap of a segment of size words. */
+void Profile_unmap(T prof, WORD_SIZE size)
+{
+        prof->unmaps[bucket(size)]++;
+}
+
+/* Counts a load (or, if store, a store) that found its segment by how. */
+void Profile_access(T prof, bool store, Profile_lookup how)
+{
+        prof->accesses[store][how]++;
+}
+
+/* Records how segments were put on huge pages and how much anonymous
+ * memory is on transparent huge pages now.
+ */
+void Profile_huge(T prof, Pool_huge huge)
+{
+        prof->huge = huge;
+        prof->anon_huge = anon_huge_bytes();
+}
+
+/* Has hw sample its counts by the class of the last opcode counted, which
+ * Profile_step keeps in current.
+ */
+void Profile_hwcounters(T prof, Hwcount_T hw)
+{
+        Hwcount_sample(hw, &prof->current, NUM_CLASSES, class_names);
+}
+
+/* Returns how many instructions have been counted. */
+uint64_t Profile_instructions(T prof)
+{
+        return prof->total;
+}
+
+/* Prints the report to out. */
+void Profile_report(T prof, FILE *out)
+{
+        static const char *const kinds[2] = { "load", "store" };
+        unsigned i;
+
+        settle(prof);
+        fprintf(out, "UM profile: %" PRIu64 " instructions\n\n", prof->total);
+
+        fprintf(out, "Instructions by opcode:\n");
+        for (i = 0; i < NUM_OPCODES; i++) {
+                if (prof->opcodes[i] != 0) {
+                        fprintf(out, "  %2u %-8s %14" PRIu64 "  %5.1f%%\n", 
+                                i, names[i], prof->opcodes[i],
+                                100.0 * prof->opcodes[i] / prof->total);
+                }
+        }
+
+        for (i = 0; i < prof->num_programs; i++) {
+                Program *program = &prof->programs[i];
+                fprintf(out, "\nProgram %u (%" PRIu32 " words, %" PRIu32
+                        " with invalid opcodes): %" PRIu64
+                        " instructions\n", i, program->length,
+                        program->invalid, program->instructions);
+                fprintf(out, "  hottest words:\n");
+                print_top(out, program->counts, program->length + 1,
+                          program->instructions);
+                fprintf(out, "  hottest load program targets:\n");
+                print_top(out, program->targets, program->length + 1, 0);
+        }
+
+        fprintf(out, "\nAdjacent instruction pairs:\n");
+        print_runs(out, prof->pairs, NUM_OPCODES * NUM_OPCODES, 2,
+                   prof->total);
+        fprintf(out, "\nAdjacent instruction triples:\n");
+        print_runs(out, prof->triples, NUM_OPCODES * NUM_OPCODES *
+                   NUM_OPCODES, 3, prof->total);
+
+        fprintf(out, "\nLoad program: %" PRIu64 " executed, %" PRIu64 
+                " replaced segment 0\n", prof->loadp, prof->replaced);
+        print_histogram(out, "Mapped segment sizes (words):", prof->maps);
+        print_histogram(out, "Unmapped segment sizes (words):", prof->unmaps);
+
+        fprintf(out, "\nSegment lookups:        segment 0     cache hits"
+                "   cache misses  hit rate\n");
+        for (i = 0; i < 2; i++) {
+                const uint64_t *n = prof->accesses[i];
+                uint64_t cached = n[PROFILE_HIT] + n[PROFILE_MISS];
+
+                fprintf(out, "    %-8s %14" PRIu64 " %14" PRIu64 " %14" 
+                        PRIu64 "    %5.1f%%\n", kinds[i], n[PROFILE_CODE],
+                        n[PROFILE_HIT], n[PROFILE_MISS],
+                        (cached == 0) ? 0.0 : 100.0 * n[PROFILE_HIT] / cached);
+        }
+
+        if (prof->huge.threshold == 0) {
+                fprintf(out, "\nHuge pages (off):\n");
+        } else {
+                fprintf(out, "\nHuge pages (segments of at least %zu "
+                        "bytes):\n", prof->huge.threshold);
+        }
+        fprintf(out, "    transparent  %10" PRIu64 " segments  %10.1f MB\n",
+                prof->huge.advised, prof->huge.advised_bytes / 1e6);
+        fprintf(out, "    hugetlbfs    %10" PRIu64 " segments  %10.1f MB%s\n",
+                prof->huge.pooled, prof->huge.pooled_bytes / 1e6,
+                prof->huge.hugetlb ? "" : " (not asked for)");
+        fprintf(out, "    on transparent huge pages at exit      %10.1f MB\n",
+                prof->anon_huge / 1e6);
+}
+
+/* Prints one line per guessed call stack to out in folded format. */
+void Profile_folded(T prof, FILE *out)
+{
+        uint32_t i;
+
+        settle(prof);
+        for (i = 1; i < prof->num_nodes; i++) {
+                if (prof->nodes[i].instructions != 0) {
+                        print_stack(prof, out, i);
+                        fprintf(out, " %" PRIu64 "\n", 
+                                prof->nodes[i].instructions);
+                }
+        }
+}
+
+/* Returns the trie node for calling function from parent. The hash table
+ * holds node indices, with 0 (the root, never a child) marking a free slot.
+ */
+static uint32_t child(T prof, uint32_t parent, WORD_SIZE function)
+{
+        uint32_t mask = prof->table_size - 1;
+        uint32_t program = prof->num_programs - 1;
+        uint32_t slot = (parent * 2654435761u ^ function * 40503u ^ program)
+                        & mask;
+        uint32_t node;
+
+        while ((node = prof->children[slot]) != 0) {
+                Node *n = &prof->nodes[node];
+                if (n->parent == parent && n->function == function &&
+                    n->program == program) {
+                        return node;
+                }
+                slot = (slot + 1) & mask;
+        }
+
+        if (prof->num_nodes == prof->node_capacity) {
+                prof->node_capacity *= 2;
+                prof->nodes = realloc(prof->nodes, prof->node_capacity *
+                                                   sizeof(Node));
+                assert(prof->nodes != NULL);
+        }
+        node = prof->num_nodes++;
+        prof->nodes[node].parent = parent;
+        prof->nodes[node].function = function;
+        prof->nodes[node].program = program;
+        prof->nodes[node].instructions = 0;
+        prof->children[slot] = node;
+
+        if (2 * prof->num_nodes > prof->table_size) {
+                uint32_t old_size = prof->table_size;
+                uint32_t *old = prof->children;
+                prof->table_size *= 2;
+                prof->children = calloc(prof->table_size, sizeof(uint32_t));
+                assert(prof->children != NULL);
+                for (uint32_t j = 0; j < old_size; j++) {
+                        if (old[j] == 0) {
+                                continue;
+                        }
+                        Node *n = &prof->nodes[old[j]];
+                        mask = prof->table_size - 1;
+                        slot = (n->parent * 2654435761u ^ 
+                                n->function * 40503u ^ n->program) & mask;
+                        while (prof->children[slot] != 0) {
+                                slot = (slot + 1) & mask;
+                        }
+                        prof->children[slot] = old[j];
+                }
+                free(old);
+        }
+        return node;
+}
+
+/* Charges the instructions run since the last call to the current stack. */
+static void settle(T prof)
+{
+        Node *node = &prof->nodes[prof->stack[prof->depth - 1].node];
+
+        node->instructions += prof->total - prof->charged;
+        prof->charged = prof->total;
+}
+
+/* Returns the histogram bucket for size. */
+static unsigned bucket(WORD_SIZE size)
+{
+        return (size == 0) ? 0 : 32 - __builtin_clz(size);
+}
+
+/* Prints a size histogram under title, skipping empty buckets. */
+static void print_histogram(FILE *out, const char *title,
+                            const uint64_t *buckets)
+{
+        unsigned i;
+
+        fprintf(out, "\n%s\n", title);
+        for (i = 0; i < NUM_BUCKETS; i++) {
+                if (buckets[i] == 0) {
+                        continue;
+                }
+                if (i == 0) {
+                        fprintf(out, "  %10u            %14" PRIu64 "\n", 0u,
+                                buckets[i]);
+                } else {
+                        fprintf(out, "  %10" PRIu64 " - %-10" PRIu64 
+                                " %14" PRIu64 "\n", (uint64_t)1 << (i - 1),
+                                ((uint64_t)1 << i) - 1, buckets[i]);
+                }
+        }
+}
+
+/* Prints the TOP largest of the n counts with their offsets, and their
+ * share of total unless total is 0.
+ */
+static void print_top(FILE *out, const uint64_t *counts, WORD_SIZE n,
+                      uint64_t total)
+{
+        WORD_SIZE top[TOP];
+        unsigned num_top = 0;
+        unsigned i, j;
+
+        for (WORD_SIZE w = 0; w < n; w++) {
+                if (counts[w] == 0) {
+                        continue;
+                }
+                if (num_top == TOP && counts[w] <= counts[top[TOP - 1]]) {
+                        continue;
+                }
+                i = (num_top < TOP) ? num_top++ : TOP - 1;
+                while (i > 0 && counts[top[i - 1]] < counts[w]) {
+                        top[i] = top[i - 1];
+                        i--;
+                }
+                top[i] = w;
+        }
+
+        for (j = 0; j < num_top; j++) {
+                fprintf(out, "    %10" PRIu32 " %14" PRIu64, top[j], 
+                        counts[top[j]]);
+                if (total != 0) {
+                        fprintf(out, "  %5.1f%%", 100.0 * counts[top[j]] / 
+                                                  total);
+                }
+                fprintf(out, "\n");
+        }
+}
+
+/* Prints the TOP largest of the n counts of runs of length opcodes, each
+ * named by its opcodes joined with +, with its share of total.
+ */
+static void print_runs(FILE *out, const uint64_t *counts, unsigned n,
+                       unsigned length, uint64_t total)
+{
+        unsigned top[TOP];
+        unsigned num_top = 0;
+        unsigned i, j;
+
+        for (unsigned run = 0; run < n; run++) {
+                if (counts[run] == 0) {
+                        continue;
+                }
+                if (num_top == TOP && counts[run] <= counts[top[TOP - 1]]) {
+                        continue;
+                }
+                i = (num_top < TOP) ? num_top++ : TOP - 1;
+                while (i > 0 && counts[top[i - 1]] < counts[run]) {
+                        top[i] = top[i - 1];
+                        i--;
+                }
+                top[i] = run;
+        }
+
+        for (j = 0; j < num_top; j++) {
+                char name[32] = "";
+                unsigned divisor = 1;
+
+                for (i = 1; i < length; i++) {
+                        divisor *= NUM_OPCODES;
+                }
+                for (i = 0; i < length; i++) {
+                        unsigned opcode = top[j] / divisor % NUM_OPCODES;
+                        strcat(name, names[opcode]);
+                        if (i + 1 < length) {
+                                strcat(name, "+");
+                        }
+                        divisor /= NUM_OPCODES;
+                }
+                fprintf(out, "    %-24s %14" PRIu64 "  %5.1f%%\n", name,
+                        counts[top[j]], 100.0 * counts[top[j]] / total);
+        }
+}
+
+/* Prints the frames of the stack ending at node, outermost first: the
+ * program, then each guessed function by the offset it starts at.
+ */
+static void print_stack(T prof, FILE *out, uint32_t node)
+{
+        Node *n = &prof->nodes[node];
+
+        if (n->function == NO_FUNCTION) {
+                fprintf(out, "program_%" PRIu32, n->program);
+                return;
+        }
+        print_stack(prof, out, n->parent);
+        fprintf(out, ";pc_%" PRIu32, n->function);
+}
+
+/* Returns how many bytes of the process's anonymous memory are on
+ * transparent huge pages, from the AnonHugePages line of
+ * /proc/self/smaps_rollup, or 0 if there is no such line.
+ */
+static uint64_t anon_huge_bytes()
+{
+        FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+        char line[128];
+        uint64_t kb = 0;
+
+        if (fp == NULL) {
+                return 0;
+        }
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                if (sscanf(line, "AnonHugePages: %" SCNu64, &kb) == 1) {
+                        break;
+                }
+        }
+        fclose(fp);
+        return kb * 1024;
+}
@@ -0,0 +1,90 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the execution profiler of the UM, built in with
+ * -DPROFILE. It counts instructions per opcode and per word of segment 0,
+ * load program targets, the sizes of mapped and unmapped segments and how
+ * loads and stores found their segments, and keeps a guess at the guest's
+ * call stack for flame graphs. It also reports how many segments were put
+ * on huge pages, and tells the hardware counters of --hwcounters which
+ * class of opcode is running.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+#include "pool.h"
+#include "hwcount.h"
+#define REG_SIZE uint32_t
+#define WORD_SIZE uint32_t
+#define T Profile_T
+typedef struct T *T;
+
+/* How a load or store found the words of its segment: through the
+ * interpreter's pointer to segment 0 (for loads), in its cache of the last
+ * segment used, or by looking the segment up.
+ */
+typedef enum Profile_lookup {
+        PROFILE_CODE = 0,
+        PROFILE_HIT,
+        PROFILE_MISS,
+        PROFILE_LOOKUPS
+} Profile_lookup;
+
+/* Creates an empty profile. */
+T Profile_new();
+
+/* Frees the profile. */
+void Profile_free(T *prof);
+
+/* Starts counting for a new program of length words in segment 0, either
+ * the first one or one a load program replaced segment 0 with, invalid of
+ * which have an invalid opcode (see Predecode_invalid).
+ */
+void Profile_load(T prof, WORD_SIZE length, WORD_SIZE invalid);
+
+/* Counts one execution of the instruction with the given opcode at pc. */
+void Profile_step(T prof, WORD_SIZE pc, unsigned opcode);
+
+/* Counts a load program at pc to target with the 8 registers r as they
+ * were when it ran. replaced says whether it replaced segment 0.
+ */
+void Profile_jump(T prof, WORD_SIZE pc, WORD_SIZE target, bool replaced,
+                  const REG_SIZE *r);
+
+/* Counts a map of a segment of size words. */
+void Profile_map(T prof, WORD_SIZE size);
+
+/* Counts an unmap of a segment of size words. */
+void Profile_unmap(T prof, WORD_SIZE size);
+
+/* Counts a load (or, if store, a store) that found its segment by how. */
+void Profile_access(T prof, bool store, Profile_lookup how);
+
+/* Records how segments were put on huge pages, from Segment_huge_stats,
+ * along with how much anonymous memory the kernel has on transparent huge
+ * pages right now. Call it while the segments are still mapped.
+ */
+void Profile_huge(T prof, Pool_huge huge);
+
+/* Has hw sample its counts by the class of the opcode running: arithmetic,
+ * load value, memory, segments, jumps, I/O and the rest.
+ */
+void Profile_hwcounters(T prof, Hwcount_T hw);
+
+/* Returns how many instructions have been counted. */
+uint64_t Profile_instructions(T prof);
+
+/* Prints the report to out. */
+void Profile_report(T prof, FILE *out);
+
+/* Prints one line per guessed call stack to out, with its frames separated
+ * by semicolons and the number of instructions run in it, the folded
+ * format flame graph tools read.
+ */
+void Profile_folded(T prof, FILE *out);
+
+#undef T
+#endif
@@ -0,0 +1,604 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the M:N scheduler of UM guests. Every worker owns a
+ * run queue, a ring of guests it takes from the front of and puts
+ * preempted guests back on the end of, so its own guests take turns.
+ * A worker whose queue is empty steals from the end of another's. The
+ * input of a guest is a channel in memory: its I/O device reads from it
+ * and reports IO_BLOCKED when it is empty but not closed, which makes
+ * UM_step return UM_BLOCKED. The worker then parks the guest unless input
+ * arrived in the meantime, and Sched_feed puts a parked guest back on the
+ * queue of the worker that last ran it.
+ *
+ * No two locks are ever held at once: queues, guests and the scheduler
+ * each have their own, and each is released before another is taken.
+ */
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "io.h"
+#include "um.h"
+#include "sched.h"
+#define INITIAL_QUEUE 64
+#define INITIAL_GUESTS 64
+#define T Sched_T
+
+/* Where a guest is: on a run queue, being stepped by a worker, parked
+ * waiting for input or stopped for good.
+ */
+typedef enum Guest_state {
+        RUNNABLE,
+        RUNNING,
+        PARKED,
+        DONE
+} Guest_state;
+
+/* A guest: its um, I/O device and output descriptor, the input fed to it
+ * and not yet read, whether its input is closed, where it is, how it
+ * stopped, how many instructions it has executed and the worker that last
+ * ran it. The lock covers everything from input on; only the worker
+ * stepping the guest touches um and io.
+ */
+typedef struct Guest {
+        UM_T um;
+        Io_T io;
+        int out_fd;
+        pthread_mutex_t lock;
+        unsigned char *input;
+        size_t in_pos;
+        size_t in_len;
+        size_t in_capacity;
+        bool closed;
+        Guest_state state;
+        UM_status status;
+        uint64_t executed;
+        unsigned home;
+} Guest;
+
+/* A run queue: a ring of capacity guests starting at head. */
+typedef struct Queue {
+        pthread_mutex_t lock;
+        Guest **ring;
+        size_t head;
+        size_t length;
+        size_t capacity;
+} Queue;
+
+/* A worker thread and the queue it owns. */
+typedef struct Worker {
+        T sched;
+        unsigned id;
+        pthread_t thread;
+        Queue queue;
+} Worker;
+
+/* Struct that holds the workers, the guests, the quantum, and under lock
+ * how many guests are on run queues (queued) and how many are queued or
+ * running (live), where the next new guest goes and whether the workers
+ * should stop. Idle workers wait on work, Sched_wait on idle.
+ */
+struct T {
+        Worker *workers;
+        unsigned num_workers;
+        uint64_t quantum;
+        pthread_mutex_t lock;
+        pthread_cond_t work;
+        pthread_cond_t idle;
+        Guest **guests;
+        unsigned num_guests;
+        unsigned guest_capacity;
+        int queued;
+        unsigned live;
+        unsigned next_worker;
+        bool stop;
+};
+
+/* Worker thread: steps guests until the scheduler stops. */
+static void *worker_main(void *arg);
+
+/* Returns the next guest for worker to run, waiting for one if there is
+ * none, or NULL once the scheduler stops.
+ */
+static Guest *next_guest(T sched, Worker *worker);
+
+/* Puts guest on the end of the queue of worker id and wakes an idle worker.
+ */
+static void enqueue(T sched, unsigned id, Guest *guest);
+
+/* Takes a guest from the front of the queue (or the end, to steal), or
+ * returns NULL if it is empty.
+ */
+static Guest *queue_take(Queue *queue, bool from_end);
+
+/* Parks guest after it blocked on input, unless input arrived meanwhile. */
+static void park(T sched, Worker *worker, Guest *guest);
+
+/* Marks guest as stopped for good with status. */
+static void finish(T sched, Guest *guest, UM_status status);
+
+/* Takes guest off the count of live guests, waking Sched_wait at 0. */
+static void retire(T sched);
+
+/* Returns the guest numbered id. */
+static Guest *lookup(T sched, unsigned id);
+
+/* Backend read of a guest's input channel. */
+static long channel_read(void *state, unsigned char *buf, size_t len);
+
+/* Backend write of a guest's output descriptor. */
+static long channel_write(void *state, const unsigned char *buf, size_t len);
+
+
+/* Creates a scheduler with workers threads stepping guests quantum
+ * instructions at a time. The workers start out idle.
+ */
+T Sched_new(unsigned workers, uint64_t quantum)
+{
+        T sched = malloc(sizeof(struct T));
+        assert(sched != NULL && workers > 0 && quantum > 0);
+
+        sched->num_workers = workers;
+        sched->quantum = quantum;
+        pthread_mutex_init(&sched->lock, NULL);
+        pthread_cond_init(&sched->work, NULL);
+        pthread_cond_init(&sched->idle, NULL);
+        sched->guests = malloc(INITIAL_GUESTS * sizeof(Guest *));
+        sched->num_guests = 0;
+        sched->guest_capacity = INITIAL_GUESTS;
+        sched->queued = 0;
+        sched->live = 0;
+        sched->next_worker = 0;
+        sched->stop = false;
+        sched->workers = calloc(workers, sizeof(Worker));
+        assert(sched->guests != NULL && sched->workers != NULL);
+
+        for (unsigned i = 0; i < workers; i++) {
+                Worker *worker = &sched->workers[i];
+                worker->sched = sched;
+                worker->id = i;
+                pthread_mutex_init(&worker->queue.lock, NULL);
+                worker->queue.ring = malloc(INITIAL_QUEUE * sizeof(Guest *));
+                worker->queue.head = 0;
+                worker->queue.length = 0;
+                worker->queue.capacity = INITIAL_QUEUE;
+                assert(worker->queue.ring != NULL);
+        }
+        for (unsigned i = 0; i < workers; i++) {
+                int err = pthread_create(&sched->workers[i].thread, NULL,
+                                         worker_main, &sched->workers[i]);
+                assert(err == 0);
+                (void) err;
+        }
+        return sched;
+}
+
+/* Stops the workers once they finish the quantum they are on, and frees the
+ * scheduler and every guest in it.
+ */
+void Sched_free(T *sched)
+{
+        T s = *sched;
+
+        pthread_mutex_lock(&s->lock);
+        s->stop = true;
+        pthread_cond_broadcast(&s->work);
+        pthread_mutex_unlock(&s->lock);
+
+        /* Workers still running may steal from any queue, so none is
+         * destroyed until every worker has been joined.
+         */
+        for (unsigned i = 0; i < s->num_workers; i++) {
+                pthread_join(s->workers[i].thread, NULL);
+        }
+        for (unsigned i = 0; i < s->num_workers; i++) {
+                pthread_mutex_destroy(&s->workers[i].queue.lock);
+                free(s->workers[i].queue.ring);
+        }
+        for (unsigned i = 0; i < s->num_guests; i++) {
+                Guest *guest = s->guests[i];
+                UM_free(&guest->um);
+                Io_free(&guest->io);
+                pthread_mutex_destroy(&guest->lock);
+                free(guest->input);
+                free(guest);
+        }
+
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->work);
+        pthread_cond_destroy(&s->idle);
+        free(s->guests);
+        free(s->workers);
+        free(s);
+        *sched = NULL;
+}
+
+/* Loads the program at path as a new guest and puts it on the queue of the
+ * next worker in turn.
+ */
+int Sched_add(T sched, const char *path, int out_fd, const char *profile)
+{
+        Guest *guest = calloc(1, sizeof(Guest));
+        assert(guest != NULL);
+
+        Io_backend backend = { channel_read, channel_write, NULL, guest };
+        guest->io = Io_new(backend);
+        guest->um = UM_new(guest->io);
+        UM_profile_to(guest->um, profile);
+        guest->out_fd = out_fd;
+        pthread_mutex_init(&guest->lock, NULL);
+        guest->state = RUNNABLE;
+        guest->status = UM_OK;
+
+        if (UM_load(guest->um, path) != UM_OK) {
+                UM_free(&guest->um);
+                Io_free(&guest->io);
+                pthread_mutex_destroy(&guest->lock);
+                free(guest);
+                return -1;
+        }
+
+        pthread_mutex_lock(&sched->lock);
+        if (sched->num_guests == sched->guest_capacity) {
+                sched->guest_capacity *= 2;
+                sched->guests = realloc(sched->guests, sched->guest_capacity *
+                                                       sizeof(Guest *));
+                assert(sched->guests != NULL);
+        }
+        int id = sched->num_guests++;
+        sched->guests[id] = guest;
+        guest->home = sched->next_worker;
+        sched->next_worker = (sched->next_worker + 1) % sched->num_workers;
+        sched->live++;
+        pthread_mutex_unlock(&sched->lock);
+
+        enqueue(sched, guest->home, guest);
+        return id;
+}
+
+/* Appends input to the channel of the guest, and puts the guest back on a
+ * run queue if it is parked.
+ */
+void Sched_feed(T sched, unsigned id, const unsigned char *input,
+                size_t length)
+{
+        Guest *guest = lookup(sched, id);
+        bool wake;
+
+        if (length == 0) {
+                return;
+        }
+        pthread_mutex_lock(&guest->lock);
+        if (guest->in_pos > 0) {
+                memmove(guest->input, guest->input + guest->in_pos,
+                        guest->in_len - guest->in_pos);
+                guest->in_len -= guest->in_pos;
+                guest->in_pos = 0;
+        }
+        if (guest->in_len + length > guest->in_capacity) {
+                size_t capacity = guest->in_capacity * 2 + length;
+                guest->input = realloc(guest->input, capacity);
+                assert(guest->input != NULL);
+                guest->in_capacity = capacity;
+        }
+        memcpy(guest->input + guest->in_len, input, length);
+        guest->in_len += length;
+        wake = (guest->state == PARKED);
+        if (wake) {
+                guest->state = RUNNABLE;
+        }
+        pthread_mutex_unlock(&guest->lock);
+
+        if (wake) {
+                pthread_mutex_lock(&sched->lock);
+                sched->live++;
+                pthread_mutex_unlock(&sched->lock);
+                enqueue(sched, guest->home, guest);
+        }
+}
+
+/* Closes the channel of the guest, and puts the guest back on a run queue
+ * if it is parked, so it can read the end of input.
+ */
+void Sched_close_input(T sched, unsigned id)
+{
+        Guest *guest = lookup(sched, id);
+        bool wake;
+
+        pthread_mutex_lock(&guest->lock);
+        guest->closed = true;
+        wake = (guest->state == PARKED);
+        if (wake) {
+                guest->state = RUNNABLE;
+        }
+        pthread_mutex_unlock(&guest->lock);
+
+        if (wake) {
+                pthread_mutex_lock(&sched->lock);
+                sched->live++;
+                pthread_mutex_unlock(&sched->lock);
+                enqueue(sched, guest->home, guest);
+        }
+}
+
+/* Waits until every guest is parked or stopped, and counts the parked ones.
+ */
+unsigned Sched_wait(T sched)
+{
+        unsigned parked = 0;
+
+        pthread_mutex_lock(&sched->lock);
+        while (sched->live > 0) {
+                pthread_cond_wait(&sched->idle, &sched->lock);
+        }
+        pthread_mutex_unlock(&sched->lock);
+
+        for (unsigned i = 0; i < sched->num_guests; i++) {
+                Guest *guest = lookup(sched, i);
+                pthread_mutex_lock(&guest->lock);
+                parked += (guest->state == PARKED);
+                pthread_mutex_unlock(&guest->lock);
+        }
+        return parked;
+}
+
+/* Returns how the guest stopped, or UM_OK if it has not. */
+UM_status Sched_status(T sched, unsigned id)
+{
+        Guest *guest = lookup(sched, id);
+        UM_status status;
+
+        pthread_mutex_lock(&guest->lock);
+        status = guest->status;
+        pthread_mutex_unlock(&guest->lock);
+        return status;
+}
+
+/* Returns the number of instructions the guest had executed at the end of
+ * its last quantum.
+ */
+uint64_t Sched_executed(T sched, unsigned id)
+{
+        Guest *guest = lookup(sched, id);
+        uint64_t executed;
+
+        pthread_mutex_lock(&guest->lock);
+        executed = guest->executed;
+        pthread_mutex_unlock(&guest->lock);
+        return executed;
+}
+
+/* Worker thread: steps the next guest for a quantum and decides where it
+ * goes next, until the scheduler stops.
+ */
+static void *worker_main(void *arg)
+{
+        Worker *worker = arg;
+        T sched = worker->sched;
+        Guest *guest;
+
+        while ((guest = next_guest(sched, worker)) != NULL) {
+                UM_status status;
+
+                status = UM_step(guest->um, sched->quantum);
+
+                pthread_mutex_lock(&guest->lock);
+                guest->executed = UM_executed(guest->um);
+                pthread_mutex_unlock(&guest->lock);
+
+                if (status == UM_EXHAUSTED) {
+                        enqueue(sched, worker->id, guest);
+                } else if (status == UM_BLOCKED) {
+                        park(sched, worker, guest);
+                } else {
+                        finish(sched, guest, status);
+                }
+        }
+        return NULL;
+}
+
+/* Returns the guest at the front of the worker's own queue, or one stolen
+ * from the end of another worker's, going round the others in order. If
+ * every queue is empty, waits until a guest is queued.
+ */
+static Guest *next_guest(T sched, Worker *worker)
+{
+        while (true) {
+                Guest *guest = queue_take(&worker->queue, false);
+
+                for (unsigned i = 1; guest == NULL &&
+                                     i < sched->num_workers; i++) {
+                        unsigned victim = (worker->id + i) %
+                                          sched->num_workers;
+                        guest = queue_take(&sched->workers[victim].queue,
+                                           true);
+                }
+
+                pthread_mutex_lock(&sched->lock);
+                if (guest != NULL) {
+                        sched->queued--;
+                        pthread_mutex_unlock(&sched->lock);
+                        pthread_mutex_lock(&guest->lock);
+                        guest->state = RUNNING;
+                        guest->home = worker->id;
+                        pthread_mutex_unlock(&guest->lock);
+                        return guest;
+                }
+                while (sched->queued <= 0 && !sched->stop) {
+                        pthread_cond_wait(&sched->work, &sched->lock);
+                }
+                if (sched->stop) {
+                        pthread_mutex_unlock(&sched->lock);
+                        return NULL;
+                }
+                pthread_mutex_unlock(&sched->lock);
+        }
+}
+
+/* Puts guest on the end of the queue of worker id, doubling the ring if it
+ * is full, and wakes an idle worker. The count goes up only once the guest
+ * is in the queue, so a worker woken for it always finds it; a thief can
+ * take it before then, leaving the count briefly below zero.
+ */
+static void enqueue(T sched, unsigned id, Guest *guest)
+{
+        Queue *queue = &sched->workers[id].queue;
+
+        pthread_mutex_lock(&guest->lock);
+        guest->state = RUNNABLE;
+        pthread_mutex_unlock(&guest->lock);
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->length == queue->capacity) {
+                Guest **ring = malloc(2 * queue->capacity * sizeof(Guest *));
+                assert(ring != NULL);
+                for (size_t i = 0; i < queue->length; i++) {
+                        ring[i] = queue->ring[(queue->head + i) %
+                                              queue->capacity];
+                }
+                free(queue->ring);
+                queue->ring = ring;
+                queue->head = 0;
+                queue->capacity *= 2;
+        }
+        queue->ring[(queue->head + queue->length) % queue->capacity] = guest;
+        queue->length++;
+        pthread_mutex_unlock(&queue->lock);
+
+        pthread_mutex_lock(&sched->lock);
+        sched->queued++;
+        pthread_cond_signal(&sched->work);
+        pthread_mutex_unlock(&sched->lock);
+}
+
+/* Takes a guest from the front of the queue, or from the end if from_end,
+ * or returns NULL if the queue is empty.
+ */
+static Guest *queue_take(Queue *queue, bool from_end)
+{
+        Guest *guest = NULL;
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->length > 0) {
+                if (from_end) {
+                        guest = queue->ring[(queue->head + queue->length - 1)
+                                            % queue->capacity];
+                } else {
+                        guest = queue->ring[queue->head];
+                        queue->head = (queue->head + 1) % queue->capacity;
+                }
+                queue->length--;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        return guest;
+}
+
+/* Parks guest after it blocked on input. If input was fed or the channel
+ * closed while the guest was being stepped, it goes straight back on the
+ * worker's queue instead, so no wakeup is lost.
+ */
+static void park(T sched, Worker *worker, Guest *guest)
+{
+        bool ready;
+
+        pthread_mutex_lock(&guest->lock);
+        ready = guest->in_pos < guest->in_len || guest->closed;
+        if (!ready) {
+                guest->state = PARKED;
+        }
+        pthread_mutex_unlock(&guest->lock);
+
+        if (ready) {
+                enqueue(sched, worker->id, guest);
+        } else {
+                retire(sched);
+        }
+}
+
+/* Marks guest as stopped for good with status and flushes its output. */
+static void finish(T sched, Guest *guest, UM_status status)
+{
+        Io_flush(guest->io);
+
+        pthread_mutex_lock(&guest->lock);
+        guest->state = DONE;
+        guest->status = status;
+        pthread_mutex_unlock(&guest->lock);
+        retire(sched);
+}
+
+/* Takes a guest off the count of live guests, waking Sched_wait at 0. */
+static void retire(T sched)
+{
+        pthread_mutex_lock(&sched->lock);
+        sched->live--;
+        if (sched->live == 0) {
+                pthread_cond_broadcast(&sched->idle);
+        }
+        pthread_mutex_unlock(&sched->lock);
+}
+
+/* Returns the guest numbered id. */
+static Guest *lookup(T sched, unsigned id)
+{
+        Guest *guest;
+
+        pthread_mutex_lock(&sched->lock);
+        assert(id < sched->num_guests);
+        guest = sched->guests[id];
+        pthread_mutex_unlock(&sched->lock);
+        return guest;
+}
+
+/* Copies up to len bytes of the guest's input to buf. Returns 0 once the
+ * input is closed and read, and IO_BLOCKED if it is empty but still open.
+ */
+static long channel_read(void *state, unsigned char *buf, size_t len)
+{
+        Guest *guest = state;
+        long got;
+
+        pthread_mutex_lock(&guest->lock);
+        if (guest->in_pos < guest->in_len) {
+                size_t n = guest->in_len - guest->in_pos;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(buf, guest->input + guest->in_pos, n);
+                guest->in_pos += n;
+                got = n;
+        } else {
+                got = guest->closed ? 0 : IO_BLOCKED;
+        }
+        pthread_mutex_unlock(&guest->lock);
+        return got;
+}
+
+/* Writes all len bytes to the guest's output descriptor, if it has one. */
+static long channel_write(void *state, const unsigned char *buf, size_t len)
+{
+        Guest *guest = state;
+        size_t done = 0;
+
+        if (guest->out_fd < 0) {
+                return len;
+        }
+        while (done < len) {
+                ssize_t wrote = write(guest->out_fd, buf + done, len - done);
+                if (wrote < 0 && errno != EINTR) {
+                        return -1;
+                }
+                if (wrote > 0) {
+                        done += wrote;
+                }
+        }
+        return done;
+}
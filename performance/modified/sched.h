@@ -0,0 +1,61 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the M:N scheduler of UM guests. Any number of guests share
+ * a fixed set of worker threads: each worker steps a guest for a quantum
+ * of instructions with UM_step and then moves on to the next one in its
+ * run queue, stealing from the other workers when its own queue is empty.
+ * A guest that executes input with none ready is parked off every queue
+ * until Sched_feed or Sched_close_input gives it something to read.
+ */
+#include <inttypes.h>
+#include <stddef.h>
+#include "um.h"
+#ifndef SCHED_H_INCLUDED
+#define SCHED_H_INCLUDED
+#define T Sched_T
+typedef struct T *T;
+
+/* Creates a scheduler with the given number of worker threads, which step
+ * each guest quantum instructions at a time.
+ */
+T Sched_new(unsigned workers, uint64_t quantum);
+
+/* Stops the workers and frees the scheduler and every guest in it, flushing
+ * their output. Guests still running are abandoned.
+ */
+void Sched_free(T *sched);
+
+/* Loads the um binary at path as a new guest writing its output to out_fd
+ * (-1 to throw it away) and makes it runnable. A profiling build writes
+ * its profile to profile.prof and profile.folded when the scheduler is
+ * freed, unless profile is NULL. Returns the number of the guest, counting
+ * from 0, or -1 if the program cannot be loaded.
+ */
+int Sched_add(T sched, const char *path, int out_fd, const char *profile);
+
+/* Appends the length bytes at input to what the guest has left to read,
+ * waking it if it is parked.
+ */
+void Sched_feed(T sched, unsigned guest, const unsigned char *input,
+                size_t length);
+
+/* Ends the input of the guest: once it has read everything fed to it, it
+ * reads the end of input instead of parking.
+ */
+void Sched_close_input(T sched, unsigned guest);
+
+/* Waits until no guest is runnable, and returns how many are parked
+ * waiting for input; the rest have stopped.
+ */
+unsigned Sched_wait(T sched);
+
+/* Returns how the guest stopped, or UM_OK if it has not. */
+UM_status Sched_status(T sched, unsigned guest);
+
+/* Returns the number of instructions the guest has executed. */
+uint64_t Sched_executed(T sched, unsigned guest);
+
+#undef T
+#endif
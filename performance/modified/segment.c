@@ -4,48 +4,132 @@
  * 
  * Implementation of segmented memory that allows a user to store and load 
  * words as well as map and unmap segments. 
+ *
+ * Segment_move shares the words of the source with the target instead of
+ * copying them. Ids that share words are linked in a ring through their
+ * table entries, so the length of the ring is the reference count of the
+ * words; storing into any of them copies first. Segment 0 always keeps the
+ * words it has when that happens, so pointers from Segment_ptr to segment
+ * 0 stay valid across stores.
+ *
+ * Built with -DWRITE_BARRIER, Segment_isolate can move segment 0 to a block
+ * mapped on its own, which is bigger than the segment if the segment is
+ * small; the table remembers that block so it is released at its size.
+ *
+ * A saved table is a Saved_table header, a Saved_entry for each mapped id,
+ * the free id stack from the bottom up, and then the words of every block
+ * at a BLOCK_ALIGN boundary, once per ring of ids sharing them. Offsets
+ * are from the start of the header, so a restored table points straight
+ * into wherever the saved one has been mapped.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
-#include <seq.h>
 #include <assert.h>
+#include <stdbool.h>
 #include <string.h>
 #include "segment.h"
+#include "pool.h"
 #define ID_SIZE uint32_t
 #define WORD_SIZE uint32_t
-#define MAP_INCREMENT 1000
+#define INITIAL_SEGMENTS 1024
+#define BLOCK_ALIGN 64
+#define NO_OFFSET UINT64_MAX
 #define T Segment_T
 
-/* Struct that holds the unused ids and the set of segments that the client
- * uses.
+/* A mapped segment: its words, how many there are, and the next id in the
+ * ring of ids sharing the words (the id itself if they are not shared).
+ * Unmapped ids have a NULL words pointer.
+ */
+typedef struct Entry {
+        WORD_SIZE *words;
+        WORD_SIZE length;
+        ID_SIZE alias;
+} Entry;
+
+/* Struct that holds the table of segments indexed by id, a stack of the
+ * ids that are not in use, the allocator the segments come from and, with
+ * the write barrier, the block Segment_isolate padded out (if any) and the
+ * words it was allocated with. The table and the stack always have room
+ * for capacity ids.
  */
 struct T {
-        Seq_T unmapped_ids;
-        WORD_SIZE **segments;
-        unsigned num_segments;
+        Entry *segments;
+        ID_SIZE *free_ids;
+        unsigned num_free;
+        unsigned capacity;
+        Pool_T pool;
+#ifdef WRITE_BARRIER
+        WORD_SIZE *padded;
+        WORD_SIZE padded_words;
+#endif
 };
 
+/* Header of a saved segment table. */
+typedef struct Saved_table {
+        uint32_t capacity;
+        uint32_t num_mapped;
+        uint32_t num_free;
+        uint32_t unused;
+} Saved_table;
+
+/* A mapped id in a saved segment table, with the offset of its words. */
+typedef struct Saved_entry {
+        uint32_t id;
+        uint32_t length;
+        uint32_t alias;
+        uint32_t unused;
+        uint64_t offset;
+} Saved_entry;
+
+/* Doubles the capacity of the segment table and pushes the new ids onto the
+ * free id stack, lowest on top.
+ */
+static void grow(T seg_memory);
+
+/* Rounds offset up to the next BLOCK_ALIGN boundary. */
+static uint64_t align_block(uint64_t offset);
+
+/* Writes n zero bytes to fp. Returns false on an error. */
+static bool pad(FILE *fp, uint64_t n);
+
+/* Takes id out of the ring of ids sharing its words. */
+static void unlink_alias(T seg_memory, ID_SIZE id);
+
+/* Gives id words of its own before it is stored into. If id is 0 the copy
+ * goes to the rest of the ring instead.
+ */
+static void unshare(T seg_memory, ID_SIZE id);
+
+/* Lets go of the words of id, releasing them if no other id shares them. */
+static void drop(T seg_memory, ID_SIZE id);
+
+/* Checks the rings of a table restored from entries. */
+static bool rings_valid(T seg_memory, const Saved_entry *entries,
+                        unsigned num_mapped);
+
+/* Orders saved entries by offset for qsort. */
+static int by_offset(const void *a, const void *b);
+
 
 /* Takes a file pointer to store the program at segment 0 and returns the newly
  * created segmented memory.
  */
 T Segment_new()
 {
-        WORD_SIZE i;
         T seg_mem = malloc(sizeof(struct Segment_T));
         assert(seg_mem != NULL);
-        Seq_T ids = Seq_new(MAP_INCREMENT);
-        WORD_SIZE **segments = calloc(sizeof(WORD_SIZE*), MAP_INCREMENT);
 
-
-        for (i = 0; i < MAP_INCREMENT; i++) {
-                Seq_addhi(ids, (void *)(uintptr_t)i);
-        }
-
-        seg_mem->unmapped_ids = ids;
-        seg_mem->segments = segments;
-        seg_mem->num_segments = MAP_INCREMENT;
+        seg_mem->segments = NULL;
+        seg_mem->free_ids = NULL;
+        seg_mem->num_free = 0;
+        seg_mem->capacity = 0;
+        seg_mem->pool = Pool_new();
+#ifdef WRITE_BARRIER
+        seg_mem->padded = NULL;
+        seg_mem->padded_words = 0;
+#endif
+        grow(seg_mem);
 
         return seg_mem;
 }
@@ -54,59 +138,36 @@ T Segment_new()
  * where the program is stored.
  */
 void Segment_free(T * seg_memory) {
-        int len = (*seg_memory)->num_segments;
-        int i;
+        unsigned len = (*seg_memory)->capacity;
+        unsigned i;
 
         for (i = 0; i < len; i++) {
-                if ( (((*seg_memory)->segments)[i]) != NULL ) {
-                        free( (((*seg_memory)->segments)[i]) );
+                if (((*seg_memory)->segments)[i].words != NULL) {
+                        drop(*seg_memory, i);
                 }
         }
 
+        Pool_free(&((*seg_memory)->pool));
         free((*seg_memory)->segments); 
-        Seq_free(&((*seg_memory)->unmapped_ids));
+        free((*seg_memory)->free_ids);
         free (*seg_memory);
 }
 
 /* Creates a segment of desired size, intializes all words to 0 and returns the
- * identifier.
+ * identifier. The most recently unmapped id is reused first.
  */
 ID_SIZE Segment_map(T seg_memory, unsigned size)
 {
-        /*Invariant at work here in the 'if' case */
-        WORD_SIZE *seg = calloc(sizeof(WORD_SIZE), (size + 1));
-
-        assert(seg != NULL);
-        seg[0] = size;
-        ID_SIZE id, i;
-        WORD_SIZE **segments = seg_memory->segments;
-        Seq_T unmapped = seg_memory->unmapped_ids;
-        ID_SIZE unmapped_length = Seq_length(unmapped);
-        ID_SIZE segs_length = seg_memory->num_segments;
-
-        /* If there aren't any more unmapped id's, we replenish the unmapped id
-         * sequence with MAP_INCREMENT amount.
-         */
-        if (unmapped_length == 0) {
-                for (i = segs_length; i < segs_length + MAP_INCREMENT; i++) {
-                        Seq_addhi(unmapped, (void *)(uintptr_t)i);
-
-                }
-
-                WORD_SIZE **temp = calloc (sizeof(WORD_SIZE*), 
-                                                (segs_length + MAP_INCREMENT));
-                memcpy(temp, segments, sizeof(WORD_SIZE*) * (segs_length));
-                free (segments);
-
-                assert (segments != NULL);
-                seg_memory->segments = temp;
-                segs_length = segs_length + MAP_INCREMENT;
-                seg_memory->num_segments = segs_length;
+        if (seg_memory->num_free == 0) {
+                grow(seg_memory);
         }
-        id = (ID_SIZE)(uintptr_t)Seq_remlo(unmapped);
 
-        (seg_memory->segments)[id] = seg;
+        ID_SIZE id = seg_memory->free_ids[--seg_memory->num_free];
+        Entry *seg = &(seg_memory->segments)[id];
 
+        seg->words = Pool_alloc(seg_memory->pool, size);
+        seg->length = size;
+        seg->alias = id;
 
         return id;
 }
@@ -116,42 +177,450 @@ ID_SIZE Segment_map(T seg_memory, unsigned size)
  */
 void Segment_unmap(T seg_memory, ID_SIZE id)
 {
-
-        Seq_addlo(seg_memory->unmapped_ids, (void *)(uintptr_t)id);
-        free((seg_memory->segments)[id]);
-        (seg_memory->segments)[id] = NULL;
+        drop(seg_memory, id);
+        seg_memory->free_ids[seg_memory->num_free++] = id;
 }
 
 /* Returns the word at the offset in the desired segment of memory*/
 WORD_SIZE Segment_load(T seg_memory, ID_SIZE id, WORD_SIZE offset)
 {
-        WORD_SIZE *seg;
-        seg = (seg_memory->segments)[id];
-        return seg[offset + 1];
+        return (seg_memory->segments)[id].words[offset];
 }
 
-/* Stores the word at the specified offest in the desired segment of memory. */
+/* Stores the word at the specified offest in the desired segment of memory,
+ * copying the segment first if its words are shared.
+ */
 void Segment_store(T seg_memory, ID_SIZE id, WORD_SIZE offset, WORD_SIZE word)
 {
-        WORD_SIZE *seg = (seg_memory->segments)[id];
-        seg[offset + 1] = word;
+        Entry *seg = &(seg_memory->segments)[id];
+
+        if (seg->alias != id) {
+                unshare(seg_memory, id);
+        }
+        seg->words[offset] = word;
 }
 
-/* Moves the segment identified by source to the target segment. The source
- * segment is duplicated and replaces the segment at the target ID.  
+/* Moves the segment identified by source to the target segment. The target
+ * shares the words of the source until either of them is stored into.
  */
 void Segment_move(T seg_memory, ID_SIZE source, ID_SIZE target)
 {
-        WORD_SIZE *src = (seg_memory->segments)[source];
-        WORD_SIZE size = src[0];
         Segment_unmap(seg_memory, target);
-        assert (Segment_map(seg_memory, size) == target);
-        WORD_SIZE *tar = (seg_memory->segments)[target];
-        memcpy(tar, src, ((size + 1) * sizeof(WORD_SIZE)));
+        assert(seg_memory->free_ids[seg_memory->num_free - 1] == target);
+        seg_memory->num_free--;
+
+        Entry *src = &(seg_memory->segments)[source];
+        Entry *tar = &(seg_memory->segments)[target];
+        tar->words = src->words;
+        tar->length = src->length;
+        tar->alias = src->alias;
+        src->alias = target;
 }
 
 /* Returns a pointer to a desired segment located at source.*/
 WORD_SIZE *Segment_ptr(T seg_memory, ID_SIZE source)
 {
-        return (seg_memory->segments)[source] + 1;   
-}
\ No newline at end of file
+        return (seg_memory->segments)[source].words;
+}
+
+/* Returns a pointer to the words of id for storing into, copying them first
+ * if they are shared. Nothing but a move can share them again.
+ */
+WORD_SIZE *Segment_writable(T seg_memory, ID_SIZE id)
+{
+        Entry *seg = &(seg_memory->segments)[id];
+
+        if (seg->alias != id) {
+                unshare(seg_memory, id);
+        }
+        return seg->words;
+}
+
+/* Returns whether id is in a ring of ids sharing its words. */
+bool Segment_shared(T seg_memory, ID_SIZE id)
+{
+        return (seg_memory->segments)[id].alias != id;
+}
+
+/* Returns the number of words in the segment identified by id. */
+WORD_SIZE Segment_length(T seg_memory, ID_SIZE id)
+{
+        return (seg_memory->segments)[id].length;
+}
+
+/* Writes the segment table and the words of every mapped segment to fp in
+ * the saved table layout, starting at the current position. Blocks shared
+ * by a ring of ids are written once, for the lowest id in the ring.
+ */
+bool Segment_save(T seg_memory, FILE *fp)
+{
+        Entry *segments = seg_memory->segments;
+        unsigned capacity = seg_memory->capacity;
+        uint64_t *offsets = malloc(capacity * sizeof(uint64_t));
+        Saved_table table = { capacity, 0, seg_memory->num_free, 0 };
+        uint64_t next;
+        bool ok = true;
+        ID_SIZE id, i;
+
+        assert(offsets != NULL);
+        for (id = 0; id < capacity; id++) {
+                offsets[id] = NO_OFFSET;
+                table.num_mapped += (segments[id].words != NULL);
+        }
+
+        next = align_block(sizeof(table) + 
+                           table.num_mapped * sizeof(Saved_entry) +
+                           table.num_free * sizeof(ID_SIZE));
+        for (id = 0; id < capacity; id++) {
+                if (segments[id].words == NULL || offsets[id] != NO_OFFSET) {
+                        continue;
+                }
+                i = id;
+                do {
+                        offsets[i] = next;
+                        i = segments[i].alias;
+                } while (i != id);
+                /* even an empty segment gets a word, so its words lie
+                 * inside the file
+                 */
+                next = align_block(next + sizeof(WORD_SIZE) * 
+                                   (segments[id].length ? 
+                                    (uint64_t)segments[id].length : 1));
+        }
+        uint64_t total = next;
+
+        ok = fwrite(&table, sizeof(table), 1, fp) == 1;
+        for (id = 0; ok && id < capacity; id++) {
+                if (segments[id].words != NULL) {
+                        Saved_entry entry = { id, segments[id].length, 
+                                              segments[id].alias, 0, 
+                                              offsets[id] };
+                        ok = fwrite(&entry, sizeof(entry), 1, fp) == 1;
+                }
+        }
+        if (ok && table.num_free > 0) {
+                ok = fwrite(seg_memory->free_ids, sizeof(ID_SIZE), 
+                            table.num_free, fp) == table.num_free;
+        }
+
+        next = sizeof(table) + table.num_mapped * sizeof(Saved_entry) +
+               table.num_free * sizeof(ID_SIZE);
+        for (id = 0; ok && id < capacity; id++) {
+                Entry *seg = &segments[id];
+                if (seg->words == NULL || offsets[id] < next) {
+                        continue;
+                }
+                ok = pad(fp, offsets[id] - next) &&
+                     fwrite(seg->words, sizeof(WORD_SIZE), seg->length, 
+                            fp) == seg->length;
+                next = offsets[id] + (uint64_t)seg->length * 
+                                     sizeof(WORD_SIZE);
+        }
+        ok = ok && pad(fp, total - next);
+
+        free(offsets);
+        return ok;
+}
+
+/* Replaces the empty table of seg_memory with the saved table in the bytes
+ * at saved, pointing each segment at its words there. Every id, alias and
+ * offset is checked against the table and the bytes before any of it is
+ * used, every alias chain must be a ring back to its id, and the words of
+ * different rings must not overlap.
+ */
+bool Segment_restore(T seg_memory, void *saved, size_t bytes)
+{
+        Saved_table table;
+        const Saved_entry *entries;
+        const ID_SIZE *free_ids;
+        char *base = saved;
+        unsigned i;
+
+        assert(seg_memory->num_free == seg_memory->capacity);
+        if (bytes < sizeof(table)) {
+                return false;
+        }
+        memcpy(&table, base, sizeof(table));
+        if (table.capacity == 0 || table.num_mapped == 0 ||
+            (uint64_t)table.num_mapped + table.num_free != table.capacity ||
+            sizeof(table) + (uint64_t)table.num_mapped * sizeof(Saved_entry) +
+            (uint64_t)table.num_free * sizeof(ID_SIZE) > bytes) {
+                return false;
+        }
+        entries = (const Saved_entry *)(base + sizeof(table));
+        free_ids = (const ID_SIZE *)(entries + table.num_mapped);
+
+        for (i = 0; i < table.num_mapped; i++) {
+                const Saved_entry *e = &entries[i];
+                if (e->id >= table.capacity || e->alias >= table.capacity ||
+                    e->offset >= bytes ||
+                    (uint64_t)e->length * sizeof(WORD_SIZE) >
+                    bytes - e->offset || e->offset % sizeof(WORD_SIZE) != 0) {
+                        return false;
+                }
+        }
+        for (i = 0; i < table.num_free; i++) {
+                if (free_ids[i] >= table.capacity) {
+                        return false;
+                }
+        }
+
+        while (seg_memory->capacity < table.capacity) {
+                grow(seg_memory);
+        }
+        for (i = 0; i < table.num_mapped; i++) {
+                Entry *seg = &seg_memory->segments[entries[i].id];
+                if (seg->words != NULL) {
+                        break;
+                }
+                seg->words = (WORD_SIZE *)(base + entries[i].offset);
+                seg->length = entries[i].length;
+                seg->alias = entries[i].alias;
+        }
+        bool ok = (i == table.num_mapped) &&
+                  seg_memory->segments[0].words != NULL;
+        for (i = 0; ok && i < table.num_mapped; i++) {
+                Entry *seg = &seg_memory->segments[entries[i].id];
+                Entry *next = &seg_memory->segments[seg->alias];
+                ok = next->words == seg->words && next->length == seg->length;
+        }
+        ok = ok && rings_valid(seg_memory, entries, table.num_mapped);
+        for (i = 0; ok && i < table.num_free; i++) {
+                ok = seg_memory->segments[free_ids[i]].words == NULL;
+        }
+        if (!ok) {
+                for (i = 0; i < seg_memory->capacity; i++) {
+                        seg_memory->segments[i].words = NULL;
+                        seg_memory->segments[i].alias = i;
+                }
+                return false;
+        }
+
+        /* ids past the saved capacity stay free, below the saved stack */
+        unsigned extra = seg_memory->capacity - table.capacity;
+        for (i = 0; i < extra; i++) {
+                seg_memory->free_ids[i] = seg_memory->capacity - 1 - i;
+        }
+        memcpy(seg_memory->free_ids + extra, free_ids,
+               table.num_free * sizeof(ID_SIZE));
+        seg_memory->num_free = extra + table.num_free;
+        Pool_adopt(seg_memory->pool, saved, bytes);
+        return true;
+}
+
+/* Puts segments of at least threshold bytes on huge pages, which the
+ * allocator does for blocks that large.
+ */
+void Segment_huge_pages(T seg_memory, size_t threshold, bool hugetlb)
+{
+        Pool_huge_pages(seg_memory->pool, threshold, hugetlb);
+}
+
+/* Returns how the allocator puts segments on huge pages and how many it
+ * has.
+ */
+Pool_huge Segment_huge_stats(T seg_memory)
+{
+        return Pool_huge_stats(seg_memory->pool);
+}
+
+#ifdef WRITE_BARRIER
+/* Gives segment 0 a block of its own from the pool, padded out to the
+ * size the pool maps on its own pages if it is smaller, unless its words
+ * already are one. A block mapped on its own stays shared: the ids sharing
+ * it copy before they store, and segment 0 keeps it, so only stores into
+ * segment 0 ever reach its pages. Any ids sharing a copied block keep it.
+ */
+WORD_SIZE *Segment_isolate(T seg_memory)
+{
+        Entry *code = &(seg_memory->segments)[0];
+        WORD_SIZE length = code->length;
+        WORD_SIZE size = Pool_exclusive_words(length);
+        WORD_SIZE *copy;
+
+        if (Pool_exclusive(seg_memory->pool, code->words, length)) {
+                return code->words;
+        }
+        copy = Pool_alloc(seg_memory->pool, size);
+        memcpy(copy, code->words, length * sizeof(WORD_SIZE));
+        drop(seg_memory, 0);
+        code->words = copy;
+        code->length = length;
+        code->alias = 0;
+        if (size != length) {
+                seg_memory->padded = copy;
+                seg_memory->padded_words = size;
+        }
+        return copy;
+}
+#endif
+
+/* Prints the statistics of the allocator the segments come from. */
+void Segment_report(T seg_memory, FILE *out)
+{
+        Pool_report(seg_memory->pool, out);
+}
+
+/* Doubles the capacity of the segment table and pushes the new ids onto the
+ * free id stack so that the lowest of them is handed out first.
+ */
+static void grow(T seg_memory)
+{
+        unsigned old = seg_memory->capacity;
+        unsigned capacity = (old == 0) ? INITIAL_SEGMENTS : old * 2;
+        unsigned i;
+
+        assert(capacity > old);
+        seg_memory->segments = realloc(seg_memory->segments, 
+                                       capacity * sizeof(Entry));
+        seg_memory->free_ids = realloc(seg_memory->free_ids, 
+                                       capacity * sizeof(ID_SIZE));
+        assert(seg_memory->segments != NULL && seg_memory->free_ids != NULL);
+
+        for (i = old; i < capacity; i++) {
+                seg_memory->segments[i].words = NULL;
+                seg_memory->segments[i].length = 0;
+                seg_memory->segments[i].alias = i;
+        }
+        for (i = capacity; i > old; i--) {
+                seg_memory->free_ids[seg_memory->num_free++] = i - 1;
+        }
+        seg_memory->capacity = capacity;
+}
+
+/* Rounds offset up to the next BLOCK_ALIGN boundary. */
+static uint64_t align_block(uint64_t offset)
+{
+        return (offset + BLOCK_ALIGN - 1) & ~(uint64_t)(BLOCK_ALIGN - 1);
+}
+
+/* Writes n zero bytes to fp. Returns false on an error. */
+static bool pad(FILE *fp, uint64_t n)
+{
+        static const char zeros[BLOCK_ALIGN];
+
+        while (n > 0) {
+                size_t chunk = n < BLOCK_ALIGN ? n : BLOCK_ALIGN;
+                if (fwrite(zeros, 1, chunk, fp) != chunk) {
+                        return false;
+                }
+                n -= chunk;
+        }
+        return true;
+}
+
+/* Returns whether following the aliases from each id of the num_mapped
+ * entries comes back to it within num_mapped steps, without running into
+ * another ring, and whether the blocks of different rings are disjoint.
+ * The ids of a ring share words, which the caller has checked, so each
+ * ring is walked once and its block recorded once.
+ */
+static bool rings_valid(T seg_memory, const Saved_entry *entries,
+                        unsigned num_mapped)
+{
+        Entry *segments = seg_memory->segments;
+        bool *seen = calloc(seg_memory->capacity, sizeof(bool));
+        Saved_entry *blocks = malloc(num_mapped * sizeof(Saved_entry));
+        unsigned num_blocks = 0;
+        uint64_t end = 0;
+        bool ok = true;
+        unsigned i, steps;
+        ID_SIZE id;
+
+        assert(seen != NULL && blocks != NULL);
+        for (i = 0; ok && i < num_mapped; i++) {
+                if (seen[entries[i].id]) {
+                        continue;
+                }
+                id = entries[i].id;
+                steps = 0;
+                do {
+                        ok = !seen[id] && steps++ < num_mapped;
+                        seen[id] = true;
+                        id = segments[id].alias;
+                } while (ok && id != entries[i].id);
+                blocks[num_blocks++] = entries[i];
+        }
+
+        qsort(blocks, num_blocks, sizeof(Saved_entry), by_offset);
+        for (i = 0; ok && i < num_blocks; i++) {
+                if (blocks[i].length == 0) {
+                        continue;
+                }
+                ok = blocks[i].offset >= end;
+                end = blocks[i].offset +
+                      (uint64_t)blocks[i].length * sizeof(WORD_SIZE);
+        }
+
+        free(seen);
+        free(blocks);
+        return ok;
+}
+
+/* Orders saved entries by the offset of their words. */
+static int by_offset(const void *a, const void *b)
+{
+        uint64_t x = ((const Saved_entry *)a)->offset;
+        uint64_t y = ((const Saved_entry *)b)->offset;
+
+        return (x > y) - (x < y);
+}
+
+/* Takes id out of the ring of ids sharing its words. */
+static void unlink_alias(T seg_memory, ID_SIZE id)
+{
+        Entry *segments = seg_memory->segments;
+        ID_SIZE prev = id;
+
+        while (segments[prev].alias != id) {
+                prev = segments[prev].alias;
+        }
+        segments[prev].alias = segments[id].alias;
+        segments[id].alias = id;
+}
+
+/* Gives id words of its own before it is stored into. Segment 0 keeps the
+ * words it has and the rest of its ring moves to the copy.
+ */
+static void unshare(T seg_memory, ID_SIZE id)
+{
+        Entry *segments = seg_memory->segments;
+        WORD_SIZE length = segments[id].length;
+        WORD_SIZE *copy = Pool_alloc(seg_memory->pool, length);
+        ID_SIZE i;
+
+        memcpy(copy, segments[id].words, length * sizeof(WORD_SIZE));
+        if (id != 0) {
+                unlink_alias(seg_memory, id);
+                segments[id].words = copy;
+                return;
+        }
+
+        ID_SIZE rest = segments[0].alias;
+        unlink_alias(seg_memory, 0);
+        i = rest;
+        do {
+                segments[i].words = copy;
+                i = segments[i].alias;
+        } while (i != rest);
+}
+
+/* Lets go of the words of id, releasing them if no other id shares them. */
+static void drop(T seg_memory, ID_SIZE id)
+{
+        Entry *seg = &(seg_memory->segments)[id];
+
+        if (seg->alias != id) {
+                unlink_alias(seg_memory, id);
+        } else {
+                WORD_SIZE words = seg->length;
+#ifdef WRITE_BARRIER
+                if (seg->words == seg_memory->padded) {
+                        words = seg_memory->padded_words;
+                        seg_memory->padded = NULL;
+                }
+#endif
+                Pool_release(seg_memory->pool, seg->words, words);
+        }
+        seg->words = NULL;
+}
@@ -4,11 +4,23 @@
  *
  * Interface for segmented memory of a universal machine. Allows the user to
  * map and unmap segments, as well as store or load words within segments.
+ *
+ * segment.c implements it with a table of ids and copy-on-write sharing;
+ * segment_arena.c, linked instead when built with -DARENA_SEGMENTS, keeps
+ * every segment in one reserved arena and uses offsets into it as ids, so
+ * that the words of segment id are at Segment_ptr(memory, 0) + id. Built
+ * with -DGUARD_SEGMENTS as well, every segment ends at an inaccessible
+ * guard page and unmapped segments are made inaccessible, and
+ * Segment_explain says what a faulting address was. The table built with
+ * -DWRITE_BARRIER can give segment 0 pages of its own to be protected.
  */
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #ifndef SEGMENT_H_INCLUDED
 #define SEGMENT_H_INCLUDED
+#include "pool.h"
 #define ID_SIZE uint32_t
 #define WORD_SIZE uint32_t
 #define T Segment_T
@@ -41,12 +53,90 @@ WORD_SIZE Segment_load (T seg_memory, ID_SIZE id, WORD_SIZE offset);
 void Segment_store (T seg_memory, ID_SIZE id, WORD_SIZE offset, WORD_SIZE word);
 
 /* Moves the segment identified by source to the target segment. The source 
- * segment is duplicated and replaces the segment at the target ID.
+ * segment is duplicated and replaces the segment at the target ID; the
+ * copy is only made once either of them is stored into. The arena copies
+ * at once, and only into segment 0.
  */
 void Segment_move(T seg_memory, ID_SIZE source, ID_SIZE target);
 
-/* Returns a pointer to a desired segment located at source. */
+/* Returns a pointer to a desired segment located at source. The words may
+ * be shared with other segments, so change them only with Segment_store.
+ * The pointer to segment 0 stays valid until segment 0 is unmapped or
+ * replaced. Any other stays valid until source is unmapped, the next
+ * Segment_move or Segment_writable, or a Segment_store into source or
+ * segment 0.
+ */
 WORD_SIZE *Segment_ptr(T seg_memory, ID_SIZE source);
 
+/* Returns a pointer to the words of the segment identified by id for
+ * storing into directly, after copying them if they are shared. The
+ * pointer stays valid until id is unmapped or the next Segment_move.
+ */
+WORD_SIZE *Segment_writable(T seg_memory, ID_SIZE id);
+
+/* Returns whether the segment identified by id shares its words with
+ * another segment, so they outlive it. The arena shares nothing.
+ */
+bool Segment_shared(T seg_memory, ID_SIZE id);
+
+/* Returns the number of words in the segment identified by id. */
+WORD_SIZE Segment_length(T seg_memory, ID_SIZE id);
+
+/* Puts segments of at least threshold bytes (none if 0) mapped from now on
+ * on huge pages, from the hugetlbfs pool first if hugetlb is set. Must be
+ * called before any segment that large is mapped. The arena has no
+ * hugetlbfs pages and only uses transparent ones.
+ */
+void Segment_huge_pages(T seg_memory, size_t threshold, bool hugetlb);
+
+/* Returns how segments are put on huge pages and how many have been. */
+Pool_huge Segment_huge_stats(T seg_memory);
+
+/* Prints the hit and miss statistics of the allocator behind the segments
+ * to out.
+ */
+void Segment_report(T seg_memory, FILE *out);
+
+/* Writes the segment table, including which ids are free and which share
+ * words, and the words of every mapped segment to fp at its current
+ * position, which should be a multiple of 64 bytes into the file. Returns
+ * false if writing fails.
+ */
+bool Segment_save(T seg_memory, FILE *fp);
+
+/* Makes the segmented memory, which must have nothing mapped, what was
+ * written by Segment_save to the bytes at saved (mapped from the file at
+ * the same position). Segments use their words in place, so saved must be
+ * writable, 4-byte aligned and outlive seg_memory. Returns false, mapping
+ * nothing, if the bytes are not a saved table.
+ */
+bool Segment_restore(T seg_memory, void *saved, size_t bytes);
+
+#ifdef GUARD_SEGMENTS
+/* What an address the um faulted at is in a guarded arena. */
+typedef enum Segment_fault {
+        SEGMENT_OUTSIDE,        /* not in the arena at all */
+        SEGMENT_PAST_END,       /* past the end of a mapped segment */
+        SEGMENT_UNMAPPED,       /* in a segment since unmapped */
+        SEGMENT_NOWHERE         /* in the arena but in no segment */
+} Segment_fault;
+
+/* Says what addr is in the arena and, unless it is outside or nowhere,
+ * sets id and offset to the segment and the offset in it that it is.
+ * Async-signal-safe.
+ */
+Segment_fault Segment_explain(T seg_memory, const void *addr, ID_SIZE *id,
+                              WORD_SIZE *offset);
+#endif
+
+#ifdef WRITE_BARRIER
+/* Gives segment 0 words on pages of their own, starting at a page
+ * boundary, copying them there if they are not, and returns them. Other
+ * segments may still share the words, since they copy them before any
+ * store. They stay put until segment 0 is replaced.
+ */
+WORD_SIZE *Segment_isolate(T seg_memory);
+#endif
+
 #undef T
 #endif
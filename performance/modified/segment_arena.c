@@ -0,0 +1,855 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Arena implementation of segmented memory, linked in place of segment.c
+ * when the um is built with -DARENA_SEGMENTS.
+ *
+ * Every segment lives in one region of ARENA_WORDS words reserved up front
+ * with PROT_NONE and MAP_NORESERVE, and a segment's id is the offset in
+ * words of its first word from the start of the arena. Loading or storing
+ * is then an add and a memory access, with no table in between: the words
+ * of segment id are at Segment_ptr(memory, 0) + id.
+ *
+ * Segment 0 has the first CODE_WORDS words of the arena to itself, so its
+ * id is 0 and its words never move; a load program copies the new program
+ * over it rather than sharing words. Every other segment is a block of a
+ * power of two words, HEADER_WORDS of them holding its size class and
+ * length just before its words. Blocks are carved from the end of the used
+ * part of the arena, which is made readable and writable COMMIT_WORDS at a
+ * time, and unmapped blocks go on a free list per size class, threaded
+ * through their headers. The pages of a freed block past its first are
+ * handed back to the kernel with MADV_DONTNEED, so they read as zero when
+ * the block is used again and only its first page has to be cleared; a
+ * free block's header holds how many words kept their pages instead of
+ * its size class.
+ * Blocks of at least the huge page threshold start on a HUGE_WORDS
+ * boundary and are advised to be backed by transparent huge pages, and
+ * keep their first huge page rather than their first page when freed, so
+ * that giving the rest back splits no huge page.
+ *
+ * A saved arena is a Saved_arena header, the words of segment 0 padded to
+ * a BLOCK_ALIGN boundary, and the used part of the arena after segment 0's
+ * region, free blocks included, so ids come back unchanged. It is copied
+ * into the arena on restore rather than used in place.
+ *
+ * Built with -DGUARD_SEGMENTS as well, blocks are whole pages instead, a
+ * power of two of them counting a guard page at the end, and a segment's
+ * words end right where its guard page starts, so running off the end of
+ * it faults. Unmapped blocks are made inaccessible and given back, and
+ * spend QUARANTINE unmaps in a queue before they can be reused, so a
+ * segment used after it is unmapped faults too. Pages are guarded with
+ * MADV_GUARD_INSTALL markers where the kernel has them (Linux 6.13 on),
+ * which leave the arena one mapping, and with mprotect otherwise, which
+ * splits it into a mapping per run of pages and so runs into
+ * vm.max_map_count with a few tens of thousands of segments. Twice
+ * ARENA_WORDS is reserved, so that any id plus any offset lands in the
+ * reservation. Per-page tables say which segment each page belongs to and
+ * what it is, for Segment_explain. Segment 0's region is made writable a
+ * page at a time and shrinks again when a shorter program is loaded. A
+ * guarded arena cannot be saved or restored.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "segment.h"
+#define ID_SIZE uint32_t
+#define WORD_SIZE uint32_t
+#define ARENA_WORDS ((uint64_t)1 << 32)
+#define CODE_WORDS ((uint64_t)1 << 28)
+#define COMMIT_WORDS ((uint64_t)1 << 18)
+#define HEADER_WORDS 2
+#define MIN_SHIFT 2
+#define NUM_CLASSES 32
+#define NO_BLOCK 0
+#define BLOCK_ALIGN 64
+#define SAVED_MAGIC "UMARENB"
+#define SAVED_HEADER 192
+#define HUGE_WORDS ((uint64_t)1 << 19)
+#define HUGE_THRESHOLD (HUGE_WORDS * sizeof(WORD_SIZE))
+#define QUARANTINE 4096
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#define MADV_GUARD_REMOVE 103
+#endif
+#ifdef GUARD_SEGMENTS
+#define REGION_WORDS (2 * ARENA_WORDS)
+#else
+#define REGION_WORDS ARENA_WORDS
+#endif
+#define T Segment_T
+
+#ifdef GUARD_SEGMENTS
+/* What a page of the guarded arena past segment 0's region holds. */
+typedef enum Page {
+        PAGE_UNUSED = 0,
+        PAGE_WORDS,
+        PAGE_GUARD,
+        PAGE_UNMAPPED
+} Page;
+
+/* A growable stack of the blocks of one size class ready to be reused. */
+typedef struct Stack {
+        uint32_t *blocks;
+        unsigned size;
+        unsigned capacity;
+} Stack;
+#endif
+
+/* Struct that holds the arena, the length of segment 0 and whether it is
+ * mapped, how much of the arena is used and how much of it (and of segment
+ * 0's region) is writable, the free list of each size class, the page size
+ * in words, the statistics and which blocks get huge pages.
+ */
+struct T {
+        WORD_SIZE *arena;
+        WORD_SIZE code_length;
+        bool code_mapped;
+        uint64_t code_committed;
+        uint64_t end;
+        uint64_t committed;
+        uint32_t free_list[NUM_CLASSES];
+        uint64_t page_words;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t released;
+        Pool_huge huge;
+#ifdef GUARD_SEGMENTS
+        uint32_t *owners;
+        uint8_t *pages;
+        Stack reusable[NUM_CLASSES];
+        uint64_t quarantine[QUARANTINE];
+        unsigned quarantine_next;
+        unsigned quarantined;
+        bool markers;
+#endif
+};
+
+/* Header of a saved arena, padded to SAVED_HEADER bytes. */
+typedef struct Saved_arena {
+        char magic[8];
+        uint32_t code_length;
+        uint32_t unused;
+        uint64_t end;
+        uint32_t free_list[NUM_CLASSES];
+        char padding[SAVED_HEADER - 24 - 4 * NUM_CLASSES];
+} Saved_arena;
+
+/* Returns the size class of a block of words words: the power of two it
+ * rounds up to.
+ */
+static inline unsigned size_class(uint64_t words);
+
+/* Returns whether blocks of size class cls are large enough to give pages
+ * back to the kernel when they are freed.
+ */
+static inline bool releases(T seg_memory, unsigned cls);
+
+/* Returns whether blocks of size class cls are put on huge pages. */
+static inline bool is_huge(T seg_memory, unsigned cls);
+
+/* Returns how many words at the start of a freed block of size class cls
+ * keep their pages.
+ */
+static inline uint64_t kept_words(T seg_memory, unsigned cls);
+
+#ifndef GUARD_SEGMENTS
+/* Returns a new block of size class cls from the end of the used arena. */
+static uint32_t carve(T seg_memory, unsigned cls);
+#endif
+
+/* Makes the arena writable up to the word offset end. */
+static void commit(T seg_memory, uint64_t end);
+
+/* Makes the first words words of segment 0's region writable. */
+static void commit_code(T seg_memory, uint64_t words);
+
+/* Rounds offset up to the next BLOCK_ALIGN boundary. */
+static uint64_t align_block(uint64_t offset);
+
+#ifdef GUARD_SEGMENTS
+/* Maps a segment of size words in a block of pages ending in a guard page
+ * and returns its id.
+ */
+static ID_SIZE guard_map(T seg_memory, unsigned size);
+
+/* Makes the block of segment id inaccessible and queues it for reuse. */
+static void guard_unmap(T seg_memory, ID_SIZE id);
+
+/* Marks the pages from the word offset first up to end as state,
+ * belonging to segment id.
+ */
+static void mark(T seg_memory, uint64_t first, uint64_t end, Page state,
+                 ID_SIZE id);
+
+/* Makes the pages of segment 0's region past its first words words
+ * inaccessible again.
+ */
+static void uncommit_code(T seg_memory, uint64_t words);
+
+/* Makes the words of the arena from the word offset first up to end
+ * accessible or not.
+ */
+static void protect(T seg_memory, uint64_t first, uint64_t end,
+                    bool accessible);
+#endif
+
+
+/* Reserves the arena and returns segmented memory with nothing mapped. */
+T Segment_new()
+{
+        T seg_mem = calloc(1, sizeof(struct Segment_T));
+        assert(seg_mem != NULL);
+
+        seg_mem->arena = mmap(NULL, REGION_WORDS * sizeof(WORD_SIZE),
+                              PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+                              MAP_NORESERVE, -1, 0);
+        assert(seg_mem->arena != MAP_FAILED);
+        seg_mem->end = CODE_WORDS;
+        seg_mem->committed = CODE_WORDS;
+        seg_mem->page_words = sysconf(_SC_PAGESIZE) / sizeof(WORD_SIZE);
+#ifndef GUARD_SEGMENTS
+        seg_mem->huge.threshold = HUGE_THRESHOLD;
+#endif
+#ifdef GUARD_SEGMENTS
+        uint64_t num_pages = ARENA_WORDS / seg_mem->page_words;
+        seg_mem->owners = mmap(NULL, num_pages * sizeof(uint32_t),
+                               PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                               MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        seg_mem->pages = mmap(NULL, num_pages, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                              -1, 0);
+        assert(seg_mem->owners != MAP_FAILED && seg_mem->pages != MAP_FAILED);
+        seg_mem->markers = madvise(seg_mem->arena, sizeof(WORD_SIZE),
+                                   MADV_GUARD_INSTALL) == 0 &&
+                           madvise(seg_mem->arena, sizeof(WORD_SIZE),
+                                   MADV_GUARD_REMOVE) == 0;
+#endif
+
+        return seg_mem;
+}
+
+/* Frees the arena, and with it every segment. */
+void Segment_free(T * seg_memory) {
+        munmap((*seg_memory)->arena, REGION_WORDS * sizeof(WORD_SIZE));
+#ifdef GUARD_SEGMENTS
+        uint64_t num_pages = ARENA_WORDS / (*seg_memory)->page_words;
+        munmap((*seg_memory)->owners, num_pages * sizeof(uint32_t));
+        munmap((*seg_memory)->pages, num_pages);
+        for (unsigned i = 0; i < NUM_CLASSES; i++) {
+                free((*seg_memory)->reusable[i].blocks);
+        }
+#endif
+        free(*seg_memory);
+}
+
+/* Creates a segment of desired size, intializes all words to 0 and returns
+ * the identifier: 0 if segment 0 is not mapped yet, otherwise the offset of
+ * its words in the arena. A block from a free list is cleared only where
+ * its pages were not given back.
+ */
+ID_SIZE Segment_map(T seg_memory, unsigned size)
+{
+        WORD_SIZE *arena = seg_memory->arena;
+
+        if (!seg_memory->code_mapped) {
+                assert(size <= CODE_WORDS);
+                commit_code(seg_memory, size);
+                memset(arena, 0, (size_t)size * sizeof(WORD_SIZE));
+                seg_memory->code_mapped = true;
+                seg_memory->code_length = size;
+                return 0;
+        }
+#ifdef GUARD_SEGMENTS
+        return guard_map(seg_memory, size);
+#else
+
+        unsigned cls = size_class((uint64_t)size + HEADER_WORDS);
+        uint32_t block = seg_memory->free_list[cls];
+
+        if (block != NO_BLOCK) {
+                uint64_t clear = (uint64_t)size + HEADER_WORDS;
+
+                seg_memory->free_list[cls] = arena[block + 1];
+                seg_memory->hits++;
+                if (clear > arena[block]) {
+                        clear = arena[block];
+                }
+                memset(&arena[block + HEADER_WORDS], 0,
+                       (clear - HEADER_WORDS) * sizeof(WORD_SIZE));
+        } else {
+                seg_memory->misses++;
+                block = carve(seg_memory, cls);
+        }
+
+        arena[block] = cls;
+        arena[block + 1] = size;
+        return block + HEADER_WORDS;
+#endif
+}
+
+/* Unmaps identified segment from memory, putting its block on the free
+ * list of its size class and giving back every page of it but the first
+ * (or the first huge page). Unmapping segment 0 or an id that is not
+ * mapped is an unchecked runtime error.
+ */
+void Segment_unmap(T seg_memory, ID_SIZE id)
+{
+#ifdef GUARD_SEGMENTS
+        guard_unmap(seg_memory, id);
+#else
+        WORD_SIZE *arena = seg_memory->arena;
+        uint32_t block = id - HEADER_WORDS;
+        unsigned cls = arena[block];
+        uint64_t kept = kept_words(seg_memory, cls);
+        uint64_t words = ((uint64_t)1 << cls) - kept;
+
+        if (words > 0) {
+                madvise(&arena[block + kept], words * sizeof(WORD_SIZE),
+                        MADV_DONTNEED);
+                seg_memory->released += words * sizeof(WORD_SIZE);
+        }
+        arena[block] = kept;
+        arena[block + 1] = seg_memory->free_list[cls];
+        seg_memory->free_list[cls] = block;
+#endif
+}
+
+/* Returns the word at the offset in the desired segment of memory. */
+WORD_SIZE Segment_load(T seg_memory, ID_SIZE id, WORD_SIZE offset)
+{
+        return seg_memory->arena[id + offset];
+}
+
+/* Stores the word at the specified offest in the desired segment of
+ * memory.
+ */
+void Segment_store(T seg_memory, ID_SIZE id, WORD_SIZE offset, WORD_SIZE word)
+{
+        seg_memory->arena[id + offset] = word;
+}
+
+/* Copies the segment identified by source over segment 0, which is the
+ * only target a load program uses and the only one the arena allows.
+ */
+void Segment_move(T seg_memory, ID_SIZE source, ID_SIZE target)
+{
+        WORD_SIZE length;
+
+        assert(target == 0);
+        if (source == 0) {
+                return;
+        }
+        length = Segment_length(seg_memory, source);
+        assert(length <= CODE_WORDS);
+#ifdef GUARD_SEGMENTS
+        uncommit_code(seg_memory, length);
+#endif
+        commit_code(seg_memory, length);
+        memcpy(seg_memory->arena, &seg_memory->arena[source],
+               (size_t)length * sizeof(WORD_SIZE));
+        seg_memory->code_length = length;
+}
+
+/* Returns a pointer to a desired segment located at source: the arena
+ * offset by the id.
+ */
+WORD_SIZE *Segment_ptr(T seg_memory, ID_SIZE source)
+{
+        return &seg_memory->arena[source];
+}
+
+/* Returns a pointer to the words of id for storing into. No words are
+ * shared in the arena, so this is the same as Segment_ptr.
+ */
+WORD_SIZE *Segment_writable(T seg_memory, ID_SIZE id)
+{
+        return &seg_memory->arena[id];
+}
+
+/* Returns false: every segment in the arena has words of its own. */
+bool Segment_shared(T seg_memory, ID_SIZE id)
+{
+        (void) seg_memory;
+        (void) id;
+        return false;
+}
+
+/* Returns the number of words in the segment identified by id, kept in its
+ * header (or, for segment 0, in seg_memory).
+ */
+WORD_SIZE Segment_length(T seg_memory, ID_SIZE id)
+{
+        if (id == 0) {
+                return seg_memory->code_length;
+        }
+        return seg_memory->arena[id - 1];
+}
+
+/* Writes the saved arena layout to fp, starting at the current position. */
+bool Segment_save(T seg_memory, FILE *fp)
+{
+        Saved_arena header;
+        uint64_t code_bytes = (uint64_t)seg_memory->code_length *
+                              sizeof(WORD_SIZE);
+        uint64_t used = seg_memory->end - CODE_WORDS;
+        bool ok;
+
+#ifdef GUARD_SEGMENTS
+        /* the free and guard pages of the arena cannot even be read */
+        (void) fp;
+        return false;
+#endif
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SAVED_MAGIC, sizeof(header.magic));
+        header.code_length = seg_memory->code_length;
+        header.end = seg_memory->end;
+        memcpy(header.free_list, seg_memory->free_list,
+               sizeof(header.free_list));
+
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(seg_memory->arena, 1, code_bytes, fp) == code_bytes;
+        for (uint64_t i = code_bytes; ok && i < align_block(code_bytes);
+             i++) {
+                ok = fputc(0, fp) != EOF;
+        }
+        return ok && fwrite(&seg_memory->arena[CODE_WORDS],
+                            sizeof(WORD_SIZE), used, fp) == used;
+}
+
+/* Copies the saved arena in the bytes at saved into the arena of
+ * seg_memory, which must have nothing mapped. The header is checked
+ * against the bytes, and every free list against the used arena, before
+ * anything is copied.
+ */
+bool Segment_restore(T seg_memory, void *saved, size_t bytes)
+{
+        Saved_arena header;
+        const char *base = saved;
+        uint64_t code_bytes, used;
+        unsigned i;
+
+        assert(!seg_memory->code_mapped && seg_memory->end == CODE_WORDS);
+#ifdef GUARD_SEGMENTS
+        return false;
+#endif
+        if (bytes < sizeof(header)) {
+                return false;
+        }
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, SAVED_MAGIC, sizeof(header.magic)) != 0 ||
+            header.code_length > CODE_WORDS || header.end < CODE_WORDS ||
+            header.end > ARENA_WORDS) {
+                return false;
+        }
+        code_bytes = align_block((uint64_t)header.code_length *
+                                 sizeof(WORD_SIZE));
+        used = header.end - CODE_WORDS;
+        if (sizeof(header) + code_bytes + used * sizeof(WORD_SIZE) > bytes) {
+                return false;
+        }
+        for (i = 0; i < NUM_CLASSES; i++) {
+                uint32_t block = header.free_list[i];
+                if (block != NO_BLOCK &&
+                    (block < CODE_WORDS || block >= header.end)) {
+                        return false;
+                }
+        }
+
+        commit_code(seg_memory, header.code_length);
+        commit(seg_memory, header.end);
+        memcpy(seg_memory->arena, base + sizeof(header),
+               (size_t)header.code_length * sizeof(WORD_SIZE));
+        memcpy(&seg_memory->arena[CODE_WORDS],
+               base + sizeof(header) + code_bytes,
+               used * sizeof(WORD_SIZE));
+        seg_memory->code_mapped = true;
+        seg_memory->code_length = header.code_length;
+        seg_memory->end = header.end;
+        memcpy(seg_memory->free_list, header.free_list,
+               sizeof(seg_memory->free_list));
+        return true;
+}
+
+/* Puts segments of at least threshold bytes on huge pages, which for the
+ * arena can only be transparent ones: hugetlb is noted but not used. A
+ * guarded arena has no huge pages.
+ */
+void Segment_huge_pages(T seg_memory, size_t threshold, bool hugetlb)
+{
+#ifdef GUARD_SEGMENTS
+        (void) seg_memory;
+        (void) threshold;
+        (void) hugetlb;
+#else
+        seg_memory->huge.threshold = threshold;
+        seg_memory->huge.hugetlb = hugetlb;
+#endif
+}
+
+/* Returns how segments are put on huge pages and how many have been. */
+Pool_huge Segment_huge_stats(T seg_memory)
+{
+        return seg_memory->huge;
+}
+
+/* Prints how many maps were served from a free list (hits) or carved from
+ * the arena (misses), how many blocks were put on huge pages, how much of
+ * the arena is used and how much has been given back to the kernel.
+ */
+void Segment_report(T seg_memory, FILE *out)
+{
+        uint64_t maps = seg_memory->hits + seg_memory->misses;
+
+        fprintf(out, "arena: %" PRIu64 " hits, %" PRIu64 " misses "
+                "(%.1f%% hit rate), %" PRIu64 " blocks on huge pages, "
+                "%.1f MB used, %.1f MB released\n",
+                seg_memory->hits, seg_memory->misses,
+                maps ? 100.0 * seg_memory->hits / maps : 0.0,
+                seg_memory->huge.advised,
+                (seg_memory->end - CODE_WORDS) * sizeof(WORD_SIZE) / 1e6,
+                seg_memory->released / 1e6);
+}
+
+/* Returns the size class of a block of words words, the power of two it
+ * rounds up to, and never less than 2^MIN_SHIFT.
+ */
+static inline unsigned size_class(uint64_t words)
+{
+        unsigned cls = MIN_SHIFT;
+
+        while (((uint64_t)1 << cls) < words) {
+                cls++;
+        }
+        assert(cls < NUM_CLASSES);
+        return cls;
+}
+
+/* Returns whether a block of size class cls spans more than one page. */
+static inline bool releases(T seg_memory, unsigned cls)
+{
+        return ((uint64_t)1 << cls) > seg_memory->page_words;
+}
+
+/* Returns whether blocks of size class cls span more than a page and
+ * reach the huge page threshold, and so start on a huge page and are
+ * backed by huge pages.
+ */
+static inline bool is_huge(T seg_memory, unsigned cls)
+{
+        uint64_t threshold = seg_memory->huge.threshold;
+
+        return threshold != 0 && releases(seg_memory, cls) &&
+               ((uint64_t)1 << cls) * sizeof(WORD_SIZE) >= threshold;
+}
+
+/* Returns how many words at the start of a freed block of size class cls
+ * keep their pages: all of a block of one page, the first huge page of a
+ * block on huge pages and the first page of any other.
+ */
+static inline uint64_t kept_words(T seg_memory, unsigned cls)
+{
+        uint64_t words = (uint64_t)1 << cls;
+
+        if (!releases(seg_memory, cls)) {
+                return words;
+        } else if (is_huge(seg_memory, cls)) {
+                return words < HUGE_WORDS ? words : HUGE_WORDS;
+        }
+        return seg_memory->page_words;
+}
+
+#ifndef GUARD_SEGMENTS
+/* Returns a new block of size class cls from the end of the used arena.
+ * Blocks that give pages back start on a page, so that every page of them
+ * past the first lies inside them, and blocks on huge pages start on a
+ * huge page.
+ */
+static uint32_t carve(T seg_memory, unsigned cls)
+{
+        uint64_t block = seg_memory->end;
+        uint64_t words = (uint64_t)1 << cls;
+        bool huge = is_huge(seg_memory, cls);
+
+        if (huge) {
+                block = (block + HUGE_WORDS - 1) / HUGE_WORDS * HUGE_WORDS;
+        } else if (releases(seg_memory, cls)) {
+                uint64_t page = seg_memory->page_words;
+                block = (block + page - 1) / page * page;
+        }
+        if (block + words > ARENA_WORDS) {
+                fprintf(stderr, "Error: segment arena exhausted\n");
+                exit(EXIT_FAILURE);
+        }
+        commit(seg_memory, block + words);
+        seg_memory->end = block + words;
+        if (huge) {
+                madvise(&seg_memory->arena[block], words * sizeof(WORD_SIZE),
+                        MADV_HUGEPAGE);
+                seg_memory->huge.advised++;
+                seg_memory->huge.advised_bytes += words * sizeof(WORD_SIZE);
+        }
+        return block;
+}
+#endif
+
+/* Makes the arena readable and writable up to the word offset end,
+ * COMMIT_WORDS at a time.
+ */
+static void commit(T seg_memory, uint64_t end)
+{
+        uint64_t committed = seg_memory->committed;
+
+        if (end <= committed) {
+                return;
+        }
+        end = (end + COMMIT_WORDS - 1) / COMMIT_WORDS * COMMIT_WORDS;
+        if (mprotect(&seg_memory->arena[committed],
+                     (end - committed) * sizeof(WORD_SIZE),
+                     PROT_READ | PROT_WRITE) != 0) {
+                fprintf(stderr, "Error: cannot commit segment arena\n");
+                exit(EXIT_FAILURE);
+        }
+        seg_memory->committed = end;
+}
+
+/* Makes the first words words of segment 0's region readable and
+ * writable, a page at a time.
+ */
+static void commit_code(T seg_memory, uint64_t words)
+{
+        uint64_t page = seg_memory->page_words;
+        uint64_t committed = seg_memory->code_committed;
+
+        if (words <= committed) {
+                return;
+        }
+        words = (words + page - 1) / page * page;
+        if (mprotect(&seg_memory->arena[committed],
+                     (words - committed) * sizeof(WORD_SIZE),
+                     PROT_READ | PROT_WRITE) != 0) {
+                fprintf(stderr, "Error: cannot commit segment arena\n");
+                exit(EXIT_FAILURE);
+        }
+        seg_memory->code_committed = words;
+}
+
+/* Rounds offset up to the next BLOCK_ALIGN boundary. */
+static uint64_t align_block(uint64_t offset)
+{
+        return (offset + BLOCK_ALIGN - 1) & ~(uint64_t)(BLOCK_ALIGN - 1);
+}
+
+#ifdef GUARD_SEGMENTS
+/* Says what the address addr, at which the um faulted, is in the guarded
+ * arena, and which segment and offset in it if any. Reads only the page
+ * tables, so it may be called from a signal handler.
+ */
+Segment_fault Segment_explain(T seg_memory, const void *addr, ID_SIZE *id,
+                              WORD_SIZE *offset)
+{
+        const char *base = (const char *)seg_memory->arena;
+        const char *byte = addr;
+        uint64_t word, page;
+
+        if (byte < base || byte >= base + REGION_WORDS * sizeof(WORD_SIZE)) {
+                return SEGMENT_OUTSIDE;
+        }
+        word = (byte - base) / sizeof(WORD_SIZE);
+        if (word < CODE_WORDS) {
+                *id = 0;
+                *offset = word;
+                return SEGMENT_PAST_END;
+        }
+        if (word >= ARENA_WORDS) {
+                return SEGMENT_NOWHERE;
+        }
+
+        page = word / seg_memory->page_words;
+        *id = seg_memory->owners[page];
+        *offset = word - *id;
+        switch (seg_memory->pages[page]) {
+        case PAGE_GUARD:
+                return SEGMENT_PAST_END;
+        case PAGE_UNMAPPED:
+                return SEGMENT_UNMAPPED;
+        default:
+                return SEGMENT_NOWHERE;
+        }
+}
+
+/* Maps a segment of size words in a block of a power of two pages, reused
+ * from the stack of its size class or carved from the end of the used
+ * arena. Its words end where the last page, its guard page, starts, with
+ * its header just before them, and only the pages holding them are made
+ * accessible. With markers, the arena is committed as usual and every
+ * page of it guarded until a segment uses it. A new or given back block
+ * reads as zero; the one page of words of a reused block of two pages
+ * kept by mprotect is cleared instead.
+ */
+static ID_SIZE guard_map(T seg_memory, unsigned size)
+{
+        uint64_t page = seg_memory->page_words;
+        uint64_t pages = ((uint64_t)size + HEADER_WORDS + page - 1) / page + 1;
+        Stack *reusable;
+        uint64_t block, guard, id, first;
+        unsigned cls = 1;
+        bool reused = false;
+
+        while (((uint64_t)1 << cls) < pages) {
+                cls++;
+        }
+        pages = (uint64_t)1 << cls;
+        reusable = &seg_memory->reusable[cls];
+
+        if (reusable->size > 0) {
+                block = reusable->blocks[--reusable->size];
+                seg_memory->hits++;
+                reused = true;
+        } else {
+                uint64_t committed = seg_memory->committed;
+
+                block = seg_memory->end;
+                if (block + pages * page > ARENA_WORDS) {
+                        fprintf(stderr, "Error: segment arena exhausted\n");
+                        exit(EXIT_FAILURE);
+                }
+                seg_memory->end = block + pages * page;
+                seg_memory->misses++;
+                if (seg_memory->markers) {
+                        commit(seg_memory, seg_memory->end);
+                        protect(seg_memory, committed,
+                                seg_memory->committed, false);
+                }
+        }
+
+        guard = block + (pages - 1) * page;
+        id = guard - size;
+        first = (id - HEADER_WORDS) / page * page;
+        protect(seg_memory, first, guard, true);
+        if (reused && cls == 1 && !seg_memory->markers) {
+                memset(&seg_memory->arena[first], 0,
+                       (guard - first) * sizeof(WORD_SIZE));
+        }
+        mark(seg_memory, block, first, PAGE_UNUSED, id);
+        mark(seg_memory, first, guard, PAGE_WORDS, id);
+        mark(seg_memory, guard, guard + page, PAGE_GUARD, id);
+
+        seg_memory->arena[id - 2] = cls;
+        seg_memory->arena[id - 1] = size;
+        return id;
+}
+
+/* Makes the whole block of segment id inaccessible, which gives its pages
+ * back to the kernel with markers; with mprotect they are given back
+ * unless it has only the one page of words (which the kernel would only
+ * have to fault back in and clear again). Then puts the block at the back
+ * of the quarantine, moving the block at the front onto the stack of its
+ * size class once the quarantine is full.
+ */
+static void guard_unmap(T seg_memory, ID_SIZE id)
+{
+        uint64_t page = seg_memory->page_words;
+        unsigned cls = seg_memory->arena[id - 2];
+        uint64_t words = ((uint64_t)1 << cls) * page;
+        uint64_t guard = id + (uint64_t)seg_memory->arena[id - 1];
+        uint64_t block = guard + page - words;
+        unsigned next = seg_memory->quarantine_next;
+
+        protect(seg_memory, block, block + words, false);
+        if (seg_memory->markers || cls > 1) {
+                if (!seg_memory->markers) {
+                        madvise(&seg_memory->arena[block],
+                                words * sizeof(WORD_SIZE), MADV_DONTNEED);
+                }
+                seg_memory->released += words * sizeof(WORD_SIZE);
+        }
+        mark(seg_memory, block, block + words, PAGE_UNMAPPED, id);
+
+        if (seg_memory->quarantined == QUARANTINE) {
+                uint64_t oldest = seg_memory->quarantine[next];
+                Stack *reusable = &seg_memory->reusable[oldest >> 32];
+
+                if (reusable->size == reusable->capacity) {
+                        reusable->capacity = 2 * reusable->capacity + 16;
+                        reusable->blocks = realloc(reusable->blocks,
+                                                   reusable->capacity *
+                                                   sizeof(uint32_t));
+                        assert(reusable->blocks != NULL);
+                }
+                reusable->blocks[reusable->size++] = (uint32_t)oldest;
+        } else {
+                seg_memory->quarantined++;
+        }
+        seg_memory->quarantine[next] = (uint64_t)cls << 32 | block;
+        seg_memory->quarantine_next = (next + 1) % QUARANTINE;
+}
+
+/* Marks the pages from the word offset first up to end as state,
+ * belonging to segment id.
+ */
+static void mark(T seg_memory, uint64_t first, uint64_t end, Page state,
+                 ID_SIZE id)
+{
+        uint64_t page = seg_memory->page_words;
+
+        for (uint64_t i = first / page; i < end / page; i++) {
+                seg_memory->owners[i] = id;
+                seg_memory->pages[i] = state;
+        }
+}
+
+/* Makes the pages of segment 0's region past its first words words
+ * inaccessible again and gives them back to the kernel, so a shorter
+ * program is guarded as closely as the longer one was.
+ */
+static void uncommit_code(T seg_memory, uint64_t words)
+{
+        uint64_t page = seg_memory->page_words;
+        uint64_t committed = seg_memory->code_committed;
+        void *start;
+
+        words = (words + page - 1) / page * page;
+        if (words >= committed) {
+                return;
+        }
+        start = &seg_memory->arena[words];
+        mprotect(start, (committed - words) * sizeof(WORD_SIZE), PROT_NONE);
+        madvise(start, (committed - words) * sizeof(WORD_SIZE),
+                MADV_DONTNEED);
+        seg_memory->code_committed = words;
+}
+
+/* Makes the words of the arena from the word offset first up to end (both
+ * on page boundaries) accessible or not: by removing or installing guard
+ * markers if the kernel has them, otherwise with mprotect.
+ */
+static void protect(T seg_memory, uint64_t first, uint64_t end,
+                    bool accessible)
+{
+        void *start = &seg_memory->arena[first];
+        size_t bytes = (end - first) * sizeof(WORD_SIZE);
+        int failed;
+
+        if (first == end) {
+                return;
+        }
+        if (seg_memory->markers) {
+                failed = madvise(start, bytes, accessible ? MADV_GUARD_REMOVE
+                                                          : MADV_GUARD_INSTALL);
+        } else {
+                failed = mprotect(start, bytes, accessible ?
+                                  PROT_READ | PROT_WRITE : PROT_NONE);
+        }
+        if (failed != 0) {
+                fprintf(stderr, "Error: cannot guard segment arena\n");
+                exit(EXIT_FAILURE);
+        }
+}
+#endif
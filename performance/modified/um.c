@@ -4,15 +4,31 @@
  *
  * Implementation for UM, allows a user to run the UM with the
  * provided instructions. Contains 8 registers that the 
- * instructions make use of.
+ * instructions make use of. All of the state of a guest is in its UM_T and
+ * the engines return when it stops, so the um can be embedded; main.c is
+ * the command line front end.
  */
+#define _DEFAULT_SOURCE
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include "segment.h"
 #include "instructions.h"
-#include <bitpack.h>
+#include "predecode.h"
+#include "jit.h"
+#include "loader.h"
+#include "io.h"
+#include "profile.h"
+#include "barrier.h"
+#include "hwcount.h"
+#include "um.h"
 #include <assert.h>
 #define REG_ID_LEN 3
 #define WORD_LEN 32
@@ -26,117 +42,1245 @@
 #define LOAD_VAL_LSB OPCODE_LSB - REG_ID_LEN
 #define WORD_SIZE uint32_t
 #define REG_SIZE uint32_t
+#define SNAPSHOT_MAGIC "UMSNAP1"
+#define SNAPSHOT_HEADER 64
+#define BYTE_ORDER_MARK 0x01020304
+#define NO_SEGMENT UINT32_MAX
+#define KEPT_PROGRAMS 4
 #define T UM_T
 
-/* Global function pointer arrays */
-void (*three_reg[7]) (Segment_T seg_memory, REG_SIZE *reg_a, REG_SIZE *reg_b, 
-                    REG_SIZE *reg_c);
-void (*two_reg[5]) (Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c);
+#if defined(PROFILE) && defined(REFERENCE_ENGINE)
+#error "PROFILE instruments the threaded engine only"
+#endif
 
-WORD_SIZE *prog_copy;
+#if defined(GUARD_SEGMENTS) && !defined(ARENA_SEGMENTS)
+#error "GUARD_SEGMENTS needs the arena of ARENA_SEGMENTS"
+#endif
+#if defined(GUARD_SEGMENTS) && (defined(REFERENCE_ENGINE) || defined(PROFILE))
+#error "GUARD_SEGMENTS guards the threaded engine only, uninstrumented"
+#endif
+
+#if defined(WRITE_BARRIER) && (defined(ARENA_SEGMENTS) || \
+                               defined(GUARD_SEGMENTS))
+#error "WRITE_BARRIER protects segment 0 of the segment table only"
+#endif
+#if defined(WRITE_BARRIER) && (defined(REFERENCE_ENGINE) || defined(PROFILE))
+#error "WRITE_BARRIER keeps the threaded engine's program, uninstrumented"
+#endif
+
+/* Guard hooks in the engine disappear unless built with -DGUARD_SEGMENTS. */
+#ifdef GUARD_SEGMENTS
+#define GUARD_HOOK(statement) statement
+#else
+#define GUARD_HOOK(statement)
+#endif
+
+/* A store into segment 0 patches the predecoded program on the spot,
+ * unless built with -DWRITE_BARRIER, where the fault handler marks the page
+ * the store went to stale instead and no store has to check.
+ */
+#ifdef WRITE_BARRIER
+#define PATCH_CODE(id, offset, word)
+#else
+#define PATCH_CODE(id, offset, word) do {                               \
+                if ((id) == 0) {                                        \
+                        Predecode_update(program, (offset), (word));    \
+                }                                                       \
+        } while (0)
+#endif
+
+/* Profiling hooks in the engine disappear unless built with -DPROFILE. */
+#ifdef PROFILE
+#define PROFILE_HOOK(call) call
+#else
+#define PROFILE_HOOK(call)
+#endif
+
+/* Handlers in instructions.c for the opcodes the reference engine routes
+ * through tables: 0-6 take three registers, map and unmap take two.
+ */
+static void (*const three_reg[7]) (Segment_T seg_memory, REG_SIZE *reg_a,
+                                   REG_SIZE *reg_b, REG_SIZE *reg_c) = {
+        conditional_move, load, store, add, multiply, divide, nand
+};
+static void (*const two_reg[2]) (Segment_T seg_memory, REG_SIZE *reg_b,
+                                 REG_SIZE *reg_c) = {
+        map_segment, unmap_segment
+};
+
+/* The start of a snapshot file, padded to SNAPSHOT_HEADER bytes. The saved
+ * segment table follows it, in host byte order, which byte_order records.
+ */
+typedef struct Snapshot_header {
+        char magic[8];
+        uint32_t byte_order;
+        uint32_t pc;
+        uint32_t registers[8];
+        char unused[SNAPSHOT_HEADER - 48];
+} Snapshot_header;
+
+/* A predecoded program kept for words that were segment 0 and are still
+ * some other segment's, so loading that segment again needs no decoding.
+ * A slot with NULL words holds a program to decode into and nothing else.
+ */
+typedef struct Kept_program {
+        const WORD_SIZE *words;
+        Predecode_T program;
+} Kept_program;
 
 /* Struct that holds contents of a UM, the segmented
- * memory, registers and program counter */
+ * memory, registers, the offset in segment 0 of the next instruction, the
+ * predecoded copy of segment 0, the programs kept for segments it was
+ * loaded from, how many of them there are and the slot to reuse next, the
+ * I/O device, whether segment 0 runs on
+ * the JIT, how the guest stopped (UM_OK while it can still run), how many
+ * instructions the interpreter has executed, the snapshot mapping it was
+ * restored from (if any), in profiling builds the profile and the
+ * path to write it to without its suffix (NULL for none), in guarded
+ * builds where to jump back to on a fault, the instruction running and
+ * what the fault was, with
+ * the write barrier the barrier on segment 0, and the hardware counters
+ * (NULL unless they are on) */
 struct T {
         Segment_T memory; 
         REG_SIZE *registers;
+        WORD_SIZE pc;
+        uint64_t executed;
+        Predecode_T program;
+        Kept_program kept[KEPT_PROGRAMS];
+        unsigned num_kept;
+        unsigned next_kept;
+        Io_T io;
+        bool use_jit;
+        bool loaded;
+        UM_status status;
+        void *snapshot;
+        size_t snapshot_bytes;
+        Hwcount_T hw;
+#ifdef PROFILE
+        Profile_T profile;
+        char *profile_path;
+#endif
+#ifdef GUARD_SEGMENTS
+        sigjmp_buf guard;
+        const Op *volatile current;
+        Segment_fault fault;
+        ID_SIZE fault_id;
+        WORD_SIZE fault_offset;
+        WORD_SIZE fault_pc;
+#endif
+#ifdef WRITE_BARRIER
+        Barrier_T barrier;
+#endif
 };
-typedef struct T *T;
 
+#ifdef GUARD_SEGMENTS
+/* The um running on this thread, if any, for the fault handler. */
+static __thread T guarded = NULL;
 
-/* Creates a new universal machine, initializes the memory and all of the 
- * registers to 0.
+/* Turns a fault in the arena of the running guest into a jump back to
+ * execute_guarded. Any other fault is the um's own, so the handler is
+ * reset and the fault happens again, killing the process as usual.
  */
-T UM_new();
+static void guard_fault(int sig, siginfo_t *info, void *context);
 
-/* Takes a um executable file and runs the program on the um.  */
-void UM_run(T um, const char *input);
+/* Runs execute_threaded, returning UM_FAULT with the fault recorded in um
+ * if the guest touches memory outside its segments.
+ */
+UM_status execute_guarded(T um, uint64_t budget);
+#endif
+
+#ifdef WRITE_BARRIER
+/* The um running on this thread, if any, for the fault handler. */
+static __thread T barred = NULL;
 
-/* Frees the universal machine and all of its components. */
-void UM_free(T *um);
+/* Turns a store into a protected page of segment 0 of the running guest
+ * into a stale page: the page is made writable and its instructions marked
+ * STALE, and the store is retried. Any other fault is the um's own and
+ * kills the process, as in guard_fault.
+ */
+static void barrier_fault(int sig, siginfo_t *info, void *context);
 
-/* Returns the file size (number of words). */
-size_t get_file_size(const char *filename);
+/* Runs execute_threaded with um as the guest the fault handler serves. */
+UM_status execute_barred(T um, uint64_t budget);
 
-/* Loads the file's words into the 0th segment */
-void load_file(T um, int size, const char *input);
+/* Decodes the page of segment 0 holding the word at offset again and
+ * protects it again, unless the barrier has given up on the page; then its
+ * instructions are marked UNCACHED instead.
+ */
+void refresh_page(T um, WORD_SIZE offset);
+
+/* Decodes the register fields and immediate of word into op, leaving its
+ * opcode alone, and returns the opcode of word.
+ */
+static inline unsigned decode_fields(Op *op, WORD_SIZE word);
+#endif
+
+#ifdef PROFILE
+/* Writes the profile of um to <prefix>.prof and <prefix>.folded with the
+ * prefix given to UM_profile_to, unless there is none or the um ran no
+ * instructions (as a fork server does).
+ */
+void write_profile(T um);
+#endif
 
 /* Breaks apart the word to determine registers and opcode in order to
- * use the corerct instruction.
+ * use the corerct instruction. Returns UM_OK unless the instruction stops
+ * the guest or blocks on input.
  */
-void route_instruct(T um, WORD_SIZE instruct);
+UM_status route_instruct(T um, WORD_SIZE instruct);
 
-/* Initializes the global function pointer array for opcode 0-6 */
-void function_array_init();
+/* Runs at most budget instructions of segment 0 from um->pc, using
+ * whichever execution engine was selected at build time. Returns UM_OK if
+ * the budget ran out, otherwise how the guest stopped.
+ */
+UM_status execute(T um, uint64_t budget);
+
+/* Runs segment 0 on the JIT. Returns UM_HALTED if the guest does, otherwise
+ * UM_OK with the um ready for the interpreter to resume where the JIT
+ * stopped.
+ */
+UM_status execute_jit(T um);
+
+#ifdef REFERENCE_ENGINE
+/* Reference engine: routes every instruction through route_instruct. */
+UM_status execute_reference(T um, uint64_t budget);
+#else
+/* Threaded engine: computed-goto dispatch with the registers in locals and
+ * every instruction handled inline.
+ */
+UM_status execute_threaded(T um, uint64_t budget);
+#endif
 
 /* Loads the segment identified by reg_b and makes a duplicate to replace
- * contents of segment 0 (which is abandoned). Program pointer is set to point
- * to the segment stored at segment 0 at the word offset of reg_c.
+ * contents of segment 0 (which is abandoned). Program counter is set to
+ * the word offset of reg_c.
  */
-void load_program(Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c);
+void load_program(T um, REG_SIZE *reg_b, REG_SIZE *reg_c);
 
+/* Predecodes segment 0 into um->program, putting it behind the write
+ * barrier in builds that have one.
+ */
+void decode_program(T um);
+
+/* Puts segment 0 behind the write barrier, in builds that have one, and
+ * returns its words.
+ */
+const WORD_SIZE *protect_program(T um);
+
+/* Replaces segment 0 with segment id, as a load program does, and
+ * um->program with its predecoded copy, taken from the kept programs if
+ * the words of id have one.
+ */
+void switch_program(T um, ID_SIZE id);
+
+/* Drops the kept program for words, if there is one, before they change
+ * or are released.
+ */
+void forget_program(T um, const WORD_SIZE *words);
+
+/* Drops every kept program. */
+void forget_programs(T um);
+
+/* Does the work of UM_load, which counts it as the load phase. */
+UM_status load_file(T um, const char *input);
+
+/* Does the work of UM_restore, which counts it as the load phase. */
+UM_status restore_file(T um, const char *path);
 
-int main(int argc, char *argv[])
-{
-        if (argc > 2) {
-                fprintf(stderr, "Error: too many arguments\n");
-                exit(EXIT_FAILURE);
-        }
-        else if (argc == 2) {
-                UM_T um = UM_new();
-                UM_run(um, argv[1]);
-                UM_free(&um);
-        }
-        else {
-                fprintf(stderr, "Error: too few arguments\n");
-                exit(EXIT_FAILURE);
-        }
-        return 1;
-}
 
 /* Creates a new universal machine, initializes the memory and all of the
  * registers to 0.
  */
-T UM_new()
+T UM_new(Io_T io)
 {
         T um = malloc(sizeof(struct UM_T));
+        assert(um != NULL);
         um->memory = Segment_new();
         um->registers = calloc(8, sizeof(REG_SIZE));
-        function_array_init();
+        assert(um->registers != NULL);
+        um->pc = 0;
+        um->executed = 0;
+        um->program = Predecode_new();
+        for (int i = 0; i < KEPT_PROGRAMS; i++) {
+                um->kept[i].words = NULL;
+                um->kept[i].program = NULL;
+        }
+        um->num_kept = 0;
+        um->next_kept = 0;
+        um->io = io;
+        um->use_jit = false;
+        um->loaded = false;
+        um->status = UM_OK;
+        um->snapshot = NULL;
+        um->snapshot_bytes = 0;
+        um->hw = NULL;
+#ifdef PROFILE
+        um->profile = Profile_new();
+        um->profile_path = NULL;
+        Predecode_fuse(um->program, 0);
+#endif
+#ifdef GUARD_SEGMENTS
+        struct sigaction action;
+
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = guard_fault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, NULL);
+        Predecode_fuse(um->program, 0);
+#endif
+#ifdef WRITE_BARRIER
+        struct sigaction action;
+
+        um->barrier = Barrier_new();
+        Predecode_window(um->program, Barrier_page_words(um->barrier));
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = barrier_fault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, NULL);
+#endif
         return um;
 }
 
-/* Takes a um executable file, loads the program and runs each instuction
- * in segment 0 until a halt is reached. 
+/* Chooses whether UM_run starts segment 0 on the JIT. */
+void UM_use_jit(T um, bool use_jit)
+{
+        um->use_jit = use_jit;
+}
+
+/* Chooses the superinstructions the threaded engine fuses from a list of
+ * their names. A profiling build counts every instruction on its own, and
+ * a guarded build reports the instruction that faults, so they check the
+ * list but fuse nothing.
+ */
+bool UM_fuse(T um, const char *list)
+{
+        unsigned set;
+
+        assert(!um->loaded);
+        if (!Predecode_fusion(list, &set)) {
+                return false;
+        }
+#if !defined(PROFILE) && !defined(GUARD_SEGMENTS)
+        Predecode_fuse(um->program, set);
+#endif
+        return true;
+}
+
+/* Chooses which segments go on huge pages: those of at least threshold
+ * bytes (none if 0), from the hugetlbfs pool first if hugetlb is set. The
+ * write barrier protects segment 0 a page at a time, which hugetlbfs pages
+ * cannot be, so a build with it uses transparent ones only.
+ */
+void UM_huge_pages(T um, size_t threshold, bool hugetlb)
+{
+        assert(!um->loaded);
+#ifdef WRITE_BARRIER
+        if (hugetlb) {
+                fprintf(stderr, "Write barrier build: --hugetlb ignored.\n");
+                hugetlb = false;
+        }
+#endif
+        Segment_huge_pages(um->memory, threshold, hugetlb);
+}
+
+/* Counts the rest of the um's life with hardware counters, splitting it
+ * into loading, running and freeing, and in a profiling build samples the
+ * counts by opcode class too.
+ */
+void UM_hwcounters(T um)
+{
+        assert(!um->loaded);
+        if (um->hw == NULL) {
+                um->hw = Hwcount_new();
+                PROFILE_HOOK(Profile_hwcounters(um->profile, um->hw));
+        }
+}
+
+/* Keeps a copy of prefix for write_profile in a profiling build. */
+bool UM_profile_to(T um, const char *prefix)
+{
+#ifdef PROFILE
+        free(um->profile_path);
+        um->profile_path = NULL;
+        if (prefix != NULL) {
+                um->profile_path = malloc(strlen(prefix) + 1);
+                assert(um->profile_path != NULL);
+                strcpy(um->profile_path, prefix);
+        }
+        return true;
+#else
+        (void) um;
+        (void) prefix;
+        return false;
+#endif
+}
+
+/* Loads a um executable file, counting it as the load phase of the
+ * hardware counters.
+ */
+UM_status UM_load(T um, const char *input)
+{
+        UM_status status;
+
+        Hwcount_start(um->hw, HWCOUNT_LOAD);
+        status = load_file(um, input);
+        Hwcount_stop(um->hw);
+        return status;
+}
+
+/* Takes a um executable file and maps segment 0 to hold its words, swapped
+ * into host order in bulk.
+ */
+UM_status load_file(T um, const char *input)
+{
+        WORD_SIZE num_words;
+
+        assert(!um->loaded);
+        if (!Loader_read(um->memory, input, &num_words)) {
+                return UM_LOAD_ERROR;
+        }
+        um->loaded = true;
+        um->pc = 0;
+        decode_program(um);
+        PROFILE_HOOK(Profile_load(um->profile, num_words,
+                                  Predecode_invalid(um->program)));
+        return UM_OK;
+}
+
+/* Writes the registers, program counter and segmented memory of um, which
+ * must still be able to run, to a snapshot file at path, flushing its
+ * output first. Returns false, leaving no file behind, if it cannot.
+ */
+bool UM_save(T um, const char *path)
+{
+        Snapshot_header header;
+        FILE *fp;
+        bool ok;
+
+        if (!um->loaded || um->status != UM_OK) {
+                return false;
+        }
+        Io_flush(um->io);
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.byte_order = BYTE_ORDER_MARK;
+        header.pc = um->pc;
+        memcpy(header.registers, um->registers, sizeof(header.registers));
+
+        fp = fopen(path, "wb");
+        if (fp == NULL) {
+                return false;
+        }
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             Segment_save(um->memory, fp);
+        ok = (fclose(fp) == 0) && ok;
+        if (!ok) {
+                remove(path);
+        }
+        return ok;
+}
+
+/* Restores the snapshot at path, counting it as the load phase of the
+ * hardware counters.
+ */
+UM_status UM_restore(T um, const char *path)
+{
+        UM_status status;
+
+        Hwcount_start(um->hw, HWCOUNT_LOAD);
+        status = restore_file(um, path);
+        Hwcount_stop(um->hw);
+        return status;
+}
+
+/* Maps the snapshot at path privately and makes it the state of um: the
+ * segments use their words where they lie in the mapping, so pages are
+ * only read in (and copied, if stored into) as the guest touches them.
+ */
+UM_status restore_file(T um, const char *path)
+{
+        Snapshot_header header;
+        struct stat st;
+        char *base;
+        int fd;
+
+        assert(!um->loaded);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                return UM_LOAD_ERROR;
+        }
+        if (fstat(fd, &st) != 0 || st.st_size <= SNAPSHOT_HEADER) {
+                close(fd);
+                return UM_LOAD_ERROR;
+        }
+        base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+                return UM_LOAD_ERROR;
+        }
+
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+            header.byte_order != BYTE_ORDER_MARK ||
+            !Segment_restore(um->memory, base + SNAPSHOT_HEADER,
+                             st.st_size - SNAPSHOT_HEADER) ||
+            header.pc > Segment_length(um->memory, 0)) {
+                munmap(base, st.st_size);
+                return UM_LOAD_ERROR;
+        }
+
+        um->snapshot = base;
+        um->snapshot_bytes = st.st_size;
+        um->loaded = true;
+        um->pc = header.pc;
+        memcpy(um->registers, header.registers, sizeof(header.registers));
+        decode_program(um);
+        PROFILE_HOOK(Profile_load(um->profile,
+                                  Segment_length(um->memory, 0),
+                                  Predecode_invalid(um->program)));
+        return UM_OK;
+}
+
+/* Makes memory, registers and pc the state of a um that has no program
+ * yet, freeing the memory it was created with, and decodes segment 0.
+ */
+void UM_adopt(T um, Segment_T memory, const uint32_t *registers,
+              uint32_t pc)
+{
+        assert(!um->loaded);
+        Segment_free(&um->memory);
+        um->memory = memory;
+        memcpy(um->registers, registers, 8 * sizeof(REG_SIZE));
+        um->pc = pc;
+        um->loaded = true;
+        decode_program(um);
+        PROFILE_HOOK(Profile_load(um->profile,
+                                  Segment_length(um->memory, 0),
+                                  Predecode_invalid(um->program)));
+}
+
+/* Runs each instuction in segment 0 until the guest halts, executes an
+ * invalid instruction or blocks on input. The JIT, if asked for, gets the
+ * guest first; once it hands the guest back the rest of the run is
+ * interpreted.
+ */
+UM_status UM_run(T um)
+{
+        UM_status status;
+
+        assert(um->loaded);
+        Hwcount_start(um->hw, HWCOUNT_EXECUTE);
+#ifdef PROFILE
+        if (um->use_jit) {
+                fprintf(stderr, "Profiling build: --jit ignored.\n");
+        }
+#elif defined(GUARD_SEGMENTS)
+        if (um->use_jit) {
+                fprintf(stderr, "Guarded build: --jit ignored.\n");
+        }
+#elif defined(WRITE_BARRIER)
+        if (um->use_jit) {
+                fprintf(stderr, "Write barrier build: --jit ignored.\n");
+        }
+#else
+        if (um->use_jit && um->status == UM_OK) {
+                um->status = execute_jit(um);
+        }
+#endif
+        um->use_jit = false;
+
+        do {
+                status = UM_step(um, UINT64_MAX);
+        } while (status == UM_EXHAUSTED);
+        Hwcount_stop(um->hw);
+        return status;
+}
+
+/* Interprets at most budget instructions of the guest, stopping early if it
+ * halts, executes an invalid instruction or blocks on input.
  */
-void UM_run(T um, const char *input)
+UM_status UM_step(T um, uint64_t budget)
 {
+        UM_status status;
+
+        assert(um->loaded);
+        if (um->status != UM_OK) {
+                return um->status;
+        }
+
+        status = execute(um, budget);
+        if (status == UM_OK) {
+                return UM_EXHAUSTED;
+        }
+        if (status != UM_BLOCKED) {
+                um->status = status;
+        }
+        return status;
+}
+
+/* Returns how many instructions the guest has executed outside the JIT. */
+uint64_t UM_executed(T um)
+{
+        return um->executed;
+}
+
+/* Returns a short description of status for error messages. */
+const char *UM_describe(UM_status status)
+{
+        switch (status) {
+        case UM_OK:
+                return "running";
+        case UM_HALTED:
+                return "halted";
+        case UM_INVALID:
+                return "Invalid Instruction.";
+        case UM_LOAD_ERROR:
+                return "Incompatible File Size.";
+        case UM_BLOCKED:
+                return "blocked on input";
+        case UM_EXHAUSTED:
+                return "out of budget";
+        case UM_FAULT:
+                return "Memory fault.";
+        }
+        return "unknown status";
+}
+
+/* Prints where the guest in um faulted and what it touched, if it stopped
+ * with UM_FAULT, to out. Only a guarded build can fault.
+ */
+void UM_report_fault(T um, FILE *out)
+{
+        if (um->status != UM_FAULT) {
+                return;
+        }
+#ifdef GUARD_SEGMENTS
+        switch (um->fault) {
+        case SEGMENT_PAST_END:
+                fprintf(out, "pc %" PRIu32 ": offset %" PRIu32 " of segment "
+                        "%" PRIu32 " is past its end (%" PRIu32 " words)\n",
+                        um->fault_pc, um->fault_offset, um->fault_id,
+                        Segment_length(um->memory, um->fault_id));
+                break;
+        case SEGMENT_UNMAPPED:
+                fprintf(out, "pc %" PRIu32 ": offset %" PRIu32 " of segment "
+                        "%" PRIu32 ", which is unmapped\n", um->fault_pc,
+                        um->fault_offset, um->fault_id);
+                break;
+        default:
+                fprintf(out, "pc %" PRIu32 ": address in no segment\n",
+                        um->fault_pc);
+                break;
+        }
+#else
+        (void) out;
+#endif
+}
+
+/* Runs at most budget instructions of segment 0 from um->pc, using
+ * whichever execution engine was selected at build time. Returns UM_OK if
+ * the budget ran out, otherwise how the guest stopped.
+ */
+UM_status execute(T um, uint64_t budget)
+{
+#ifdef REFERENCE_ENGINE
+        return execute_reference(um, budget);
+#elif defined(GUARD_SEGMENTS)
+        return execute_guarded(um, budget);
+#elif defined(WRITE_BARRIER)
+        return execute_barred(um, budget);
+#else
+        return execute_threaded(um, budget);
+#endif
+}
+
+/* Runs segment 0 on the JIT. Returns UM_HALTED if the guest does, otherwise
+ * UM_OK with the um ready for the interpreter to resume where the JIT
+ * stopped.
+ */
+UM_status execute_jit(T um)
+{
+        Jit_T jit = Jit_new(um->memory, um->io);
+        bool halted;
+
+        if (jit == NULL) {
+                return UM_OK;
+        }
+
+        halted = Jit_run(jit, um->registers, &um->pc);
+        Jit_free(&jit);
+        /* the JIT stores without telling the kept programs */
+        forget_programs(um);
+
+        if (halted) {
+                return UM_HALTED;
+        }
+        decode_program(um);
+        return UM_OK;
+}
+
+#ifdef REFERENCE_ENGINE
+/* Reference engine: routes every instruction through route_instruct, which
+ * calls the handlers in instructions.c through the function pointer arrays.
+ */
+UM_status execute_reference(T um, uint64_t budget)
+{
+        UM_status status = UM_OK;
         WORD_SIZE curr_inst;
-        int size = get_file_size(input);
+        uint64_t fuel = budget;
+
+        while (status == UM_OK && fuel > 0) {
+                curr_inst = Segment_ptr(um->memory, 0)[um->pc];
+                um->pc += 1;
+                fuel--;
+                status = route_instruct(um, curr_inst);
+        }
+        if (status == UM_BLOCKED) {
+                fuel++;
+        }
+        um->executed += budget - fuel;
+        return status;
+}
+
+#else
+/* Fetches the next predecoded instruction and jumps straight to its handler,
+ * unless the budget has run out. Computed gotos are a GNU extension, hence
+ * the __extension__ markers under -pedantic.
+ */
+#define DISPATCH() do {                                                 \
+                if (fuel == 0) {                                        \
+                        goto exhausted;                                 \
+                }                                                       \
+                fuel--;                                                 \
+                op = pc++;                                              \
+                GUARD_HOOK(um->current = op);                           \
+                PROFILE_HOOK(Profile_step(um->profile,                  \
+                                          op - Predecode_ops(program),  \
+                                          op->opcode));                 \
+                __extension__ ({ goto *handlers[op->opcode]; });        \
+        } while (0)
+
+#ifdef ARENA_SEGMENTS
+/* Points words at the words of segment id: in the arena every segment's
+ * words are at its id from segment 0's, so there is nothing to cache.
+ */
+#define LOAD_WORDS(words, id) do {                                      \
+                PROFILE_HOOK(Profile_access(um->profile, false,         \
+                                            PROFILE_CODE));             \
+                words = code + (id);                                    \
+        } while (0)
+#define STORE_WORDS(words, id) do {                                     \
+                PROFILE_HOOK(Profile_access(um->profile, true,          \
+                                            PROFILE_CODE));             \
+                words = code + (id);                                    \
+        } while (0)
+#define FORGET_SEGMENT(id)
+#define FORGET_SEGMENTS()
+
+#else
+/* Drops the program kept for words, if any, before they are stored into
+ * in place or released.
+ */
+#define FORGET_PROGRAM(words) do {                                      \
+                if (um->num_kept != 0) {                                \
+                        forget_program(um, (words));                    \
+                }                                                       \
+        } while (0)
+
+/* Points words at the words of segment id for a load: segment 0 through
+ * code, any other through the cache of the last segment loaded from,
+ * which is refilled on a miss.
+ */
+#define LOAD_WORDS(words, id) do {                                      \
+                ID_SIZE id_ = (id);                                     \
+                if (id_ == 0) {                                         \
+                        PROFILE_HOOK(Profile_access(um->profile, false, \
+                                                    PROFILE_CODE));     \
+                        words = code;                                   \
+                } else if (id_ == load_id) {                            \
+                        PROFILE_HOOK(Profile_access(um->profile, false, \
+                                                    PROFILE_HIT));      \
+                        words = load_words;                             \
+                } else {                                                \
+                        PROFILE_HOOK(Profile_access(um->profile, false, \
+                                                    PROFILE_MISS));     \
+                        load_words = Segment_ptr(memory, id_);          \
+                        load_id = id_;                                  \
+                        words = load_words;                             \
+                }                                                       \
+        } while (0)
+
+/* Points words at the words of segment id for a store: segment 0 through
+ * code_store once it has been made writable, any other through the cache
+ * of the last segment stored into. A miss may copy shared words, moving
+ * the segment cached for loads, so that cache is refilled too.
+ */
+#define STORE_WORDS(words, id) do {                                     \
+                ID_SIZE id_ = (id);                                     \
+                if (id_ == 0 && code_store != NULL) {                   \
+                        PROFILE_HOOK(Profile_access(um->profile, true,  \
+                                                    PROFILE_CODE));     \
+                        words = code_store;                             \
+                } else if (id_ == store_id) {                           \
+                        PROFILE_HOOK(Profile_access(um->profile, true,  \
+                                                    PROFILE_HIT));      \
+                        words = store_words;                            \
+                } else {                                                \
+                        PROFILE_HOOK(Profile_access(um->profile, true,  \
+                                                    PROFILE_MISS));     \
+                        if (id_ != 0) {                                 \
+                                FORGET_PROGRAM(Segment_ptr(memory,      \
+                                                           id_));       \
+                        }                                               \
+                        words = Segment_writable(memory, id_);          \
+                        if (id_ == 0) {                                 \
+                                code_store = words;                     \
+                        } else {                                        \
+                                store_words = words;                    \
+                                store_id = id_;                         \
+                        }                                               \
+                        if (load_id != NO_SEGMENT) {                    \
+                                load_words = Segment_ptr(memory,        \
+                                                         load_id);      \
+                        }                                               \
+                }                                                       \
+        } while (0)
+
+/* Empties the caches that hold segment id, and drops any program kept for
+ * its words, before it is unmapped.
+ */
+#define FORGET_SEGMENT(id) do {                                         \
+                FORGET_PROGRAM(Segment_ptr(memory, (id)));              \
+                if ((id) == load_id) {                                  \
+                        load_id = NO_SEGMENT;                           \
+                }                                                       \
+                if ((id) == store_id) {                                 \
+                        store_id = NO_SEGMENT;                          \
+                }                                                       \
+        } while (0)
+
+/* Empties every cache, after segment 0 is replaced. */
+#define FORGET_SEGMENTS() do {                                          \
+                code_store = NULL;                                      \
+                load_id = NO_SEGMENT;                                   \
+                store_id = NO_SEGMENT;                                  \
+        } while (0)
+#endif
+
+/* Takes the fuel for the extra instructions of a superinstruction, or runs
+ * only its first instruction, at plain_label, if the budget is too short.
+ */
+#define FUSED(extra, plain_label) do {                                  \
+                if (fuel < (extra)) {                                   \
+                        goto plain_label;                               \
+                }                                                       \
+                fuel -= (extra);                                        \
+        } while (0)
+
+/* Threaded engine: every handler is a label inside this function, and every
+ * handler ends in its own indirect jump to the next one, so the branch
+ * predictor sees one jump site per opcode instead of a single shared one.
+ * The registers live in a local array for the duration of the run, and
+ * instructions come from the predecoded copy of segment 0, which is
+ * rebuilt by load_program and patched by any store into segment 0. When
+ * the guest stops or the budget runs out, the registers and program
+ * counter go back into um.
+ *
+ * A superinstruction's handler steps op through the words of its run and
+ * either finishes the last one inline or jumps to its plain handler. A
+ * store into segment 0 may rewrite the words after it, so a store that is
+ * not the last of its run falls back to the plain handler for such stores.
+ *
+ * Loads and stores skip the segment table for segment 0 and for the last
+ * segment each of them used. Unmapping a cached segment empties its cache
+ * (so a later map can never find a stale id), and replacing segment 0
+ * empties them all, since it shares words between segments again. An
+ * arena build needs no caches: every segment is an add away from code.
+ */
+UM_status execute_threaded(T um, uint64_t budget)
+{
+        static void *const handlers[NUM_OPS] = {
+                __extension__ &&op_cmov,   __extension__ &&op_load,
+                __extension__ &&op_store,  __extension__ &&op_add,
+                __extension__ &&op_mul,    __extension__ &&op_div,
+                __extension__ &&op_nand,   __extension__ &&op_halt,
+                __extension__ &&op_map,    __extension__ &&op_unmap,
+                __extension__ &&op_output, __extension__ &&op_input,
+                __extension__ &&op_loadp,  __extension__ &&op_loadv,
+                __extension__ &&op_invalid, __extension__ &&op_invalid,
+                [FUSED_LOADV_LOAD] = __extension__ &&fused_loadv_load,
+                [FUSED_LOADV_STORE] = __extension__ &&fused_loadv_store,
+                [FUSED_LOADV_LOADV] = __extension__ &&fused_loadv_loadv,
+                [FUSED_LOADV_LOADP] = __extension__ &&fused_loadv_loadp,
+                [FUSED_LOADV_CMOV] = __extension__ &&fused_loadv_cmov,
+                [FUSED_STORE_LOADV] = __extension__ &&fused_store_loadv,
+                [FUSED_LOAD_LOADV] = __extension__ &&fused_load_loadv,
+                [FUSED_NAND_NAND] = __extension__ &&fused_nand_nand,
+                [FUSED_NAND_CMOV] = __extension__ &&fused_nand_cmov,
+                [FUSED_LOAD_LOADP] = __extension__ &&fused_load_loadp,
+                [FUSED_LOADV_STORE_LOADV] =
+                        __extension__ &&fused_loadv_store_loadv,
+                [FUSED_LOADV_LOAD_LOADV] =
+                        __extension__ &&fused_loadv_load_loadv,
+                [FUSED_LOAD_ADD_STORE] = __extension__ &&fused_load_add_store,
+#ifdef WRITE_BARRIER
+                [STALE] = __extension__ &&op_stale,
+                [UNCACHED] = __extension__ &&op_uncached
+#endif
+        };
+        Segment_T memory = um->memory;
+        Predecode_T program = um->program;
+        Io_T io = um->io;
+        REG_SIZE r[8];
+        const Op *pc = Predecode_ops(program) + um->pc;
+        const Op *op;
+        WORD_SIZE *code = Segment_ptr(memory, 0);
+        WORD_SIZE *words;
+#ifndef ARENA_SEGMENTS
+        WORD_SIZE *code_store = NULL;
+        WORD_SIZE *load_words = NULL, *store_words = NULL;
+        ID_SIZE load_id = NO_SEGMENT, store_id = NO_SEGMENT;
+#endif
+        WORD_SIZE target;
+        UM_status status;
+        uint64_t fuel = budget;
 
-        assert(Segment_map(um->memory, size) == 0);
+        for (int i = 0; i < 8; i++) {
+                r[i] = um->registers[i];
+        }
 
-        load_file(um, size, input);
+        DISPATCH();
 
-        while (true) {
-                curr_inst = *prog_copy;
-                route_instruct(um, curr_inst);
-                prog_copy += 1;
-                curr_inst = *prog_copy;
-                route_instruct(um, curr_inst);
-                prog_copy += 1;
-                curr_inst = *prog_copy;
-                route_instruct(um, curr_inst);
-                prog_copy += 1;
+op_cmov:
+        if (r[op->c] != 0) {
+                r[op->a] = r[op->b];
+        }
+        DISPATCH();
+op_load:
+        LOAD_WORDS(words, r[op->b]);
+        r[op->a] = words[r[op->c]];
+        DISPATCH();
+op_store:
+        STORE_WORDS(words, r[op->a]);
+        words[r[op->b]] = r[op->c];
+        PATCH_CODE(r[op->a], r[op->b], r[op->c]);
+        DISPATCH();
+op_add:
+        r[op->a] = r[op->b] + r[op->c];
+        DISPATCH();
+op_mul:
+        r[op->a] = r[op->b] * r[op->c];
+        DISPATCH();
+op_div:
+        r[op->a] = r[op->b] / r[op->c];
+        DISPATCH();
+op_nand:
+        r[op->a] = ~(r[op->b] & r[op->c]);
+        DISPATCH();
+op_halt:
+        status = UM_HALTED;
+        goto stop;
+op_map:
+        PROFILE_HOOK(Profile_map(um->profile, r[op->c]));
+        r[op->b] = Segment_map(memory, r[op->c]);
+        DISPATCH();
+op_unmap:
+        PROFILE_HOOK(Profile_unmap(um->profile, 
+                                   Segment_length(memory, r[op->c])));
+        FORGET_SEGMENT(r[op->c]);
+        Segment_unmap(memory, r[op->c]);
+        DISPATCH();
+op_output:
+        Io_put(io, r[op->c]);
+        DISPATCH();
+op_input:
+        if (!Io_ready(io)) {
+                /* try this input again when the guest is resumed */
+                status = UM_BLOCKED;
+                fuel++;
+                pc = op;
+                goto stop;
+        }
+        r[op->c] = Io_get(io);
+        DISPATCH();
+op_loadp:
+        /* op lives in the array that Predecode_load may replace */
+        target = r[op->c];
+        PROFILE_HOOK(Profile_jump(um->profile, op - Predecode_ops(program),
+                                  target, r[op->b] != 0, r));
+        if (r[op->b] != 0) {
+#ifdef WRITE_BARRIER
+                Barrier_disarm(um->barrier);
+#endif
+                switch_program(um, r[op->b]);
+                program = um->program;
+                code = Segment_ptr(memory, 0);
+                FORGET_SEGMENTS();
+                PROFILE_HOOK(Profile_load(um->profile, 
+                                          Segment_length(memory, 0),
+                                          Predecode_invalid(program)));
+        }
+        pc = Predecode_ops(program) + target;
+        DISPATCH();
+op_loadv:
+        r[op->a] = op->value;
+        DISPATCH();
+op_invalid:
+        status = UM_INVALID;
+        pc = op;
+        goto stop;
+#ifdef WRITE_BARRIER
+op_stale:
+        /* run op again once its page is decoded from what it holds now */
+        refresh_page(um, op - Predecode_ops(program));
+        fuel++;
+        pc = op;
+        DISPATCH();
+op_uncached:
+        /* the page keeps being stored into, so op is decoded from its word
+         * every time it runs and keeps its UNCACHED opcode */
+        target = decode_fields((Op *)op, code[op - Predecode_ops(program)]);
+        __extension__ ({ goto *handlers[target]; });
+#endif
+fused_loadv_load:
+        FUSED(1, op_loadv);
+        r[op->a] = op->value;
+        op = pc++;
+        LOAD_WORDS(words, r[op->b]);
+        r[op->a] = words[r[op->c]];
+        DISPATCH();
+fused_loadv_store:
+        FUSED(1, op_loadv);
+        r[op->a] = op->value;
+        op = pc++;
+        goto op_store;
+fused_loadv_loadv:
+        FUSED(1, op_loadv);
+        r[op->a] = op->value;
+        op = pc++;
+        r[op->a] = op->value;
+        DISPATCH();
+fused_loadv_loadp:
+        FUSED(1, op_loadv);
+        r[op->a] = op->value;
+        op = pc++;
+        goto op_loadp;
+fused_loadv_cmov:
+        FUSED(1, op_loadv);
+        r[op->a] = op->value;
+        op = pc++;
+        if (r[op->c] != 0) {
+                r[op->a] = r[op->b];
+        }
+        DISPATCH();
+fused_store_loadv:
+        if (r[op->a] == 0) {
+                goto op_store;
         }
-        return;
+        FUSED(1, op_store);
+        STORE_WORDS(words, r[op->a]);
+        words[r[op->b]] = r[op->c];
+        op = pc++;
+        r[op->a] = op->value;
+        DISPATCH();
+fused_load_loadv:
+        FUSED(1, op_load);
+        LOAD_WORDS(words, r[op->b]);
+        r[op->a] = words[r[op->c]];
+        op = pc++;
+        r[op->a] = op->value;
+        DISPATCH();
+fused_nand_nand:
+        FUSED(1, op_nand);
+        r[op->a] = ~(r[op->b] & r[op->c]);
+        op = pc++;
+        r[op->a] = ~(r[op->b] & r[op->c]);
+        DISPATCH();
+fused_nand_cmov:
+        FUSED(1, op_nand);
+        r[op->a] = ~(r[op->b] & r[op->c]);
+        op = pc++;
+        if (r[op->c] != 0) {
+                r[op->a] = r[op->b];
+        }
+        DISPATCH();
+fused_load_loadp:
+        FUSED(1, op_load);
+        LOAD_WORDS(words, r[op->b]);
+        r[op->a] = words[r[op->c]];
+        op = pc++;
+        goto op_loadp;
+fused_loadv_store_loadv:
+        FUSED(2, op_loadv);
+        r[op->a] = op->value;
+        op = pc++;
+        if (r[op->a] == 0) {
+                /* the loadv after it is run on its own */
+                fuel++;
+                goto op_store;
+        }
+        STORE_WORDS(words, r[op->a]);
+        words[r[op->b]] = r[op->c];
+        op = pc++;
+        r[op->a] = op->value;
+        DISPATCH();
+fused_loadv_load_loadv:
+        FUSED(2, op_loadv);
+        r[op->a] = op->value;
+        op = pc++;
+        LOAD_WORDS(words, r[op->b]);
+        r[op->a] = words[r[op->c]];
+        op = pc++;
+        r[op->a] = op->value;
+        DISPATCH();
+fused_load_add_store:
+        FUSED(2, op_load);
+        LOAD_WORDS(words, r[op->b]);
+        r[op->a] = words[r[op->c]];
+        op = pc++;
+        r[op->a] = r[op->b] + r[op->c];
+        op = pc++;
+        goto op_store;
+exhausted:
+        status = UM_OK;
+stop:
+        for (int i = 0; i < 8; i++) {
+                um->registers[i] = r[i];
+        }
+        um->pc = pc - Predecode_ops(program);
+        um->executed += budget - fuel;
+        return status;
+}
+#endif
+
+#ifdef GUARD_SEGMENTS
+/* Records what the address a guest faulted at was in um, the um running on
+ * this thread, and jumps back to execute_guarded. A fault outside the arena
+ * (or with no guest running) is a bug in the um itself: the handler puts
+ * the default action back and returns, so the instruction faults again
+ * and the process dies as it would have without a handler.
+ */
+static void guard_fault(int sig, siginfo_t *info, void *context)
+{
+        T um = guarded;
+
+        (void) context;
+        if (um != NULL) {
+                um->fault = Segment_explain(um->memory, info->si_addr,
+                                            &(um->fault_id),
+                                            &(um->fault_offset));
+                if (um->fault != SEGMENT_OUTSIDE) {
+                        siglongjmp(um->guard, 1);
+                }
+        }
+        signal(sig, SIG_DFL);
+}
+
+/* Runs execute_threaded, which guard_fault leaves through a jump back here
+ * if the guest touches a guard page or an unmapped segment. Its registers
+ * and the count of instructions it executed are lost with it, but it
+ * cannot run again anyway; its program counter is the instruction that
+ * faulted.
+ */
+UM_status execute_guarded(T um, uint64_t budget)
+{
+        UM_status status;
+
+        guarded = um;
+        if (sigsetjmp(um->guard, 1) != 0) {
+                guarded = NULL;
+                um->fault_pc = um->current - Predecode_ops(um->program);
+                um->pc = um->fault_pc;
+                return UM_FAULT;
+        }
+        status = execute_threaded(um, budget);
+        guarded = NULL;
+        return status;
+}
+#endif
+
+#ifdef WRITE_BARRIER
+/* Marks the page of segment 0 a store faulted on stale, if it is one of
+ * the running guest's, and returns to retry the store, which now succeeds.
+ * Marking the page is only stores into the predecoded program, so nothing
+ * here is unsafe in a signal handler.
+ */
+static void barrier_fault(int sig, siginfo_t *info, void *context)
+{
+        T um = barred;
+        unsigned page, page_words;
+
+        (void) context;
+        if (um != NULL && Barrier_fault(um->barrier, info->si_addr, &page)) {
+                page_words = Barrier_page_words(um->barrier);
+                Predecode_stale(um->program, page * page_words, page_words);
+                return;
+        }
+        signal(sig, SIG_DFL);
+}
+
+/* Runs execute_threaded with um as the guest barrier_fault serves. */
+UM_status execute_barred(T um, uint64_t budget)
+{
+        UM_status status;
+
+        barred = um;
+        status = execute_threaded(um, budget);
+        barred = NULL;
+        return status;
 }
 
+/* Protects the page holding offset again so the next store into it
+ * faults, and decodes it from segment 0 again, fusing only within it as
+ * Predecode_load did. The instructions of a page the barrier has given up
+ * on are decoded as they run from now on.
+ */
+void refresh_page(T um, WORD_SIZE offset)
+{
+        unsigned page_words = Barrier_page_words(um->barrier);
+        unsigned page = offset / page_words;
+
+        if (Barrier_clean(um->barrier, page)) {
+                Predecode_refresh(um->program, Segment_ptr(um->memory, 0),
+                                  page * page_words, page_words);
+        } else {
+                Predecode_uncache(um->program, page * page_words,
+                                  page_words);
+        }
+}
+
+/* Decodes the fields of word into op as Predecode_word would, but inline
+ * in the engine, since an UNCACHED instruction pays for it every time it
+ * runs. Only load value reads value, so the others leave it as it is.
+ */
+static inline unsigned decode_fields(Op *op, WORD_SIZE word)
+{
+        unsigned opcode = word >> OPCODE_LSB;
+
+        op->b = (word >> B_LSB) & 0x7;
+        op->c = (word >> C_LSB) & 0x7;
+        if (opcode == 13) {
+                op->a = (word >> (LOAD_VAL_LSB)) & 0x7;
+                op->value = word & ((1u << VAL_LENGTH) - 1);
+        } else {
+                op->a = (word >> A_LSB) & 0x7;
+        }
+        return opcode;
+}
+#endif
+
 /* Retrieves the opcode, registers and any other information in order
- * to perform the correct instruction. If instuction doesn't exist, exits
- * with exit failure.
+ * to perform the correct instruction. Returns UM_HALTED or UM_INVALID if
+ * the instruction stops the guest, UM_BLOCKED (with the program counter
+ * back on the instruction) if it is an input with none ready, and UM_OK
+ * otherwise.
  */
-void route_instruct(T um, WORD_SIZE instruct)
+UM_status route_instruct(T um, WORD_SIZE instruct)
 {
         WORD_SIZE opcode = instruct;
         opcode = opcode << (WORD_LEN - (OPCODE_LSB + (OPCODE_LEN)));
@@ -174,10 +1318,26 @@ void route_instruct(T um, WORD_SIZE instruct)
                 REG_SIZE *b_ptr = &((um->registers)[b_id]);
                 REG_SIZE *c_ptr = &((um->registers)[c_id]);
 
-                (*two_reg[opcode - 8]) (um->memory, b_ptr, c_ptr);
-
-                if (opcode == 12) {                
-                        prog_copy = prog_copy + *c_ptr - 1;
+                /* I/O goes to this um's device rather than the one the
+                 * handlers in instructions.c use
+                 */
+                switch (opcode) {
+                        case 10:
+                                Io_put(um->io, *c_ptr);
+                                break;
+                        case 11:
+                                if (!Io_ready(um->io)) {
+                                        um->pc -= 1;
+                                        return UM_BLOCKED;
+                                }
+                                *c_ptr = Io_get(um->io);
+                                break;
+                        case 12:
+                                load_program(um, b_ptr, c_ptr);
+                                break;
+                        default:
+                                (*two_reg[opcode - 8]) (um->memory, b_ptr, 
+                                                        c_ptr);
                 }
         }
             
@@ -185,9 +1345,7 @@ void route_instruct(T um, WORD_SIZE instruct)
                 WORD_SIZE val;
                 switch (opcode) {
                         case 7:
-                                UM_free(&um);
-                                halt();
-                                break;
+                                return UM_HALTED;
                         case 13:
                                 val = instruct;
                                 val = val << (WORD_LEN - (VAL_LSB + 
@@ -203,91 +1361,208 @@ void route_instruct(T um, WORD_SIZE instruct)
                                 load_value(a_ptr, val);
                                 break;
                         default:
-                                fprintf(stderr, "Invalid Instruction.\n");
-                                UM_free(&um);
-                                exit(EXIT_FAILURE);
+                                um->pc -= 1;
+                                return UM_INVALID;
                 }
             
         }
+        return UM_OK;
 }
 
-/* Takes a filename and checks the file size, if it is a valid um 
- * file, then the number of words in the file is returned.
+/* Frees the universal machine and all of its components, then reports
+ * the hardware counters, if they are on, with freeing counted as the
+ * teardown phase. Output and reports are written before that phase
+ * starts, so it counts only freeing.
  */
-size_t get_file_size(const char *filename)
-{
-        struct stat st;
-        int size;
-        if (stat(filename, &st) != 0) {
-                fprintf(stderr, "Incompatible File Size.\n");
-                exit(EXIT_FAILURE);
-        }
-        
-        size = st.st_size;
-
-        if (size % 4 != 0) {
-                fprintf(stderr, "Incompatible File Size.\n");
-                exit(EXIT_FAILURE);
-        }
-        return size / 4;
-}
-
-/* Takes a file name, opens the file and reads a word at a 
- * time in order to store it in segment 0.
- */
-void load_file(T um, int size, const char *input)
-{
-        WORD_SIZE word = 0;
-        WORD_SIZE num_words = size;
-        unsigned char c;
-        FILE *fp = fopen(input, "rb");
-        for (WORD_SIZE i = 0; i < num_words; i++) {
-                c = getc(fp);
-                word = Bitpack_newu(word, 8, 24, (uint64_t)c);
-                c = getc(fp);
-                word = Bitpack_newu(word, 8, 16, (uint64_t)c);
-                c = getc(fp);
-                word = Bitpack_newu(word, 8, 8, (uint64_t)c);
-                c = getc(fp);
-                word = Bitpack_newu(word, 8, 0, (uint64_t)c);
-                
-                Segment_store(um->memory, 0, i, word);
-        }
-        prog_copy = Segment_ptr(um->memory, 0);
-        fclose(fp);
-}
-
-void function_array_init()
-{
-        three_reg[0] = conditional_move;
-        three_reg[1] = load;
-        three_reg[2] = store;
-        three_reg[3] = add;
-        three_reg[4] = multiply;
-        three_reg[5] = divide;
-        three_reg[6] = nand;
-        two_reg[0] = map_segment;
-        two_reg[1] = unmap_segment;
-        two_reg[2] = output;
-        two_reg[3] = input;
-        two_reg[4] = load_program;
-
-}
-/* Frees the universal machine and all of its components. */
 void UM_free(T *um)
 {
+        Io_flush((*um)->io);
+#ifdef POOL_STATS
+        Segment_report((*um)->memory, stderr);
+#ifdef WRITE_BARRIER
+        Barrier_report((*um)->barrier, stderr);
+#endif
+#endif
+#ifdef PROFILE
+        write_profile(*um);
+#endif
+        Hwcount_start((*um)->hw, HWCOUNT_TEARDOWN);
+#ifdef WRITE_BARRIER
+        Barrier_free(&((*um)->barrier));
+#endif
+#ifdef PROFILE
+        Profile_free(&((*um)->profile));
+        free((*um)->profile_path);
+#endif
         Segment_free(&((*um)->memory));
+        if ((*um)->snapshot != NULL) {
+                munmap((*um)->snapshot, (*um)->snapshot_bytes);
+        }
+        Predecode_free(&((*um)->program));
+        for (int i = 0; i < KEPT_PROGRAMS; i++) {
+                if ((*um)->kept[i].program != NULL) {
+                        Predecode_free(&((*um)->kept[i].program));
+                }
+        }
         free((*um)->registers);
+        if ((*um)->hw != NULL) {
+                Hwcount_stop((*um)->hw);
+                Hwcount_report((*um)->hw, stderr);
+                Hwcount_free(&((*um)->hw));
+        }
         free(*um);
+        *um = NULL;
 }
 
-void load_program(Segment_T seg_memory, REG_SIZE *reg_b, REG_SIZE *reg_c)
+/* Predecodes segment 0 into um->program. With the write barrier, segment 0
+ * is first given pages of its own, so the barrier protects nothing else,
+ * and then protected.
+ */
+void decode_program(T um)
+{
+        WORD_SIZE length = Segment_length(um->memory, 0);
+
+        Predecode_load(um->program, protect_program(um), length);
+}
+
+/* Returns the words of segment 0. With the write barrier, they are first
+ * given pages of their own, so the barrier protects nothing else, and then
+ * protected.
+ */
+const WORD_SIZE *protect_program(T um)
+{
+#ifdef WRITE_BARRIER
+        WORD_SIZE *words = Segment_isolate(um->memory);
+
+        Barrier_arm(um->barrier, words, Segment_length(um->memory, 0));
+        return words;
+#else
+        return Segment_ptr(um->memory, 0);
+#endif
+}
+
+/* Replaces segment 0 with segment id and um->program with its predecoded
+ * copy. The words of id are shared with segment 0 rather than copied, so
+ * if they have a kept program, it is still theirs: a store into id or an
+ * unmap of it would have dropped it first. The old program is kept in
+ * turn if its words outlive segment 0 in another segment, taking the
+ * oldest slot if the words of id had none. Only words that were segment 0
+ * and are shared are ever kept, so none are kept in the arena, which
+ * copies. With the write barrier, a kept program may have pages marked
+ * stale that are not, which only costs decoding them again.
+ */
+void switch_program(T um, ID_SIZE id)
+{
+        Segment_T memory = um->memory;
+        const WORD_SIZE *old = Segment_ptr(memory, 0);
+        const WORD_SIZE *words = Segment_ptr(memory, id);
+        bool keep = Segment_shared(memory, 0) && words != old;
+        Kept_program *slot = NULL;
+        Predecode_T program;
+        bool hit;
+
+        Segment_move(memory, id, 0);
+        if (words == old) {
+                /* segment 0 already had these words and their program */
+                protect_program(um);
+                return;
+        }
+        for (int i = 0; i < KEPT_PROGRAMS && um->num_kept != 0; i++) {
+                if (um->kept[i].words == words) {
+                        slot = &(um->kept[i]);
+                        break;
+                }
+        }
+        hit = (slot != NULL);
+        if (!hit && keep) {
+                slot = &(um->kept[um->next_kept]);
+                um->next_kept = (um->next_kept + 1) % KEPT_PROGRAMS;
+                if (slot->program == NULL) {
+                        slot->program = Predecode_like(um->program);
+                }
+        }
+        if (slot != NULL) {
+                um->num_kept -= (slot->words != NULL);
+                program = slot->program;
+                slot->program = um->program;
+                um->program = program;
+                slot->words = keep ? old : NULL;
+                um->num_kept += keep;
+        }
+        if (hit) {
+                protect_program(um);
+        } else {
+                decode_program(um);
+        }
+}
+
+/* Drops the program kept for words, if any, leaving its slot free. */
+void forget_program(T um, const WORD_SIZE *words)
+{
+        for (int i = 0; i < KEPT_PROGRAMS; i++) {
+                if (words != NULL && um->kept[i].words == words) {
+                        um->kept[i].words = NULL;
+                        um->num_kept--;
+                }
+        }
+}
+
+/* Drops every kept program, after memory changed behind their backs. */
+void forget_programs(T um)
+{
+        for (int i = 0; i < KEPT_PROGRAMS; i++) {
+                um->kept[i].words = NULL;
+        }
+        um->num_kept = 0;
+}
+
+#ifdef PROFILE
+/* Writes the profile of um to <prefix>.prof and <prefix>.folded with the
+ * prefix given to UM_profile_to, unless there is none or the um ran no
+ * instructions (as a fork server does).
+ */
+void write_profile(T um)
+{
+        size_t size;
+        char *path;
+        FILE *fp;
+
+        if (um->profile_path == NULL ||
+            Profile_instructions(um->profile) == 0) {
+                return;
+        }
+        size = strlen(um->profile_path) + 16;
+        path = malloc(size);
+        assert(path != NULL);
+
+        Profile_huge(um->profile, Segment_huge_stats(um->memory));
+        snprintf(path, size, "%s.prof", um->profile_path);
+        fp = fopen(path, "w");
+        if (fp != NULL) {
+                Profile_report(um->profile, fp);
+                fclose(fp);
+                fprintf(stderr, "Profile written to %s\n", path);
+        }
+
+        snprintf(path, size, "%s.folded", um->profile_path);
+        fp = fopen(path, "w");
+        if (fp != NULL) {
+                Profile_folded(um->profile, fp);
+                fclose(fp);
+        }
+        free(path);
+}
+#endif
+
+/* Loads the segment identified by reg_b and makes a duplicate to replace
+ * contents of segment 0 (which is abandoned). Program counter is set to
+ * the word offset of reg_c.
+ */
+void load_program(T um, REG_SIZE *reg_b, REG_SIZE *reg_c)
 {
         if (*reg_b != 0) {
-                Segment_move(seg_memory, *reg_b, 0);        
+                Segment_move(um->memory, *reg_b, 0);        
         }  
 
-        prog_copy = Segment_ptr(seg_memory, 0);
-        (void) reg_c;
+        um->pc = *reg_c;
 }
-
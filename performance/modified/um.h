@@ -0,0 +1,140 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the UM as a library. Everything a guest owns (its memory,
+ * registers, program counter and I/O device) lives in its UM_T, so any
+ * number of them can run in one process, on as many threads as there are
+ * guests. Nothing here exits the process: halting, an invalid instruction
+ * and a program that cannot be loaded all come back as a UM_status.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "io.h"
+#include "segment.h"
+#ifndef UM_H_INCLUDED
+#define UM_H_INCLUDED
+#define T UM_T
+typedef struct T *T;
+
+/* What became of a guest. UM_OK means it can still run; so can a guest
+ * that is UM_BLOCKED on input or UM_EXHAUSTED its budget in UM_step. Only
+ * a um built with -DGUARD_SEGMENTS stops with UM_FAULT.
+ */
+typedef enum UM_status {
+        UM_OK = 0,
+        UM_HALTED,
+        UM_INVALID,
+        UM_LOAD_ERROR,
+        UM_BLOCKED,
+        UM_EXHAUSTED,
+        UM_FAULT
+} UM_status;
+
+/* Creates a universal machine with no program, all registers 0 and io as
+ * its I/O device. io belongs to the caller and must outlive the um.
+ */
+T UM_new(Io_T io);
+
+/* Frees the universal machine and all of its components, after flushing its
+ * I/O device.
+ */
+void UM_free(T *um);
+
+/* Chooses whether UM_run starts segment 0 on the JIT (off by default). */
+void UM_use_jit(T um, bool use_jit);
+
+/* Chooses the superinstructions the interpreter fuses in programs loaded
+ * from now on, from list: names like "loadv+load" separated by commas, or
+ * "default", "all" or "none". Must be called before the um has a program.
+ * Returns false, changing nothing, if a name is unknown.
+ */
+bool UM_fuse(T um, const char *list);
+
+/* Puts segments of at least threshold bytes (none if 0) on huge pages:
+ * transparent ones, or from the hugetlbfs pool first if hugetlb is set
+ * and it has room. Segments of 2 MB and up get transparent huge pages by
+ * default. Must be called before the um has a program.
+ */
+void UM_huge_pages(T um, size_t threshold, bool hugetlb);
+
+/* Counts what the um does from now on with the processor's hardware
+ * counters (cycles, instructions, branches and their misses, and last
+ * level cache misses, as far as it has them), split into loading the
+ * program, UM_run and UM_free, and prints the counts to stderr from
+ * UM_free. A profiling build also splits the counts of UM_run by the class
+ * of opcode running. Must be called before the um has a program.
+ */
+void UM_hwcounters(T um);
+
+/* Has UM_free write the profile of a profiling build to prefix.prof and
+ * prefix.folded, if the um ran any instructions; without a prefix no
+ * profile is written. prefix is copied. Returns false, changing nothing,
+ * if the um was not built with -DPROFILE.
+ */
+bool UM_profile_to(T um, const char *prefix);
+
+/* Loads the um binary at path into segment 0 of a um that has no program
+ * yet. Returns UM_OK, or UM_LOAD_ERROR if the file cannot be read or is not
+ * a whole number of words.
+ */
+UM_status UM_load(T um, const char *path);
+
+/* Makes a um that has no program yet the guest saved by UM_save to the
+ * snapshot at path, ready to run from where it was saved. The file is
+ * mapped rather than read. Returns UM_OK, or UM_LOAD_ERROR if it cannot be
+ * read or is not a snapshot from a machine of the same byte order.
+ */
+UM_status UM_restore(T um, const char *path);
+
+/* Writes everything the guest in um owns but its I/O device (registers,
+ * program counter and all mapped segments) to a snapshot file at path,
+ * after flushing its output. A guest that has halted or hit an invalid
+ * instruction cannot be saved. Returns whether the file was written.
+ */
+bool UM_save(T um, const char *path);
+
+/* Makes a um that has no program yet the guest whose segments are in
+ * memory, with the 8 registers at registers and its next instruction at
+ * offset pc of segment 0, as a runtime that started the guest some other
+ * way hands it over. memory belongs to the um from then on and replaces
+ * the one it was created with.
+ */
+void UM_adopt(T um, Segment_T memory, const uint32_t *registers,
+              uint32_t pc);
+
+/* Runs the loaded program until it halts (UM_HALTED), executes an invalid
+ * instruction (UM_INVALID) or, in a guarded build, touches memory outside
+ * its segments (UM_FAULT). Running a um that has stopped returns the same
+ * status again. If the I/O device can block (see Io_ready), a guest
+ * waiting for input returns UM_BLOCKED and can be run again once there is
+ * some. The JIT hands the guest to the interpreter at the first input
+ * instruction with no input ready.
+ */
+UM_status UM_run(T um);
+
+/* Interprets at most budget instructions of the loaded program. Returns
+ * UM_EXHAUSTED if it used them all, UM_BLOCKED if it stopped at an input
+ * instruction with no input ready (which runs first when it is stepped
+ * again), or UM_HALTED, UM_INVALID or UM_FAULT once it stops for good.
+ * Never uses the JIT.
+ */
+UM_status UM_step(T um, uint64_t budget);
+
+/* Returns how many instructions the guest has executed so far, not
+ * counting any run on the JIT.
+ */
+uint64_t UM_executed(T um);
+
+/* Returns a short description of status for error messages. */
+const char *UM_describe(UM_status status);
+
+/* If the guest in um stopped with UM_FAULT, prints the instruction that
+ * faulted and the segment and offset it touched to out.
+ */
+void UM_report_fault(T um, FILE *out);
+
+#undef T
+#endif
@@ -0,0 +1,272 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * umbatch: runs many um programs at once as guests of the scheduler in
+ * sched.c, which steps them a quantum of instructions at a time on a few
+ * worker threads. Jobs are read one per line from the file named on the
+ * command line, or from standard input:
+ *
+ *     program.um [input [output]]
+ *
+ * Each guest gets the contents of its input file fed to it and then the
+ * end of input; a missing input is an empty one. Its output goes to its
+ * own output file, or is thrown away if that is missing or -. When all of
+ * them have stopped a line per job gives its program, how it stopped and
+ * the instructions it executed, in the order of the job file.
+ *
+ * In a -DPROFILE build, -p PREFIX (or the UM_PROFILE environment
+ * variable) writes the profile of job n, counting from 0, to
+ * PREFIX.n.prof and PREFIX.n.folded.
+ *
+ *     ./umbatch -j 8 -q 100000 jobs.txt
+ */
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "um.h"
+#include "sched.h"
+#define MAX_LINE 4096
+#define DEFAULT_QUANTUM 100000
+
+/* A guest to run: the paths from the job file (NULL when left out), its
+ * number in the scheduler (-1 if it could not be started), the descriptor
+ * of its output file and whether a file could not be opened.
+ */
+typedef struct Job {
+        char *program;
+        char *input;
+        char *output;
+        int guest;
+        int out_fd;
+        bool io_error;
+} Job;
+
+/* Reads the jobs from fp into a new array and stores how many there are in
+ * num_jobs. Blank lines and lines starting with # are skipped.
+ */
+Job *read_jobs(FILE *fp, unsigned *num_jobs);
+
+/* Opens the files of job and adds it to sched with all of its input,
+ * writing its profile to profile.prof (none if NULL) in a profiling build.
+ */
+void start_job(Sched_T sched, Job *job, const char *profile);
+
+/* Returns a copy of the next whitespace separated word of the line at
+ * *line, or NULL if there is none or it is -, and moves *line past it.
+ */
+char *next_word(char **line);
+
+
+int main(int argc, char *argv[])
+{
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        uint64_t quantum = DEFAULT_QUANTUM;
+        const char *profile = getenv("UM_PROFILE");
+        FILE *fp = stdin;
+        unsigned num_jobs;
+        int i;
+
+        for (i = 1; i < argc && strncmp(argv[i], "-", 1) == 0; i++) {
+                if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                        threads = strtol(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+                        quantum = strtoull(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+#ifndef PROFILE
+                        fprintf(stderr, "Error: -p needs a -DPROFILE "
+                                "build\n");
+                        exit(EXIT_FAILURE);
+#endif
+                        profile = argv[++i];
+                } else {
+                        fprintf(stderr, "Usage: %s [-j threads] "
+                                "[-q quantum] [-p prefix] [jobs]\n",
+                                argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (i < argc) {
+                fp = fopen(argv[i], "r");
+                if (fp == NULL) {
+                        fprintf(stderr, "Error: cannot read %s\n", argv[i]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (threads < 1) {
+                threads = 1;
+        }
+        if (quantum == 0) {
+                quantum = DEFAULT_QUANTUM;
+        }
+
+        Job *jobs = read_jobs(fp, &num_jobs);
+        if (fp != stdin) {
+                fclose(fp);
+        }
+
+        Sched_T sched = Sched_new(threads, quantum);
+        for (unsigned j = 0; j < num_jobs; j++) {
+                char path[MAX_LINE];
+
+                if (profile != NULL) {
+                        snprintf(path, sizeof(path), "%s.%u", profile, j);
+                }
+                start_job(sched, &jobs[j], profile != NULL ? path : NULL);
+        }
+        Sched_wait(sched);
+
+        int failed = 0;
+        for (unsigned j = 0; j < num_jobs; j++) {
+                Job *job = &jobs[j];
+                const char *how = "I/O error.";
+                uint64_t executed = 0;
+
+                if (job->guest >= 0) {
+                        UM_status status = Sched_status(sched, job->guest);
+                        how = UM_describe(status);
+                        executed = Sched_executed(sched, job->guest);
+                        failed |= (status != UM_HALTED);
+                } else if (!job->io_error) {
+                        how = UM_describe(UM_LOAD_ERROR);
+                }
+                failed |= (job->guest < 0);
+                printf("%s\t%s\t%" PRIu64 "\n", job->program, how, executed);
+        }
+
+        /* freeing the scheduler flushes the guests' output */
+        Sched_free(&sched);
+        for (unsigned j = 0; j < num_jobs; j++) {
+                if (jobs[j].out_fd >= 0) {
+                        close(jobs[j].out_fd);
+                }
+                free(jobs[j].program);
+                free(jobs[j].input);
+                free(jobs[j].output);
+        }
+        free(jobs);
+        return failed ? EXIT_FAILURE : 0;
+}
+
+/* Reads the jobs from fp into a new array and stores how many there are in
+ * num_jobs. Blank lines and lines starting with # are skipped.
+ */
+Job *read_jobs(FILE *fp, unsigned *num_jobs)
+{
+        char line[MAX_LINE];
+        unsigned capacity = 16;
+        Job *jobs = malloc(capacity * sizeof(Job));
+
+        *num_jobs = 0;
+        while (jobs != NULL && fgets(line, sizeof(line), fp) != NULL) {
+                char *rest = line;
+                char *program = next_word(&rest);
+
+                if (program == NULL || program[0] == '#') {
+                        free(program);
+                        continue;
+                }
+                if (*num_jobs == capacity) {
+                        capacity *= 2;
+                        jobs = realloc(jobs, capacity * sizeof(Job));
+                        if (jobs == NULL) {
+                                break;
+                        }
+                }
+
+                Job *job = &jobs[(*num_jobs)++];
+                job->program = program;
+                job->input = next_word(&rest);
+                job->output = next_word(&rest);
+                job->guest = -1;
+                job->out_fd = -1;
+                job->io_error = false;
+        }
+        if (jobs == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        return jobs;
+}
+
+/* Opens the output file of job, adds the job to sched, and feeds it the
+ * whole of its input file followed by the end of input. A program that
+ * cannot be opened is an I/O error, so that only a program that opens but
+ * is not a whole number of words is reported as a load error.
+ */
+void start_job(Sched_T sched, Job *job, const char *profile)
+{
+        unsigned char *input = NULL;
+        size_t length = 0;
+        int program_fd = open(job->program, O_RDONLY);
+
+        if (program_fd < 0) {
+                job->io_error = true;
+                return;
+        }
+        close(program_fd);
+        if (job->input != NULL) {
+                FILE *in = fopen(job->input, "rb");
+                struct stat st;
+
+                if (in == NULL || fstat(fileno(in), &st) != 0) {
+                        job->io_error = true;
+                        if (in != NULL) {
+                                fclose(in);
+                        }
+                        return;
+                }
+                input = malloc(st.st_size + 1);
+                if (input == NULL) {
+                        fprintf(stderr, "Out of memory.\n");
+                        exit(EXIT_FAILURE);
+                }
+                length = fread(input, 1, st.st_size, in);
+                fclose(in);
+        }
+        if (job->output != NULL) {
+                job->out_fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC,
+                                   0666);
+                if (job->out_fd < 0) {
+                        job->io_error = true;
+                        free(input);
+                        return;
+                }
+        }
+
+        job->guest = Sched_add(sched, job->program, job->out_fd, profile);
+        if (job->guest >= 0) {
+                Sched_feed(sched, job->guest, input, length);
+                Sched_close_input(sched, job->guest);
+        }
+        free(input);
+}
+
+/* Returns a copy of the next whitespace separated word of the line at
+ * *line, or NULL if there is none or it is -, and moves *line past it.
+ */
+char *next_word(char **line)
+{
+        char *start = *line + strspn(*line, " \t\r\n");
+        size_t length = strcspn(start, " \t\r\n");
+
+        *line = start + length;
+        if (length == 0 || (length == 1 && start[0] == '-')) {
+                return NULL;
+        }
+
+        char *word = malloc(length + 1);
+        if (word == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(word, start, length);
+        word[length] = '\0';
+        return word;
+}
@@ -0,0 +1,787 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * umbench: benchmark driver for um builds. Runs midmark.um, sandmark.umz
+ * and advent.umz (with solutions.txt as its input) through each um given
+ * with --um, a few times to warm up and then --runs times for real, and
+ * prints the median and 95th percentile of the wall clock and user time of
+ * each, one row per um and benchmark, as CSV or JSON:
+ *
+ *     ./umbench --runs 10 --um ../../um/um --um ../initial/um --um ./um
+ *
+ * Input is read into memory once and written to every run through a pipe,
+ * so no run waits on the disk for it, and output is thrown away. The
+ * number of instructions each benchmark executes is counted once, in
+ * process, by the engine of um.c; every correct um executes the same
+ * instructions, so the count gives instructions per second for builds
+ * that cannot count for themselves.
+ *
+ * --program replaces the three benchmarks with the programs given, run
+ * with no input, such as the synthetic workloads of umgen:
+ *
+ *     ./umbench --program churn.um --program stream.um --um ./um
+ *
+ * --startup adds two rows timing startup alone: launching the um on
+ * sandmark.umz with --load-only, and asking a um started once with
+ * --fork-server --load-only for a run, from writing the request to reading
+ * the reply.
+ *
+ * --decode runs a microbenchmark instead: the words of each benchmark's
+ * file are decoded into predecoded instructions with the shift pairs of
+ * route_instruct in um.c, one Predecode_word at a time as Predecode_load
+ * once did, and with Predecode_decode, and the median nanoseconds per word
+ * of each are printed.
+ */
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "segment.h"
+#include "loader.h"
+#include "io.h"
+#include "predecode.h"
+#include "um.h"
+#define WORD_SIZE uint32_t
+#define REG_SIZE uint32_t
+#define DEFAULT_RUNS 5
+#define DEFAULT_WARMUP 1
+#define MAX_UMS 16
+#define MAX_PROGRAMS 16
+#define MAX_LINE 256
+#define DECODE_WORDS (1u << 24)
+#define NUM_DECODERS 3
+
+/* A program to benchmark, the file its input comes from (NULL for none),
+ * the options it is run with after the path of the um and whether each run
+ * is a request to a fork server rather than a process of its own.
+ */
+typedef struct Benchmark {
+        const char *program;
+        const char *input;
+        const char *option;
+        bool served;
+} Benchmark;
+
+/* The benchmarks run by default, looked up in the current directory. */
+static const Benchmark benchmarks[] = {
+        { "midmark.um",   NULL,            NULL, false },
+        { "sandmark.umz", NULL,            NULL, false },
+        { "advent.umz",   "solutions.txt", NULL, false },
+};
+
+/* Startup alone: loading sandmark.umz without running it, from a new
+ * process and from a fork server. Only builds that understand --load-only
+ * and --fork-server can run these.
+ */
+static const Benchmark startups[] = {
+        { "sandmark.umz", NULL, "--load-only", false },
+        { "sandmark.umz", NULL, "--load-only", true },
+};
+
+/* A um running as a fork server: its process, and the ends of the pipes
+ * requests are written to and replies read from.
+ */
+typedef struct Server {
+        pid_t pid;
+        FILE *requests;
+        FILE *replies;
+} Server;
+
+/* The timings of one um on one benchmark, in seconds. */
+typedef struct Result {
+        const char *um;
+        const Benchmark *benchmark;
+        unsigned runs;
+        uint64_t instructions;
+        double wall_median, wall_p95;
+        double user_median, user_p95;
+} Result;
+
+/* Reads the whole file at path into a new buffer and stores its size in
+ * length.
+ */
+unsigned char *read_input(const char *path, size_t *length);
+
+/* Returns the number of instructions the program at path executes before it
+ * halts, given the length bytes at input.
+ */
+uint64_t count_instructions(const char *path, const unsigned char *input,
+                            size_t length);
+
+/* Runs benchmark once on the um at um with the length bytes at input on its
+ * standard input, and stores the wall clock and user time it took. Exits
+ * if the um does not halt normally.
+ */
+void run_once(const char *um, const Benchmark *benchmark,
+              const unsigned char *input, size_t length,
+              double *wall, double *user);
+
+/* Writes all length bytes at buf to fd, giving up quietly if the reader goes
+ * away first.
+ */
+void write_all(int fd, const unsigned char *buf, size_t length);
+
+/* Starts the um at um as a fork server for benchmark. */
+void start_server(const char *um, const Benchmark *benchmark,
+                  Server *server);
+
+/* Sends server a request for one run of benchmark and stores the wall
+ * clock time until its reply and the user time the run took. Exits if the
+ * run does not halt normally.
+ */
+void run_served(Server *server, const Benchmark *benchmark,
+                double *wall, double *user);
+
+/* Ends the requests to server and waits for it to exit. */
+void stop_server(Server *server);
+
+/* Returns the options benchmark runs with, as printed in the results. */
+static const char *option_name(const Benchmark *benchmark);
+
+/* Sorts the n times and returns the one at the given percentile, using the
+ * nearest rank.
+ */
+double percentile(double *times, unsigned n, unsigned percent);
+
+/* Orders two times for qsort. */
+static int compare_times(const void *x, const void *y);
+
+/* Returns the instructions per second of result at its median wall clock
+ * time, or 0 if nothing was counted.
+ */
+static double per_second(const Result *result);
+
+/* Prints the results as CSV with a header row. */
+void print_csv(const Result *results, unsigned n, FILE *out);
+
+/* Prints the results as a JSON array of objects. */
+void print_json(const Result *results, unsigned n, FILE *out);
+
+/* A way of decoding n words into Ops, for --decode. */
+typedef void Decoder(Op *ops, const WORD_SIZE *words, unsigned n);
+
+/* Times each decoder on the words of every benchmark's file, runs times
+ * over at least DECODE_WORDS words, and prints the median nanoseconds per
+ * word of each as CSV or JSON. Exits if they do not all decode the same.
+ */
+void bench_decode(unsigned runs, bool json, FILE *out);
+
+/* Decodes n words with the shift pairs route_instruct pulls a word apart
+ * with.
+ */
+static void decode_shifts(Op *ops, const WORD_SIZE *words, unsigned n);
+
+/* Decodes n words one Predecode_word at a time. */
+static void decode_words(Op *ops, const WORD_SIZE *words, unsigned n);
+
+/* Decodes n words with Predecode_decode. */
+static void decode_simd(Op *ops, const WORD_SIZE *words, unsigned n);
+
+
+int main(int argc, char *argv[])
+{
+        const char *ums[MAX_UMS];
+        unsigned num_ums = 0;
+        Benchmark programs[MAX_PROGRAMS];
+        unsigned num_programs = 0;
+        unsigned runs = DEFAULT_RUNS;
+        unsigned warmup = DEFAULT_WARMUP;
+        bool json = false;
+        bool with_startup = false;
+        bool decode = false;
+        int i;
+
+        for (i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--um") == 0 && i + 1 < argc) {
+                        if (num_ums == MAX_UMS) {
+                                fprintf(stderr, "Error: too many ums\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        ums[num_ums++] = argv[++i];
+                } else if (strcmp(argv[i], "--program") == 0 &&
+                           i + 1 < argc) {
+                        if (num_programs == MAX_PROGRAMS) {
+                                fprintf(stderr, "Error: too many programs\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        programs[num_programs].program = argv[++i];
+                        programs[num_programs].input = NULL;
+                        programs[num_programs].option = NULL;
+                        programs[num_programs].served = false;
+                        num_programs++;
+                } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+                        runs = strtoul(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+                        warmup = strtoul(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "--json") == 0) {
+                        json = true;
+                } else if (strcmp(argv[i], "--csv") == 0) {
+                        json = false;
+                } else if (strcmp(argv[i], "--startup") == 0) {
+                        with_startup = true;
+                } else if (strcmp(argv[i], "--decode") == 0) {
+                        decode = true;
+                } else {
+                        fprintf(stderr, "Usage: %s [--um path]... [--runs n] "
+                                "[--warmup n] [--csv | --json] [--startup]\n"
+                                "       [--program path]...\n"
+                                "       %s --decode [--runs n] "
+                                "[--csv | --json]\n", argv[0], argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (runs == 0) {
+                fprintf(stderr, "Error: --runs must be at least 1\n");
+                exit(EXIT_FAILURE);
+        }
+        if (decode) {
+                bench_decode(runs, json, stdout);
+                return 0;
+        }
+        if (num_ums == 0) {
+                ums[num_ums++] = "./um";
+        }
+
+        /* a um that quits without reading all of its input must not kill
+         * the driver as well
+         */
+        signal(SIGPIPE, SIG_IGN);
+
+        const Benchmark *list = (num_programs > 0) ? programs : benchmarks;
+        unsigned num_benchmarks = (num_programs > 0) ? num_programs :
+                                  sizeof(benchmarks) / sizeof(benchmarks[0]);
+        unsigned num_startups = sizeof(startups) / sizeof(startups[0]);
+        unsigned total = num_benchmarks + (with_startup ? num_startups : 0);
+        Result *results = calloc(num_ums * total, sizeof(Result));
+        double *walls = malloc(runs * sizeof(double));
+        double *users = malloc(runs * sizeof(double));
+        unsigned n = 0;
+
+        if (results == NULL || walls == NULL || users == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (unsigned b = 0; b < total; b++) {
+                const Benchmark *benchmark = (b < num_benchmarks) ?
+                                             &list[b] :
+                                             &startups[b - num_benchmarks];
+                size_t length = 0;
+                unsigned char *input = NULL;
+                uint64_t instructions = 0;
+
+                if (benchmark->input != NULL) {
+                        input = read_input(benchmark->input, &length);
+                }
+                if (benchmark->option == NULL) {
+                        fprintf(stderr, "umbench: counting %s\n",
+                                benchmark->program);
+                        instructions = count_instructions(benchmark->program,
+                                                          input, length);
+                }
+
+                for (unsigned u = 0; u < num_ums; u++) {
+                        Result *result = &results[n++];
+                        Server server;
+
+                        fprintf(stderr, "umbench: %s %s %s\n", ums[u],
+                                option_name(benchmark), benchmark->program);
+                        if (benchmark->served) {
+                                start_server(ums[u], benchmark, &server);
+                        }
+                        for (unsigned r = 0; r < warmup + runs; r++) {
+                                /* warmup runs are timed into walls[0] and
+                                 * overwritten by the first real one */
+                                unsigned slot = (r < warmup) ? 0 : r - warmup;
+
+                                if (benchmark->served) {
+                                        run_served(&server, benchmark,
+                                                   &walls[slot],
+                                                   &users[slot]);
+                                } else {
+                                        run_once(ums[u], benchmark, input,
+                                                 length, &walls[slot],
+                                                 &users[slot]);
+                                }
+                        }
+                        if (benchmark->served) {
+                                stop_server(&server);
+                        }
+
+                        result->um = ums[u];
+                        result->benchmark = benchmark;
+                        result->runs = runs;
+                        result->instructions = instructions;
+                        result->wall_median = percentile(walls, runs, 50);
+                        result->wall_p95 = percentile(walls, runs, 95);
+                        result->user_median = percentile(users, runs, 50);
+                        result->user_p95 = percentile(users, runs, 95);
+                }
+                free(input);
+        }
+
+        if (json) {
+                print_json(results, n, stdout);
+        } else {
+                print_csv(results, n, stdout);
+        }
+
+        free(results);
+        free(walls);
+        free(users);
+        return 0;
+}
+
+/* Reads the whole file at path into a new buffer and stores its size in
+ * length.
+ */
+unsigned char *read_input(const char *path, size_t *length)
+{
+        struct stat st;
+        FILE *fp = fopen(path, "rb");
+
+        if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+                fprintf(stderr, "Error: cannot read %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+
+        unsigned char *buf = malloc(st.st_size + 1);
+        if (buf == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        *length = fread(buf, 1, st.st_size, fp);
+        fclose(fp);
+        return buf;
+}
+
+/* Returns the number of instructions the program at path executes before it
+ * halts, given the length bytes at input. The program runs in process on
+ * the engine of um.c, with its output kept in memory and discarded.
+ */
+uint64_t count_instructions(const char *path, const unsigned char *input,
+                            size_t length)
+{
+        static const unsigned char empty[1];
+        Io_T io = Io_memory(input != NULL ? input : empty, length);
+        UM_T um = UM_new(io);
+        UM_status status = UM_load(um, path);
+        uint64_t count;
+
+        if (status == UM_OK) {
+                status = UM_run(um);
+        }
+        if (status != UM_HALTED) {
+                fprintf(stderr, "Error: %s: %s\n", path,
+                        UM_describe(status));
+                exit(EXIT_FAILURE);
+        }
+        count = UM_executed(um);
+        UM_free(&um);
+        Io_free(&io);
+        return count;
+}
+
+/* Runs benchmark once on the um at um with the length bytes at input on its
+ * standard input, and stores the wall clock and user time it took. The
+ * clock starts before the fork, so process creation is part of the wall
+ * clock time, as it is for anyone running the um from a shell.
+ */
+void run_once(const char *um, const Benchmark *benchmark,
+              const unsigned char *input, size_t length,
+              double *wall, double *user)
+{
+        struct timespec start, stop;
+        struct rusage usage;
+        int fds[2];
+        int status;
+        pid_t pid;
+
+        if (pipe(fds) != 0) {
+                fprintf(stderr, "Error: pipe: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid = fork();
+        if (pid < 0) {
+                fprintf(stderr, "Error: fork: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+                int null = open("/dev/null", O_WRONLY);
+                char *args[4];
+                int n = 0;
+
+                args[n++] = (char *)um;
+                if (benchmark->option != NULL) {
+                        args[n++] = (char *)benchmark->option;
+                }
+                args[n++] = (char *)benchmark->program;
+                args[n] = NULL;
+
+                dup2(fds[0], STDIN_FILENO);
+                dup2(null, STDOUT_FILENO);
+                close(fds[0]);
+                close(fds[1]);
+                close(null);
+                execv(um, args);
+                fprintf(stderr, "Error: cannot run %s: %s\n", um,
+                        strerror(errno));
+                _exit(127);
+        }
+
+        close(fds[0]);
+        write_all(fds[1], input, length);
+        close(fds[1]);
+
+        if (wait4(pid, &status, 0, &usage) != pid) {
+                fprintf(stderr, "Error: wait: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "Error: %s %s did not halt normally\n",
+                        um, benchmark->program);
+                exit(EXIT_FAILURE);
+        }
+
+        *wall = (stop.tv_sec - start.tv_sec) +
+                (stop.tv_nsec - start.tv_nsec) / 1e9;
+        *user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+}
+
+/* Writes all length bytes at buf to fd, giving up quietly if the reader goes
+ * away first.
+ */
+void write_all(int fd, const unsigned char *buf, size_t length)
+{
+        while (length > 0) {
+                ssize_t n = write(fd, buf, length);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        return;
+                }
+                buf += n;
+                length -= n;
+        }
+}
+
+/* Starts the um at um as a fork server for benchmark, with pipes for its
+ * standard input and output. Each request asks for a run on the input file
+ * of benchmark with the output thrown away.
+ */
+void start_server(const char *um, const Benchmark *benchmark,
+                  Server *server)
+{
+        int requests[2], replies[2];
+
+        if (pipe(requests) != 0 || pipe(replies) != 0) {
+                fprintf(stderr, "Error: pipe: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        server->pid = fork();
+        if (server->pid < 0) {
+                fprintf(stderr, "Error: fork: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+        if (server->pid == 0) {
+                char *args[5];
+                int n = 0;
+
+                args[n++] = (char *)um;
+                args[n++] = "--fork-server";
+                if (benchmark->option != NULL) {
+                        args[n++] = (char *)benchmark->option;
+                }
+                args[n++] = (char *)benchmark->program;
+                args[n] = NULL;
+
+                dup2(requests[0], STDIN_FILENO);
+                dup2(replies[1], STDOUT_FILENO);
+                close(requests[0]);
+                close(requests[1]);
+                close(replies[0]);
+                close(replies[1]);
+                execv(um, args);
+                fprintf(stderr, "Error: cannot run %s: %s\n", um,
+                        strerror(errno));
+                _exit(127);
+        }
+
+        close(requests[0]);
+        close(replies[1]);
+        server->requests = fdopen(requests[1], "w");
+        server->replies = fdopen(replies[0], "r");
+        if (server->requests == NULL || server->replies == NULL) {
+                fprintf(stderr, "Error: fdopen: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Sends server a request for one run of benchmark and stores the wall
+ * clock time until its reply and the user time the run took, which the
+ * server reports for the child it forked. The server has already loaded
+ * the program, so this is the latency a client of a warm server sees.
+ */
+void run_served(Server *server, const Benchmark *benchmark,
+                double *wall, double *user)
+{
+        struct timespec start, stop;
+        char reply[MAX_LINE];
+        int status = -1;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fprintf(server->requests, "%s -\n",
+                benchmark->input != NULL ? benchmark->input : "-");
+        fflush(server->requests);
+        if (fgets(reply, sizeof(reply), server->replies) == NULL ||
+            sscanf(reply, "%d %lf", &status, user) != 2) {
+                fprintf(stderr, "Error: fork server for %s did not reply\n",
+                        benchmark->program);
+                exit(EXIT_FAILURE);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        if (status != 0) {
+                fprintf(stderr, "Error: %s --fork-server did not halt "
+                        "normally\n", benchmark->program);
+                exit(EXIT_FAILURE);
+        }
+        *wall = (stop.tv_sec - start.tv_sec) +
+                (stop.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Ends the requests to server, which makes it exit, and waits for it. */
+void stop_server(Server *server)
+{
+        fclose(server->requests);
+        fclose(server->replies);
+        waitpid(server->pid, NULL, 0);
+}
+
+/* Returns the options benchmark runs with, as printed in the results: the
+ * option given to the um, preceded by --fork-server for a served one.
+ */
+static const char *option_name(const Benchmark *benchmark)
+{
+        if (benchmark->option == NULL) {
+                return benchmark->served ? "--fork-server" : "";
+        }
+        if (benchmark->served) {
+                return "--fork-server --load-only";
+        }
+        return benchmark->option;
+}
+
+/* Orders two times for qsort. */
+static int compare_times(const void *x, const void *y)
+{
+        double a = *(const double *)x;
+        double b = *(const double *)y;
+        return (a > b) - (a < b);
+}
+
+/* Sorts the n times and returns the one at the given percentile, using the
+ * nearest rank: the smallest time at least percent of the times are no
+ * greater than.
+ */
+double percentile(double *times, unsigned n, unsigned percent)
+{
+        unsigned rank = (n * percent + 99) / 100;
+
+        qsort(times, n, sizeof(double), compare_times);
+        return times[rank == 0 ? 0 : rank - 1];
+}
+
+/* Returns the instructions per second of result at its median wall clock
+ * time, or 0 if nothing was counted.
+ */
+static double per_second(const Result *result)
+{
+        if (result->instructions == 0 || result->wall_median <= 0) {
+                return 0;
+        }
+        return result->instructions / result->wall_median;
+}
+
+/* Prints the results as CSV with a header row. */
+void print_csv(const Result *results, unsigned n, FILE *out)
+{
+        fprintf(out, "um,benchmark,option,runs,instructions,"
+                "wall_median,wall_p95,user_median,user_p95,"
+                "instructions_per_second\n");
+        for (unsigned i = 0; i < n; i++) {
+                const Result *r = &results[i];
+                fprintf(out, "%s,%s,%s,%u,%" PRIu64 ",%.4f,%.4f,%.4f,%.4f,"
+                        "%.0f\n", r->um, r->benchmark->program,
+                        option_name(r->benchmark),
+                        r->runs, r->instructions, r->wall_median, r->wall_p95,
+                        r->user_median, r->user_p95, per_second(r));
+        }
+}
+
+/* Prints the results as a JSON array of objects. Paths are printed as they
+ * were given, so they must not need escaping.
+ */
+void print_json(const Result *results, unsigned n, FILE *out)
+{
+        fprintf(out, "[\n");
+        for (unsigned i = 0; i < n; i++) {
+                const Result *r = &results[i];
+                fprintf(out, "  {\"um\": \"%s\", \"benchmark\": \"%s\", "
+                        "\"option\": \"%s\", \"runs\": %u, "
+                        "\"instructions\": %" PRIu64 ",\n"
+                        "   \"wall_median\": %.4f, \"wall_p95\": %.4f, "
+                        "\"user_median\": %.4f, \"user_p95\": %.4f, "
+                        "\"instructions_per_second\": %.0f}%s\n",
+                        r->um, r->benchmark->program,
+                        option_name(r->benchmark),
+                        r->runs, r->instructions, r->wall_median, r->wall_p95,
+                        r->user_median, r->user_p95, per_second(r),
+                        (i + 1 < n) ? "," : "");
+        }
+        fprintf(out, "]\n");
+}
+
+/* Times each decoder on the words of every benchmark's file, loaded as
+ * segment 0 like the um would, runs times, each decoding the file as
+ * often as it takes to reach DECODE_WORDS words, and prints the median
+ * nanoseconds per word of each along with how many words have invalid
+ * opcodes.
+ */
+void bench_decode(unsigned runs, bool json, FILE *out)
+{
+        static const char *const names[NUM_DECODERS] = {
+                "shifts", "word", "simd"
+        };
+        static Decoder *const decoders[NUM_DECODERS] = {
+                decode_shifts, decode_words, decode_simd
+        };
+        unsigned num_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+        double *times = malloc(runs * sizeof(double));
+
+        if (times == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        if (json) {
+                fprintf(out, "[\n");
+        } else {
+                fprintf(out, "program,words,invalid,shifts_ns,word_ns,"
+                        "simd_ns\n");
+        }
+        for (unsigned b = 0; b < num_benchmarks; b++) {
+                Segment_T memory = Segment_new();
+                WORD_SIZE n = Loader_load(memory, benchmarks[b].program);
+                const WORD_SIZE *words = Segment_ptr(memory, 0);
+                unsigned repeats = DECODE_WORDS / (n + 1) + 1;
+                Op *expected = malloc((n + 1) * sizeof(Op));
+                Op *ops = malloc((n + 1) * sizeof(Op));
+                double per_word[NUM_DECODERS];
+                unsigned invalid;
+
+                if (expected == NULL || ops == NULL) {
+                        fprintf(stderr, "Out of memory.\n");
+                        exit(EXIT_FAILURE);
+                }
+                invalid = Predecode_decode(expected, words, n);
+                for (unsigned d = 0; d < NUM_DECODERS; d++) {
+                        for (unsigned r = 0; r < runs; r++) {
+                                struct timespec start, stop;
+
+                                clock_gettime(CLOCK_MONOTONIC, &start);
+                                for (unsigned k = 0; k < repeats; k++) {
+                                        decoders[d](ops, words, n);
+                                        __asm__ __volatile__("" : : "r"(ops)
+                                                             : "memory");
+                                }
+                                clock_gettime(CLOCK_MONOTONIC, &stop);
+                                times[r] = ((stop.tv_sec - start.tv_sec) *
+                                            1e9 + (stop.tv_nsec -
+                                                   start.tv_nsec)) /
+                                           ((double)repeats * n);
+                        }
+                        per_word[d] = percentile(times, runs, 50);
+                        if (memcmp(ops, expected, n * sizeof(Op)) != 0) {
+                                fprintf(stderr, "Error: %s decodes %s "
+                                        "differently\n", names[d],
+                                        benchmarks[b].program);
+                                exit(EXIT_FAILURE);
+                        }
+                }
+
+                if (json) {
+                        fprintf(out, "  {\"program\": \"%s\", \"words\": %"
+                                PRIu32 ", \"invalid\": %u, \"shifts_ns\": "
+                                "%.3f, \"word_ns\": %.3f, \"simd_ns\": "
+                                "%.3f}%s\n", benchmarks[b].program, n,
+                                invalid, per_word[0], per_word[1],
+                                per_word[2],
+                                (b + 1 < num_benchmarks) ? "," : "");
+                } else {
+                        fprintf(out, "%s,%" PRIu32 ",%u,%.3f,%.3f,%.3f\n",
+                                benchmarks[b].program, n, invalid,
+                                per_word[0], per_word[1], per_word[2]);
+                }
+                free(expected);
+                free(ops);
+                Segment_free(&memory);
+        }
+        if (json) {
+                fprintf(out, "]\n");
+        }
+        free(times);
+}
+
+/* Decodes n words with the shift pairs route_instruct uses: each field is
+ * shifted up to the top of the word and then down to the bottom.
+ */
+static void decode_shifts(Op *ops, const WORD_SIZE *words, unsigned n)
+{
+        for (unsigned i = 0; i < n; i++) {
+                WORD_SIZE word = words[i];
+                WORD_SIZE opcode = (word << 0) >> 28;
+
+                ops[i].opcode = opcode;
+                ops[i].b = (word << 26) >> 29;
+                ops[i].c = (word << 29) >> 29;
+                if (opcode == 13) {
+                        ops[i].a = (word << 4) >> 29;
+                        ops[i].value = (word << 7) >> 7;
+                } else {
+                        ops[i].a = (word << 23) >> 29;
+                        ops[i].value = 0;
+                }
+        }
+}
+
+/* Decodes n words one Predecode_word at a time. */
+static void decode_words(Op *ops, const WORD_SIZE *words, unsigned n)
+{
+        for (unsigned i = 0; i < n; i++) {
+                Predecode_word(&ops[i], words[i]);
+        }
+}
+
+/* Decodes n words with Predecode_decode. */
+static void decode_simd(Op *ops, const WORD_SIZE *words, unsigned n)
+{
+        Predecode_decode(ops, words, n);
+}
@@ -0,0 +1,380 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * umc: ahead-of-time translator from a um binary to C. Prints a translation
+ * unit to stdout that links against segment.o, pool.o, io.o, instructions.o
+ * and umcrt.o into a native program:
+ *
+ *     ./umc midmark.um > midmark_umc.c
+ *     gcc -O2 -I. midmark_umc.c segment.o pool.o io.o instructions.o \
+ *         umcrt.o -o midmark
+ *
+ * Load programs are expected to land on a word some load value names or on
+ * the word after a load program, where calls return to. Each of those words
+ * becomes a function running the straight-line code from there to the next
+ * one, with the registers in locals the C compiler can keep in machine
+ * registers. The function returns the offset to continue from, and main
+ * looks it up in a table of entry points, handing the guest to the
+ * interpreter in umcrt.c until the next load program if it is not one of
+ * them. A function stops after FUNCTION_MAX instructions, returning the
+ * offset of the next one, which becomes an entry point too, and every way
+ * out of it goes through one label that writes the registers back. Small
+ * functions keep the time the C compiler needs linear in the size of the
+ * program.
+ *
+ * Guests may keep data in segment 0, so storing into it does not by itself
+ * leave the translated code. The program is split into runs of straight-
+ * line code, each ending at a halt, a load program or an invalid
+ * instruction, and every run remembers the highest word of it that the
+ * guest changed. Entering a run at or below that word, or falling through
+ * into a word changed further down the current run, means the translation
+ * no longer describes what would execute, so the interpreter takes over
+ * instead. Once a load program replaces segment 0 everything is
+ * interpreted.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#define WORD_SIZE uint32_t
+#define OPCODE_LSB 28
+#define A_LSB 6
+#define B_LSB 3
+#define C_LSB 0
+#define LOAD_VAL_LSB 25
+#define VAL_LENGTH 25
+#define HALT 7
+#define LOAD_PROGRAM 12
+#define LOAD_VALUE 13
+#define FUNCTION_MAX 256        /* instructions per translated function */
+
+/* Reads the big-endian words of the um binary at path into a new array and
+ * stores how many there are in length.
+ */
+WORD_SIZE *read_program(const char *path, WORD_SIZE *length);
+
+/* Returns a new array holding the run of straight-line code each of the
+ * length words of program belongs to, and stores the number of runs in
+ * num_runs.
+ */
+WORD_SIZE *find_runs(const WORD_SIZE *program, WORD_SIZE length,
+                     WORD_SIZE *num_runs);
+
+/* Returns a new array flagging the words of program that a load program is
+ * likely to jump to: word 0, every word a load value names and every word
+ * following a load program, where calls return to.
+ */
+bool *find_entries(const WORD_SIZE *program, WORD_SIZE length);
+
+/* Prints the whole translation unit for the length words of program. */
+void translate(const char *path, const WORD_SIZE *program, WORD_SIZE length);
+
+/* Prints the function for the straight-line code from the entry point
+ * first to the next entry point, the end of its run or FUNCTION_MAX
+ * instructions on, which returns the offset to continue from. Flags the
+ * word it stops before in entries if that was because of FUNCTION_MAX.
+ */
+void translate_entry(const WORD_SIZE *program, const WORD_SIZE *runs,
+                     const WORD_SIZE *run_last, bool *entries,
+                     WORD_SIZE length, WORD_SIZE first);
+
+/* Prints the C statements for the instruction at pc. Returns whether they
+ * can leave the function through EXIT.
+ */
+bool translate_instruction(const WORD_SIZE *program, WORD_SIZE pc);
+
+
+int main(int argc, char *argv[])
+{
+        WORD_SIZE length;
+        WORD_SIZE *program;
+
+        if (argc != 2) {
+                fprintf(stderr, "Usage: %s program.um > program.c\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+
+        program = read_program(argv[1], &length);
+        translate(argv[1], program, length);
+        free(program);
+        return 0;
+}
+
+/* Reads the big-endian words of the um binary at path into a new array and
+ * stores how many there are in length.
+ */
+WORD_SIZE *read_program(const char *path, WORD_SIZE *length)
+{
+        struct stat st;
+        FILE *fp = fopen(path, "rb");
+
+        if (fp == NULL || stat(path, &st) != 0 || st.st_size % 4 != 0) {
+                fprintf(stderr, "Incompatible File Size.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        *length = st.st_size / 4;
+        WORD_SIZE *program = malloc((*length + 1) * sizeof(WORD_SIZE));
+        if (program == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (WORD_SIZE i = 0; i < *length; i++) {
+                WORD_SIZE word = 0;
+                for (int j = 0; j < 4; j++) {
+                        word = (word << 8) | (unsigned char)getc(fp);
+                }
+                program[i] = word;
+        }
+        fclose(fp);
+        return program;
+}
+
+/* Returns a new array holding the run of straight-line code each word of
+ * program belongs to. A run ends after any word that cannot fall through to
+ * the next one.
+ */
+WORD_SIZE *find_runs(const WORD_SIZE *program, WORD_SIZE length,
+                     WORD_SIZE *num_runs)
+{
+        WORD_SIZE *runs = malloc((length + 1) * sizeof(WORD_SIZE));
+        WORD_SIZE run = 0;
+
+        if (runs == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (WORD_SIZE i = 0; i < length; i++) {
+                WORD_SIZE opcode = program[i] >> OPCODE_LSB;
+                runs[i] = run;
+                if (opcode == HALT || opcode == LOAD_PROGRAM ||
+                    opcode > LOAD_VALUE) {
+                        run++;
+                }
+        }
+        runs[length] = run;
+        *num_runs = run + 1;
+        return runs;
+}
+
+/* Returns a new array flagging word 0, every word a load value names and
+ * every word after a load program, as long as it holds a valid instruction.
+ */
+bool *find_entries(const WORD_SIZE *program, WORD_SIZE length)
+{
+        bool *entries = calloc(length + 1, sizeof(bool));
+
+        if (entries == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        entries[0] = (length > 0 && program[0] >> OPCODE_LSB <= LOAD_VALUE);
+        for (WORD_SIZE i = 0; i < length; i++) {
+                WORD_SIZE opcode = program[i] >> OPCODE_LSB;
+                WORD_SIZE target = length;
+                if (opcode == LOAD_VALUE) {
+                        target = program[i] & ((1u << VAL_LENGTH) - 1);
+                } else if (opcode == LOAD_PROGRAM) {
+                        target = i + 1;
+                }
+                if (target < length &&
+                    program[target] >> OPCODE_LSB <= LOAD_VALUE) {
+                        entries[target] = true;
+                }
+        }
+        return entries;
+}
+
+/* Prints the whole translation unit for the length words of program. */
+void translate(const char *path, const WORD_SIZE *program, WORD_SIZE length)
+{
+        WORD_SIZE num_runs;
+        WORD_SIZE *runs = find_runs(program, length, &num_runs);
+        WORD_SIZE *run_last = malloc(num_runs * sizeof(WORD_SIZE));
+        bool *entries = find_entries(program, length);
+
+        if (run_last == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        for (WORD_SIZE i = 0; i <= length; i++) {
+                run_last[runs[i]] = i;
+        }
+
+        printf("/* Translated from %s by umc. */\n", path);
+        printf("#include <inttypes.h>\n");
+        printf("#include <stdio.h>\n");
+        printf("#include \"segment.h\"\n");
+        printf("#include \"instructions.h\"\n");
+        printf("#include \"io.h\"\n");
+        printf("#include \"umcrt.h\"\n\n");
+        printf("#define EXIT(pc) do { \\\n");
+        printf("\tnext = (pc); \\\n");
+        printf("\tgoto leave; \\\n} while (0)\n\n");
+
+        printf("static const WORD_SIZE program[%" PRIu32 "] = {",
+               length + 1);
+        for (WORD_SIZE i = 0; i < length; i++) {
+                printf("%s0x%08" PRIx32 ",", (i % 6 == 0) ? "\n\t" : " ",
+                       program[i]);
+        }
+        printf("\n\t0\n};\n\n");
+
+        printf("static const WORD_SIZE run_of[%" PRIu32 "] = {", length + 1);
+        for (WORD_SIZE i = 0; i <= length; i++) {
+                printf("%s%" PRIu32 "%s", (i % 10 == 0) ? "\n\t" : " ",
+                       runs[i], (i < length) ? "," : "");
+        }
+        printf("\n};\n\n");
+
+        printf("static WORD_SIZE dirty_end[%" PRIu32 "];\n", num_runs);
+        printf("static Umc_program prog = { program, run_of, dirty_end, "
+               "%" PRIu32 ", false };\n", length);
+        printf("static Segment_T mem;\n");
+        printf("static Io_T io;\n\n");
+
+        for (WORD_SIZE pc = 0; pc < length; pc++) {
+                if (entries[pc]) {
+                        translate_entry(program, runs, run_last, entries,
+                                        length, pc);
+                }
+        }
+
+        printf("static WORD_SIZE (*const entry[%" PRIu32 "])(REG_SIZE *) = {",
+               length + 1);
+        for (WORD_SIZE pc = 0; pc < length; pc++) {
+                if (entries[pc]) {
+                        printf("\n\t[%" PRIu32 "] = E%" PRIu32 ",", pc, pc);
+                }
+        }
+        printf("\n};\n\n");
+
+        printf("int main(void)\n{\n");
+        printf("\tREG_SIZE r[8] = { 0 };\n");
+        printf("\tWORD_SIZE pc = 0;\n\n");
+        printf("\tmem = Umc_load(&prog);\n");
+        printf("\tio = Io_stdio();\n");
+        printf("\tfor (;;) {\n");
+        printf("\t\tif (Umc_can_enter(&prog, pc) && entry[pc] != NULL) {\n");
+        printf("\t\t\tpc = entry[pc](r);\n");
+        printf("\t\t} else {\n");
+        printf("\t\t\tpc = Umc_interpret(&prog, mem, r, pc);\n");
+        printf("\t\t}\n\t}\n}\n");
+        free(runs);
+        free(run_last);
+        free(entries);
+}
+
+/* Prints the function for the straight-line code from the entry point
+ * first to the next entry point, the end of its run or FUNCTION_MAX
+ * instructions on. A valid instruction it stops at because of FUNCTION_MAX
+ * is made an entry point; an invalid one is left to the interpreter. The
+ * registers are written back once, at the label every EXIT goes to.
+ */
+void translate_entry(const WORD_SIZE *program, const WORD_SIZE *runs,
+                     const WORD_SIZE *run_last, bool *entries,
+                     WORD_SIZE length, WORD_SIZE first)
+{
+        WORD_SIZE last = run_last[runs[first]];
+        bool exits = false;
+        WORD_SIZE pc;
+
+        printf("static WORD_SIZE E%" PRIu32 "(REG_SIZE *r)\n{\n", first);
+        printf("\tREG_SIZE r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3];\n");
+        printf("\tREG_SIZE r4 = r[4], r5 = r[5], r6 = r[6], r7 = r[7];\n");
+        printf("\tWORD_SIZE next;\n\n");
+        for (pc = first; pc <= last && pc < length; pc++) {
+                if (pc != first && entries[pc]) {
+                        break;
+                }
+                if (pc - first == FUNCTION_MAX) {
+                        entries[pc] = program[pc] >> OPCODE_LSB <= LOAD_VALUE;
+                        break;
+                }
+                exits |= translate_instruction(program, pc);
+        }
+        if (pc > last || pc == length || pc - first == FUNCTION_MAX ||
+            entries[pc]) {
+                printf("\tEXIT(%" PRIu32 "u);\n", pc);
+                exits = true;
+        }
+        if (exits) {
+                printf("leave:\n");
+                printf("\tr[0] = r0; r[1] = r1; r[2] = r2; r[3] = r3;\n");
+                printf("\tr[4] = r4; r[5] = r5; r[6] = r6; r[7] = r7;\n");
+                printf("\treturn next;\n");
+        }
+        printf("}\n\n");
+}
+
+/* Prints the C statements for the instruction at pc. Returns whether they
+ * can leave the function through EXIT.
+ */
+bool translate_instruction(const WORD_SIZE *program, WORD_SIZE pc)
+{
+        WORD_SIZE word = program[pc];
+        unsigned a = (word >> A_LSB) & 0x7;
+        unsigned b = (word >> B_LSB) & 0x7;
+        unsigned c = (word >> C_LSB) & 0x7;
+
+        switch (word >> OPCODE_LSB) {
+        case 0:
+                printf("\tif (r%u != 0) r%u = r%u;\n", c, a, b);
+                break;
+        case 1:
+                printf("\tr%u = Segment_load(mem, r%u, r%u);\n", a, b, c);
+                break;
+        case 2:
+                printf("\tSegment_store(mem, r%u, r%u, r%u);\n", a, b, c);
+                printf("\tif (r%u == 0 && Umc_store(&prog, r%u, r%u, "
+                       "%" PRIu32 "u)) EXIT(%" PRIu32 "u);\n", a, b, c,
+                       pc + 1, pc + 1);
+                return true;
+        case 3:
+                printf("\tr%u = r%u + r%u;\n", a, b, c);
+                break;
+        case 4:
+                printf("\tr%u = r%u * r%u;\n", a, b, c);
+                break;
+        case 5:
+                printf("\tr%u = r%u / r%u;\n", a, b, c);
+                break;
+        case 6:
+                printf("\tr%u = ~(r%u & r%u);\n", a, b, c);
+                break;
+        case 7:
+                printf("\thalt();\n");
+                break;
+        case 8:
+                printf("\tr%u = Segment_map(mem, r%u);\n", b, c);
+                break;
+        case 9:
+                printf("\tSegment_unmap(mem, r%u);\n", c);
+                break;
+        case 10:
+                printf("\tIo_put(io, r%u);\n", c);
+                break;
+        case 11:
+                printf("\tr%u = Io_get(io);\n", c);
+                break;
+        case 12:
+                printf("\tif (r%u != 0) Umc_load_program(&prog, mem, r%u);\n",
+                       b, b);
+                printf("\tEXIT(r%u);\n", c);
+                return true;
+        case 13:
+                a = (word >> LOAD_VAL_LSB) & 0x7;
+                printf("\tr%u = %" PRIu32 "u;\n", a,
+                       word & ((1u << VAL_LENGTH) - 1));
+                break;
+        default:
+                printf("\tEXIT(%" PRIu32 "u);\n", pc);
+                return true;
+        }
+        return false;
+}
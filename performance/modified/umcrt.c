@@ -0,0 +1,152 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Implementation of the runtime for programs translated by umc. The
+ * interpreter here is deliberately simple; it only runs code of the
+ * original program the translation does not cover, until a load program
+ * lands back in it. Once segment 0 is replaced the guest is handed to the
+ * threaded engine of um.c for good.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "segment.h"
+#include "instructions.h"
+#include "io.h"
+#include "um.h"
+#include "umcrt.h"
+#define REG_SIZE uint32_t
+#define WORD_SIZE uint32_t
+#define OPCODE_LSB 28
+#define A_LSB 6
+#define B_LSB 3
+#define C_LSB 0
+#define LOAD_VAL_LSB 25
+#define VAL_LENGTH 25
+
+/* Creates segmented memory with the program in segment 0. */
+Segment_T Umc_load(const Umc_program *program)
+{
+        Segment_T memory = Segment_new();
+        WORD_SIZE id = Segment_map(memory, program->length);
+
+        assert(id == 0);
+        (void) id;
+        memcpy(Segment_ptr(memory, 0), program->words, 
+               program->length * sizeof(WORD_SIZE));
+        return memory;
+}
+
+/* Records that the guest stored word at offset of segment 0 and returns
+ * true if that changes code about to run in the run of next.
+ */
+bool Umc_store(Umc_program *program, WORD_SIZE offset, WORD_SIZE word,
+               WORD_SIZE next)
+{
+        if (program->replaced || offset >= program->length ||
+            word == program->words[offset]) {
+                return false;
+        }
+
+        WORD_SIZE run = program->run_of[offset];
+        if (program->dirty_end[run] <= offset) {
+                program->dirty_end[run] = offset + 1;
+        }
+        return offset >= next && run == program->run_of[next];
+}
+
+/* Replaces segment 0 with a copy of segment id. */
+void Umc_load_program(Umc_program *program, Segment_T memory, WORD_SIZE id)
+{
+        Segment_move(memory, id, 0);
+        program->replaced = true;
+}
+
+/* Returns true if the translation can be entered at pc. */
+bool Umc_can_enter(const Umc_program *program, WORD_SIZE pc)
+{
+        return !program->replaced && pc < program->length &&
+               program->dirty_end[program->run_of[pc]] <= pc;
+}
+
+/* Runs the guest on the threaded engine of um.c from the word offset pc
+ * until it stops, then exits as the um would.
+ */
+static void run_engine(Segment_T memory, REG_SIZE *r, WORD_SIZE pc)
+{
+        UM_T um = UM_new(Io_stdio());
+        UM_status status;
+
+        UM_adopt(um, memory, r, pc);
+        status = UM_run(um);
+        UM_free(&um);
+        if (status != UM_HALTED) {
+                fprintf(stderr, "%s\n", UM_describe(status));
+                exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+}
+
+/* Interprets segment 0 from the word offset pc with the 8 registers in r
+ * until a load program lands somewhere the translation can be entered,
+ * or runs it on the threaded engine once segment 0 has been replaced.
+ */
+WORD_SIZE Umc_interpret(Umc_program *program, Segment_T memory, REG_SIZE *r,
+                        WORD_SIZE pc)
+{
+        WORD_SIZE *words = Segment_ptr(memory, 0);
+        WORD_SIZE length = Segment_length(memory, 0);
+
+        if (program->replaced) {
+                run_engine(memory, r, pc);
+        }
+        while (pc < length) {
+                WORD_SIZE word = words[pc++];
+                REG_SIZE *a = &r[(word >> A_LSB) & 0x7];
+                REG_SIZE *b = &r[(word >> B_LSB) & 0x7];
+                REG_SIZE *c = &r[(word >> C_LSB) & 0x7];
+
+                switch (word >> OPCODE_LSB) {
+                case 0:  conditional_move(memory, a, b, c); break;
+                case 1:  load(memory, a, b, c);             break;
+                case 2:
+                        if (*a == 0) {
+                                Umc_store(program, *b, *c, pc);
+                        }
+                        store(memory, a, b, c);
+                        break;
+                case 3:  add(memory, a, b, c);              break;
+                case 4:  multiply(memory, a, b, c);         break;
+                case 5:  divide(memory, a, b, c);           break;
+                case 6:  nand(memory, a, b, c);             break;
+                case 7:  halt();                            break;
+                case 8:  map_segment(memory, b, c);         break;
+                case 9:  unmap_segment(memory, b, c);       break;
+                case 10: output(memory, b, c);              break;
+                case 11: input(memory, b, c);               break;
+                case 12:
+                        if (*b != 0) {
+                                Umc_load_program(program, memory, *b);
+                                run_engine(memory, r, *c);
+                        }
+                        pc = *c;
+                        if (Umc_can_enter(program, pc)) {
+                                return pc;
+                        }
+                        break;
+                case 13:
+                        load_value(&r[(word >> LOAD_VAL_LSB) & 0x7], 
+                                   word & ((1u << VAL_LENGTH) - 1));
+                        break;
+                default:
+                        pc = length;
+                        break;
+                }
+        }
+
+        fprintf(stderr, "Invalid Instruction.\n");
+        exit(EXIT_FAILURE);
+}
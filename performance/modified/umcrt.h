@@ -0,0 +1,61 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * Interface for the runtime that programs translated by umc link against.
+ * It loads the translated program into segment 0, keeps track of which
+ * words of it the guest has changed, and interprets the guest wherever the
+ * translated code can no longer be trusted.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include "segment.h"
+#ifndef UMCRT_H_INCLUDED
+#define UMCRT_H_INCLUDED
+#define REG_SIZE uint32_t
+#define WORD_SIZE uint32_t
+
+/* A translated program: its words, the run of straight-line code each word
+ * belongs to, for each run one past the highest word of it the guest has
+ * changed (0 while it is untouched), and whether segment 0 has been replaced
+ * by a load program.
+ */
+typedef struct Umc_program {
+        const WORD_SIZE *words;
+        const WORD_SIZE *run_of;
+        WORD_SIZE *dirty_end;
+        WORD_SIZE length;
+        bool replaced;
+} Umc_program;
+
+/* Creates segmented memory with the program in segment 0. */
+Segment_T Umc_load(const Umc_program *program);
+
+/* Records that the guest stored word at offset of segment 0, which changes
+ * the program unless word is what the translation was made from. Returns
+ * true if the change lands at or after next in the run of next, so that
+ * the code about to execute no longer matches its translation.
+ */
+bool Umc_store(Umc_program *program, WORD_SIZE offset, WORD_SIZE word,
+               WORD_SIZE next);
+
+/* Replaces segment 0 with a copy of segment id, after which the translation
+ * no longer describes the program.
+ */
+void Umc_load_program(Umc_program *program, Segment_T memory, WORD_SIZE id);
+
+/* Returns true if the translation can be entered at pc: segment 0 is still
+ * the original program and nothing at or after pc in its run has changed.
+ */
+bool Umc_can_enter(const Umc_program *program, WORD_SIZE pc);
+
+/* Interprets segment 0 from the word offset pc with the 8 registers in r
+ * until a load program lands somewhere the translation can be entered, and
+ * returns that offset. Once segment 0 has been replaced the guest runs on
+ * the threaded engine of um.c instead, which takes memory over. Exits if
+ * the guest halts or fails.
+ */
+WORD_SIZE Umc_interpret(Umc_program *program, Segment_T memory, REG_SIZE *r,
+                        WORD_SIZE pc);
+
+#endif
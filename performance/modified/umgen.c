@@ -0,0 +1,867 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * umgen: generator of synthetic um programs that each stress one part of
+ * a um, so that a speedup on midmark.um or sandmark.umz can be traced to
+ * the subsystem it came from:
+ *
+ *     ./umgen [--count n] [--size n] [--sizes dist] [--seed n] kind out.um
+ *
+ * arith    a loop of adds, multiplies, nands and divides on registers, which
+ *          is bound by dispatch
+ * churn    maps and unmaps segments with sizes drawn from dist, keeping
+ *          --size of them mapped at once, which is bound by the allocator
+ * stream   sums a segment of --size words over and over, which is bound
+ *          by loads from a segment too big for the cache
+ * jumps    runs a chain of --size blocks spread over segment 0 in a random
+ *          order, each ending in a load program, which is bound by jumps
+ * output   writes a byte per iteration, which is bound by output
+ *
+ * Every program folds what it computes into a checksum and prints it in
+ * hex on a line of its own before it halts. umgen works the checksum out
+ * itself, in C, and prints exactly what the program should print on
+ * standard output (for output, every byte it writes as well), so
+ *
+ *     ./umgen churn churn.um > churn.expected
+ *     ./um churn.um | cmp - churn.expected
+ *
+ * checks a um. ./genbench does that for every kind and then times them
+ * with umbench.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define WORD_SIZE uint32_t
+#define REG_SIZE uint32_t
+#define OPCODE_LSB 28
+#define A_LSB 6
+#define B_LSB 3
+#define C_LSB 0
+#define LOAD_VAL_LSB 25
+#define MAX_VALUE ((1u << 25) - 1)
+#define NUM_SIZES 256
+#define LINE_LENGTH 64
+#define BLOCK_STRIDE 32
+#define MULTIPLIER 33
+#define ARITH_FACTOR 0x1f3d5b7
+#define STREAM_FACTOR 0x9e3779
+#define DEFAULT_SEED 0x2545f491
+
+enum { CMOV, LOAD, STORE, ADD, MUL, DIV, NAND, HALT, MAP, UNMAP, OUTPUT,
+       INPUT, LOAD_PROGRAM, LOAD_VALUE };
+
+/* Registers every program uses the same way: r0 is always 0, r7 always
+ * all ones (so adding it subtracts 1), r6 counts the iterations of the
+ * main loop down to 0 and r5 holds the checksum. r1 and r2 are scratch,
+ * and the loops use them for their jumps.
+ */
+enum { R0, R1, R2, R3, R4, CHECKSUM, COUNTER, ONES };
+
+/* The kinds of program, with the --count and --size each gets by default,
+ * picked so that each runs for about half a second on the threaded engine.
+ */
+typedef enum Kind { ARITH, CHURN, STREAM, JUMPS, OUT } Kind;
+
+typedef struct Workload {
+        const char *name;
+        Kind kind;
+        REG_SIZE count;
+        REG_SIZE size;
+} Workload;
+
+static const Workload workloads[] = {
+        { "arith",  ARITH,  20000000, 0 },
+        { "churn",  CHURN,  2000000,  1024 },
+        { "stream", STREAM, 32,       1 << 20 },
+        { "jumps",  JUMPS,  10000,    4096 },
+        { "output", OUT,    20000000, 0 },
+};
+
+/* A program being generated: its words and how many there are room for,
+ * the address each label stands for (or -1 until it is placed) and the
+ * load values still waiting for the address of a label.
+ */
+typedef struct Fixup {
+        WORD_SIZE at;
+        unsigned label;
+} Fixup;
+
+typedef struct Gen {
+        WORD_SIZE *words;
+        WORD_SIZE length, capacity;
+        long *labels;
+        unsigned num_labels, label_capacity;
+        Fixup *fixups;
+        unsigned num_fixups, fixup_capacity;
+} Gen;
+
+/* What to generate: the workload, its --count and --size, the segment
+ * sizes churn draws from and the seed of the random numbers.
+ */
+typedef struct Options {
+        const Workload *workload;
+        REG_SIZE count;
+        REG_SIZE size;
+        const char *sizes;
+        uint32_t seed;
+} Options;
+
+/* Emits the program for the options into g and writes what it prints to
+ * out.
+ */
+void generate(Gen *g, const Options *options, FILE *out);
+
+/* Emits a loop of arithmetic on registers and returns its checksum. */
+REG_SIZE gen_arith(Gen *g, REG_SIZE count);
+
+/* Emits a loop that maps a segment with a size from the table at sizes and
+ * unmaps one mapped ring iterations ago, and returns its checksum.
+ */
+REG_SIZE gen_churn(Gen *g, REG_SIZE count, REG_SIZE ring,
+                   const REG_SIZE *sizes);
+
+/* Emits passes over a segment of words words, summing it, and returns the
+ * checksum.
+ */
+REG_SIZE gen_stream(Gen *g, REG_SIZE count, REG_SIZE words);
+
+/* Emits count trips through a chain of blocks laid out in segment 0 and
+ * visited in the order of the permutation order, and returns the checksum.
+ */
+REG_SIZE gen_jumps(Gen *g, REG_SIZE count, REG_SIZE blocks,
+                   const REG_SIZE *order);
+
+/* Emits a loop that writes a byte an iteration, writes the bytes to out and
+ * returns the checksum.
+ */
+REG_SIZE gen_output(Gen *g, REG_SIZE count, FILE *out);
+
+/* Emits the code that prints the checksum in hex and halts, and the table
+ * of hex digits it reads.
+ */
+void gen_print(Gen *g);
+
+/* Fills the NUM_SIZES sizes with segment sizes drawn from dist: "small",
+ * "mixed", "large" or a number of words. Returns false if dist is none of
+ * them.
+ */
+bool draw_sizes(const char *dist, uint32_t *seed, REG_SIZE *sizes);
+
+/* Emits one instruction. */
+void emit(Gen *g, unsigned opcode, unsigned a, unsigned b, unsigned c);
+
+/* Emits a load value of value, which must fit in 25 bits, into a. */
+void emit_value(Gen *g, unsigned a, REG_SIZE value);
+
+/* Emits the 32-bit constant value into a, using r1 and r2 if it does not
+ * fit in a load value.
+ */
+void emit_constant(Gen *g, unsigned a, REG_SIZE value);
+
+/* Emits word as data, for the program to load rather than run. */
+void emit_data(Gen *g, WORD_SIZE word);
+
+/* Emits a load value of the address of label into a. */
+void emit_label(Gen *g, unsigned a, unsigned label);
+
+/* Emits a = b & mask with two nands, through a. */
+void emit_and(Gen *g, unsigned a, unsigned b, REG_SIZE mask);
+
+/* Emits checksum += checksum >> 16, using r1 and r2. */
+void emit_fold(Gen *g);
+
+/* Emits a jump back to head while counter is not 0, using r1 and r2. */
+void emit_loop(Gen *g, unsigned counter, unsigned head);
+
+/* Returns a new label, not placed yet. */
+unsigned new_label(Gen *g);
+
+/* Places label at the next word emitted. */
+void place(Gen *g, unsigned label);
+
+/* Fills in the address of every label used before it was placed. */
+void resolve(Gen *g);
+
+/* Writes the length words at words to path, big-endian. */
+void write_program(const char *path, const WORD_SIZE *words,
+                   WORD_SIZE length);
+
+/* Writes the checksum as a um program prints it to out. */
+static void print_checksum(REG_SIZE checksum, FILE *out);
+
+/* Returns the next of a sequence of random numbers (xorshift32). */
+static uint32_t next_random(uint32_t *seed);
+
+/* Reads a number from arg, exiting with a message naming option if it is
+ * not one or is larger than max.
+ */
+static REG_SIZE number(const char *arg, const char *option, REG_SIZE max);
+
+/* Reallocates p to count elements of size bytes, exiting if it cannot. */
+static void *grow(void *p, size_t count, size_t size);
+
+
+int main(int argc, char *argv[])
+{
+        Options options = { NULL, 0, 0, "mixed", DEFAULT_SEED };
+        bool count_set = false, size_set = false;
+        Gen g;
+
+        while (argc > 1 && strncmp(argv[1], "--", 2) == 0 && argc > 2) {
+                if (strcmp(argv[1], "--count") == 0) {
+                        options.count = number(argv[2], "--count",
+                                               UINT32_MAX);
+                        count_set = true;
+                } else if (strcmp(argv[1], "--size") == 0) {
+                        options.size = number(argv[2], "--size",
+                                              MAX_VALUE);
+                        size_set = true;
+                } else if (strcmp(argv[1], "--sizes") == 0) {
+                        options.sizes = argv[2];
+                } else if (strcmp(argv[1], "--seed") == 0) {
+                        options.seed = number(argv[2], "--seed",
+                                              UINT32_MAX);
+                } else {
+                        break;
+                }
+                argc -= 2;
+                argv += 2;
+        }
+        if (argc == 3) {
+                unsigned n = sizeof(workloads) / sizeof(workloads[0]);
+
+                for (unsigned w = 0; w < n; w++) {
+                        if (strcmp(argv[1], workloads[w].name) == 0) {
+                                options.workload = &workloads[w];
+                        }
+                }
+        }
+        if (options.workload == NULL) {
+                fprintf(stderr, "Usage: umgen [--count n] [--size n] "
+                        "[--sizes small|mixed|large|n] [--seed n]\n"
+                        "             arith|churn|stream|jumps|output "
+                        "out.um\n");
+                exit(EXIT_FAILURE);
+        }
+        if (!count_set) {
+                options.count = options.workload->count;
+        }
+        if (!size_set) {
+                options.size = options.workload->size;
+        }
+        if (options.count == 0 || (options.workload->size != 0 &&
+                                   options.size == 0)) {
+                fprintf(stderr, "Error: --count and --size must be at "
+                        "least 1\n");
+                exit(EXIT_FAILURE);
+        }
+        if (options.seed == 0) {
+                /* xorshift never leaves 0 */
+                options.seed = DEFAULT_SEED;
+        }
+
+        memset(&g, 0, sizeof(g));
+        generate(&g, &options, stdout);
+        write_program(argv[2], g.words, g.length);
+
+        free(g.words);
+        free(g.labels);
+        free(g.fixups);
+        return 0;
+}
+
+/* Emits the program for the options into g and writes what it prints to
+ * out. Every program starts by setting r7 to all ones, runs its workload,
+ * which leaves the checksum in r5, and prints it; the data it reads
+ * follows the code.
+ */
+void generate(Gen *g, const Options *options, FILE *out)
+{
+        REG_SIZE count = options->count, size = options->size;
+        uint32_t seed = options->seed;
+        REG_SIZE checksum = 0;
+
+        emit(g, NAND, ONES, R0, R0);
+        switch (options->workload->kind) {
+        case ARITH:
+                checksum = gen_arith(g, count);
+                break;
+        case CHURN: {
+                REG_SIZE sizes[NUM_SIZES];
+
+                if ((size & (size - 1)) != 0) {
+                        fprintf(stderr, "Error: churn needs a --size that "
+                                "is a power of two\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (!draw_sizes(options->sizes, &seed, sizes)) {
+                        fprintf(stderr, "Error: unknown --sizes %s\n",
+                                options->sizes);
+                        exit(EXIT_FAILURE);
+                }
+                checksum = gen_churn(g, count, size, sizes);
+                break;
+        }
+        case STREAM:
+                checksum = gen_stream(g, count, size);
+                break;
+        case JUMPS: {
+                REG_SIZE *order = grow(NULL, size, sizeof(REG_SIZE));
+
+                if (size > MAX_VALUE / BLOCK_STRIDE) {
+                        fprintf(stderr, "Error: jumps takes a --size of at "
+                                "most %u\n", MAX_VALUE / BLOCK_STRIDE);
+                        exit(EXIT_FAILURE);
+                }
+                for (REG_SIZE i = 0; i < size; i++) {
+                        order[i] = i;
+                }
+                for (REG_SIZE i = size - 1; i > 0; i--) {
+                        REG_SIZE j = next_random(&seed) % (i + 1);
+                        REG_SIZE swap = order[i];
+
+                        order[i] = order[j];
+                        order[j] = swap;
+                }
+                checksum = gen_jumps(g, count, size, order);
+                free(order);
+                break;
+        }
+        case OUT:
+                checksum = gen_output(g, count, out);
+                break;
+        }
+        gen_print(g);
+        resolve(g);
+        print_checksum(checksum, out);
+}
+
+/* Emits a loop of arithmetic on registers and returns its checksum. The
+ * body is an add, a multiply, a nand, a divide and another add, each
+ * depending on the one before, so nothing but dispatch and the
+ * instructions themselves is measured.
+ */
+REG_SIZE gen_arith(Gen *g, REG_SIZE count)
+{
+        unsigned head = new_label(g);
+        REG_SIZE checksum = 0;
+
+        emit_constant(g, COUNTER, count);
+
+        place(g, head);
+        emit(g, ADD, R1, COUNTER, CHECKSUM);
+        emit_value(g, R2, ARITH_FACTOR);
+        emit(g, MUL, R3, R1, R2);
+        emit(g, NAND, R3, R3, R1);
+        emit_value(g, R2, 7);
+        emit(g, DIV, R4, R3, R2);
+        emit(g, ADD, CHECKSUM, R4, R3);
+        emit(g, ADD, COUNTER, COUNTER, ONES);
+        emit_loop(g, COUNTER, head);
+
+        for (REG_SIZE i = count; i > 0; i--) {
+                REG_SIZE x = i + checksum;
+                REG_SIZE y = ~((x * ARITH_FACTOR) & x);
+
+                checksum = y / 7 + y;
+        }
+        return checksum;
+}
+
+/* Emits a loop that maps a segment with a size from the table at sizes and
+ * unmaps one mapped ring iterations ago, and returns its checksum. r4 holds
+ * a segment of ring ids, filled with segments of one word first, and
+ * iteration i maps a segment of sizes[i % NUM_SIZES] words, stores i in
+ * its last word and loads it back, and swaps it for the id at i % ring.
+ */
+REG_SIZE gen_churn(Gen *g, REG_SIZE count, REG_SIZE ring,
+                   const REG_SIZE *sizes)
+{
+        unsigned fill = new_label(g), head = new_label(g);
+        unsigned table = new_label(g), skip = new_label(g);
+        REG_SIZE checksum = 0;
+
+        emit_value(g, R1, ring);
+        emit(g, MAP, R0, R4, R1);
+        emit_value(g, COUNTER, ring);
+        place(g, fill);
+        emit_value(g, R1, 1);
+        emit(g, MAP, R0, R2, R1);
+        emit(g, ADD, R1, COUNTER, ONES);
+        emit(g, STORE, R4, R1, R2);
+        emit(g, ADD, COUNTER, COUNTER, ONES);
+        emit_loop(g, COUNTER, fill);
+
+        emit_constant(g, COUNTER, count);
+        place(g, head);
+        emit_and(g, R3, COUNTER, NUM_SIZES - 1);
+        emit_label(g, R1, table);
+        emit(g, ADD, R3, R3, R1);
+        emit(g, LOAD, R3, R0, R3);
+        emit(g, MAP, R0, R2, R3);
+        emit(g, ADD, R1, R3, ONES);
+        emit(g, STORE, R2, R1, COUNTER);
+        emit(g, LOAD, R1, R2, R1);
+        emit(g, ADD, R3, R3, R1);
+        emit_value(g, R1, MULTIPLIER);
+        emit(g, MUL, CHECKSUM, CHECKSUM, R1);
+        emit(g, ADD, CHECKSUM, CHECKSUM, R3);
+        emit_and(g, R3, COUNTER, ring - 1);
+        emit(g, LOAD, R1, R4, R3);
+        emit(g, UNMAP, R0, R0, R1);
+        emit(g, STORE, R4, R3, R2);
+        emit(g, ADD, COUNTER, COUNTER, ONES);
+        emit_loop(g, COUNTER, head);
+
+        emit_label(g, R1, skip);
+        emit(g, LOAD_PROGRAM, R0, R0, R1);
+        place(g, table);
+        for (unsigned s = 0; s < NUM_SIZES; s++) {
+                emit_data(g, sizes[s]);
+        }
+        place(g, skip);
+
+        for (REG_SIZE i = count; i > 0; i--) {
+                checksum = checksum * MULTIPLIER + sizes[i % NUM_SIZES] + i;
+        }
+        return checksum;
+}
+
+/* Emits passes over a segment of words words, summing it, and returns the
+ * checksum. The segment is filled with word j holding j * STREAM_FACTOR,
+ * then each pass folds it into the checksum from the last word down, four
+ * words an iteration, so that loads are most of what runs.
+ */
+REG_SIZE gen_stream(Gen *g, REG_SIZE count, REG_SIZE words)
+{
+        unsigned fill = new_label(g), pass = new_label(g);
+        unsigned inner = new_label(g);
+        REG_SIZE checksum = 0;
+
+        /* round up to whole iterations of the inner loop */
+        words = (words + 3) & ~3u;
+        if (words > MAX_VALUE) {
+                words -= 4;
+        }
+
+        emit_value(g, R1, words);
+        emit(g, MAP, R0, R4, R1);
+        emit_value(g, R3, words);
+        place(g, fill);
+        emit(g, ADD, R3, R3, ONES);
+        emit_value(g, R2, STREAM_FACTOR);
+        emit(g, MUL, R2, R3, R2);
+        emit(g, STORE, R4, R3, R2);
+        emit_loop(g, R3, fill);
+
+        emit_constant(g, COUNTER, count);
+        place(g, pass);
+        emit_value(g, R3, words);
+        place(g, inner);
+        for (int unroll = 0; unroll < 4; unroll++) {
+                emit(g, ADD, R3, R3, ONES);
+                emit(g, LOAD, R2, R4, R3);
+                emit_value(g, R1, MULTIPLIER);
+                emit(g, MUL, CHECKSUM, CHECKSUM, R1);
+                emit(g, ADD, CHECKSUM, CHECKSUM, R2);
+        }
+        emit_loop(g, R3, inner);
+        emit_fold(g);
+        emit(g, ADD, COUNTER, COUNTER, ONES);
+        emit_loop(g, COUNTER, pass);
+
+        for (REG_SIZE i = count; i > 0; i--) {
+                for (REG_SIZE j = words; j > 0; j--) {
+                        checksum = checksum * MULTIPLIER +
+                                   (j - 1) * STREAM_FACTOR;
+                }
+                checksum += checksum >> 16;
+        }
+        return checksum;
+}
+
+/* Emits count trips through a chain of blocks laid out in segment 0 and
+ * visited in the order of the permutation order, and returns the checksum.
+ * Block k starts BLOCK_STRIDE words after block k - 1, so a chain of a few
+ * thousand covers hundreds of pages, and folds k into the checksum before
+ * jumping to the next block in order; the last jumps back to the loop.
+ */
+REG_SIZE gen_jumps(Gen *g, REG_SIZE count, REG_SIZE blocks,
+                   const REG_SIZE *order)
+{
+        unsigned head = new_label(g), back = new_label(g);
+        unsigned after = new_label(g);
+        unsigned first = g->num_labels;
+        REG_SIZE checksum = 0;
+
+        for (REG_SIZE k = 0; k < blocks; k++) {
+                new_label(g);
+        }
+        emit_value(g, R3, MULTIPLIER);
+        emit_constant(g, COUNTER, count);
+        place(g, head);
+        emit_label(g, R2, first + order[0]);
+        emit(g, LOAD_PROGRAM, R0, R0, R2);
+        place(g, back);
+        emit_fold(g);
+        emit(g, ADD, COUNTER, COUNTER, ONES);
+        emit_loop(g, COUNTER, head);
+        emit_label(g, R2, after);
+        emit(g, LOAD_PROGRAM, R0, R0, R2);
+
+        /* the blocks, with padding that never runs between them */
+        unsigned *next = grow(NULL, blocks, sizeof(unsigned));
+
+        for (REG_SIZE p = 0; p < blocks; p++) {
+                next[order[p]] = (p + 1 < blocks) ? first + order[p + 1] :
+                                                   back;
+        }
+        for (REG_SIZE k = 0; k < blocks; k++) {
+                WORD_SIZE start = g->length;
+
+                place(g, first + k);
+                emit_value(g, R1, k);
+                emit(g, MUL, CHECKSUM, CHECKSUM, R3);
+                emit(g, ADD, CHECKSUM, CHECKSUM, R1);
+                emit_label(g, R2, next[k]);
+                emit(g, LOAD_PROGRAM, R0, R0, R2);
+                while (g->length - start < BLOCK_STRIDE) {
+                        emit_data(g, 0);
+                }
+        }
+        free(next);
+        place(g, after);
+
+        for (REG_SIZE i = count; i > 0; i--) {
+                for (REG_SIZE p = 0; p < blocks; p++) {
+                        checksum = checksum * MULTIPLIER + order[p];
+                }
+                checksum += checksum >> 16;
+        }
+        return checksum;
+}
+
+/* Emits a loop that writes a byte an iteration, writes the bytes to out and
+ * returns the checksum. Iteration i writes character i % LINE_LENGTH of a
+ * line of printable characters ending in a newline, read from segment 0,
+ * and folds it into the checksum.
+ */
+REG_SIZE gen_output(Gen *g, REG_SIZE count, FILE *out)
+{
+        unsigned head = new_label(g), line = new_label(g);
+        unsigned skip = new_label(g);
+        WORD_SIZE chars[LINE_LENGTH];
+        REG_SIZE checksum = 0;
+
+        for (unsigned k = 0; k < LINE_LENGTH - 1; k++) {
+                chars[k] = '!' + (k * 7) % ('~' - '!' + 1);
+        }
+        chars[LINE_LENGTH - 1] = '\n';
+
+        emit_constant(g, COUNTER, count);
+        place(g, head);
+        emit_and(g, R3, COUNTER, LINE_LENGTH - 1);
+        emit_label(g, R1, line);
+        emit(g, ADD, R3, R3, R1);
+        emit(g, LOAD, R3, R0, R3);
+        emit(g, OUTPUT, R0, R0, R3);
+        emit_value(g, R1, MULTIPLIER);
+        emit(g, MUL, CHECKSUM, CHECKSUM, R1);
+        emit(g, ADD, CHECKSUM, CHECKSUM, R3);
+        emit(g, ADD, COUNTER, COUNTER, ONES);
+        emit_loop(g, COUNTER, head);
+
+        emit_label(g, R1, skip);
+        emit(g, LOAD_PROGRAM, R0, R0, R1);
+        place(g, line);
+        for (unsigned k = 0; k < LINE_LENGTH; k++) {
+                emit_data(g, chars[k]);
+        }
+        place(g, skip);
+
+        for (REG_SIZE i = count; i > 0; i--) {
+                WORD_SIZE c = chars[i % LINE_LENGTH];
+
+                putc(c, out);
+                checksum = checksum * MULTIPLIER + c;
+        }
+        return checksum;
+}
+
+/* Emits the code that prints the checksum in hex and halts, and the table
+ * of hex digits it reads. Each digit is the checksum divided by 2^28,
+ * looked up in the table, and the checksum is then shifted left four bits
+ * by multiplying it by 16.
+ */
+void gen_print(Gen *g)
+{
+        unsigned digits = new_label(g);
+        const char *hex = "0123456789abcdef";
+
+        for (int d = 0; d < 8; d++) {
+                emit_value(g, R2, 1 << 14);
+                emit(g, MUL, R2, R2, R2);
+                emit(g, DIV, R1, CHECKSUM, R2);
+                emit_label(g, R3, digits);
+                emit(g, ADD, R3, R3, R1);
+                emit(g, LOAD, R3, R0, R3);
+                emit(g, OUTPUT, R0, R0, R3);
+                emit_value(g, R2, 16);
+                emit(g, MUL, CHECKSUM, CHECKSUM, R2);
+        }
+        emit_value(g, R3, '\n');
+        emit(g, OUTPUT, R0, R0, R3);
+        emit(g, HALT, R0, R0, R0);
+
+        place(g, digits);
+        for (int d = 0; d < 16; d++) {
+                emit_data(g, hex[d]);
+        }
+}
+
+/* Fills the NUM_SIZES sizes with segment sizes drawn from dist. small is
+ * 1 to 16 words, the size of most segments in sandmark.umz; mixed is
+ * mostly small, with an eighth up to 1024 words and one in 32 up to 65536;
+ * large is 4096 words up to 256K, all past the pool's free lists.
+ */
+bool draw_sizes(const char *dist, uint32_t *seed, REG_SIZE *sizes)
+{
+        char *end;
+        unsigned long fixed = strtoul(dist, &end, 10);
+
+        if (*end == '\0' && end != dist) {
+                if (fixed == 0 || fixed > MAX_VALUE) {
+                        return false;
+                }
+                for (unsigned s = 0; s < NUM_SIZES; s++) {
+                        sizes[s] = fixed;
+                }
+                return true;
+        }
+        for (unsigned s = 0; s < NUM_SIZES; s++) {
+                uint32_t r = next_random(seed);
+
+                if (strcmp(dist, "small") == 0) {
+                        sizes[s] = 1 + r % 16;
+                } else if (strcmp(dist, "mixed") == 0) {
+                        if (r % 32 == 0) {
+                                sizes[s] = 1 + next_random(seed) % 65536;
+                        } else if (r % 8 == 0) {
+                                sizes[s] = 1 + next_random(seed) % 1024;
+                        } else {
+                                sizes[s] = 1 + next_random(seed) % 16;
+                        }
+                } else if (strcmp(dist, "large") == 0) {
+                        sizes[s] = 4096 + r % (1 << 18);
+                } else {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/* Emits one instruction, growing the words as needed. */
+void emit(Gen *g, unsigned opcode, unsigned a, unsigned b, unsigned c)
+{
+        if (g->length == g->capacity) {
+                g->capacity = g->capacity ? 2 * g->capacity : 1024;
+                g->words = grow(g->words, g->capacity, sizeof(WORD_SIZE));
+        }
+        g->words[g->length++] = ((WORD_SIZE)opcode << OPCODE_LSB) |
+                                (a << A_LSB) | (b << B_LSB) | (c << C_LSB);
+}
+
+/* Emits a load value of value, which must fit in 25 bits, into a. */
+void emit_value(Gen *g, unsigned a, REG_SIZE value)
+{
+        if (value > MAX_VALUE) {
+                fprintf(stderr, "Error: %" PRIu32 " does not fit in a load "
+                        "value\n", value);
+                exit(EXIT_FAILURE);
+        }
+        emit(g, LOAD_VALUE, 0, 0, 0);
+        g->words[g->length - 1] |= ((WORD_SIZE)a << LOAD_VAL_LSB) | value;
+}
+
+/* Emits the 32-bit constant value into a: its low 25 bits with a load
+ * value and, if there is more, the rest as a multiple of 2^25 made from
+ * 2^24 added to itself.
+ */
+void emit_constant(Gen *g, unsigned a, REG_SIZE value)
+{
+        emit_value(g, a, value & MAX_VALUE);
+        if (value > MAX_VALUE) {
+                emit_value(g, R1, value >> 25);
+                emit_value(g, R2, 1 << 24);
+                emit(g, ADD, R2, R2, R2);
+                emit(g, MUL, R1, R1, R2);
+                emit(g, ADD, a, a, R1);
+        }
+}
+
+/* Emits word as data, for the program to load rather than run. */
+void emit_data(Gen *g, WORD_SIZE word)
+{
+        emit(g, CMOV, R0, R0, R0);
+        g->words[g->length - 1] = word;
+}
+
+/* Emits a load value of the address of label into a, to be filled in by
+ * resolve if the label is not placed yet.
+ */
+void emit_label(Gen *g, unsigned a, unsigned label)
+{
+        if (g->labels[label] >= 0) {
+                emit_value(g, a, g->labels[label]);
+                return;
+        }
+        emit_value(g, a, 0);
+        if (g->num_fixups == g->fixup_capacity) {
+                g->fixup_capacity = g->fixup_capacity ?
+                                    2 * g->fixup_capacity : 64;
+                g->fixups = grow(g->fixups, g->fixup_capacity,
+                                 sizeof(Fixup));
+        }
+        g->fixups[g->num_fixups].at = g->length - 1;
+        g->fixups[g->num_fixups].label = label;
+        g->num_fixups++;
+}
+
+/* Emits a = b & mask as the nand of b and mask, nanded with itself. */
+void emit_and(Gen *g, unsigned a, unsigned b, REG_SIZE mask)
+{
+        emit_value(g, a, mask);
+        emit(g, NAND, a, b, a);
+        emit(g, NAND, a, a, a);
+}
+
+/* Emits checksum += checksum >> 16, with a divide. Multiplying and adding
+ * alone is linear, so a pass repeated a power of two times, over a power
+ * of two words, leaves the low bits of the checksum 0; folding the high
+ * half in after every pass keeps them meaningful.
+ */
+void emit_fold(Gen *g)
+{
+        emit_value(g, R1, 1 << 16);
+        emit(g, DIV, R2, CHECKSUM, R1);
+        emit(g, ADD, CHECKSUM, CHECKSUM, R2);
+}
+
+/* Emits a jump back to head while counter is not 0: r1 gets the word after
+ * the loop and r2 head, and a conditional move on counter picks which one
+ * the load program jumps to.
+ */
+void emit_loop(Gen *g, unsigned counter, unsigned head)
+{
+        unsigned done = new_label(g);
+
+        emit_label(g, R1, done);
+        emit_label(g, R2, head);
+        emit(g, CMOV, R1, R2, counter);
+        emit(g, LOAD_PROGRAM, R0, R0, R1);
+        place(g, done);
+}
+
+/* Returns a new label, not placed yet. */
+unsigned new_label(Gen *g)
+{
+        if (g->num_labels == g->label_capacity) {
+                g->label_capacity = g->label_capacity ?
+                                    2 * g->label_capacity : 64;
+                g->labels = grow(g->labels, g->label_capacity, sizeof(long));
+        }
+        g->labels[g->num_labels] = -1;
+        return g->num_labels++;
+}
+
+/* Places label at the next word emitted. */
+void place(Gen *g, unsigned label)
+{
+        g->labels[label] = g->length;
+}
+
+/* Fills in the address of every label used before it was placed. */
+void resolve(Gen *g)
+{
+        for (unsigned f = 0; f < g->num_fixups; f++) {
+                long address = g->labels[g->fixups[f].label];
+
+                if (address < 0 || address > MAX_VALUE) {
+                        fprintf(stderr, "Error: program too large\n");
+                        exit(EXIT_FAILURE);
+                }
+                g->words[g->fixups[f].at] |= (WORD_SIZE)address;
+        }
+}
+
+/* Writes the length words at words to path, big-endian. */
+void write_program(const char *path, const WORD_SIZE *words,
+                   WORD_SIZE length)
+{
+        FILE *fp = fopen(path, "wb");
+
+        if (fp == NULL) {
+                fprintf(stderr, "Error: cannot write %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+        for (WORD_SIZE i = 0; i < length; i++) {
+                for (int shift = 24; shift >= 0; shift -= 8) {
+                        putc((words[i] >> shift) & 0xff, fp);
+                }
+        }
+        if (fclose(fp) != 0) {
+                fprintf(stderr, "Error: cannot write %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Writes the checksum as eight lower case hex digits and a newline, as
+ * gen_print's code does.
+ */
+static void print_checksum(REG_SIZE checksum, FILE *out)
+{
+        fprintf(out, "%08" PRIx32 "\n", checksum);
+}
+
+/* Returns the next of a sequence of random numbers (xorshift32), which is
+ * all umgen needs and the same everywhere for a seed.
+ */
+static uint32_t next_random(uint32_t *seed)
+{
+        uint32_t x = *seed;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        *seed = x;
+        return x;
+}
+
+/* Reads a number from arg, exiting with a message naming option if it is
+ * not one or is larger than max.
+ */
+static REG_SIZE number(const char *arg, const char *option, REG_SIZE max)
+{
+        char *end;
+        unsigned long long n = strtoull(arg, &end, 0);
+
+        if (*arg == '\0' || *end != '\0' || n > max) {
+                fprintf(stderr, "Error: bad %s %s\n", option, arg);
+                exit(EXIT_FAILURE);
+        }
+        return n;
+}
+
+/* Reallocates p to count elements of size bytes, exiting if it cannot. */
+static void *grow(void *p, size_t count, size_t size)
+{
+        p = realloc(p, count * size);
+        if (p == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        return p;
+}
@@ -0,0 +1,1137 @@
+/* Forrest Butler and Amoses Holton
+ * Assignment 7
+ * 12/4/15
+ *
+ * umopt: offline peephole optimizer for um binaries. Reads a program,
+ * rewrites what it can prove safe and writes the result, with a report of
+ * every change on stderr (or the file given with --report):
+ *
+ *     ./umopt [--report file] program.um optimized.um
+ *
+ * The program is split into basic blocks at every word a load program
+ * could land on: word 0, the word after each load program (where calls
+ * return to) and every address the program materializes, whether with a
+ * load value or by arithmetic on constants. A forward dataflow over the
+ * blocks tracks which registers hold known constants (or are known not to
+ * be 0), starting from the all-zero registers of a new machine. That
+ * resolves the jumps and segment 0 loads and stores it can, and the words
+ * loaded or stored are marked as data. If every one is resolved and no
+ * word is stored into while it can still run, then inside each reached
+ * block with no data in it:
+ *
+ *   - instructions whose result is a known constant become load values
+ *     (constant folding), and conditional moves that cannot move anything
+ *     are dropped;
+ *   - instructions without side effects whose result no path reads are
+ *     dropped (dead writes), using a global liveness analysis.
+ *
+ * Otherwise the program is written unchanged. Nothing moves between
+ * blocks: a um program cannot tell addresses from numbers, so the words
+ * cannot be relocated, and the output is the same length as the input. A
+ * block that ends in a jump or halt is packed to its start, so the words
+ * dropped from it are never executed; in a block that falls through they
+ * become no-ops in place.
+ *
+ * That proof fails for every benchmark and for rpn/calc40.um, which are
+ * left unchanged: they jump through addresses loaded from memory and
+ * store at computed offsets into segment 0 (calc40's stack grows with its
+ * input towards its code), so only small straight-line programs gain.
+ *
+ * ./optcheck runs the programs in a UMTESTS list through umopt and ./um
+ * and checks that each prints the same thing before and after.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#define WORD_SIZE uint32_t
+#define REG_SIZE uint32_t
+#define OPCODE_LSB 28
+#define A_LSB 6
+#define B_LSB 3
+#define C_LSB 0
+#define LOAD_VAL_LSB 25
+#define VAL_LENGTH 25
+#define NUM_REGS 8
+#define ALL_LIVE 0xff
+#define NOP 0
+
+enum { CMOV, LOAD, STORE, ADD, MUL, DIV, NAND, HALT, MAP, UNMAP, OUTPUT,
+       INPUT, LOAD_PROGRAM, LOAD_VALUE };
+
+/* What is known about a register: its value, that it is not 0, or
+ * nothing.
+ */
+typedef enum Kind { KNOWN, NONZERO, UNKNOWN } Kind;
+
+typedef struct Value {
+        Kind kind;
+        REG_SIZE k;
+} Value;
+
+/* The registers on entry to a block, once some path reaches it. */
+typedef struct State {
+        bool reached;
+        Value r[NUM_REGS];
+} State;
+
+/* An instruction of a block as rewritten: its word, the word it was and the
+ * offset that was at, whether it can be dropped when its result is dead,
+ * whether it has been, and why it changed (NULL if it has not).
+ */
+typedef struct Insn {
+        WORD_SIZE word;
+        WORD_SIZE original;
+        WORD_SIZE pc;
+        bool pure;
+        bool deleted;
+        const char *why;
+} Insn;
+
+/* The words start to end - 1 of the program, the registers on entry,
+ * whether its words may be rewritten, its instructions as rewritten and
+ * the registers live on entry.
+ */
+typedef struct Block {
+        WORD_SIZE start, end;
+        State in;
+        bool rewrite;
+        Insn *code;
+        unsigned char live_in;
+} Block;
+
+/* A program and everything known about it. */
+typedef struct Program {
+        WORD_SIZE *words;
+        WORD_SIZE length;
+        bool *target;
+        bool *jumped;
+        bool exact;
+        bool *loaded;
+        bool *stored;
+        WORD_SIZE *block_of;
+        Block *blocks;
+        WORD_SIZE num_blocks;
+        State unknown;
+        unsigned num_targets;
+        unsigned unresolved_jumps;
+        unsigned unresolved_accesses;
+        unsigned stored_code;
+        unsigned folded, nops, dead, unreachable;
+} Program;
+
+/* Reads the big-endian words of the um binary at path into a new array and
+ * stores how many there are in length.
+ */
+WORD_SIZE *read_program(const char *path, WORD_SIZE *length);
+
+/* Writes the length words at words to path, big-endian. */
+void write_program(const char *path, const WORD_SIZE *words,
+                   WORD_SIZE length);
+
+/* Finds the jump targets, blocks, register constants and data words of
+ * prog, repeating until the targets and data words stop growing.
+ */
+void analyze(Program *prog);
+
+/* Marks word 0, every load value address and every word after a load
+ * program as a possible jump target.
+ */
+void find_targets(Program *prog);
+
+/* Splits prog into blocks at its jump targets and after every word that
+ * cannot fall through.
+ */
+void find_blocks(Program *prog);
+
+/* Runs the constant dataflow over the blocks of prog to a fixed point. */
+void propagate(Program *prog);
+
+/* Replays each reached block with its entry registers, marking constants
+ * as jump targets and loaded or stored words as data and counting what
+ * cannot be resolved. Returns whether any target or data word is new.
+ */
+bool record(Program *prog);
+
+/* Interprets the instruction word on the registers r, abstractly. If prog
+ * is not NULL, the constants it produces and the words it loads or stores
+ * are recorded in prog; the return value says whether any was new.
+ */
+bool step(Program *prog, WORD_SIZE word, Value *r);
+
+/* Returns the block the load program ending block jumps to, or -1 if it
+ * does not jump to a known address in segment 0.
+ */
+long jump_target(Program *prog, const Block *block, const Insn *code);
+
+/* Rewrites the blocks of prog that may be rewritten: folding, then
+ * dropping dead writes until none are left.
+ */
+void optimize(Program *prog);
+
+/* Folds the instructions of block. */
+void fold_block(Block *block);
+
+/* Computes the registers live on entry to every block of prog. */
+void liveness(Program *prog);
+
+/* Returns the registers live after the last instruction of block. */
+unsigned char live_out(Program *prog, const Block *block);
+
+/* Drops the pure instructions of block whose results are dead. Returns
+ * whether it dropped any.
+ */
+bool drop_dead(Program *prog, Block *block);
+
+/* Writes the rewritten blocks of prog back into its words and counts the
+ * changes that made it into them.
+ */
+void lay_out(Program *prog);
+
+/* Counts the change to insn, if it still stands, under its reason. */
+void count_change(Program *prog, const Insn *insn);
+
+/* Prints a summary of prog and every change made to it to out. */
+void report(Program *prog, const char *path, FILE *out);
+
+/* Writes a description of word to buf, which holds size bytes. */
+void disassemble(WORD_SIZE word, char *buf, size_t size);
+
+/* Returns the registers read and written by word as bit masks. */
+void uses(WORD_SIZE word, unsigned char *read, unsigned char *written);
+
+/* Returns the join of two register values. */
+static Value join(Value x, Value y);
+
+/* Joins state into the state at into, returning whether it grew. */
+static bool flow(State *into, const State *state);
+
+/* Returns a load value of k into register a. */
+static WORD_SIZE load_value(unsigned a, REG_SIZE k);
+
+/* Returns whether word ends a block by never falling through. */
+static bool terminates(WORD_SIZE word);
+
+/* Allocates count zeroed elements of size bytes, exiting if it cannot. */
+static void *allocate(size_t count, size_t size);
+
+/* Returns the opcode and register fields of word. */
+static inline unsigned opcode(WORD_SIZE word)
+{
+        return word >> OPCODE_LSB;
+}
+
+static inline unsigned reg_a(WORD_SIZE word)
+{
+        return (word >> A_LSB) & 0x7;
+}
+
+static inline unsigned reg_b(WORD_SIZE word)
+{
+        return (word >> B_LSB) & 0x7;
+}
+
+static inline unsigned reg_c(WORD_SIZE word)
+{
+        return (word >> C_LSB) & 0x7;
+}
+
+/* Returns the register and the value of a load value. */
+static inline unsigned value_reg(WORD_SIZE word)
+{
+        return (word >> LOAD_VAL_LSB) & 0x7;
+}
+
+static inline WORD_SIZE value_of(WORD_SIZE word)
+{
+        return word & ((1u << VAL_LENGTH) - 1);
+}
+
+
+int main(int argc, char *argv[])
+{
+        const char *report_path = NULL;
+        Program prog;
+
+        if (argc > 2 && strcmp(argv[1], "--report") == 0) {
+                report_path = argv[2];
+                argc -= 2;
+                argv += 2;
+        }
+        if (argc != 3) {
+                fprintf(stderr, "Usage: umopt [--report file] "
+                        "program.um optimized.um\n");
+                exit(EXIT_FAILURE);
+        }
+
+        memset(&prog, 0, sizeof(prog));
+        prog.words = read_program(argv[1], &prog.length);
+        analyze(&prog);
+
+        bool proved = prog.unresolved_jumps == 0 &&
+                      prog.unresolved_accesses == 0 && prog.stored_code == 0;
+        if (proved) {
+                optimize(&prog);
+                lay_out(&prog);
+        }
+        write_program(argv[2], prog.words, prog.length);
+
+        FILE *out = stderr;
+        if (report_path != NULL) {
+                out = fopen(report_path, "w");
+                if (out == NULL) {
+                        fprintf(stderr, "Error: cannot write %s\n",
+                                report_path);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        report(&prog, argv[1], out);
+        if (out != stderr) {
+                fclose(out);
+        }
+
+        for (WORD_SIZE b = 0; b < prog.num_blocks; b++) {
+                free(prog.blocks[b].code);
+        }
+        free(prog.blocks);
+        free(prog.block_of);
+        free(prog.target);
+        free(prog.jumped);
+        free(prog.loaded);
+        free(prog.stored);
+        free(prog.words);
+        return 0;
+}
+
+/* Reads the big-endian words of the um binary at path into a new array and
+ * stores how many there are in length.
+ */
+WORD_SIZE *read_program(const char *path, WORD_SIZE *length)
+{
+        struct stat st;
+        FILE *fp = fopen(path, "rb");
+
+        if (fp == NULL || stat(path, &st) != 0 || st.st_size % 4 != 0) {
+                fprintf(stderr, "Incompatible File Size.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        *length = st.st_size / 4;
+        WORD_SIZE *program = allocate(*length + 1, sizeof(WORD_SIZE));
+        for (WORD_SIZE i = 0; i < *length; i++) {
+                WORD_SIZE word = 0;
+                for (int j = 0; j < 4; j++) {
+                        word = (word << 8) | (unsigned char)getc(fp);
+                }
+                program[i] = word;
+        }
+        fclose(fp);
+        return program;
+}
+
+/* Writes the length words at words to path, big-endian. */
+void write_program(const char *path, const WORD_SIZE *words,
+                   WORD_SIZE length)
+{
+        FILE *fp = fopen(path, "wb");
+
+        if (fp == NULL) {
+                fprintf(stderr, "Error: cannot write %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+        for (WORD_SIZE i = 0; i < length; i++) {
+                for (int shift = 24; shift >= 0; shift -= 8) {
+                        putc((words[i] >> shift) & 0xff, fp);
+                }
+        }
+        if (fclose(fp) != 0) {
+                fprintf(stderr, "Error: cannot write %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Finds the jump targets, blocks, register constants and data words of
+ * prog. New constants can become targets, which split blocks and change
+ * what the dataflow knows, so this repeats until nothing new turns up;
+ * both sets only grow, so it stops. If that resolves every jump, the only
+ * words control can reach other than by falling through are word 0 and
+ * the words jumped to, so the analysis is run again with just those as
+ * targets, which gives longer blocks to pack.
+ */
+void analyze(Program *prog)
+{
+        prog->target = allocate(prog->length + 1, sizeof(bool));
+        prog->jumped = allocate(prog->length + 1, sizeof(bool));
+        prog->loaded = allocate(prog->length + 1, sizeof(bool));
+        prog->stored = allocate(prog->length + 1, sizeof(bool));
+        prog->block_of = allocate(prog->length + 1, sizeof(WORD_SIZE));
+        find_targets(prog);
+
+        do {
+                find_blocks(prog);
+                propagate(prog);
+        } while (record(prog));
+        if (prog->unresolved_jumps != 0 || prog->length == 0) {
+                return;
+        }
+
+        prog->exact = true;
+        memcpy(prog->target, prog->jumped, prog->length * sizeof(bool));
+        prog->target[0] = true;
+        do {
+                find_blocks(prog);
+                propagate(prog);
+        } while (record(prog));
+}
+
+/* Marks word 0, every address a load value names and every word after a
+ * load program as a possible jump target.
+ */
+void find_targets(Program *prog)
+{
+        if (prog->length > 0) {
+                prog->target[0] = true;
+        }
+        for (WORD_SIZE i = 0; i < prog->length; i++) {
+                WORD_SIZE word = prog->words[i];
+                if (opcode(word) == LOAD_VALUE &&
+                    value_of(word) < prog->length) {
+                        prog->target[value_of(word)] = true;
+                } else if (opcode(word) == LOAD_PROGRAM &&
+                           i + 1 < prog->length) {
+                        prog->target[i + 1] = true;
+                }
+        }
+}
+
+/* Splits prog into blocks, each starting at a jump target or after a word
+ * that cannot fall through. Any blocks from an earlier pass are freed.
+ */
+void find_blocks(Program *prog)
+{
+        WORD_SIZE n = 0;
+
+        free(prog->blocks);
+        prog->blocks = allocate(prog->length + 1, sizeof(Block));
+        prog->num_targets = 0;
+        for (WORD_SIZE i = 0; i < prog->length; i++) {
+                prog->num_targets += prog->target[i];
+                if (i == 0 || prog->target[i] ||
+                    terminates(prog->words[i - 1])) {
+                        prog->blocks[n].start = i;
+                        n++;
+                }
+                prog->blocks[n - 1].end = i + 1;
+                prog->block_of[i] = n - 1;
+        }
+        prog->num_blocks = n;
+}
+
+/* Runs the constant dataflow over the blocks of prog with a worklist,
+ * starting from block 0 with every register 0. A jump whose target is not
+ * known joins the unknown state, which flows into every jump target.
+ */
+void propagate(Program *prog)
+{
+        WORD_SIZE *work = allocate(prog->num_blocks + 1, sizeof(WORD_SIZE));
+        bool *queued = allocate(prog->num_blocks + 1, sizeof(bool));
+        WORD_SIZE pending = 0;
+        State state;
+
+        if (prog->num_blocks == 0) {
+                free(work);
+                free(queued);
+                return;
+        }
+        memset(&prog->unknown, 0, sizeof(State));
+        state.reached = true;
+        for (unsigned i = 0; i < NUM_REGS; i++) {
+                state.r[i].kind = KNOWN;
+                state.r[i].k = 0;
+        }
+        flow(&prog->blocks[0].in, &state);
+        work[pending++] = 0;
+        queued[0] = true;
+
+        while (pending > 0) {
+                WORD_SIZE b = work[--pending];
+                Block *block = &prog->blocks[b];
+                WORD_SIZE last = prog->words[block->end - 1];
+                WORD_SIZE next[2];
+                unsigned num_next = 0;
+                bool to_unknown = false;
+
+                queued[b] = false;
+                state = block->in;
+                for (WORD_SIZE pc = block->start; pc < block->end; pc++) {
+                        step(NULL, prog->words[pc], state.r);
+                }
+
+                if (opcode(last) == LOAD_PROGRAM) {
+                        Value seg = state.r[reg_b(last)];
+                        Value to = state.r[reg_c(last)];
+                        bool maybe_zero = seg.kind == UNKNOWN ||
+                                          (seg.kind == KNOWN && seg.k == 0);
+                        if (maybe_zero && to.kind == KNOWN) {
+                                if (to.k < prog->length) {
+                                        next[num_next++] =
+                                                prog->block_of[to.k];
+                                }
+                        } else if (maybe_zero) {
+                                to_unknown = true;
+                        }
+                } else if (!terminates(last) && block->end < prog->length) {
+                        next[num_next++] = prog->block_of[block->end];
+                }
+
+                for (unsigned i = 0; i < num_next; i++) {
+                        if (flow(&prog->blocks[next[i]].in, &state) &&
+                            !queued[next[i]]) {
+                                work[pending++] = next[i];
+                                queued[next[i]] = true;
+                        }
+                }
+                if (to_unknown && flow(&prog->unknown, &state)) {
+                        for (WORD_SIZE t = 0; t < prog->num_blocks; t++) {
+                                Block *target = &prog->blocks[t];
+                                if (prog->target[target->start] &&
+                                    flow(&target->in, &prog->unknown) &&
+                                    !queued[t]) {
+                                        work[pending++] = t;
+                                        queued[t] = true;
+                                }
+                        }
+                }
+        }
+        free(work);
+        free(queued);
+}
+
+/* Replays each reached block with its entry registers, marking constants
+ * as jump targets and loaded or stored words as data and counting the
+ * jumps and segment 0 accesses it cannot resolve. Returns whether any
+ * target or data word is new, in which case the analysis must run again.
+ */
+bool record(Program *prog)
+{
+        bool grew = false;
+
+        prog->unresolved_jumps = 0;
+        prog->unresolved_accesses = 0;
+        prog->stored_code = 0;
+        for (WORD_SIZE b = 0; b < prog->num_blocks; b++) {
+                Block *block = &prog->blocks[b];
+                State state = block->in;
+
+                if (!state.reached) {
+                        continue;
+                }
+                for (WORD_SIZE pc = block->start; pc < block->end; pc++) {
+                        grew |= step(prog, prog->words[pc], state.r);
+                }
+        }
+        for (WORD_SIZE b = 0; b < prog->num_blocks; b++) {
+                Block *block = &prog->blocks[b];
+                for (WORD_SIZE pc = block->start; pc < block->end; pc++) {
+                        if (block->in.reached && prog->stored[pc]) {
+                                prog->stored_code++;
+                        }
+                }
+        }
+        return grew;
+}
+
+/* Interprets the instruction word on the registers r, abstractly. With a
+ * prog it also records what the instruction tells us about the program:
+ * constants below its length become jump targets (once every jump is
+ * resolved, only the addresses jumped to do), and loads and stores that
+ * may be in segment 0 mark their word as data or, at an unknown offset,
+ * count as unresolved, as does a jump to an unknown address.
+ */
+bool step(Program *prog, WORD_SIZE word, Value *r)
+{
+        unsigned a = reg_a(word), b = reg_b(word), c = reg_c(word);
+        Value result = { UNKNOWN, 0 };
+        bool grew = false;
+        int dest = -1;
+
+        switch (opcode(word)) {
+        case CMOV:
+                if (r[c].kind == KNOWN && r[c].k == 0) {
+                        break;
+                }
+                result = (r[c].kind == UNKNOWN) ? join(r[a], r[b]) : r[b];
+                dest = a;
+                break;
+        case LOAD:
+        case STORE: {
+                Value seg = (opcode(word) == LOAD) ? r[b] : r[a];
+                Value offset = (opcode(word) == LOAD) ? r[c] : r[b];
+                bool maybe_zero = seg.kind == UNKNOWN ||
+                                  (seg.kind == KNOWN && seg.k == 0);
+                if (prog != NULL && maybe_zero) {
+                        if (offset.kind != KNOWN) {
+                                prog->unresolved_accesses++;
+                        } else if (offset.k < prog->length) {
+                                bool *data = (opcode(word) == LOAD) ?
+                                             prog->loaded : prog->stored;
+                                grew |= !data[offset.k];
+                                data[offset.k] = true;
+                        }
+                }
+                dest = (opcode(word) == LOAD) ? (int)a : -1;
+                break;
+        }
+        case ADD:
+        case MUL:
+        case DIV:
+        case NAND:
+                dest = a;
+                if (r[b].kind == KNOWN && r[c].kind == KNOWN) {
+                        result.kind = KNOWN;
+                        switch (opcode(word)) {
+                        case ADD:
+                                result.k = r[b].k + r[c].k;
+                                break;
+                        case MUL:
+                                result.k = r[b].k * r[c].k;
+                                break;
+                        case DIV:
+                                result.kind = (r[c].k != 0) ? KNOWN : UNKNOWN;
+                                result.k = (r[c].k != 0) ? r[b].k / r[c].k : 0;
+                                break;
+                        default:
+                                result.k = ~(r[b].k & r[c].k);
+                                break;
+                        }
+                } else if (opcode(word) == NAND &&
+                           ((r[b].kind == KNOWN && r[b].k == 0) ||
+                            (r[c].kind == KNOWN && r[c].k == 0))) {
+                        result.kind = KNOWN;
+                        result.k = ~(REG_SIZE)0;
+                } else if (opcode(word) == MUL &&
+                           ((r[b].kind == KNOWN && r[b].k == 0) ||
+                            (r[c].kind == KNOWN && r[c].k == 0))) {
+                        result.kind = KNOWN;
+                        result.k = 0;
+                }
+                break;
+        case MAP:
+                result.kind = NONZERO;
+                dest = b;
+                break;
+        case INPUT:
+                dest = c;
+                break;
+        case LOAD_PROGRAM:
+                if (prog == NULL || r[b].kind == NONZERO ||
+                    (r[b].kind == KNOWN && r[b].k != 0)) {
+                        break;
+                }
+                if (r[c].kind != KNOWN) {
+                        prog->unresolved_jumps++;
+                } else if (r[c].k < prog->length) {
+                        prog->jumped[r[c].k] = true;
+                        grew |= !prog->target[r[c].k];
+                        prog->target[r[c].k] = true;
+                }
+                break;
+        case LOAD_VALUE:
+                result.kind = KNOWN;
+                result.k = value_of(word);
+                dest = value_reg(word);
+                break;
+        default:
+                break;
+        }
+
+        if (dest >= 0) {
+                r[dest] = result;
+                if (prog != NULL && !prog->exact && result.kind == KNOWN &&
+                    result.k < prog->length && !prog->target[result.k]) {
+                        prog->target[result.k] = true;
+                        grew = true;
+                }
+        }
+        return grew;
+}
+
+/* Returns the block the load program ending block jumps to, or -1 if it
+ * may load a new program or its target is not known. The block's
+ * instructions are taken from code, skipping dropped ones, or from the
+ * program if code is NULL.
+ */
+long jump_target(Program *prog, const Block *block, const Insn *code)
+{
+        WORD_SIZE n = block->end - block->start;
+        WORD_SIZE last = prog->words[block->end - 1];
+        State state = block->in;
+
+        for (WORD_SIZE i = 0; i < n - 1; i++) {
+                if (code == NULL) {
+                        step(NULL, prog->words[block->start + i], state.r);
+                } else if (!code[i].deleted) {
+                        step(NULL, code[i].word, state.r);
+                }
+        }
+        Value seg = state.r[reg_b(last)];
+        Value to = state.r[reg_c(last)];
+        if (!state.reached || seg.kind != KNOWN || seg.k != 0 ||
+            to.kind != KNOWN || to.k >= prog->length) {
+                return -1;
+        }
+        return prog->block_of[to.k];
+}
+
+/* Rewrites the blocks of prog that are reached, hold no data and do not
+ * end in an invalid instruction: folds each, then alternates liveness and
+ * dropping dead writes until nothing more can go.
+ */
+void optimize(Program *prog)
+{
+        for (WORD_SIZE b = 0; b < prog->num_blocks; b++) {
+                Block *block = &prog->blocks[b];
+                WORD_SIZE last = prog->words[block->end - 1];
+                bool data = false;
+
+                for (WORD_SIZE pc = block->start; pc < block->end; pc++) {
+                        data |= prog->loaded[pc] || prog->stored[pc];
+                }
+                block->rewrite = block->in.reached && !data &&
+                                 opcode(last) <= LOAD_VALUE;
+                block->code = allocate(block->end - block->start,
+                                       sizeof(Insn));
+                for (WORD_SIZE pc = block->start; pc < block->end; pc++) {
+                        Insn *insn = &block->code[pc - block->start];
+                        insn->word = prog->words[pc];
+                        insn->original = prog->words[pc];
+                        insn->pc = pc;
+                }
+                if (block->rewrite) {
+                        fold_block(block);
+                }
+        }
+
+        bool dropped;
+        do {
+                dropped = false;
+                liveness(prog);
+                for (WORD_SIZE b = 0; b < prog->num_blocks; b++) {
+                        if (prog->blocks[b].rewrite) {
+                                dropped |= drop_dead(prog,
+                                                     &prog->blocks[b]);
+                        }
+                }
+        } while (dropped);
+}
+
+/* Folds the instructions of block with the registers known on its entry:
+ * one whose result is a known constant that fits a load value becomes
+ * that load value, a conditional move that cannot change its register is
+ * dropped, and a division by a known nonzero constant is marked pure, as
+ * are the other instructions that cannot fail or do I/O.
+ */
+void fold_block(Block *block)
+{
+        unsigned n = block->end - block->start;
+        State state = block->in;
+
+        for (unsigned i = 0; i < n; i++) {
+                Insn *insn = &block->code[i];
+                WORD_SIZE word = insn->word;
+                unsigned a = reg_a(word), c = reg_c(word);
+                Value *r = state.r;
+
+                switch (opcode(word)) {
+                case CMOV:
+                        insn->pure = true;
+                        if (a == reg_b(word) ||
+                            (r[c].kind == KNOWN && r[c].k == 0)) {
+                                insn->deleted = true;
+                                insn->why = "no-op";
+                        }
+                        break;
+                case DIV:
+                        insn->pure = r[c].kind == NONZERO ||
+                                     (r[c].kind == KNOWN && r[c].k != 0);
+                        break;
+                case ADD:
+                case MUL:
+                case NAND:
+                case LOAD_VALUE:
+                        insn->pure = true;
+                        break;
+                default:
+                        break;
+                }
+
+                step(NULL, word, r);
+                if (insn->pure && !insn->deleted &&
+                    opcode(word) != LOAD_VALUE && r[a].kind == KNOWN &&
+                    r[a].k < (1u << VAL_LENGTH)) {
+                        insn->word = load_value(a, r[a].k);
+                        insn->why = "folded";
+                }
+        }
+}
+
+/* Computes the registers live on entry to every block of prog, iterating
+ * backwards over the blocks until nothing changes. Blocks that are never
+ * reached count every register as live.
+ */
+void liveness(Program *prog)
+{
+        bool changed = true;
+
+        for (WORD_SIZE b = 0; b < prog->num_blocks; b++) {
+                prog->blocks[b].live_in = prog->blocks[b].in.reached ?
+                                          0 : ALL_LIVE;
+        }
+        while (changed) {
+                changed = false;
+                for (WORD_SIZE b = prog->num_blocks; b-- > 0; ) {
+                        Block *block = &prog->blocks[b];
+                        unsigned char live;
+
+                        if (!block->in.reached) {
+                                continue;
+                        }
+                        live = live_out(prog, block);
+                        for (WORD_SIZE i = block->end - block->start;
+                             i-- > 0; ) {
+                                unsigned char read, written;
+                                if (block->code[i].deleted) {
+                                        continue;
+                                }
+                                uses(block->code[i].word, &read, &written);
+                                live = (live & ~written) | read;
+                        }
+                        if (live != block->live_in) {
+                                block->live_in |= live;
+                                changed = true;
+                        }
+                }
+        }
+}
+
+/* Returns the registers live after the last instruction of block: none
+ * after a halt, an invalid instruction or falling off the program, those
+ * live into the next block or the block a known jump goes to, and all of
+ * them after any other load program, which may go anywhere.
+ */
+unsigned char live_out(Program *prog, const Block *block)
+{
+        WORD_SIZE last = prog->words[block->end - 1];
+
+        if (opcode(last) == LOAD_PROGRAM) {
+                long next = jump_target(prog, block, block->code);
+                return (next < 0) ? ALL_LIVE : prog->blocks[next].live_in;
+        }
+        if (terminates(last) || block->end >= prog->length) {
+                return 0;
+        }
+        return prog->blocks[prog->block_of[block->end]].live_in;
+}
+
+/* Drops the pure instructions of block whose results are dead, working
+ * backwards from the registers live out of it. Returns whether it dropped
+ * any.
+ */
+bool drop_dead(Program *prog, Block *block)
+{
+        unsigned char live = live_out(prog, block);
+        bool dropped = false;
+
+        for (WORD_SIZE i = block->end - block->start; i-- > 0; ) {
+                Insn *insn = &block->code[i];
+                unsigned char read, written;
+
+                if (insn->deleted) {
+                        continue;
+                }
+                uses(insn->word, &read, &written);
+                if (insn->pure && (written & live) == 0) {
+                        insn->deleted = true;
+                        insn->why = "dead";
+                        dropped = true;
+                        continue;
+                }
+                live = (live & ~written) | read;
+        }
+        return dropped;
+}
+
+/* Writes the rewritten blocks of prog back into its words. A block that
+ * ends in a jump or halt has its remaining instructions packed to its
+ * start, so the words after them are never reached. A block that falls
+ * through keeps its words where they are and each dropped one becomes a
+ * no-op (a conditional move of r0 into itself), which still runs.
+ * Dropping a word that was already a no-op in place changes nothing, and
+ * is not counted.
+ */
+void lay_out(Program *prog)
+{
+        for (WORD_SIZE b = 0; b < prog->num_blocks; b++) {
+                Block *block = &prog->blocks[b];
+                WORD_SIZE n = block->end - block->start;
+                WORD_SIZE pc = block->start;
+                bool packed;
+
+                if (!block->rewrite) {
+                        continue;
+                }
+                packed = terminates(block->code[n - 1].original);
+
+                for (WORD_SIZE i = 0; i < n; i++) {
+                        Insn *insn = &block->code[i];
+
+                        if (!insn->deleted) {
+                                prog->words[pc++] = insn->word;
+                        } else if (!packed) {
+                                prog->words[pc++] = NOP;
+                                if (insn->original == NOP) {
+                                        insn->why = NULL;
+                                }
+                        }
+                        count_change(prog, insn);
+                }
+                prog->unreachable += block->end - pc;
+                while (pc < block->end) {
+                        prog->words[pc++] = NOP;
+                }
+        }
+}
+
+/* Counts the change to insn under the reason it was made, unless lay_out
+ * found it changed nothing.
+ */
+void count_change(Program *prog, const Insn *insn)
+{
+        if (insn->why == NULL) {
+                return;
+        } else if (strcmp(insn->why, "no-op") == 0) {
+                prog->nops++;
+        } else if (strcmp(insn->why, "dead") == 0) {
+                prog->dead++;
+        } else {
+                prog->folded++;
+        }
+}
+
+/* Prints a summary of prog and a line for every instruction changed, with
+ * its word, what it was, what it became and why, to out.
+ */
+void report(Program *prog, const char *path, FILE *out)
+{
+        WORD_SIZE reached = 0, rewritable = 0;
+        bool proved = prog->unresolved_jumps == 0 &&
+                      prog->unresolved_accesses == 0 &&
+                      prog->stored_code == 0;
+        unsigned data = 0;
+
+        for (WORD_SIZE b = 0; b < prog->num_blocks; b++) {
+                reached += prog->blocks[b].in.reached;
+                rewritable += prog->blocks[b].rewrite;
+        }
+        for (WORD_SIZE i = 0; i < prog->length; i++) {
+                data += prog->loaded[i] || prog->stored[i];
+        }
+
+        fprintf(out, "umopt: %s: %" PRIu32 " words, %" PRIu32 " blocks "
+                "(%" PRIu32 " reached, %" PRIu32 " rewritten), %u jump "
+                "targets, %u data words\n", path, prog->length,
+                prog->num_blocks, reached, rewritable, prog->num_targets,
+                data);
+        fprintf(out, "unresolved: %u jumps, %u segment 0 accesses, %u "
+                "stores into code\n", prog->unresolved_jumps,
+                prog->unresolved_accesses, prog->stored_code);
+        if (!proved) {
+                fprintf(out, "not provably safe to rewrite: written "
+                        "unchanged\n");
+                return;
+        }
+        fprintf(out, "folded %u, dropped %u no-ops and %u dead writes; %u "
+                "words are no longer executed\n", prog->folded, prog->nops,
+                prog->dead, prog->unreachable);
+
+        for (WORD_SIZE b = 0; b < prog->num_blocks; b++) {
+                Block *block = &prog->blocks[b];
+                if (block->code == NULL) {
+                        continue;
+                }
+                for (WORD_SIZE i = 0; i < block->end - block->start; i++) {
+                        Insn *insn = &block->code[i];
+                        char was[32], now[32];
+
+                        if (insn->why == NULL) {
+                                continue;
+                        }
+                        disassemble(insn->original, was, sizeof(was));
+                        if (insn->deleted) {
+                                snprintf(now, sizeof(now), "-");
+                        } else {
+                                disassemble(insn->word, now, sizeof(now));
+                        }
+                        fprintf(out, "%8" PRIu32 "  %-24s %-24s %s\n",
+                                insn->pc, was, now, insn->why);
+                }
+        }
+}
+
+/* Writes a description of word to buf, which holds size bytes, in the
+ * style of the opcode names the profiler prints.
+ */
+void disassemble(WORD_SIZE word, char *buf, size_t size)
+{
+        static const char *const names[] = {
+                "cmov", "load", "store", "add", "mul", "div", "nand",
+                "halt", "map", "unmap", "output", "input", "loadp", "loadv"
+        };
+        unsigned a = reg_a(word), b = reg_b(word), c = reg_c(word);
+
+        switch (opcode(word)) {
+        case HALT:
+                snprintf(buf, size, "halt");
+                break;
+        case MAP:
+        case LOAD_PROGRAM:
+                snprintf(buf, size, "%s r%u, r%u", names[opcode(word)], b, c);
+                break;
+        case UNMAP:
+        case OUTPUT:
+        case INPUT:
+                snprintf(buf, size, "%s r%u", names[opcode(word)], c);
+                break;
+        case LOAD_VALUE:
+                snprintf(buf, size, "loadv r%u, %" PRIu32, value_reg(word),
+                         value_of(word));
+                break;
+        default:
+                if (opcode(word) > LOAD_VALUE) {
+                        snprintf(buf, size, "invalid 0x%08" PRIx32, word);
+                } else {
+                        snprintf(buf, size, "%s r%u, r%u, r%u",
+                                 names[opcode(word)], a, b, c);
+                }
+                break;
+        }
+}
+
+/* Returns the registers word reads and writes as bit masks. A conditional
+ * move reads the register it may write, since it may leave it alone.
+ */
+void uses(WORD_SIZE word, unsigned char *read, unsigned char *written)
+{
+        unsigned a = 1u << reg_a(word);
+        unsigned b = 1u << reg_b(word);
+        unsigned c = 1u << reg_c(word);
+
+        *read = 0;
+        *written = 0;
+        switch (opcode(word)) {
+        case CMOV:
+                *read = a | b | c;
+                *written = a;
+                break;
+        case LOAD:
+        case ADD:
+        case MUL:
+        case DIV:
+        case NAND:
+                *read = b | c;
+                *written = a;
+                break;
+        case STORE:
+                *read = a | b | c;
+                break;
+        case MAP:
+                *read = c;
+                *written = b;
+                break;
+        case UNMAP:
+        case OUTPUT:
+                *read = c;
+                break;
+        case INPUT:
+                *written = c;
+                break;
+        case LOAD_PROGRAM:
+                *read = b | c;
+                break;
+        case LOAD_VALUE:
+                *written = 1u << value_reg(word);
+                break;
+        default:
+                break;
+        }
+}
+
+/* Returns the join of two register values: the value if both know the
+ * same one, nonzero if neither can be 0, and nothing known otherwise.
+ */
+static Value join(Value x, Value y)
+{
+        Value result = { UNKNOWN, 0 };
+
+        if (x.kind == KNOWN && y.kind == KNOWN && x.k == y.k) {
+                return x;
+        }
+        if ((x.kind == NONZERO || (x.kind == KNOWN && x.k != 0)) &&
+            (y.kind == NONZERO || (y.kind == KNOWN && y.k != 0))) {
+                result.kind = NONZERO;
+        }
+        return result;
+}
+
+/* Joins state into the state at into, returning whether it grew. A state
+ * no path has reached yet takes the other as it is.
+ */
+static bool flow(State *into, const State *state)
+{
+        bool grew = false;
+
+        if (!into->reached) {
+                *into = *state;
+                into->reached = true;
+                return true;
+        }
+        for (unsigned i = 0; i < NUM_REGS; i++) {
+                Value joined = join(into->r[i], state->r[i]);
+                if (joined.kind != into->r[i].kind ||
+                    joined.k != into->r[i].k) {
+                        into->r[i] = joined;
+                        grew = true;
+                }
+        }
+        return grew;
+}
+
+/* Returns a load value of k into register a. */
+static WORD_SIZE load_value(unsigned a, REG_SIZE k)
+{
+        return ((WORD_SIZE)LOAD_VALUE << OPCODE_LSB) |
+               ((WORD_SIZE)a << LOAD_VAL_LSB) | k;
+}
+
+/* Returns whether word ends a block by never falling through: a halt, a
+ * load program or an invalid instruction.
+ */
+static bool terminates(WORD_SIZE word)
+{
+        return opcode(word) == HALT || opcode(word) == LOAD_PROGRAM ||
+               opcode(word) > LOAD_VALUE;
+}
+
+/* Allocates count zeroed elements of size bytes, exiting if it cannot. */
+static void *allocate(size_t count, size_t size)
+{
+        void *p = calloc(count, size);
+
+        if (p == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        return p;
+}